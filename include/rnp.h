@@ -45,7 +45,7 @@
 
 __BEGIN_DECLS
 
-enum keyring_format_t { GPG_KEYRING, SSH_KEYRING };
+enum keyring_format_t { GPG_KEYRING, SSH_KEYRING, KBX_KEYRING };
 
 /* structure used to hold (key,value) pair information */
 typedef struct rnp_t {
@@ -55,6 +55,10 @@ typedef struct rnp_t {
     char **  value;   /* value information */
     void *   pubring; /* public key ring */
     void *   secring; /* s3kr1t key ring */
+    void *   keys;    /* shared keyring snapshot the rings belong to */
+    void *   watch;   /* keyring files being watched for changes */
+    void *   seckeys; /* unlocked secret keys kept for reuse */
+    void *   agent;   /* connection to rnp-agent, if one is used */
     void *   io;      /* the io struct for results/errs */
     void *   passfp;  /* file pointer for password input */
 
@@ -64,12 +68,16 @@ typedef struct rnp_t {
 /* begin and end */
 int rnp_init(rnp_t *);
 int rnp_end(rnp_t *);
+int rnp_share(rnp_t *);
 
 /* debugging, reflection and information */
 int         rnp_set_debug(const char *);
 int         rnp_get_debug(const char *);
+int         rnp_set_stats(int);
+int         rnp_set_trace(const char *);
 const char *rnp_get_info(const char *);
 int         rnp_list_packets(rnp_t *, char *, int, char *);
+int         rnp_speed(rnp_t *, int, char **);
 
 /* variables */
 int   rnp_setvar(rnp_t *, const char *, const char *);
@@ -91,20 +99,47 @@ int   rnp_find_key(rnp_t *, char *);
 char *rnp_get_key(rnp_t *, const char *, const char *);
 char *rnp_export_key(rnp_t *, char *);
 int   rnp_import_key(rnp_t *, char *);
+int   rnp_import_keys(rnp_t *, char **, unsigned);
+int   rnp_compact_keys(rnp_t *);
 int   rnp_generate_key(rnp_t *, char *, int);
+int   rnp_watch_keys(rnp_t *);
+int   rnp_update_keys(rnp_t *);
+void  rnp_unwatch_keys(rnp_t *);
+
+/* keyrings shared between threads, reloadable while in use */
+void *rnp_shared_keys_new(void);
+void  rnp_shared_keys_free(void *);
+int   rnp_publish_keys(rnp_t *, void *);
+int   rnp_attach_keys(rnp_t *, void *);
 
 /* file management */
 int rnp_encrypt_file(rnp_t *, const char *, const char *, char *, int);
+int rnp_encrypt_file_multi(rnp_t *, const char **, unsigned, const char *, char *, int);
 int rnp_decrypt_file(rnp_t *, const char *, char *, int);
 int rnp_sign_file(rnp_t *, const char *, const char *, char *, int, int, int);
+int rnp_sign_file_multi(rnp_t *, const char **, unsigned, const char *, char *, int, int);
 int rnp_verify_file(rnp_t *, const char *, const char *, int);
 
 /* memory signing and encryption */
 int rnp_sign_memory(
   rnp_t *, const char *, char *, size_t, char *, size_t, const unsigned, const unsigned);
+int rnp_sign_memory_multi(
+  rnp_t *, const char **, unsigned, char *, size_t, char *, size_t, const unsigned);
 int rnp_verify_memory(rnp_t *, const void *, const size_t, void *, size_t, const int);
 int rnp_encrypt_memory(rnp_t *, const char *, void *, const size_t, char *, size_t, int);
+int rnp_encrypt_memory_multi(
+  rnp_t *, const char **, unsigned, void *, const size_t, char *, size_t, int);
 int rnp_decrypt_memory(rnp_t *, const void *, const size_t, char *, size_t, const int);
+int rnp_sign_encrypt_file(
+  rnp_t *, const char *, const char **, unsigned, const char *, char *, int);
+int rnp_sign_encrypt_memory(
+  rnp_t *, const char *, const char **, unsigned, void *, const size_t, char *, size_t, int);
+
+/* signing many messages with a key unlocked once, from any thread */
+void *rnp_signer_open(rnp_t *, const char *);
+int   rnp_signer_sign_memory(
+  void *, const void *, size_t, char *, size_t, const unsigned, const unsigned);
+void rnp_signer_close(void *);
 
 /* match and hkp-related functions */
 int rnp_match_keys_json(rnp_t *, char **, char *, const char *, const int);
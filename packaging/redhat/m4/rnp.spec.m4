@@ -36,6 +36,7 @@ make;
 %make_install
 find "%{buildroot}"%{_libdir} -name "*.la" -delete;
 rm -f "%{buildroot}"%{_bindir}/rnp_tests;
+rm -f "%{buildroot}"%{_bindir}/rnp-bench;
 
 %files
 %defattr(-,root,root)
@@ -65,6 +65,10 @@ main(void)
       cmocka_unit_test(cipher_test_success),
       cmocka_unit_test(pkcs1_rsa_test_success),
       cmocka_unit_test(raw_elg_test_success),
+      cmocka_unit_test(stage_stats_test_success),
+      cmocka_unit_test(rng_fork_test_success),
+      cmocka_unit_test(key_split_test_success),
+      cmocka_unit_test(bn_lazy_test_success),
       cmocka_unit_test(rnpkeys_generatekey_testSignature),
       cmocka_unit_test(rnpkeys_generatekey_testEncryption),
       cmocka_unit_test(rnpkeys_generatekey_verifySupportedHashAlg),
@@ -72,7 +76,23 @@ main(void)
       cmocka_unit_test(rnpkeys_generatekey_verifykeyHomeDirOption),
       cmocka_unit_test(rnpkeys_generatekey_verifykeyNonexistingHomeDir),
       cmocka_unit_test(rnpkeys_generatekey_verifykeyHomeDirNoPermission),
+      cmocka_unit_test(rnpkeys_generatekey_verifyKeyringWatch),
+      cmocka_unit_test(rnpkeys_generatekey_verifyParallelLoad),
+      cmocka_unit_test(rnpkeys_generatekey_verifyCachedFingerprint),
+      cmocka_unit_test(rnpkeys_generatekey_verifySigCache),
+      cmocka_unit_test(rnpkeys_generatekey_verifyKeybox),
+      cmocka_unit_test(rnpkeys_generatekey_verifySeckeyCache),
+      cmocka_unit_test(rnpkeys_generatekey_verifyAgent),
+      cmocka_unit_test(rnpkeys_generatekey_verifyMultiRecipient),
+      cmocka_unit_test(rnpkeys_generatekey_verifySignEncrypt),
+      cmocka_unit_test(rnpkeys_generatekey_verifyMultiSigner),
+      cmocka_unit_test(rnpkeys_generatekey_verifyHiddenRecipient),
+      cmocka_unit_test(rnpkeys_generatekey_verifyBulkImport),
+      cmocka_unit_test(rnpkeys_generatekey_verifyCompact),
       cmocka_unit_test(rnpkeys_exportkey_verifyUserId),
+      cmocka_unit_test(threads_mixed_ops_test_success),
+      cmocka_unit_test(shared_keys_reload_test_success),
+      cmocka_unit_test(threads_signer_test_success),
     };
 
     /* Each test entry will invoke setup_test before running
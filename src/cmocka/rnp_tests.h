@@ -40,6 +40,32 @@ void rnpkeys_generatekey_verifykeyNonexistingHomeDir(void **state);
 
 void rnpkeys_generatekey_verifykeyHomeDirNoPermission(void **state);
 
+void rnpkeys_generatekey_verifyKeyringWatch(void **state);
+
+void rnpkeys_generatekey_verifyParallelLoad(void **state);
+
+void rnpkeys_generatekey_verifyCachedFingerprint(void **state);
+
+void rnpkeys_generatekey_verifySigCache(void **state);
+
+void rnpkeys_generatekey_verifyKeybox(void **state);
+
+void rnpkeys_generatekey_verifySeckeyCache(void **state);
+
+void rnpkeys_generatekey_verifyAgent(void **state);
+
+void rnpkeys_generatekey_verifyMultiRecipient(void **state);
+
+void rnpkeys_generatekey_verifySignEncrypt(void **state);
+
+void rnpkeys_generatekey_verifyMultiSigner(void **state);
+
+void rnpkeys_generatekey_verifyHiddenRecipient(void **state);
+
+void rnpkeys_generatekey_verifyBulkImport(void **state);
+
+void rnpkeys_generatekey_verifyCompact(void **state);
+
 void rnpkeys_exportkey_verifyUserId(void **state);
 
 void hash_test_success(void **state);
@@ -49,3 +75,17 @@ void cipher_test_success(void **state);
 void pkcs1_rsa_test_success(void **state);
 
 void raw_elg_test_success(void **state);
+
+void stage_stats_test_success(void **state);
+
+void rng_fork_test_success(void **state);
+
+void key_split_test_success(void **state);
+
+void bn_lazy_test_success(void **state);
+
+void threads_mixed_ops_test_success(void **state);
+
+void shared_keys_reload_test_success(void **state);
+
+void threads_signer_test_success(void **state);
@@ -24,11 +24,19 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <crypto.h>
 #include <key_store_pgp.h>
 #include <packet.h>
 #include <packet-key.h>
+#include <packet-parse.h>
 #include <bn.h>
+#include <readerwriter.h>
+#include <rng.h>
+#include <signature.h>
+#include <writer.h>
 #include <rnp.h>
 #include <rnp_tests_support.h>
 #include <rnp_tests.h>
@@ -267,3 +275,147 @@ raw_elg_test_success(void **state)
     BN_clear_free(sec_elg.x);
     BN_clear_free(pub_elg.y);
 }
+
+void
+stage_stats_test_success(void **state)
+{
+    pgp_output_t *     output;
+    pgp_memory_t *     mem;
+    pgp_stage_stats_t *base64;
+    pgp_stage_stats_t *memory;
+    uint8_t            data[1000];
+
+    memset(data, 'x', sizeof(data));
+
+    /* nothing is counted until asked for */
+    pgp_setup_memory_write(&output, &mem, sizeof(data));
+    assert_null(output->writer.stats);
+    pgp_teardown_memory_write(output, mem);
+
+    assert_int_equal(1, rnp_set_stats(1));
+    pgp_setup_memory_write(&output, &mem, sizeof(data));
+    pgp_writer_push_armor_msg(output);
+    assert_int_equal(1, pgp_write(output, data, sizeof(data)));
+    pgp_teardown_memory_write(output, mem);
+
+    base64 = pgp_stats_stage("base64", PGP_STAGE_WRITER);
+    memory = pgp_stats_stage("memory", PGP_STAGE_WRITER);
+    assert_non_null(base64);
+    assert_non_null(memory);
+    assert_int_equal(1, base64->calls);
+    assert_int_equal(sizeof(data), base64->bytes_in);
+    assert_true(base64->bytes_out >= sizeof(data) * 4 / 3);
+    assert_true(memory->bytes_in > base64->bytes_out);
+    assert_true(base64->usec >= base64->self_usec);
+    assert_non_null(strstr(rnp_get_info("stats"), "base64"));
+
+    /* a reset clears the counters, but keeps the stages where they are */
+    pgp_stats_reset();
+    assert_int_equal(0, base64->calls);
+    assert_int_equal(0, base64->bytes_in);
+    assert_true(base64 == pgp_stats_stage("base64", PGP_STAGE_WRITER));
+
+    assert_int_equal(1, rnp_set_stats(0));
+}
+
+void
+rng_fork_test_success(void **state)
+{
+    uint8_t parent[32];
+    uint8_t child[32];
+    uint8_t first[16];
+    int     fds[2];
+    pid_t   pid;
+
+    /* leave some output buffered before forking */
+    assert_int_equal(1, pgp_rng_get(first, sizeof(first)));
+    assert_non_null(pgp_rng_handle());
+    assert_int_equal(0, pipe(fds));
+
+    if ((pid = fork()) == 0) {
+        close(fds[0]);
+        _exit(!pgp_rng_get(child, sizeof(child)) ||
+              write(fds[1], child, sizeof(child)) != sizeof(child));
+    }
+    assert_true(pid > 0);
+    close(fds[1]);
+    assert_int_equal(1, pgp_rng_get(parent, sizeof(parent)));
+    assert_int_equal(sizeof(child), read(fds[0], child, sizeof(child)));
+    close(fds[0]);
+    assert_int_equal(pid, waitpid(pid, NULL, 0));
+
+    /* parent and child must not hand out the same bytes */
+    assert_memory_not_equal(parent, child, sizeof(parent));
+}
+
+void
+key_split_test_success(void **state)
+{
+    uint8_t ring[233];
+    size_t  starts[8];
+
+    memset(ring, 0x0, sizeof(ring));
+    /* old format public key, two octet length */
+    memcpy(&ring[0], "\x99\x00\x03", 3);
+    /* old format user id */
+    memcpy(&ring[6], "\xb4\x02", 2);
+    /* new format signature, two octet length of 200 */
+    memcpy(&ring[10], "\xc2\xc0\x08", 3);
+    /* new format public key */
+    memcpy(&ring[213], "\xc6\x05", 2);
+    /* new format subkey, five octet length */
+    memcpy(&ring[220], "\xce\xff\x00\x00\x00\x04", 6);
+    /* old format secret key */
+    memcpy(&ring[230], "\x94\x01", 2);
+
+    assert_int_equal(1, pgp_split_at_keys(ring, sizeof(ring), starts, 1));
+    assert_int_equal(0, starts[0]);
+    assert_int_equal(3, pgp_split_at_keys(ring, sizeof(ring), starts, 3));
+    assert_int_equal(213, starts[1]);
+    assert_int_equal(230, starts[2]);
+    assert_int_equal(3, pgp_split_at_keys(ring, sizeof(ring), starts, 8));
+    assert_int_equal(2, pgp_split_at_keys(ring, 220, starts, 2));
+    assert_int_equal(213, starts[1]);
+
+    /* cut short, or not packets at all */
+    assert_int_equal(0, pgp_split_at_keys(ring, sizeof(ring) - 1, starts, 3));
+    assert_int_equal(0, pgp_split_at_keys(ring, 100, starts, 3));
+    ring[213] = 0x06;
+    assert_int_equal(0, pgp_split_at_keys(ring, sizeof(ring), starts, 3));
+}
+
+void
+bn_lazy_test_success(void **state)
+{
+    static const uint8_t value[] = {0x00, 0x01, 0x80, 0xff};
+    uint8_t              out[sizeof(value)];
+    BIGNUM *             lazy;
+    BIGNUM *             copy;
+    BIGNUM *             eager;
+
+    /* values read from packets stay as bytes until arithmetic needs them */
+    lazy = BN_bin2bn(value, sizeof(value), NULL);
+    assert_non_null(lazy);
+    assert_int_equal(3, BN_num_bytes(lazy));
+    assert_int_equal(17, BN_num_bits(lazy));
+    memset(out, 0x0, sizeof(out));
+    assert_int_equal(0, BN_bn2bin(lazy, out));
+    assert_memory_equal(&value[1], out, 3);
+    copy = BN_dup(lazy);
+    assert_non_null(copy);
+    assert_null(atomic_load(&lazy->mp));
+    assert_null(atomic_load(&copy->mp));
+
+    eager = BN_new();
+    assert_non_null(BN_bin2bn(value, sizeof(value), eager));
+    assert_non_null(atomic_load(&eager->mp));
+    assert_int_equal(0, BN_cmp(lazy, eager));
+    assert_non_null(atomic_load(&lazy->mp));
+    assert_int_equal(17, BN_num_bits(lazy));
+    assert_true(get_BN_mp(copy) == get_BN_mp(copy));
+    assert_int_equal(0, BN_cmp(copy, eager));
+
+    BN_free(lazy);
+    BN_free(copy);
+    BN_free(eager);
+}
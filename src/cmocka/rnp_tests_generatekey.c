@@ -24,8 +24,24 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include <rnp.h>
 #include <rnp_tests_support.h>
+#include <key_store.h>
+#include <key_store_pgp.h>
+#include <key_store_kbx.h>
+#include <key_store_internal.h>
+#include <seckeycache.h>
+#include <agent.h>
+#include <packet-key.h>
+#include <poll.h>
+#include <pthread.h>
+#include <rnpsdk.h>
+#include <sigcache.h>
+#include <validate.h>
 
 void
 rnpkeys_generatekey_testSignature(void **state)
@@ -495,3 +511,922 @@ rnpkeys_generatekey_verifykeyHomeDirNoPermission(void **state)
 
     rnp_end(&rnp); // Free memory and other allocated resources.
 }
+
+static void
+keys_setup_rnp(rnp_t *rnp, int *pipefd)
+{
+    char passfd[4] = {0};
+
+    assert_int_equal(setupPassphrasefd(pipefd), 1);
+    memset(rnp, '\0', sizeof(*rnp));
+    rnp_setvar(rnp, "sshkeydir", "/etc/ssh");
+    rnp_setvar(rnp, "res", "<stdout>");
+    rnp_setvar(rnp, "format", "human");
+    rnp_setvar(rnp, "pass-fd", uint_to_string(passfd, 4, pipefd[0], 10));
+    assert_int_equal(rnp_setvar(rnp, "hash", "SHA256"), 1);
+    assert_int_equal(1, rnp_init(rnp));
+}
+
+/* as keys_setup_rnp(), with a line holding the pass phrase for each unlock */
+static void
+passes_setup_rnp(rnp_t *rnp, int *pipefd, int passes)
+{
+    const char *password = "passwordforkeygeneration\n";
+    char        passfd[4] = {0};
+    int         i;
+
+    assert_int_equal(0, pipe(pipefd));
+    for (i = 0; i < passes; i++) {
+        assert_int_equal(strlen(password), write(pipefd[1], password, strlen(password)));
+    }
+    close(pipefd[1]);
+    memset(rnp, '\0', sizeof(*rnp));
+    rnp_setvar(rnp, "sshkeydir", "/etc/ssh");
+    rnp_setvar(rnp, "res", "<stdout>");
+    rnp_setvar(rnp, "format", "human");
+    rnp_setvar(rnp, "pass-fd", uint_to_string(passfd, 4, pipefd[0], 10));
+    assert_int_equal(1, rnp_setvar(rnp, "hash", "SHA256"));
+    assert_int_equal(1, rnp_init(rnp));
+}
+
+void
+rnpkeys_generatekey_verifyKeyringWatch(void **state)
+{
+    const char *ourdir = (char *) *state;
+    /* Generate a key and load it, then watch the keyring files while
+     * another rnp_t appends keys to them. The watcher should pick up just
+     * the new keys without reading the keyrings again, including one that
+     * was added after the keyrings were loaded but before they were watched.
+     */
+    rnp_t     watcher;
+    rnp_t     writer;
+    const int numbits = 1024;
+    int       pipefd[2];
+    int       fd;
+
+    keys_setup_rnp(&watcher, pipefd);
+    rnp_setvar(&watcher, "need seckey", "true");
+    assert_int_equal(1, rnp_generate_key(&watcher, "firstkey", numbits));
+    assert_int_equal(1, rnp_load_keys(&watcher));
+    assert_int_equal(1, ((rnp_key_store_t *) watcher.pubring)->keyc);
+    assert_int_equal(1, ((rnp_key_store_t *) watcher.secring)->keyc);
+    assert_int_equal(0, rnp_find_key(&watcher, "secondkey"));
+
+    keys_setup_rnp(&writer, pipefd);
+    assert_true(path_file_exists(ourdir, ".rnp/pubring.gpg", NULL));
+    assert_int_equal(1, rnp_generate_key(&writer, "secondkey", numbits));
+
+    fd = rnp_watch_keys(&watcher);
+    assert_true(fd >= 0);
+    assert_int_equal(fd, rnp_watch_keys(&watcher));
+    assert_int_equal(0, rnp_update_keys(&watcher));
+
+    assert_int_equal(1, rnp_generate_key(&writer, "thirdkey", numbits));
+    rnp_end(&writer);
+
+    /* both rings were appended to, twice */
+    assert_int_equal(2, rnp_update_keys(&watcher));
+    assert_int_equal(3, ((rnp_key_store_t *) watcher.pubring)->keyc);
+    assert_int_equal(3, ((rnp_key_store_t *) watcher.pubring)->hotc);
+    assert_int_equal(3, ((rnp_key_store_t *) watcher.secring)->keyc);
+    assert_int_equal(1, rnp_find_key(&watcher, "firstkey"));
+    assert_int_equal(1, rnp_find_key(&watcher, "secondkey"));
+    assert_int_equal(1, rnp_find_key(&watcher, "thirdkey"));
+    assert_int_equal(0, rnp_update_keys(&watcher));
+
+    rnp_unwatch_keys(&watcher);
+    rnp_end(&watcher);
+}
+
+#define PARALLEL_COPIES 2048
+
+void
+rnpkeys_generatekey_verifyParallelLoad(void **state)
+{
+    const char *ourdir = (char *) *state;
+    /* A keyring big enough to get split between threads must load the
+     * same keys, in the same order, as the small keyring it is made of.
+     */
+    rnp_key_store_t  single;
+    rnp_key_store_t  parallel;
+    const pgp_key_t *found;
+    pgp_memory_t *   key;
+    pgp_memory_t *   big;
+    rnp_t            rnp;
+    char             path[256];
+    int              pipefd[2];
+    unsigned         from;
+    unsigned         i;
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_generate_key(&rnp, "parallelkey", 1024));
+
+    memset(&single, 0x0, sizeof(single));
+    paths_concat(path, sizeof(path), ourdir, ".rnp/pubring.gpg", NULL);
+    assert_true(rnp_key_store_pgp_read_from_file(rnp.io, &single, 0, path));
+    assert_int_equal(1, single.keyc);
+
+    key = pgp_memory_new();
+    assert_int_equal(1, pgp_mem_readfile(key, path));
+    big = pgp_memory_new();
+    for (i = 0; i < PARALLEL_COPIES; i++) {
+        pgp_memory_add(big, key->buf, key->length);
+    }
+    paths_concat(path, sizeof(path), ourdir, "big.gpg", NULL);
+    FILE *fp = fopen(path, "wb");
+    assert_non_null(fp);
+    assert_int_equal(1, fwrite(big->buf, big->length, 1, fp));
+    fclose(fp);
+
+    memset(&parallel, 0x0, sizeof(parallel));
+    assert_true(rnp_key_store_pgp_read_from_file(rnp.io, &parallel, 0, path));
+    assert_int_equal(PARALLEL_COPIES, parallel.keyc);
+    assert_int_equal(parallel.keyc, parallel.hotc);
+    for (i = 0; i < parallel.keyc; i++) {
+        assert_int_equal(single.keys[0].uidc, parallel.keys[i].uidc);
+        assert_int_equal(single.keys[0].subsigc, parallel.keys[i].subsigc);
+        assert_memory_equal(single.keys[0].sigid, parallel.keys[i].sigid, PGP_KEY_ID_SIZE);
+    }
+
+
+    /* lookups go through the index, which follows keys being removed */
+    from = 0;
+    found = rnp_key_store_get_key_by_id(rnp.io, &parallel, single.keys[0].sigid, &from, NULL);
+    assert_true(found == &parallel.keys[0]);
+    assert_int_equal(1, rnp_key_store_remove_key(rnp.io, &parallel, &parallel.keys[0]));
+    assert_int_equal(PARALLEL_COPIES - 1, parallel.hotc);
+    from = 0;
+    found =
+      rnp_key_store_get_key_by_id(rnp.io, &parallel, &single.keys[0].sigid[4], &from, NULL);
+    assert_true(found == &parallel.keys[0]);
+    assert_int_equal(
+      0, memcmp(parallel.hots[0].sigid, parallel.keys[0].sigid, PGP_KEY_ID_SIZE));
+
+    rnp_key_store_free(&single);
+    rnp_key_store_free(&parallel);
+    pgp_memory_free(key);
+    pgp_memory_free(big);
+    rnp_end(&rnp);
+}
+
+void
+rnpkeys_generatekey_verifyCachedFingerprint(void **state)
+{
+    const char *ourdir = (char *) *state;
+    /* Keys read from a keyring carry the fingerprint of the packet they
+     * were read from, which must match the one built from the key.
+     */
+    rnp_key_store_t   ring;
+    pgp_fingerprint_t fp;
+    pgp_pubkey_t      pubkey;
+    rnp_t             rnp;
+    char              path[256];
+    int               pipefd[2];
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_generate_key(&rnp, "fingerprintkey", 1024));
+
+    memset(&ring, 0x0, sizeof(ring));
+    paths_concat(path, sizeof(path), ourdir, ".rnp/pubring.gpg", NULL);
+    assert_true(rnp_key_store_pgp_read_from_file(rnp.io, &ring, 0, path));
+    assert_int_equal(1, ring.keyc);
+    assert_int_equal(PGP_FINGERPRINT_SIZE, ring.keys[0].key.pubkey.fingerprint.length);
+    assert_memory_equal(ring.keys[0].key.pubkey.fingerprint.fingerprint,
+                        ring.keys[0].sigfingerprint.fingerprint,
+                        PGP_FINGERPRINT_SIZE);
+
+    pubkey = ring.keys[0].key.pubkey;
+    memset(&pubkey.fingerprint, 0x0, sizeof(pubkey.fingerprint));
+    assert_int_equal(1, pgp_fingerprint(&fp, &pubkey, PGP_HASH_SHA1));
+    assert_int_equal(PGP_FINGERPRINT_SIZE, fp.length);
+    assert_memory_equal(
+      fp.fingerprint, ring.keys[0].sigfingerprint.fingerprint, PGP_FINGERPRINT_SIZE);
+
+    rnp_key_store_free(&ring);
+    rnp_end(&rnp);
+}
+
+void
+rnpkeys_generatekey_verifySigCache(void **state)
+{
+    const char *ourdir = (char *) *state;
+    /* Validate the keyring twice through a signature cache, then mark every
+     * cached check as failed: the next run must take its results from the
+     * cache rather than checking the signatures again.
+     */
+    rnp_t       rnp;
+    struct stat st;
+    off_t       size;
+    uint8_t     buf[4096];
+    char        path[256];
+    size_t      len;
+    size_t      i;
+    FILE *      fp;
+    int         pipefd[2];
+
+    keys_setup_rnp(&rnp, pipefd);
+    paths_concat(path, sizeof(path), ourdir, "sigcache", NULL);
+    assert_int_equal(1, rnp_setvar(&rnp, "sigcache", path));
+    assert_int_equal(1, rnp_generate_key(&rnp, "sigcachekey", 1024));
+    assert_int_equal(1, rnp_load_keys(&rnp));
+
+    assert_int_equal(1, rnp_validate_sigs(&rnp));
+    assert_int_equal(0, stat(path, &st));
+    /* header, then a key and result for at least the self-signature */
+    assert_true(st.st_size >= 8 + 33);
+    size = st.st_size;
+
+    /* nothing new to record the second time round */
+    assert_int_equal(1, rnp_validate_sigs(&rnp));
+    assert_int_equal(0, stat(path, &st));
+    assert_int_equal(size, st.st_size);
+
+    assert_non_null(fp = fopen(path, "r+b"));
+    len = fread(buf, 1, sizeof(buf), fp);
+    assert_int_equal(size, len);
+    for (i = 8 + 32; i < len; i += 33) {
+        buf[i] = 1;
+    }
+    rewind(fp);
+    assert_int_equal(len, fwrite(buf, 1, len, fp));
+    assert_int_equal(0, fclose(fp));
+    assert_int_equal(0, rnp_validate_sigs(&rnp));
+
+    rnp_end(&rnp);
+}
+
+#define KBX_TEST_THREADS 4
+
+/* look at every key of a keybox which other threads may be parsing */
+static void *
+kbx_test_reader(void *arg)
+{
+    rnp_key_store_t *ring = arg;
+    pgp_io_t         io = {stdout, stderr, stdout};
+    unsigned         from;
+    unsigned         i;
+    char             id[MAX_ID_LENGTH];
+
+    for (i = 0; i < ring->keyc; i++) {
+        from = 0;
+        if (!rnp_key_store_get_first_ring(ring, id, sizeof(id), i & 1) ||
+            rnp_key_store_get_key_by_id(&io, ring, ring->hots[i].sigid, &from, NULL) == NULL ||
+            rnp_key_store_get_key(&io, ring, i)->uidc != 1) {
+            return NULL;
+        }
+    }
+    return ring;
+}
+
+void
+rnpkeys_generatekey_verifyKeybox(void **state)
+{
+    const char *ourdir = (char *) *state;
+    /* Generate keys into a keybox, then look one of them up by user id and
+     * another by key id: only those two should get parsed. Written back
+     * out, the keyring should be the keybox it was read from.
+     */
+    const rnp_key_store_t *ring;
+    const pgp_key_t *      key;
+    rnp_key_store_t        copy;
+    pgp_memory_t *         file;
+    pgp_memory_t *         mem;
+    pthread_t              readers[KBX_TEST_THREADS];
+    rnp_t                  rnp;
+    char                   path[256];
+    void *                 res;
+    unsigned               from;
+    unsigned               i;
+    int                    pipefd[2];
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_set_keyring_format(&rnp, "KBX"));
+    assert_int_equal(1, rnp_generate_key(&rnp, "kbxkey0", 1024));
+    assert_int_equal(1, rnp_generate_key(&rnp, "kbxkey1", 1024));
+    assert_int_equal(1, rnp_generate_key(&rnp, "kbxkey2", 1024));
+    assert_true(path_file_exists(ourdir, ".rnp/pubring.kbx", NULL));
+    assert_false(path_file_exists(ourdir, ".rnp/pubring.gpg", NULL));
+    assert_int_equal(1, rnp_load_keys(&rnp));
+
+    ring = rnp.pubring;
+    assert_int_equal(3, ring->keyc);
+    assert_int_equal(3, ring->blobc);
+    for (i = 0; i < ring->blobc; i++) {
+        assert_int_equal(PGP_KBX_BLOB_HEADER, ring->blobs[i].state);
+    }
+
+    assert_int_equal(1, rnp_find_key(&rnp, "kbxkey1"));
+    assert_int_equal(PGP_KBX_BLOB_HEADER, ring->blobs[0].state);
+    assert_int_equal(PGP_KBX_BLOB_PARSED, ring->blobs[1].state);
+    assert_int_equal(PGP_KBX_BLOB_HEADER, ring->blobs[2].state);
+
+    from = 0;
+    key = rnp_key_store_get_key_by_id(rnp.io, ring, ring->keys[2].sigid, &from, NULL);
+    assert_non_null(key);
+    assert_int_equal(2, from);
+    assert_int_equal(PGP_KBX_BLOB_HEADER, ring->blobs[0].state);
+    assert_int_equal(PGP_KBX_BLOB_PARSED, ring->blobs[2].state);
+    assert_int_equal(1, key->uidc);
+    assert_string_equal("kbxkey2", (char *) key->uids[0]);
+
+    /* the same blobs, after a header with different timestamps */
+    paths_concat(path, sizeof(path), ourdir, ".rnp/pubring.kbx", NULL);
+    assert_non_null(file = pgp_memory_new());
+    assert_int_equal(1, pgp_mem_readfile(file, path));
+    assert_non_null(mem = pgp_memory_new());
+    assert_int_equal(1, rnp_key_store_kbx_to_mem(rnp.io, ring, mem));
+    assert_int_equal(file->length, mem->length);
+    assert_int_equal(0, memcmp(&file->buf[32], &mem->buf[32], mem->length - 32));
+
+    memset(&copy, 0x0, sizeof(copy));
+    assert_int_equal(1, rnp_key_store_kbx_from_mem(rnp.io, &copy, 0, mem));
+    assert_int_equal(3, copy.keyc);
+    from = 0;
+    key = rnp_key_store_get_key_by_id(rnp.io, &copy, ring->keys[0].sigid, &from, NULL);
+    assert_non_null(key);
+    assert_int_equal(0, from);
+    assert_string_equal("kbxkey0", (char *) key->uids[0]);
+    rnp_key_store_free(&copy);
+
+    /* keys looked at by several threads at once are parsed once, and whole */
+    memset(&copy, 0x0, sizeof(copy));
+    assert_int_equal(1, rnp_key_store_kbx_from_mem(rnp.io, &copy, 0, mem));
+    for (i = 0; i < KBX_TEST_THREADS; i++) {
+        assert_int_equal(0, pthread_create(&readers[i], NULL, kbx_test_reader, &copy));
+    }
+    for (i = 0; i < KBX_TEST_THREADS; i++) {
+        assert_int_equal(0, pthread_join(readers[i], &res));
+        assert_true(res == &copy);
+    }
+    for (i = 0; i < copy.blobc; i++) {
+        assert_int_equal(PGP_KBX_BLOB_PARSED, copy.blobs[i].state);
+    }
+
+    rnp_key_store_free(&copy);
+    pgp_memory_free(mem);
+
+    /* a parsed key makes a blob of its own which reads back the same */
+    assert_non_null(mem = pgp_memory_new());
+    assert_int_equal(1, rnp_key_store_kbx_write_key(rnp.io, &ring->keys[1], mem));
+    memset(&copy, 0x0, sizeof(copy));
+    assert_int_equal(1, rnp_key_store_kbx_from_mem(rnp.io, &copy, 0, mem));
+    assert_int_equal(1, copy.keyc);
+    assert_non_null(key = rnp_key_store_get_key(rnp.io, &copy, 0));
+    assert_int_equal(0, memcmp(key->sigid, ring->keys[1].sigid, PGP_KEY_ID_SIZE));
+    assert_int_equal(ring->keys[1].packetc, key->packetc);
+    assert_string_equal("kbxkey1", (char *) key->uids[0]);
+
+    rnp_key_store_free(&copy);
+    pgp_memory_free(mem);
+    pgp_memory_free(file);
+    rnp_end(&rnp);
+}
+
+void
+rnpkeys_generatekey_verifySeckeyCache(void **state)
+{
+    /* Sign with a key unlocked through a cache which hands each key out
+     * twice: once for signing, and once more here. After that it must be
+     * unlocked again.
+     */
+    const pgp_key_t *key;
+    pgp_seckey_t *   seckey;
+    rnp_t            rnp;
+    char             msg[] = "A simple test message";
+    char             sig[4096];
+    int              pipefd[2];
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_generate_key(&rnp, "seckeycachekey", 1024));
+    rnp_end(&rnp);
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_setvar(&rnp, "need seckey", "true"));
+    assert_int_equal(1, rnp_setvar(&rnp, "seckey_ttl", "60"));
+    assert_int_equal(1, rnp_setvar(&rnp, "seckey_uses", "2"));
+    assert_int_equal(1, rnp_load_keys(&rnp));
+    assert_true(
+      rnp_sign_memory(&rnp, "seckeycachekey", msg, strlen(msg), sig, sizeof(sig), 1, 0) > 0);
+    assert_non_null(rnp.seckeys);
+
+    key = rnp_key_store_get_key_by_name(rnp.io, rnp.secring, "seckeycachekey");
+    assert_non_null(key);
+    assert_int_equal(0, pgp_seckey_cache_release(rnp.seckeys, &key->key.seckey));
+    assert_non_null(seckey = pgp_seckey_cache_get(rnp.seckeys, key));
+    assert_int_equal(1, pgp_seckey_cache_release(rnp.seckeys, seckey));
+    assert_null(pgp_seckey_cache_get(rnp.seckeys, key));
+
+    rnp_end(&rnp);
+    assert_null(rnp.seckeys);
+}
+
+typedef struct {
+    rnp_t *             rnp;
+    pgp_seckey_cache_t *keys;
+    int                 listenfd;
+} agent_test_t;
+
+/* answer two connections at once, as rnp-agent does, until both close */
+static void *
+agent_test_serve(void *arg)
+{
+    pgp_agent_conn_t *conns[2];
+    agent_test_t *    agent = arg;
+    struct pollfd     fds[2];
+    unsigned          open;
+    unsigned          i;
+
+    for (open = 0; open < 2; open++) {
+        if ((conns[open] = pgp_agent_accept(agent->listenfd)) == NULL) {
+            break;
+        }
+        fds[open].fd = pgp_agent_conn_fd(conns[open]);
+        fds[open].events = POLLIN;
+    }
+    for (i = open; i < 2; i++) {
+        fds[i].fd = -1;
+    }
+    while (open > 0 && poll(fds, 2, -1) > 0) {
+        for (i = 0; i < 2; i++) {
+            if (fds[i].fd >= 0 && fds[i].revents != 0 &&
+                !pgp_agent_serve(agent->rnp->io, conns[i], agent->rnp->secring, agent->keys)) {
+                pgp_agent_conn_close(conns[i]);
+                fds[i].fd = -1;
+                open--;
+            }
+        }
+    }
+    return NULL;
+}
+
+void
+rnpkeys_generatekey_verifyAgent(void **state)
+{
+    /* Sign through an agent which holds the only unlocked copy of the key.
+     * The pass-fd pipe holds a single passphrase, which the agent uses up,
+     * so the signer cannot have unlocked the key itself.
+     */
+    struct sockaddr_un addr;
+    const pgp_key_t *  key;
+    pgp_seckey_t *     seckey;
+    agent_test_t       agent;
+    pthread_t          server;
+    rnp_t              rnp;
+    char               msg[] = "A simple test message";
+    char               sig[4096];
+    char               out[4096];
+    char               sock[MAXPATHLEN];
+    char *             slash;
+    int                pipefd[2];
+    int                stalled;
+    int                len;
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_generate_key(&rnp, "agentkey", 1024));
+    rnp_end(&rnp);
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_setvar(&rnp, "need seckey", "true"));
+    assert_int_equal(1, rnp_load_keys(&rnp));
+    key = rnp_key_store_get_key_by_name(rnp.io, rnp.secring, "agentkey");
+    assert_non_null(key);
+
+    agent.rnp = &rnp;
+    assert_non_null(agent.keys = pgp_seckey_cache_new(60, 0));
+    assert_non_null(seckey = pgp_decrypt_seckey(key, rnp.passfp));
+    assert_non_null(seckey = pgp_seckey_cache_put(agent.keys, key, seckey));
+    assert_int_equal(1, pgp_seckey_cache_release(agent.keys, seckey));
+
+    /* the agent listens in the key directory, where rnp looks by default */
+    snprintf(sock, sizeof(sock), "%s", rnp_getvar(&rnp, "secring"));
+    assert_non_null(slash = strrchr(sock, '/'));
+    snprintf(slash + 1, sizeof(sock) - (slash + 1 - sock), "%s", PGP_AGENT_SOCKET);
+    assert_true((agent.listenfd = pgp_agent_listen(sock)) >= 0);
+    assert_int_equal(0, pthread_create(&server, NULL, agent_test_serve, &agent));
+
+    /* a client which sends only part of a request holds nobody up */
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    assert_true(strlen(sock) < sizeof(addr.sun_path));
+    memcpy(addr.sun_path, sock, strlen(sock) + 1);
+    assert_true((stalled = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+    assert_int_equal(0, connect(stalled, (struct sockaddr *) &addr, sizeof(addr)));
+    assert_int_equal(2, write(stalled, "\0\0", 2));
+
+    assert_int_equal(1, rnp_setvar(&rnp, "agent", ""));
+    len = rnp_sign_memory(&rnp, "agentkey", msg, strlen(msg), sig, sizeof(sig), 0, 0);
+    assert_true(len > 0);
+    assert_non_null(rnp.agent);
+    assert_int_equal(strlen(msg), rnp_verify_memory(&rnp, sig, len, out, sizeof(out), 0));
+    assert_int_equal(0, memcmp(out, msg, strlen(msg)));
+
+    /* closing both connections lets the server go, before the keys it
+     * uses are */
+    close(stalled);
+    pgp_agent_close(rnp.agent);
+    rnp.agent = NULL;
+    assert_int_equal(0, pthread_join(server, NULL));
+    rnp_end(&rnp);
+
+    /* a second agent does not take the socket from one which is listening,
+     * only from one which has gone */
+    assert_int_equal(-1, pgp_agent_listen(sock));
+    close(agent.listenfd);
+    assert_true((agent.listenfd = pgp_agent_listen(sock)) >= 0);
+    close(agent.listenfd);
+    unlink(sock);
+    pgp_seckey_cache_free(agent.keys);
+}
+
+void
+rnpkeys_generatekey_verifyMultiRecipient(void **state)
+{
+    /* Encrypt once for two keys, and decrypt with the secret keyring
+     * holding both, with each key's session key packet coming first.
+     */
+    const char *recipients[][2] = {{"multione", "multitwo"}, {"multitwo", "multione"}};
+    rnp_t       rnp;
+    char        msg[] = "A message for two";
+    char        ctext[4096];
+    char        ptext[4096];
+    int         pipefd[2];
+    int         len;
+    int         i;
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_generate_key(&rnp, "multione", 1024));
+    rnp_end(&rnp);
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_generate_key(&rnp, "multitwo", 1024));
+    rnp_end(&rnp);
+
+    for (i = 0; i < 2; i++) {
+        keys_setup_rnp(&rnp, pipefd);
+        assert_int_equal(1, rnp_setvar(&rnp, "need seckey", "true"));
+        assert_int_equal(1, rnp_load_keys(&rnp));
+        len = rnp_encrypt_memory_multi(
+          &rnp, recipients[i], 2, msg, strlen(msg), ctext, sizeof(ctext), 0);
+        assert_true(len > 0);
+        memset(ptext, 0, sizeof(ptext));
+        assert_int_equal(strlen(msg),
+                         rnp_decrypt_memory(&rnp, ctext, len, ptext, sizeof(ptext), 0));
+        assert_string_equal(msg, ptext);
+        rnp_end(&rnp);
+    }
+}
+
+void
+rnpkeys_generatekey_verifySignEncrypt(void **state)
+{
+    /* Sign and encrypt in one pass, a short message which fits in one
+     * packet and a long one whose encrypted body has partial lengths, and
+     * check both decrypt to the plaintext.
+     */
+    const size_t sizes[] = {17, 300000};
+    char         userid[] = "signencrypt";
+    const char * recipient = userid;
+    uint32_t     seed = 1;
+    rnp_t        rnp;
+    char *       msg;
+    char *       ctext;
+    char *       ptext;
+    size_t       j;
+    int          pipefd[2];
+    int          len;
+    int          i;
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_generate_key(&rnp, userid, 1024));
+    rnp_end(&rnp);
+
+    for (i = 0; i < 2; i++) {
+        assert_non_null(msg = malloc(sizes[i]));
+        assert_non_null(ctext = malloc(sizes[i] + 4096));
+        assert_non_null(ptext = calloc(1, sizes[i] + 1));
+        /* text-like, as a signed and encrypted file usually is */
+        for (j = 0; j < sizes[i]; j++) {
+            seed = seed * 1103515245 + 12345;
+            msg[j] = 'a' + (seed >> 16) % 16;
+        }
+
+        keys_setup_rnp(&rnp, pipefd);
+        assert_int_equal(1, rnp_setvar(&rnp, "need seckey", "true"));
+        assert_int_equal(1, rnp_load_keys(&rnp));
+        len = rnp_sign_encrypt_memory(
+          &rnp, userid, &recipient, 1, msg, sizes[i], ctext, sizes[i] + 4096, 0);
+        assert_true(len > 0);
+        rnp_end(&rnp);
+
+        keys_setup_rnp(&rnp, pipefd);
+        assert_int_equal(1, rnp_setvar(&rnp, "need seckey", "true"));
+        assert_int_equal(1, rnp_load_keys(&rnp));
+        assert_int_equal(sizes[i],
+                         rnp_decrypt_memory(&rnp, ctext, len, ptext, sizes[i] + 1, 0));
+        assert_memory_equal(msg, ptext, sizes[i]);
+        rnp_end(&rnp);
+
+        free(msg);
+        free(ctext);
+        free(ptext);
+    }
+}
+
+void
+rnpkeys_generatekey_verifyMultiSigner(void **state)
+{
+    /* Sign once with two keys, and check the message carries a valid
+     * signature from each of them.
+     */
+    const char *      signers[] = {"multisignone", "multisigntwo"};
+    pgp_validation_t *result;
+    pgp_memory_t *    mem;
+    rnp_t             rnp;
+    char              msg[] = "A message signed twice";
+    char              sig[4096];
+    int               pipefd[2];
+    int               len;
+    int               i;
+
+    for (i = 0; i < 2; i++) {
+        keys_setup_rnp(&rnp, pipefd);
+        assert_int_equal(1, rnp_generate_key(&rnp, (char *) signers[i], 1024));
+        rnp_end(&rnp);
+    }
+
+    passes_setup_rnp(&rnp, pipefd, 2);
+    assert_int_equal(1, rnp_setvar(&rnp, "need seckey", "true"));
+    assert_int_equal(1, rnp_load_keys(&rnp));
+
+    len = rnp_sign_memory_multi(&rnp, signers, 2, msg, strlen(msg), sig, sizeof(sig), 0);
+    assert_true(len > 0);
+
+    assert_non_null(result = calloc(1, sizeof(*result)));
+    mem = pgp_memory_new();
+    pgp_memory_add(mem, (uint8_t *) sig, len);
+    assert_int_equal(1, pgp_validate_mem(rnp.io, result, mem, NULL, 0, rnp.pubring));
+    assert_int_equal(2, result->validc);
+    assert_int_equal(0, result->invalidc + result->unknownc);
+    pgp_validate_result_free(result);
+    rnp_end(&rnp);
+}
+
+void
+rnpkeys_generatekey_verifyHiddenRecipient(void **state)
+{
+    /* Encrypt for the second of two keys, then hide the recipient by
+     * zeroing the key id of the session key. It should decrypt by
+     * unlocking and trying the secret keys in turn, and once they are
+     * kept, by trying the kept keys without any pass phrase.
+     */
+    const char *recipients[] = {"hiddenone", "hiddentwo"};
+    rnp_t       rnp;
+    char        msg[] = "A message for someone";
+    char        ctext[4096];
+    char        ptext[64];
+    uint8_t *   pkt;
+    size_t      off;
+    int         pipefd[2];
+    int         len;
+    int         i;
+
+    for (i = 0; i < 2; i++) {
+        keys_setup_rnp(&rnp, pipefd);
+        assert_int_equal(1, rnp_generate_key(&rnp, (char *) recipients[i], 1024));
+        rnp_end(&rnp);
+    }
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_load_keys(&rnp));
+    len = rnp_encrypt_memory(&rnp, recipients[1], msg, strlen(msg), ctext, sizeof(ctext), 0);
+    assert_true(len > 0);
+    rnp_end(&rnp);
+    /* the key id follows the header and version of the first packet */
+    pkt = (uint8_t *) ctext;
+    if (pkt[0] & 0x40) {
+        off = (pkt[1] < 192) ? 2 : (pkt[1] < 224) ? 3 : 6;
+    } else {
+        off = 1 + (((pkt[0] & 0x3) == 0) ? 1 : ((pkt[0] & 0x3) == 1) ? 2 : 4);
+    }
+    assert_int_equal(3, pkt[off]);
+    memset(&pkt[off + 1], 0x0, PGP_KEY_ID_SIZE);
+
+    /* nothing kept: both keys get unlocked */
+    passes_setup_rnp(&rnp, pipefd, 2);
+    assert_int_equal(1, rnp_setvar(&rnp, "need seckey", "true"));
+    assert_int_equal(1, rnp_load_keys(&rnp));
+    memset(ptext, 0x0, sizeof(ptext));
+    assert_int_equal(strlen(msg),
+                     rnp_decrypt_memory(&rnp, ctext, len, ptext, sizeof(ptext), 0));
+    assert_string_equal(msg, ptext);
+    rnp_end(&rnp);
+
+    /* the second time round the kept keys are tried, with no pass phrase left */
+    passes_setup_rnp(&rnp, pipefd, 2);
+    assert_int_equal(1, rnp_setvar(&rnp, "need seckey", "true"));
+    assert_int_equal(1, rnp_setvar(&rnp, "seckey_ttl", "600"));
+    assert_int_equal(1, rnp_load_keys(&rnp));
+    for (i = 0; i < 2; i++) {
+        memset(ptext, 0x0, sizeof(ptext));
+        assert_int_equal(strlen(msg),
+                         rnp_decrypt_memory(&rnp, ctext, len, ptext, sizeof(ptext), 0));
+        assert_string_equal(msg, ptext);
+    }
+    rnp_end(&rnp);
+}
+
+void
+rnpkeys_generatekey_verifyBulkImport(void **state)
+{
+    const char *ourdir = (char *) *state;
+    /* Import a directory holding two copies of a key, and a third copy
+     * on its own. The key is added to the keyring once, and the keyring
+     * on disk has it afterwards, packet for packet as it was read.
+     * The secret keyring, holding both keys, is imported first, and
+     * only the public part of its keys is taken.
+     */
+    pgp_memory_t *   mem;
+    rnp_key_store_t *ring;
+    rnp_t            rnp;
+    char             pubring[256];
+    char             secring[256];
+    char             dir[256];
+    char             path[256];
+    char *           files[2];
+    size_t           keylen;
+    size_t           ringlen;
+    unsigned         i;
+    unsigned         j;
+    int              pipefd[2];
+    FILE *           fp;
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_generate_key(&rnp, "importedkey", 1024));
+    rnp_end(&rnp);
+
+    /* take the key's pubring away, to be imported again */
+    paths_concat(pubring, sizeof(pubring), ourdir, ".rnp/pubring.gpg", NULL);
+    path_mkdir(0700, ourdir, "import", NULL);
+    paths_concat(dir, sizeof(dir), ourdir, "import", NULL);
+    paths_concat(path, sizeof(path), dir, "one.gpg", NULL);
+    assert_int_equal(0, rename(pubring, path));
+    mem = pgp_memory_new();
+    assert_int_equal(1, pgp_mem_readfile(mem, path));
+    paths_concat(path, sizeof(path), dir, "two.gpg", NULL);
+    assert_non_null(fp = fopen(path, "wb"));
+    assert_int_equal(1, fwrite(mem->buf, mem->length, 1, fp));
+    fclose(fp);
+    paths_concat(path, sizeof(path), ourdir, "three.gpg", NULL);
+    assert_non_null(fp = fopen(path, "wb"));
+    assert_int_equal(1, fwrite(mem->buf, mem->length, 1, fp));
+    fclose(fp);
+    keylen = mem->length;
+    pgp_memory_free(mem);
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_generate_key(&rnp, "otherkey", 1024));
+    mem = pgp_memory_new();
+    assert_int_equal(1, pgp_mem_readfile(mem, pubring));
+    ringlen = mem->length;
+    pgp_memory_free(mem);
+    assert_int_equal(1, rnp_load_keys(&rnp));
+    assert_int_equal(1, ((rnp_key_store_t *) rnp.pubring)->keyc);
+    assert_int_equal(0, rnp_find_key(&rnp, "importedkey"));
+    paths_concat(secring, sizeof(secring), ourdir, ".rnp/secring.gpg", NULL);
+    files[0] = secring;
+    assert_int_equal(1, rnp_import_keys(&rnp, files, 1));
+    assert_int_equal(2, ((rnp_key_store_t *) rnp.pubring)->keyc);
+    files[0] = dir;
+    files[1] = path;
+    assert_int_equal(1, rnp_import_keys(&rnp, files, 2));
+    assert_int_equal(2, ((rnp_key_store_t *) rnp.pubring)->keyc);
+    assert_int_equal(1, rnp_find_key(&rnp, "importedkey"));
+    rnp_end(&rnp);
+
+    mem = pgp_memory_new();
+    assert_int_equal(1, pgp_mem_readfile(mem, pubring));
+    assert_int_equal(ringlen + keylen, mem->length);
+    pgp_memory_free(mem);
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_load_keys(&rnp));
+    ring = rnp.pubring;
+    assert_int_equal(2, ring->keyc);
+    for (i = 0; i < ring->keyc; i++) {
+        assert_false(pgp_is_key_secret(&ring->keys[i]));
+        for (j = 0; j < ring->keys[i].packetc; j++) {
+            assert_int_not_equal(PGP_PTAG_CT_SECRET_KEY,
+                                 pgp_subpacket_tag(&ring->keys[i].packets[j]));
+            assert_int_not_equal(PGP_PTAG_CT_SECRET_SUBKEY,
+                                 pgp_subpacket_tag(&ring->keys[i].packets[j]));
+        }
+    }
+    assert_int_equal(1, rnp_find_key(&rnp, "importedkey"));
+    assert_int_equal(1, rnp_find_key(&rnp, "otherkey"));
+    rnp_end(&rnp);
+}
+
+void
+rnpkeys_generatekey_verifyCompact(void **state)
+{
+    const char *ourdir = (char *) *state;
+    /* A keyring holding three copies of a key, merged with a copy that
+     * has another user id, one with a trust packet after the first user
+     * id's signature and the secret key, is compacted into one key with
+     * both user ids, its packets in keyblock order and none of them
+     * secret.
+     */
+    static const uint8_t uid[] = {0xb4, 14, 'c', 'o', 'm', 'p', 'a', 'c', 't',
+                                  'k',  'e', 'y', ' ', 't', 'o', 'o'};
+    static const uint8_t trust[] = {0xb0, 2, 0, 0};
+    rnp_key_store_t *    pubring;
+    rnp_key_store_t      extra;
+    pgp_key_t *          key;
+    pgp_memory_t *       mem;
+    pgp_memory_t *       copy;
+    rnp_t                rnp;
+    char                 path[256];
+    int                  pipefd[2];
+    FILE *               fp;
+    unsigned             i;
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_generate_key(&rnp, "compactkey", 1024));
+    rnp_end(&rnp);
+
+    paths_concat(path, sizeof(path), ourdir, ".rnp/pubring.gpg", NULL);
+    mem = pgp_memory_new();
+    assert_int_equal(1, pgp_mem_readfile(mem, path));
+    assert_non_null(fp = fopen(path, "ab"));
+    for (i = 0; i < 2; i++) {
+        assert_int_equal(1, fwrite(mem->buf, mem->length, 1, fp));
+    }
+    fclose(fp);
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_load_keys(&rnp));
+    pubring = rnp.pubring;
+    assert_int_equal(3, pubring->keyc);
+    assert_int_equal(3, pubring->keys[0].packetc);
+
+    /* key, user id, signature and the new user id */
+    copy = pgp_memory_new();
+    pgp_memory_add(copy, mem->buf, mem->length);
+    pgp_memory_add(copy, uid, sizeof(uid));
+    memset(&extra, 0x0, sizeof(extra));
+    assert_true(rnp_key_store_pgp_read_from_mem(rnp.io, &extra, 0, copy));
+    assert_int_equal(1, extra.keyc);
+    assert_int_equal(2, extra.keys[0].uidc);
+    assert_int_equal(1, rnp_key_store_append_keyring(rnp.io, pubring, &extra));
+    rnp_key_store_free(&extra);
+    pgp_memory_free(copy);
+
+    /* key, user id, signature and trust */
+    copy = pgp_memory_new();
+    pgp_memory_add(copy, mem->buf, mem->length);
+    pgp_memory_add(copy, trust, sizeof(trust));
+    memset(&extra, 0x0, sizeof(extra));
+    assert_true(rnp_key_store_pgp_read_from_mem(rnp.io, &extra, 0, copy));
+    assert_int_equal(1, rnp_key_store_append_keyring(rnp.io, pubring, &extra));
+    rnp_key_store_free(&extra);
+    pgp_memory_free(copy);
+
+    /* the secret key, of which only the public part is taken */
+    paths_concat(path, sizeof(path), ourdir, ".rnp/secring.gpg", NULL);
+    copy = pgp_memory_new();
+    assert_int_equal(1, pgp_mem_readfile(copy, path));
+    memset(&extra, 0x0, sizeof(extra));
+    assert_true(rnp_key_store_pgp_read_from_mem(rnp.io, &extra, 0, copy));
+    assert_int_equal(1, extra.keyc);
+    assert_int_equal(PGP_PTAG_CT_SECRET_KEY, pgp_subpacket_tag(&extra.keys[0].packets[0]));
+    assert_int_equal(1, rnp_key_store_append_keyring(rnp.io, pubring, &extra));
+    rnp_key_store_free(&extra);
+    pgp_memory_free(copy);
+
+    assert_int_equal(3, pubring->keyc);
+    key = &pubring->keys[0];
+    assert_int_equal(2, key->uidc);
+    assert_int_equal(1, pubring->keys[1].uidc);
+    assert_int_equal(5, key->packetc);
+    assert_int_equal(PGP_PTAG_CT_TRUST, pgp_subpacket_tag(&key->packets[3]));
+    assert_int_equal(PGP_PTAG_CT_USER_ID, pgp_subpacket_tag(&key->packets[4]));
+    assert_false(pgp_is_key_secret(key));
+    for (i = 0; i < key->packetc; i++) {
+        assert_int_not_equal(PGP_PTAG_CT_SECRET_KEY, pgp_subpacket_tag(&key->packets[i]));
+        assert_int_not_equal(PGP_PTAG_CT_SECRET_SUBKEY, pgp_subpacket_tag(&key->packets[i]));
+    }
+
+    assert_int_equal(1, rnp_compact_keys(&rnp));
+    pubring = rnp.pubring;
+    assert_int_equal(1, pubring->keyc);
+    assert_int_equal(pubring->keyc, pubring->hotc);
+    assert_int_equal(2, pubring->keys[0].uidc);
+    rnp_end(&rnp);
+
+    keys_setup_rnp(&rnp, pipefd);
+    assert_int_equal(1, rnp_load_keys(&rnp));
+    pubring = rnp.pubring;
+    assert_int_equal(1, pubring->keyc);
+    assert_int_equal(5, pubring->keys[0].packetc);
+    assert_int_equal(1, rnp_find_key(&rnp, "compactkey too"));
+    rnp_end(&rnp);
+    pgp_memory_free(mem);
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ * 2.  Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+
+#include <rnp.h>
+#include <key_store.h>
+#include <rng.h>
+#include <rnp_tests_support.h>
+#include <rnp_tests.h>
+
+#define STRESS_THREADS 8
+#define STRESS_ROUNDS 4
+#define STRESS_PASSWORD "passwordforkeygeneration"
+#define RELOAD_SNAPSHOTS 1000
+
+typedef struct {
+    const char *userid;
+    int         failures;
+} stress_arg_t;
+
+/* open a private rnp_t with enough passphrases queued for every round */
+static int
+stress_init(rnp_t *rnp, char *passfd, size_t size)
+{
+    const char line[] = STRESS_PASSWORD "\n";
+    int        pipefd[2];
+    int        i;
+
+    if (pipe(pipefd) == -1) {
+        return 0;
+    }
+    for (i = 0; i < STRESS_ROUNDS * 2; i++) {
+        if (write(pipefd[1], line, sizeof(line) - 1) != sizeof(line) - 1) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return 0;
+        }
+    }
+    close(pipefd[1]);
+
+    memset(rnp, '\0', sizeof(*rnp));
+    rnp_setvar(rnp, "sshkeydir", "/etc/ssh");
+    rnp_setvar(rnp, "res", "<stdout>");
+    rnp_setvar(rnp, "format", "human");
+    rnp_setvar(rnp, "pass-fd", uint_to_string(passfd, size, pipefd[0], 10));
+    rnp_setvar(rnp, "need seckey", "true");
+    return rnp_init(rnp) && rnp_load_keys(rnp);
+}
+
+/* one thread: encrypt, decrypt, sign and verify with its own rnp_t */
+static void *
+stress_thread(void *vp)
+{
+    stress_arg_t *arg = vp;
+    rnp_t         rnp;
+    char          passfd[4] = {0};
+    char          msg[] = "A simple test message";
+    char          ctext[4096];
+    char          ptext[4096];
+    char          sig[4096];
+    int           len;
+    int           i;
+
+    if (!stress_init(&rnp, passfd, sizeof(passfd))) {
+        arg->failures++;
+        return NULL;
+    }
+    for (i = 0; i < STRESS_ROUNDS; i++) {
+        const int armored = i & 1;
+
+        /* the debug table may change while others read it */
+        (void) rnp_set_debug("rnp_tests_threads.c");
+        (void) rnp_get_debug(__FILE__);
+
+        memset(ptext, 0, sizeof(ptext));
+        len = rnp_encrypt_memory(
+          &rnp, arg->userid, msg, strlen(msg), ctext, sizeof(ctext), armored);
+        if (len <= 0 ||
+            rnp_decrypt_memory(&rnp, ctext, len, ptext, sizeof(ptext), armored) !=
+              (int) strlen(msg) ||
+            strcmp(msg, ptext) != 0) {
+            arg->failures++;
+        }
+
+        memset(ptext, 0, sizeof(ptext));
+        len = rnp_sign_memory(
+          &rnp, arg->userid, msg, strlen(msg), sig, sizeof(sig), armored, 0);
+        if (len <= 0 ||
+            rnp_verify_memory(&rnp, sig, len, ptext, sizeof(ptext), armored) !=
+              (int) strlen(msg) ||
+            strcmp(msg, ptext) != 0) {
+            arg->failures++;
+        }
+    }
+    rnp_end(&rnp);
+    pgp_rng_cleanup();
+    return NULL;
+}
+
+void
+threads_mixed_ops_test_success(void **state)
+{
+    stress_arg_t args[STRESS_THREADS];
+    pthread_t    threads[STRESS_THREADS];
+    rnp_t        rnp;
+    char         passfd[4] = {0};
+    int          pipefd[2];
+    int          i;
+
+    /* one key for everybody, generated up front */
+    assert_int_equal(setupPassphrasefd(pipefd), 1);
+    memset(&rnp, '\0', sizeof(rnp));
+    rnp_setvar(&rnp, "sshkeydir", "/etc/ssh");
+    rnp_setvar(&rnp, "res", "<stdout>");
+    rnp_setvar(&rnp, "format", "human");
+    rnp_setvar(&rnp, "pass-fd", uint_to_string(passfd, 4, pipefd[0], 10));
+    rnp_setvar(&rnp, "need seckey", "true");
+    assert_int_equal(rnp_init(&rnp), 1);
+    assert_int_equal(rnp_generate_key(&rnp, "threadtest", 1024), 1);
+    rnp_end(&rnp);
+    close(pipefd[0]);
+
+    /* shared counters are updated from every thread */
+    assert_int_equal(1, rnp_set_stats(1));
+    for (i = 0; i < STRESS_THREADS; i++) {
+        args[i].userid = "threadtest";
+        args[i].failures = 0;
+        assert_int_equal(0, pthread_create(&threads[i], NULL, stress_thread, &args[i]));
+    }
+    for (i = 0; i < STRESS_THREADS; i++) {
+        assert_int_equal(0, pthread_join(threads[i], NULL));
+        assert_int_equal(0, args[i].failures);
+    }
+    assert_non_null(strstr(rnp_get_info("stats"), "memory"));
+    assert_int_equal(1, rnp_set_stats(0));
+}
+
+typedef struct {
+    rnp_key_shared_t *shared;
+    atomic_int *      done;
+    int               failures;
+} reload_arg_t;
+
+/*
+ * generations are tagged in pubring->keyc and must never go backwards.
+ * The keys are blank, so freeing the keyring frees nothing in them.
+ */
+static rnp_key_snapshot_t *
+reload_snapshot(unsigned generation)
+{
+    rnp_key_store_t *pubring = calloc(1, sizeof(*pubring));
+
+    pubring->keys = calloc(generation + 1, sizeof(*pubring->keys));
+    pubring->keyc = generation;
+    pubring->keyvsize = generation + 1;
+    return rnp_key_snapshot_new(pubring, NULL);
+}
+
+static void *
+reload_reader(void *vp)
+{
+    reload_arg_t *      arg = vp;
+    rnp_key_snapshot_t *snap;
+    unsigned            seen = 0;
+
+    while (!atomic_load(arg->done)) {
+        if ((snap = rnp_key_shared_acquire(arg->shared)) == NULL) {
+            arg->failures++;
+            continue;
+        }
+        if (snap->pubring->keyc < seen || atomic_load(&snap->refs) < 1) {
+            arg->failures++;
+        }
+        seen = snap->pubring->keyc;
+        rnp_key_snapshot_unref(snap);
+    }
+    return NULL;
+}
+
+void
+shared_keys_reload_test_success(void **state)
+{
+    reload_arg_t        args[STRESS_THREADS];
+    pthread_t           threads[STRESS_THREADS];
+    rnp_key_shared_t *  shared;
+    rnp_key_snapshot_t *held;
+    atomic_int          done = 0;
+    unsigned            i;
+
+    shared = rnp_key_shared_new();
+    assert_non_null(shared);
+    assert_null(rnp_key_shared_acquire(shared));
+    rnp_key_shared_publish(shared, reload_snapshot(0));
+
+    /* a snapshot in use outlives being replaced */
+    held = rnp_key_shared_acquire(shared);
+    assert_int_equal(2, atomic_load(&held->refs));
+    rnp_key_shared_publish(shared, reload_snapshot(1));
+    assert_int_equal(1, atomic_load(&held->refs));
+    assert_int_equal(0, held->pubring->keyc);
+    rnp_key_snapshot_unref(held);
+
+    for (i = 0; i < STRESS_THREADS; i++) {
+        args[i].shared = shared;
+        args[i].done = &done;
+        args[i].failures = 0;
+        assert_int_equal(0, pthread_create(&threads[i], NULL, reload_reader, &args[i]));
+    }
+    for (i = 2; i < RELOAD_SNAPSHOTS; i++) {
+        rnp_key_shared_publish(shared, reload_snapshot(i));
+    }
+    atomic_store(&done, 1);
+    for (i = 0; i < STRESS_THREADS; i++) {
+        assert_int_equal(0, pthread_join(threads[i], NULL));
+        assert_int_equal(0, args[i].failures);
+    }
+    held = rnp_key_shared_acquire(shared);
+    assert_int_equal(RELOAD_SNAPSHOTS - 1, held->pubring->keyc);
+    rnp_key_snapshot_unref(held);
+    rnp_key_shared_free(shared);
+}
+
+typedef struct {
+    void *signer;
+    char  sig[STRESS_ROUNDS][4096];
+    int   len[STRESS_ROUNDS];
+} signer_arg_t;
+
+static void *
+signer_thread(void *vp)
+{
+    signer_arg_t *arg = vp;
+    char          msg[] = "Signed by one of many threads";
+    int           i;
+
+    for (i = 0; i < STRESS_ROUNDS; i++) {
+        arg->len[i] = rnp_signer_sign_memory(
+          arg->signer, msg, strlen(msg), arg->sig[i], sizeof(arg->sig[i]), 0, 0);
+    }
+    pgp_rng_cleanup();
+    return NULL;
+}
+
+void
+threads_signer_test_success(void **state)
+{
+    static signer_arg_t args[STRESS_THREADS];
+    pthread_t           threads[STRESS_THREADS];
+    rnp_t               rnp;
+    void *              signer;
+    char                passfd[4] = {0};
+    char                ptext[4096];
+    int                 pipefd[2];
+    int                 i;
+    int                 j;
+
+    assert_int_equal(setupPassphrasefd(pipefd), 1);
+    memset(&rnp, '\0', sizeof(rnp));
+    rnp_setvar(&rnp, "res", "<stdout>");
+    rnp_setvar(&rnp, "format", "human");
+    rnp_setvar(&rnp, "pass-fd", uint_to_string(passfd, 4, pipefd[0], 10));
+    rnp_setvar(&rnp, "need seckey", "true");
+    assert_int_equal(rnp_init(&rnp), 1);
+    assert_int_equal(rnp_generate_key(&rnp, "signertest", 1024), 1);
+    rnp_end(&rnp);
+    close(pipefd[0]);
+
+    /* the key is unlocked once, with the one passphrase in the pipe */
+    assert_int_equal(setupPassphrasefd(pipefd), 1);
+    memset(&rnp, '\0', sizeof(rnp));
+    rnp_setvar(&rnp, "pass-fd", uint_to_string(passfd, 4, pipefd[0], 10));
+    rnp_setvar(&rnp, "need seckey", "true");
+    assert_int_equal(rnp_init(&rnp), 1);
+    assert_int_equal(rnp_load_keys(&rnp), 1);
+    assert_non_null(signer = rnp_signer_open(&rnp, "signertest"));
+
+    for (i = 0; i < STRESS_THREADS; i++) {
+        args[i].signer = signer;
+        assert_int_equal(0, pthread_create(&threads[i], NULL, signer_thread, &args[i]));
+    }
+    for (i = 0; i < STRESS_THREADS; i++) {
+        assert_int_equal(0, pthread_join(threads[i], NULL));
+    }
+    rnp_signer_close(signer);
+
+    for (i = 0; i < STRESS_THREADS; i++) {
+        for (j = 0; j < STRESS_ROUNDS; j++) {
+            assert_true(args[i].len[j] > 0);
+            assert_true(rnp_verify_memory(
+                          &rnp, args[i].sig[j], args[i].len[j], ptext, sizeof(ptext), 0) > 0);
+        }
+    }
+    rnp_end(&rnp);
+}
@@ -0,0 +1,679 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "agent.h"
+#include "bn.h"
+#include "crypto.h"
+#include "packet-key.h"
+#include "rnpdefs.h"
+#include "writer.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* requests and replies are never bigger than this */
+#define AGENT_MAX_MSG 8192
+
+/* how long the agent waits for a client to take a reply, in milliseconds */
+#define AGENT_SEND_TIMEOUT 1000
+
+struct pgp_agent_t {
+    pthread_mutex_t lock; /* one request at a time goes over the socket */
+    int             fd;
+};
+
+typedef struct agent_msg_t {
+    uint8_t buf[AGENT_MAX_MSG];
+    size_t  len; /* put in, or read */
+    size_t  off; /* taken out */
+} agent_msg_t;
+
+/* a client of the agent, whose requests are read as they come in */
+struct pgp_agent_conn_t {
+    int         fd; /* non-blocking */
+    uint8_t     hdr[4];
+    size_t      got; /* bytes of the length and the request read so far */
+    agent_msg_t req;
+};
+
+static int
+read_full(int fd, uint8_t *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = read(fd, buf, len)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+    return 1;
+}
+
+static int
+wait_writable(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    return poll(&pfd, 1, AGENT_SEND_TIMEOUT) > 0 && (pfd.revents & POLLOUT) != 0;
+}
+
+static int
+write_full(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        /* a peer which went away must not take us down with SIGPIPE */
+        if ((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+            continue;
+        }
+        /* a non-blocking peer gets a little while to make room */
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd)) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+    return 1;
+}
+
+static int
+msg_send(int fd, const agent_msg_t *msg)
+{
+    uint8_t hdr[4];
+
+    hdr[0] = (uint8_t)(msg->len >> 24);
+    hdr[1] = (uint8_t)(msg->len >> 16);
+    hdr[2] = (uint8_t)(msg->len >> 8);
+    hdr[3] = (uint8_t) msg->len;
+    return write_full(fd, hdr, sizeof(hdr)) && write_full(fd, msg->buf, msg->len);
+}
+
+static int
+msg_recv(int fd, agent_msg_t *msg)
+{
+    uint8_t hdr[4];
+    size_t  len;
+
+    if (!read_full(fd, hdr, sizeof(hdr))) {
+        return 0;
+    }
+    len = ((size_t) hdr[0] << 24) | ((size_t) hdr[1] << 16) | ((size_t) hdr[2] << 8) | hdr[3];
+    if (len > sizeof(msg->buf) || !read_full(fd, msg->buf, len)) {
+        return 0;
+    }
+    msg->len = len;
+    msg->off = 0;
+    return 1;
+}
+
+static int
+msg_put(agent_msg_t *msg, const void *data, size_t len)
+{
+    if (len > sizeof(msg->buf) - msg->len) {
+        return 0;
+    }
+    if (len > 0) {
+        (void) memcpy(&msg->buf[msg->len], data, len);
+    }
+    msg->len += len;
+    return 1;
+}
+
+/* put a number, given as its bytes */
+static int
+msg_put_num(agent_msg_t *msg, const uint8_t *num, size_t len)
+{
+    uint8_t hdr[2];
+
+    hdr[0] = (uint8_t)(len >> 8);
+    hdr[1] = (uint8_t) len;
+    return len <= 0xffff && msg_put(msg, hdr, sizeof(hdr)) && msg_put(msg, num, len);
+}
+
+/* put a number, or an empty one for NULL */
+static int
+msg_put_bn(agent_msg_t *msg, const BIGNUM *bn)
+{
+    uint8_t buf[RNP_BUFSIZ];
+    int     len;
+
+    if (bn == NULL) {
+        return msg_put_num(msg, NULL, 0);
+    }
+    if ((len = BN_num_bytes(bn)) < 0 || (size_t) len > sizeof(buf)) {
+        return 0;
+    }
+    (void) BN_bn2bin(bn, buf);
+    return msg_put_num(msg, buf, (size_t) len);
+}
+
+static int
+msg_take(agent_msg_t *msg, void *data, size_t len)
+{
+    if (len > msg->len - msg->off) {
+        return 0;
+    }
+    (void) memcpy(data, &msg->buf[msg->off], len);
+    msg->off += len;
+    return 1;
+}
+
+/* take a number, returning its bytes, which stay in the message */
+static const uint8_t *
+msg_take_num(agent_msg_t *msg, size_t *len)
+{
+    const uint8_t *num;
+    uint8_t        hdr[2];
+
+    if (!msg_take(msg, hdr, sizeof(hdr))) {
+        return NULL;
+    }
+    *len = ((size_t) hdr[0] << 8) | hdr[1];
+    if (*len > msg->len - msg->off) {
+        return NULL;
+    }
+    num = &msg->buf[msg->off];
+    msg->off += *len;
+    return num;
+}
+
+/* take a number as a BIGNUM, or NULL if it is empty */
+static int
+msg_take_bn(agent_msg_t *msg, BIGNUM **bn)
+{
+    const uint8_t *num;
+    size_t         len;
+
+    *bn = NULL;
+    if ((num = msg_take_num(msg, &len)) == NULL) {
+        return 0;
+    }
+    return len == 0 || (*bn = BN_bin2bn(num, (int) len, NULL)) != NULL;
+}
+
+static void
+start_request(agent_msg_t *msg, unsigned op, const uint8_t *keyid)
+{
+    msg->buf[0] = (uint8_t) op;
+    (void) memcpy(&msg->buf[1], keyid, PGP_KEY_ID_SIZE);
+    msg->len = 1 + PGP_KEY_ID_SIZE;
+    msg->off = 0;
+}
+
+/* send a request and read the reply, returning its status */
+static unsigned
+agent_call(pgp_agent_t *agent, agent_msg_t *msg)
+{
+    uint8_t status = PGP_AGENT_FAILED;
+    int     ok;
+
+    (void) pthread_mutex_lock(&agent->lock);
+    ok = msg_send(agent->fd, msg) && msg_recv(agent->fd, msg) && msg_take(msg, &status, 1);
+    (void) pthread_mutex_unlock(&agent->lock);
+    return ok ? status : PGP_AGENT_FAILED;
+}
+
+/**
+ * \ingroup HighLevel_Agent
+ * \brief Connect to rnp-agent
+ * \param path Path of the agent's socket
+ * \return the connection, or NULL if there is no agent there
+ */
+pgp_agent_t *
+pgp_agent_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    pgp_agent_t *      agent;
+    int                fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return NULL;
+    }
+    (void) memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    (void) strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return NULL;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        (agent = calloc(1, sizeof(*agent))) == NULL) {
+        (void) close(fd);
+        return NULL;
+    }
+    (void) pthread_mutex_init(&agent->lock, NULL);
+    agent->fd = fd;
+    return agent;
+}
+
+/**
+ * \ingroup HighLevel_Agent
+ * \brief Close a connection to rnp-agent
+ */
+void
+pgp_agent_close(pgp_agent_t *agent)
+{
+    if (agent != NULL) {
+        (void) close(agent->fd);
+        (void) pthread_mutex_destroy(&agent->lock);
+        free(agent);
+    }
+}
+
+/**
+ * \ingroup HighLevel_Agent
+ * \brief Ask rnp-agent for the secret key of a key
+ *
+ * The secret key only has the public part; signing and decrypting with it
+ * goes through the agent. That public part belongs to `key', so the
+ * secret key must be freed with free() rather than pgp_seckey_free().
+ * \return the secret key, or NULL if the agent does not have it unlocked
+ */
+pgp_seckey_t *
+pgp_agent_seckey(pgp_agent_t *agent, const pgp_key_t *key)
+{
+    pgp_seckey_t *seckey;
+    agent_msg_t   msg;
+
+    start_request(&msg, PGP_AGENT_HAVE, key->sigid);
+    if (agent_call(agent, &msg) != PGP_AGENT_OK ||
+        (seckey = calloc(1, sizeof(*seckey))) == NULL) {
+        return NULL;
+    }
+    seckey->pubkey = pgp_is_key_secret(key) ? key->key.seckey.pubkey : key->key.pubkey;
+    seckey->agent = agent;
+    return seckey;
+}
+
+/**
+ * \ingroup HighLevel_Agent
+ * \brief Have rnp-agent sign a hash, as rsa_sign() and dsa_sign() do
+ * \return 1 if the signature was written to out; else 0
+ */
+int
+pgp_agent_sign(pgp_hash_t *hash, const pgp_seckey_t *seckey, pgp_output_t *out)
+{
+    const uint8_t *num;
+    pgp_hash_alg_t alg = pgp_hash_alg_type(hash);
+    agent_msg_t    msg;
+    uint8_t        hashbuf[PGP_MAX_HASH_SIZE];
+    uint8_t        keyid[PGP_KEY_ID_SIZE];
+    uint8_t        op = (uint8_t) alg;
+    BIGNUM *       bn;
+    size_t         hashlen;
+    size_t         len;
+
+    hashlen = pgp_hash_finish(hash, hashbuf);
+    pgp_write(out, hashbuf, 2);
+    pgp_keyid(keyid, sizeof(keyid), &seckey->pubkey, PGP_HASH_SHA1);
+    start_request(&msg, PGP_AGENT_SIGN, keyid);
+    if (!msg_put(&msg, &op, 1) || !msg_put(&msg, hashbuf, hashlen) ||
+        agent_call(seckey->agent, &msg) != PGP_AGENT_OK) {
+        (void) fprintf(stderr, "pgp_agent_sign: the agent did not sign\n");
+        return 0;
+    }
+    while (msg.off < msg.len) {
+        if ((num = msg_take_num(&msg, &len)) == NULL ||
+            (bn = BN_bin2bn(num, (int) len, NULL)) == NULL) {
+            (void) fprintf(stderr, "pgp_agent_sign: bad reply\n");
+            return 0;
+        }
+        pgp_write_mpi(out, bn);
+        BN_free(bn);
+    }
+    return 1;
+}
+
+/**
+ * \ingroup HighLevel_Agent
+ * \brief Have rnp-agent decrypt a session key, as pgp_decrypt_decode_mpi()
+ * does
+ * \return length of the decrypted session key, or -1
+ */
+int
+pgp_agent_decrypt(uint8_t *           buf,
+                  unsigned            buflen,
+                  const BIGNUM *      g_to_k,
+                  const BIGNUM *      encmpi,
+                  const pgp_seckey_t *seckey)
+{
+    agent_msg_t msg;
+    uint8_t     keyid[PGP_KEY_ID_SIZE];
+    size_t      len;
+
+    pgp_keyid(keyid, sizeof(keyid), &seckey->pubkey, PGP_HASH_SHA1);
+    start_request(&msg, PGP_AGENT_DECRYPT, keyid);
+    if (!msg_put_bn(&msg, g_to_k) || !msg_put_bn(&msg, encmpi) ||
+        agent_call(seckey->agent, &msg) != PGP_AGENT_OK) {
+        (void) fprintf(stderr, "pgp_agent_decrypt: the agent did not decrypt\n");
+        return -1;
+    }
+    len = msg.len - msg.off;
+    if (len > buflen) {
+        pgp_forget(msg.buf, sizeof(msg.buf));
+        return -1;
+    }
+    (void) memcpy(buf, &msg.buf[msg.off], len);
+    pgp_forget(msg.buf, sizeof(msg.buf));
+    return (int) len;
+}
+
+/**
+ * \ingroup HighLevel_Agent
+ * \brief Make the socket rnp-agent listens on, which only we can use
+ *
+ * A socket left at `path' is taken over only if no agent answers on it.
+ * \return the listening socket, or -1
+ */
+int
+pgp_agent_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    pgp_agent_t *      agent;
+    struct stat        st;
+    mode_t             mask;
+    int                fd;
+    int                ok;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        (void) fprintf(stderr, "socket path too long '%s'\n", path);
+        return -1;
+    }
+    (void) memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    (void) strcpy(addr.sun_path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if ((agent = pgp_agent_connect(path)) != NULL) {
+            pgp_agent_close(agent);
+            (void) fprintf(stderr, "an agent is already listening on '%s'\n", path);
+            return -1;
+        }
+        /* left behind by an agent which did not get to clean up */
+        (void) unlink(path);
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    mask = umask(077);
+    ok = bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 && listen(fd, 16) == 0;
+    (void) umask(mask);
+    if (!ok) {
+        (void) fprintf(stderr, "cannot listen on '%s': %s\n", path, strerror(errno));
+        (void) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * \ingroup HighLevel_Agent
+ * \brief Take a connection to rnp-agent from its listening socket
+ *
+ * The connection does not block, so that a client which is slow to send
+ * its requests does not hold up the others.
+ * \return the connection, or NULL
+ */
+pgp_agent_conn_t *
+pgp_agent_accept(int listenfd)
+{
+    pgp_agent_conn_t *conn;
+    int               flags;
+    int               fd;
+
+    if ((fd = accept(listenfd, NULL, NULL)) < 0) {
+        return NULL;
+    }
+    if ((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        (conn = calloc(1, sizeof(*conn))) == NULL) {
+        (void) close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    return conn;
+}
+
+/**
+ * \ingroup HighLevel_Agent
+ * \brief The socket of a connection to rnp-agent, to wait for requests on
+ */
+int
+pgp_agent_conn_fd(const pgp_agent_conn_t *conn)
+{
+    return conn->fd;
+}
+
+/**
+ * \ingroup HighLevel_Agent
+ * \brief Close a connection to rnp-agent, wiping what it was sent
+ */
+void
+pgp_agent_conn_close(pgp_agent_conn_t *conn)
+{
+    if (conn != NULL) {
+        (void) close(conn->fd);
+        pgp_forget(conn, sizeof(*conn));
+        free(conn);
+    }
+}
+
+static int
+serve_sign(agent_msg_t *req, const pgp_seckey_t *seckey, agent_msg_t *reply)
+{
+    DSA_SIG *dsasig;
+    uint8_t  hashbuf[PGP_MAX_HASH_SIZE];
+    uint8_t  sigbuf[RNP_BUFSIZ];
+    uint8_t  alg;
+    size_t   hashlen;
+    int      n;
+    int      ok;
+
+    hashlen = req->len - req->off - 1;
+    if (!msg_take(req, &alg, 1) || hashlen > sizeof(hashbuf) ||
+        !msg_take(req, hashbuf, hashlen)) {
+        return 0;
+    }
+    switch (seckey->pubkey.alg) {
+    case PGP_PKA_RSA:
+    case PGP_PKA_RSA_ENCRYPT_ONLY:
+    case PGP_PKA_RSA_SIGN_ONLY:
+        n = pgp_rsa_pkcs1_sign_hash(sigbuf,
+                                    sizeof(sigbuf),
+                                    (pgp_hash_alg_t) alg,
+                                    hashbuf,
+                                    hashlen,
+                                    &seckey->key.rsa,
+                                    &seckey->pubkey.key.rsa);
+        return n > 0 && msg_put_num(reply, sigbuf, (size_t) n);
+
+    case PGP_PKA_DSA:
+        /* as in dsa_sign(), the hash has to be the size of q */
+        if (hashlen != 20 ||
+            (dsasig = pgp_dsa_sign(hashbuf, 20, &seckey->key.dsa, &seckey->pubkey.key.dsa)) ==
+              NULL) {
+            return 0;
+        }
+        ok = msg_put_bn(reply, dsasig->r) && msg_put_bn(reply, dsasig->s);
+        DSA_SIG_free(dsasig);
+        return ok;
+
+    default:
+        return 0;
+    }
+}
+
+static int
+serve_decrypt(agent_msg_t *req, const pgp_seckey_t *seckey, agent_msg_t *reply)
+{
+    BIGNUM *g_to_k = NULL;
+    BIGNUM *encmpi = NULL;
+    uint8_t buf[RNP_BUFSIZ];
+    int     n = -1;
+    int     ok;
+
+    if (msg_take_bn(req, &g_to_k) && msg_take_bn(req, &encmpi) && encmpi != NULL) {
+        n = pgp_decrypt_decode_mpi(buf, sizeof(buf), g_to_k, encmpi, seckey);
+    }
+    BN_free(g_to_k);
+    BN_free(encmpi);
+    ok = n > 0 && msg_put(reply, buf, (size_t) n);
+    pgp_forget(buf, sizeof(buf));
+    return ok;
+}
+
+/* read what has come in of a request: 1 if all of it is in, 0 if more is
+ * to come, -1 if the connection is done with */
+static int
+conn_recv(pgp_agent_conn_t *conn)
+{
+    uint8_t *p;
+    size_t   want;
+    size_t   len;
+    ssize_t  n;
+
+    for (;;) {
+        if (conn->got < sizeof(conn->hdr)) {
+            p = &conn->hdr[conn->got];
+            want = sizeof(conn->hdr) - conn->got;
+        } else {
+            len = ((size_t) conn->hdr[0] << 24) | ((size_t) conn->hdr[1] << 16) |
+                  ((size_t) conn->hdr[2] << 8) | conn->hdr[3];
+            if (len > sizeof(conn->req.buf)) {
+                return -1;
+            }
+            if (conn->got - sizeof(conn->hdr) == len) {
+                conn->req.len = len;
+                conn->req.off = 0;
+                conn->got = 0;
+                return 1;
+            }
+            p = &conn->req.buf[conn->got - sizeof(conn->hdr)];
+            want = len - (conn->got - sizeof(conn->hdr));
+        }
+        if ((n = read(conn->fd, p, want)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        conn->got += (size_t) n;
+    }
+}
+
+/**
+ * \ingroup HighLevel_Agent
+ * \brief Read from a connection to rnp-agent, and answer the request once
+ * all of it has come in
+ * \param io Where to put debug output
+ * \param conn The connection, which has something to read
+ * \param secring Keyring the keys come from
+ * \param keys Keys which are unlocked
+ * \return 1 if the connection is still open; 0 if it is done with
+ */
+int
+pgp_agent_serve(pgp_io_t *             io,
+                pgp_agent_conn_t *     conn,
+                const rnp_key_store_t *secring,
+                pgp_seckey_cache_t *   keys)
+{
+    const pgp_key_t *key;
+    pgp_seckey_t *   seckey;
+    agent_msg_t *    req = &conn->req;
+    agent_msg_t      reply;
+    uint8_t          keyid[PGP_KEY_ID_SIZE];
+    uint8_t          status;
+    uint8_t          op;
+    unsigned         from = 0;
+    int              ok;
+
+    if ((ok = conn_recv(conn)) <= 0) {
+        return ok == 0;
+    }
+    if (!msg_take(req, &op, 1) || !msg_take(req, keyid, sizeof(keyid))) {
+        return 0;
+    }
+    reply.len = 1;
+    reply.off = 0;
+    key = rnp_key_store_get_key_by_id(io, secring, keyid, &from, NULL);
+    if (key == NULL || (seckey = pgp_seckey_cache_get(keys, key)) == NULL) {
+        status = PGP_AGENT_NOKEY;
+    } else {
+        switch (op) {
+        case PGP_AGENT_HAVE:
+            ok = 1;
+            break;
+        case PGP_AGENT_SIGN:
+            ok = serve_sign(req, seckey, &reply);
+            break;
+        case PGP_AGENT_DECRYPT:
+            ok = serve_decrypt(req, seckey, &reply);
+            break;
+        default:
+            ok = 0;
+            break;
+        }
+        (void) pgp_seckey_cache_release(keys, seckey);
+        status = ok ? PGP_AGENT_OK : PGP_AGENT_FAILED;
+    }
+    reply.buf[0] = status;
+    ok = msg_send(conn->fd, &reply);
+    pgp_forget(&reply, sizeof(reply));
+    pgp_forget(req, sizeof(*req));
+    return ok;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RNP_AGENT_H_
+#define RNP_AGENT_H_
+
+#include "types.h"
+#include "packet.h"
+#include "hash.h"
+#include "key_store.h"
+#include "seckeycache.h"
+
+/* rnp-agent holds unlocked secret keys, and signs and decrypts with them
+ * on behalf of other processes over a Unix domain socket, so that those
+ * need not unlock the keys themselves.
+ *
+ * Requests and replies are a 4-byte length followed by that many bytes.
+ * A request is an operation and the id of the key to use it with,
+ * followed by what the operation needs; a reply is a status followed by
+ * the result. Numbers go as a 2-byte length followed by their bytes.
+ */
+
+#define PGP_AGENT_SOCKET "S.rnp-agent" /* in the key directory */
+
+enum { PGP_AGENT_HAVE = 1, PGP_AGENT_SIGN = 2, PGP_AGENT_DECRYPT = 3 };
+
+enum { PGP_AGENT_OK = 0, PGP_AGENT_NOKEY = 1, PGP_AGENT_FAILED = 2 };
+
+typedef struct pgp_agent_t      pgp_agent_t;
+typedef struct pgp_agent_conn_t pgp_agent_conn_t;
+
+/* for those using the agent */
+pgp_agent_t * pgp_agent_connect(const char *);
+void          pgp_agent_close(pgp_agent_t *);
+pgp_seckey_t *pgp_agent_seckey(pgp_agent_t *, const pgp_key_t *);
+int           pgp_agent_sign(pgp_hash_t *, const pgp_seckey_t *, pgp_output_t *);
+int           pgp_agent_decrypt(
+  uint8_t *, unsigned, const BIGNUM *, const BIGNUM *, const pgp_seckey_t *);
+
+/* for the agent */
+int               pgp_agent_listen(const char *);
+pgp_agent_conn_t *pgp_agent_accept(int);
+int               pgp_agent_conn_fd(const pgp_agent_conn_t *);
+void              pgp_agent_conn_close(pgp_agent_conn_t *);
+int               pgp_agent_serve(pgp_io_t *,
+                                  pgp_agent_conn_t *,
+                                  const rnp_key_store_t *,
+                                  pgp_seckey_cache_t *);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Bump allocator for parser contents, see arena.h */
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN (2 * sizeof(void *))
+
+struct pgp_arena_block_t {
+    pgp_arena_block_t *next; /* older block */
+    size_t             size;
+    size_t             used;
+    uint8_t *          data;
+};
+
+static pgp_arena_block_t *
+arena_block_new(size_t size)
+{
+    pgp_arena_block_t *block;
+
+    if ((block = calloc(1, sizeof(*block) + size)) == NULL) {
+        return NULL;
+    }
+    block->size = size;
+    block->data = (uint8_t *) (block + 1);
+    return block;
+}
+
+/* zeroed memory which lives until the arena is released past it */
+void *
+pgp_arena_alloc(pgp_arena_t *arena, size_t size)
+{
+    pgp_arena_block_t *block;
+    void *             p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (size == 0) {
+        size = ARENA_ALIGN;
+    }
+    block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        if (arena->spare && arena->spare->size >= size) {
+            block = arena->spare;
+            arena->spare = NULL;
+            block->used = 0;
+        } else if ((block = arena_block_new(
+                      (size > ARENA_BLOCK_SIZE / 4) ? size : ARENA_BLOCK_SIZE)) == NULL) {
+            return NULL;
+        }
+        block->next = arena->head;
+        arena->head = block;
+    }
+    p = &block->data[block->used];
+    block->used += size;
+    (void) memset(p, 0x0, size);
+    return p;
+}
+
+pgp_arena_mark_t
+pgp_arena_mark(const pgp_arena_t *arena)
+{
+    pgp_arena_mark_t mark;
+
+    mark.block = arena->head;
+    mark.used = (arena->head) ? arena->head->used : 0;
+    return mark;
+}
+
+/* give back everything allocated since `mark' was taken */
+void
+pgp_arena_release(pgp_arena_t *arena, pgp_arena_mark_t mark)
+{
+    pgp_arena_block_t *block;
+
+    while ((block = arena->head) != mark.block) {
+        arena->head = block->next;
+        if (arena->spare == NULL || arena->spare->size < block->size) {
+            free(arena->spare);
+            arena->spare = block;
+        } else {
+            free(block);
+        }
+    }
+    if (block) {
+        block->used = mark.used;
+    }
+}
+
+void
+pgp_arena_free(pgp_arena_t *arena)
+{
+    pgp_arena_block_t *block;
+
+    while ((block = arena->head) != NULL) {
+        arena->head = block->next;
+        free(block);
+    }
+    free(arena->spare);
+    arena->spare = NULL;
+}
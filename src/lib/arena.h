@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RNP_ARENA_H_
+#define RNP_ARENA_H_
+
+#include <stddef.h>
+
+/* A bump allocator for short-lived parser contents.
+ *
+ * Allocations are zeroed, like calloc(), and are never freed one by
+ * one: pgp_arena_release() drops everything allocated since a mark in
+ * one go, and pgp_arena_free() drops the lot. Released blocks are kept
+ * for reuse, so a steady parse loop stops calling malloc at all.
+ */
+
+typedef struct pgp_arena_block_t pgp_arena_block_t;
+
+typedef struct pgp_arena_t {
+    pgp_arena_block_t *head;  /* block being allocated from */
+    pgp_arena_block_t *spare; /* released block kept for reuse */
+} pgp_arena_t;
+
+typedef struct pgp_arena_mark_t {
+    pgp_arena_block_t *block;
+    size_t             used;
+} pgp_arena_mark_t;
+
+void *           pgp_arena_alloc(pgp_arena_t *, size_t);
+pgp_arena_mark_t pgp_arena_mark(const pgp_arena_t *);
+void             pgp_arena_release(pgp_arena_t *, pgp_arena_mark_t);
+void             pgp_arena_free(pgp_arena_t *);
+
+#endif
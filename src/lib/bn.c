@@ -23,10 +23,14 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "config.h"
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "crypto.h"
 #include "bn.h"
+#include "rng.h"
+#include "rnpdefs.h"
 
 #ifndef USE_ARG
 #define USE_ARG(x) /*LINTED*/ (void) &x
@@ -41,45 +45,117 @@
 /* the PGPV_BIGNUM API tends to have more const poisoning */
 /* these wrappers also check the arguments passed for sanity */
 
+/* the value of `a', made from its raw bytes if nothing has needed it yet */
+botan_mp_t
+get_BN_mp(const PGPV_BIGNUM *a)
+{
+    PGPV_BIGNUM *bn = (PGPV_BIGNUM *) a; /* making mp leaves the value alone */
+    botan_mp_t   mp;
+    botan_mp_t   expected = NULL;
+
+    if (bn == NULL) {
+        return NULL;
+    }
+    if ((mp = atomic_load(&bn->mp)) != NULL) {
+        return mp;
+    }
+    if (botan_mp_init(&mp) != 0) {
+        return NULL;
+    }
+    if (bn->rawlen > 0 && botan_mp_from_bin(mp, bn->raw, bn->rawlen) != 0) {
+        botan_mp_destroy(mp);
+        return NULL;
+    }
+    /* threads sharing a key may race to make it: the loser frees its copy */
+    if (!atomic_compare_exchange_strong(&bn->mp, &expected, mp)) {
+        botan_mp_destroy(mp);
+        mp = expected;
+    }
+    return mp;
+}
+
+/* the significant raw bytes of a value which has no mp yet */
+static const uint8_t *
+raw_value(const PGPV_BIGNUM *a, size_t *len)
+{
+    size_t i;
+
+    for (i = 0; i < a->rawlen && a->raw[i] == 0x0; i++) {
+    }
+    *len = a->rawlen - i;
+    return &a->raw[i];
+}
+
 PGPV_BIGNUM *
 PGPV_BN_bin2bn(const uint8_t *data, int len, PGPV_BIGNUM *ret)
 {
     if (data == NULL) {
         return PGPV_BN_new();
     }
-    if (ret == NULL) {
-        ret = PGPV_BN_new();
+    if (ret != NULL) {
+        return (botan_mp_from_bin(get_BN_mp(ret), data, len) == 0) ? ret : NULL;
     }
-
-    return (botan_mp_from_bin(ret->mp, data, len) == 0) ? ret : NULL;
+    /* a new value is kept as bytes until it gets used */
+    if (len < 0 || (ret = calloc(1, sizeof(*ret))) == NULL) {
+        return NULL;
+    }
+    if (len > 0 && (ret->raw = malloc((size_t) len)) == NULL) {
+        free(ret);
+        return NULL;
+    }
+    (void) memcpy(ret->raw, data, (size_t) len);
+    ret->rawlen = (size_t) len;
+    return ret;
 }
 
 /* store in unsigned [big endian] format */
 int
 PGPV_BN_bn2bin(const PGPV_BIGNUM *a, unsigned char *b)
 {
+    const uint8_t *raw;
+    size_t         len;
+
     if (a == NULL || b == NULL) {
         return -1;
     }
-
-    return botan_mp_to_bin(a->mp, b);
+    if (atomic_load(&a->mp) == NULL) {
+        raw = raw_value(a, &len);
+        (void) memcpy(b, raw, len);
+        return 0;
+    }
+    return botan_mp_to_bin(get_BN_mp(a), b);
 }
 
 PGPV_BIGNUM *
 PGPV_BN_new(void)
 {
     PGPV_BIGNUM *a;
+    botan_mp_t   mp;
 
-    a = calloc(1, sizeof(*a));
-    botan_mp_init(&a->mp);
+    if ((a = calloc(1, sizeof(*a))) == NULL) {
+        return NULL;
+    }
+    if (botan_mp_init(&mp) != 0) {
+        free(a);
+        return NULL;
+    }
+    atomic_init(&a->mp, mp);
     return a;
 }
 
 void
 PGPV_BN_free(PGPV_BIGNUM *a)
 {
+    botan_mp_t mp;
+
     if (a) {
-        botan_mp_destroy(a->mp);
+        if ((mp = atomic_load(&a->mp)) != NULL) {
+            botan_mp_destroy(mp);
+        }
+        if (a->raw != NULL) {
+            pgp_forget(a->raw, a->rawlen);
+            free(a->raw);
+        }
         free(a);
     }
 }
@@ -91,7 +167,7 @@ PGPV_BN_copy(PGPV_BIGNUM *to, const PGPV_BIGNUM *from)
     if (from == NULL || to == NULL) {
         return -1;
     }
-    return botan_mp_set_from_mp(to->mp, from->mp);
+    return botan_mp_set_from_mp(get_BN_mp(to), get_BN_mp(from));
 }
 
 PGPV_BIGNUM *
@@ -102,6 +178,12 @@ PGPV_BN_dup(const PGPV_BIGNUM *a)
     if (a == NULL) {
         return NULL;
     }
+    if (atomic_load(&a->mp) == NULL) {
+        /* still just bytes: so is the copy */
+        return PGPV_BN_bin2bn(a->raw != NULL ? a->raw : (const uint8_t *) "",
+                              (int) a->rawlen,
+                              NULL);
+    }
     if ((ret = PGPV_BN_new()) != NULL) {
         PGPV_BN_copy(ret, a);
     }
@@ -112,7 +194,7 @@ void
 PGPV_BN_swap(PGPV_BIGNUM *a, PGPV_BIGNUM *b)
 {
     if (a && b) {
-        botan_mp_swap(a->mp, b->mp);
+        botan_mp_swap(get_BN_mp(a), get_BN_mp(b));
     }
 }
 
@@ -122,7 +204,7 @@ PGPV_BN_lshift(PGPV_BIGNUM *r, const PGPV_BIGNUM *a, int n)
     if (r == NULL || a == NULL || n < 0) {
         return 0;
     }
-    return botan_mp_lshift(r->mp, a->mp, n) == 0;
+    return botan_mp_lshift(get_BN_mp(r), get_BN_mp(a), n) == 0;
 }
 
 int
@@ -137,7 +219,7 @@ PGPV_BN_rshift(PGPV_BIGNUM *r, const PGPV_BIGNUM *a, int n)
     if (r == NULL || a == NULL || n < 0) {
         return -1;
     }
-    return botan_mp_lshift(r->mp, a->mp, n) == 0;
+    return botan_mp_lshift(get_BN_mp(r), get_BN_mp(a), n) == 0;
 }
 
 int
@@ -152,7 +234,7 @@ PGPV_BN_add(PGPV_BIGNUM *r, const PGPV_BIGNUM *a, const PGPV_BIGNUM *b)
     if (a == NULL || b == NULL || r == NULL) {
         return 0;
     }
-    return botan_mp_add(r->mp, a->mp, b->mp) == 0;
+    return botan_mp_add(get_BN_mp(r), get_BN_mp(a), get_BN_mp(b)) == 0;
 }
 
 int
@@ -161,7 +243,7 @@ PGPV_BN_sub(PGPV_BIGNUM *r, const PGPV_BIGNUM *a, const PGPV_BIGNUM *b)
     if (a == NULL || b == NULL || r == NULL) {
         return 0;
     }
-    return botan_mp_sub(r->mp, a->mp, b->mp) == 0;
+    return botan_mp_sub(get_BN_mp(r), get_BN_mp(a), get_BN_mp(b)) == 0;
 }
 
 int
@@ -171,7 +253,7 @@ PGPV_BN_mul(PGPV_BIGNUM *r, const PGPV_BIGNUM *a, const PGPV_BIGNUM *b, PGPV_BN_
         return 0;
     }
     USE_ARG(ctx);
-    return botan_mp_mul(r->mp, a->mp, b->mp) == 0;
+    return botan_mp_mul(get_BN_mp(r), get_BN_mp(a), get_BN_mp(b)) == 0;
 }
 
 int
@@ -185,14 +267,14 @@ PGPV_BN_div(PGPV_BIGNUM *      dv,
         return 0;
     }
     USE_ARG(ctx);
-    return botan_mp_div(dv->mp, rem->mp, a->mp, d->mp) == 0;
+    return botan_mp_div(get_BN_mp(dv), get_BN_mp(rem), get_BN_mp(a), get_BN_mp(d)) == 0;
 }
 
 void
 PGPV_BN_clear(PGPV_BIGNUM *a)
 {
     if (a) {
-        botan_mp_clear(a->mp);
+        botan_mp_clear(get_BN_mp(a));
     }
 }
 
@@ -211,7 +293,11 @@ PGPV_BN_num_bytes(const PGPV_BIGNUM *a)
         return -1;
     }
 
-    if (botan_mp_num_bytes(a->mp, &num_bytes) < 0) {
+    if (atomic_load(&a->mp) == NULL) {
+        (void) raw_value(a, &num_bytes);
+        return num_bytes;
+    }
+    if (botan_mp_num_bytes(get_BN_mp(a), &num_bytes) < 0) {
         return -1;
     }
     return num_bytes;
@@ -220,12 +306,20 @@ PGPV_BN_num_bytes(const PGPV_BIGNUM *a)
 int
 PGPV_BN_num_bits(const PGPV_BIGNUM *a)
 {
-    size_t num_bits;
+    const uint8_t *raw;
+    size_t         num_bits;
+    unsigned       top;
     if (a == NULL) {
         return -1;
     }
 
-    if (botan_mp_num_bits(a->mp, &num_bits) < 0) {
+    if (atomic_load(&a->mp) == NULL) {
+        raw = raw_value(a, &num_bits);
+        for (top = 0; num_bits > 0 && (raw[0] >> top) != 0; top++) {
+        }
+        return (num_bits == 0) ? 0 : (num_bits - 1) * 8 + top;
+    }
+    if (botan_mp_num_bits(get_BN_mp(a), &num_bits) < 0) {
         return -1;
     }
     return num_bits;
@@ -240,18 +334,18 @@ PGPV_BN_set_negative(PGPV_BIGNUM *a, int n)
          * \param  n  0 if the BIGNUM b should be positive and a value != 0 otherwise
          */
 
-        int a_is_currently_negative = (botan_mp_is_negative(a->mp) == 1);
+        int a_is_currently_negative = (botan_mp_is_negative(get_BN_mp(a)) == 1);
 
         if (n == 0) // set a to positive
         {
             // if a is negative, flip it to positive
             if (a_is_currently_negative) {
-                botan_mp_flip_sign(a->mp);
+                botan_mp_flip_sign(get_BN_mp(a));
             }
         } else {
             // if a is not negative, flip it to negative
             if (!a_is_currently_negative) {
-                botan_mp_flip_sign(a->mp);
+                botan_mp_flip_sign(get_BN_mp(a));
             }
         }
     }
@@ -266,7 +360,7 @@ PGPV_BN_cmp(PGPV_BIGNUM *a, PGPV_BIGNUM *b)
         return -1;
     }
 
-    botan_mp_cmp(&cmp_result, a->mp, b->mp);
+    botan_mp_cmp(&cmp_result, get_BN_mp(a), get_BN_mp(b));
     return cmp_result;
 }
 
@@ -278,7 +372,7 @@ PGPV_BN_mod_exp(
         return -1;
     }
     USE_ARG(ctx);
-    return botan_mp_powmod(Y->mp, G->mp, X->mp, P->mp) == 0;
+    return botan_mp_powmod(get_BN_mp(Y), get_BN_mp(G), get_BN_mp(X), get_BN_mp(P)) == 0;
 }
 
 PGPV_BIGNUM *
@@ -288,7 +382,7 @@ PGPV_BN_mod_inverse(PGPV_BIGNUM *r, PGPV_BIGNUM *a, const PGPV_BIGNUM *n, PGPV_B
     if (r == NULL || a == NULL || n == NULL) {
         return NULL;
     }
-    return (botan_mp_mod_inverse(r->mp, a->mp, n->mp) == 0) ? r : NULL;
+    return (botan_mp_mod_inverse(get_BN_mp(r), get_BN_mp(a), get_BN_mp(n)) == 0) ? r : NULL;
 }
 
 int
@@ -299,7 +393,9 @@ PGPV_BN_mod_mul(
     if (ret == NULL || a == NULL || b == NULL || m == NULL) {
         return 0;
     }
-    return (botan_mp_mod_mul(ret->mp, a->mp, b->mp, m->mp) < 0) ? 0 : 1;
+    return (botan_mp_mod_mul(get_BN_mp(ret), get_BN_mp(a), get_BN_mp(b), get_BN_mp(m)) < 0) ?
+             0 :
+             1;
 }
 
 PGPV_BN_CTX *
@@ -379,14 +475,14 @@ PGPV_BN_bn2radix(const PGPV_BIGNUM *a, unsigned radix)
     out_len = initial_guess;
     out = malloc(out_len);
 
-    rc = botan_mp_to_str(a->mp, radix, out, &out_len);
+    rc = botan_mp_to_str(get_BN_mp(a), radix, out, &out_len);
 
     if (rc == 0) {
         return out;
     } else if (out_len != initial_guess) {
         /* need to retry with longer buffer... */
         out = realloc(out, out_len);
-        rc = botan_mp_to_str(a->mp, radix, out, &out_len);
+        rc = botan_mp_to_str(get_BN_mp(a), radix, out, &out_len);
         if (rc == 0) {
             return out;
         }
@@ -407,16 +503,16 @@ PGPV_BN_print_fp(FILE *fp, const PGPV_BIGNUM *a)
     if (fp == NULL || a == NULL) {
         return 0;
     }
-    if (botan_mp_num_bytes(a->mp, &num_bytes)) {
+    if (botan_mp_num_bytes(get_BN_mp(a), &num_bytes)) {
         return 0;
     }
 
-    if (botan_mp_is_negative(a->mp)) {
+    if (botan_mp_is_negative(get_BN_mp(a))) {
         fprintf(fp, "-");
     }
 
     buf = calloc(num_bytes * 2 + 2, 1);
-    botan_mp_to_hex(a->mp, buf);
+    botan_mp_to_hex(get_BN_mp(a), buf);
     ret = fprintf(fp, "%s", buf);
     free(buf);
     return ret;
@@ -432,12 +528,8 @@ PGPV_BN_rand(PGPV_BIGNUM *rnd, int bits, int top, int bottom)
     }
 
     {
-        botan_rng_t rng;
-        rc = botan_rng_init(&rng, NULL);
-        if (rc == 0) {
-            rc = botan_mp_rand_bits(rnd->mp, rng, bits);
-            botan_rng_destroy(rng);
-        }
+        botan_rng_t rng = pgp_rng_handle();
+        rc = (rng) ? botan_mp_rand_bits(get_BN_mp(rnd), rng, bits) : -1;
     }
 
     if (rc < 0) {
@@ -445,13 +537,13 @@ PGPV_BN_rand(PGPV_BIGNUM *rnd, int bits, int top, int bottom)
     }
 
     if (top == 0) {
-        botan_mp_set_bit(rnd->mp, bits);
+        botan_mp_set_bit(get_BN_mp(rnd), bits);
     } else if (top == 1) {
-        botan_mp_set_bit(rnd->mp, bits);
-        botan_mp_set_bit(rnd->mp, bits - 1);
+        botan_mp_set_bit(get_BN_mp(rnd), bits);
+        botan_mp_set_bit(get_BN_mp(rnd), bits - 1);
     }
     if (bottom) {
-        botan_mp_set_bit(rnd->mp, 0);
+        botan_mp_set_bit(get_BN_mp(rnd), 0);
     }
     return 1;
 }
@@ -477,7 +569,7 @@ PGPV_BN_words_used(const PGPV_BIGNUM *n)
     if (n == NULL) {
         return -1;
     }
-    if (botan_mp_num_bits(n->mp, &num_bits) < 0) {
+    if (botan_mp_num_bits(get_BN_mp(n), &num_bits) < 0) {
         return -1;
     }
 
@@ -497,7 +589,7 @@ PGPV_BN_get_word(const PGPV_BIGNUM *n)
         return -1;
     }
 
-    if (botan_mp_to_uint32(n->mp, &n32) < 0) {
+    if (botan_mp_to_uint32(get_BN_mp(n), &n32) < 0) {
         return -1;
     }
 
@@ -511,7 +603,7 @@ PGPV_BN_set_word(PGPV_BIGNUM *a, PGPV_BN_ULONG w)
         return -1;
     }
     /* FIXME: w is treated as signed int here */
-    return botan_mp_set_from_int(a->mp, w);
+    return botan_mp_set_from_int(get_BN_mp(a), w);
 }
 
 int
@@ -520,7 +612,7 @@ PGPV_BN_is_even(const PGPV_BIGNUM *n)
     if (n == NULL) {
         return -1;
     }
-    return botan_mp_is_even(n->mp);
+    return botan_mp_is_even(get_BN_mp(n));
 }
 
 int
@@ -529,7 +621,7 @@ PGPV_BN_is_odd(const PGPV_BIGNUM *n)
     if (n == NULL) {
         return -1;
     }
-    return botan_mp_is_odd(n->mp);
+    return botan_mp_is_odd(get_BN_mp(n));
 }
 
 int
@@ -538,7 +630,7 @@ PGPV_BN_is_zero(const PGPV_BIGNUM *n)
     if (n == NULL) {
         return -1;
     }
-    return botan_mp_is_zero(n->mp);
+    return botan_mp_is_zero(get_BN_mp(n));
 }
 
 int
@@ -547,7 +639,7 @@ PGPV_BN_is_negative(const PGPV_BIGNUM *n)
     if (n == NULL) {
         return -1;
     }
-    return botan_mp_is_negative(n->mp);
+    return botan_mp_is_negative(get_BN_mp(n));
 }
 
 int
@@ -570,10 +662,8 @@ PGPV_BN_is_prime(const PGPV_BIGNUM *a,
     test_prob = 4 * checks;
 
     {
-        botan_rng_t rng;
-        botan_rng_init(&rng, NULL);
-        ret = botan_mp_is_prime(a->mp, rng, test_prob);
-        botan_rng_destroy(rng);
+        botan_rng_t rng = pgp_rng_handle();
+        ret = (rng) ? botan_mp_is_prime(get_BN_mp(a), rng, test_prob) : -1;
     }
 
     return ret;
@@ -582,15 +672,23 @@ PGPV_BN_is_prime(const PGPV_BIGNUM *a,
 const PGPV_BIGNUM *
 PGPV_BN_value_one(void)
 {
-    static PGPV_BIGNUM one;
+    static _Atomic(PGPV_BIGNUM *) one;
+    PGPV_BIGNUM *                 v;
+    PGPV_BIGNUM *                 expected = NULL;
 
-    /* race condition here if multiple threads call BN_value_one */
-    if (one.mp == NULL) {
-        botan_mp_init(&one.mp);
-        botan_mp_set_from_int(one.mp, 1);
+    if ((v = atomic_load(&one)) != NULL) {
+        return v;
     }
-
-    return &one;
+    /* first callers may race to make it: the loser frees its copy */
+    if ((v = PGPV_BN_new()) == NULL) {
+        return NULL;
+    }
+    botan_mp_set_from_int(get_BN_mp(v), 1);
+    if (!atomic_compare_exchange_strong(&one, &expected, v)) {
+        PGPV_BN_free(v);
+        v = expected;
+    }
+    return v;
 }
 
 int
@@ -613,7 +711,7 @@ PGPV_BN_radix2bn(PGPV_BIGNUM **bn, const char *str, unsigned radix)
         *bn = PGPV_BN_new();
     }
 
-    return botan_mp_set_from_radix_str((*bn)->mp, str, radix);
+    return botan_mp_set_from_radix_str(get_BN_mp(*bn), str, radix);
 }
 
 int
@@ -622,7 +720,7 @@ PGPV_BN_is_bit_set(const PGPV_BIGNUM *a, int n)
     if (a == NULL || n < 0) {
         return 0;
     }
-    return botan_mp_get_bit(a->mp, n);
+    return botan_mp_get_bit(get_BN_mp(a), n);
 }
 
 /* get greatest common divisor */
@@ -630,5 +728,5 @@ int
 PGPV_BN_gcd(PGPV_BIGNUM *r, PGPV_BIGNUM *a, PGPV_BIGNUM *b, PGPV_BN_CTX *ctx)
 {
     USE_ARG(ctx);
-    return botan_mp_gcd(r->mp, a->mp, b->mp);
+    return botan_mp_gcd(get_BN_mp(r), get_BN_mp(a), get_BN_mp(b));
 }
@@ -371,6 +371,7 @@ pgp_decompress(pgp_region_t *region, pgp_stream_t *stream, pgp_compression_type_
             return 0;
         }
         pgp_reader_push(stream, zlib_compressed_data_reader, NULL, &z);
+        pgp_reader_set_stage(stream, "zlib");
         break;
 
 #ifdef HAVE_BZLIB_H
@@ -383,6 +384,7 @@ pgp_decompress(pgp_region_t *region, pgp_stream_t *stream, pgp_compression_type_
             return 0;
         }
         pgp_reader_push(stream, bzip2_compressed_data_reader, NULL, &bz);
+        pgp_reader_set_stage(stream, "bzip2");
         break;
 #endif
 
@@ -349,8 +349,8 @@ write_seckey_body(const pgp_seckey_t *key,
 
     case PGP_S2KS_SALTED:
         /* 8-octet salt value */
-        pgp_random(__UNCONST(&key->salt[0]), PGP_SALT_SIZE);
-        if (!pgp_write(output, key->salt, PGP_SALT_SIZE)) {
+        if (!pgp_random(__UNCONST(&key->salt[0]), PGP_SALT_SIZE) ||
+            !pgp_write(output, key->salt, PGP_SALT_SIZE)) {
             return 0;
         }
         pgp_s2k_salted(
@@ -359,7 +359,9 @@ write_seckey_body(const pgp_seckey_t *key,
 
     case PGP_S2KS_ITERATED_AND_SALTED:
         /* 8-octet salt value */
-        pgp_random(__UNCONST(&key->salt[0]), PGP_SALT_SIZE);
+        if (!pgp_random(__UNCONST(&key->salt[0]), PGP_SALT_SIZE)) {
+            return 0;
+        }
         pgp_s2k_iterated(key->hash_alg,
                          sesskey,
                          sesskey_size,
@@ -517,6 +519,36 @@ pgp_write_xfer_pubkey(pgp_output_t *         output,
     return 1;
 }
 
+/**
+   \ingroup HighLevel_KeyWrite
+
+   \brief Writes a public key to the given output stream as it was read
+
+   \param output Output stream
+   \param key Key to be written
+
+   \return 1 if OK, otherwise 0
+
+   \note A key read from a keyring keeps every packet of its keyblock,
+   subkeys included, and is written out as those. A key made here only
+   keeps its signatures, so it is put together by pgp_write_xfer_pubkey().
+*/
+unsigned
+pgp_write_keyblock(pgp_output_t *output, const pgp_key_t *key)
+{
+    unsigned i;
+
+    if (key->packetc == 0 || pgp_subpacket_tag(&key->packets[0]) != PGP_PTAG_CT_PUBLIC_KEY) {
+        return pgp_write_xfer_pubkey(output, key, NULL, 0);
+    }
+    for (i = 0; i < key->packetc; i++) {
+        if (!pgp_write(output, key->packets[i].raw, (unsigned) key->packets[i].length)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /**
    \ingroup HighLevel_KeyWrite
 
@@ -798,28 +830,17 @@ create_unencoded_m_buf(pgp_pk_sesskey_t *sesskey, pgp_crypt_t *cipherinfo, uint8
     return pgp_calc_sesskey_checksum(sesskey, m_buf + 1 + cipherinfo->keysize);
 }
 
-/**
- \ingroup Core_Create
-\brief Creates an pgp_pk_sesskey_t struct from keydata
-\param key Keydata to use
-\return pgp_pk_sesskey_t struct
-\note It is the caller's responsiblity to free the returned pointer
-\note Currently hard-coded to use CAST5
-\note Currently hard-coded to use RSA
-*/
-pgp_pk_sesskey_t *
-pgp_create_pk_sesskey(const pgp_key_t *key, const char *ciphername)
+/* encrypt a session key for the given key, making a random one if symkey is NULL */
+static pgp_pk_sesskey_t *
+create_pk_sesskey(const pgp_key_t *key, pgp_symm_alg_t cipher, const uint8_t *symkey)
 {
     /*
-     * Creates a random session key and encrypts it for the given key
-     *
      * Encryption used is PK,
      * can be any, we're hardcoding RSA for now
      */
 
     const pgp_pubkey_t *pubkey;
     const uint8_t *     id = NULL;
-    pgp_symm_alg_t      cipher;
     pgp_crypt_t         cipherinfo;
     pgp_pk_sesskey_t *  sesskey = NULL;
     uint8_t *           encoded_key = NULL;
@@ -846,8 +867,7 @@ pgp_create_pk_sesskey(const pgp_key_t *key, const char *ciphername)
 
     (void) memset(&cipherinfo, 0x0, sizeof(cipherinfo));
 
-    if (pgp_crypt_any(&cipherinfo,
-                      cipher = pgp_str_to_cipher((ciphername) ? ciphername : "cast5")) == 0) {
+    if (pgp_crypt_any(&cipherinfo, cipher) == 0) {
         return NULL;
     }
 
@@ -871,7 +891,14 @@ pgp_create_pk_sesskey(const pgp_key_t *key, const char *ciphername)
     (void) memcpy(sesskey->key_id, id, sizeof(sesskey->key_id));
     sesskey->alg = pubkey->alg;
     sesskey->symm_alg = cipher;
-    pgp_random(sesskey->key, cipherinfo.keysize);
+    if (symkey == NULL) {
+        if (!pgp_random(sesskey->key, cipherinfo.keysize)) {
+            (void) fprintf(stderr, "pgp_create_pk_sesskey: no random bytes\n");
+            goto error;
+        }
+    } else {
+        (void) memcpy(sesskey->key, symkey, cipherinfo.keysize);
+    }
 
     if (create_unencoded_m_buf(sesskey, &cipherinfo, &encoded_key[0]) == 0) {
         free(sesskey);
@@ -936,6 +963,37 @@ error:
     return NULL;
 }
 
+/**
+ \ingroup Core_Create
+\brief Creates an pgp_pk_sesskey_t struct from keydata
+\param key Keydata to use
+\return pgp_pk_sesskey_t struct
+\note It is the caller's responsiblity to free the returned pointer
+\note Currently hard-coded to use CAST5
+\note Currently hard-coded to use RSA
+*/
+pgp_pk_sesskey_t *
+pgp_create_pk_sesskey(const pgp_key_t *key, const char *ciphername)
+{
+    /* Creates a random session key and encrypts it for the given key */
+    return create_pk_sesskey(
+      key, pgp_str_to_cipher((ciphername) ? ciphername : "cast5"), NULL);
+}
+
+/**
+ \ingroup Core_Create
+\brief Creates an pgp_pk_sesskey_t struct for another recipient of a session key
+\param key Keydata of the other recipient
+\param first Session key as made for the first recipient
+\return pgp_pk_sesskey_t struct, holding the same session key
+\note It is the caller's responsiblity to free the returned pointer
+*/
+pgp_pk_sesskey_t *
+pgp_create_pk_sesskey_for(const pgp_key_t *key, const pgp_pk_sesskey_t *first)
+{
+    return create_pk_sesskey(key, first->symm_alg, first->key);
+}
+
 /**
 \ingroup Core_WritePackets
 \brief Writes Public Key Session Key packet
@@ -1150,6 +1208,26 @@ pgp_write_one_pass_sig(pgp_output_t *       output,
                        const pgp_seckey_t * seckey,
                        const pgp_hash_alg_t hash_alg,
                        const pgp_sig_type_t sig_type)
+{
+    return pgp_write_nested_one_pass_sig(output, seckey, hash_alg, sig_type, 1);
+}
+
+/**
+\ingroup Core_WritePackets
+\brief Write one of a run of One Pass Signature packets
+\param seckey Secret Key to use
+\param hash_alg Hash Algorithm to use
+\param sig_type Signature type
+\param last Set for the last packet of the run, the one next to the signed data
+\param output Write settings
+\return 1 if OK; else 0
+*/
+unsigned
+pgp_write_nested_one_pass_sig(pgp_output_t *       output,
+                              const pgp_seckey_t * seckey,
+                              const pgp_hash_alg_t hash_alg,
+                              const pgp_sig_type_t sig_type,
+                              const unsigned       last)
 {
     uint8_t keyid[PGP_KEY_ID_SIZE];
 
@@ -1160,5 +1238,5 @@ pgp_write_one_pass_sig(pgp_output_t *       output,
            pgp_write_scalar(output, (unsigned) sig_type, 1) &&
            pgp_write_scalar(output, (unsigned) hash_alg, 1) &&
            pgp_write_scalar(output, (unsigned) seckey->pubkey.alg, 1) &&
-           pgp_write(output, keyid, 8) && pgp_write_scalar(output, 1, 1);
+           pgp_write(output, keyid, 8) && pgp_write_scalar(output, (last) ? 1 : 0, 1);
 }
@@ -87,13 +87,20 @@ unsigned pgp_write_one_pass_sig(pgp_output_t *,
                                 const pgp_seckey_t *,
                                 const pgp_hash_alg_t,
                                 const pgp_sig_type_t);
+unsigned pgp_write_nested_one_pass_sig(pgp_output_t *,
+                                       const pgp_seckey_t *,
+                                       const pgp_hash_alg_t,
+                                       const pgp_sig_type_t,
+                                       const unsigned);
 unsigned pgp_write_litdata(pgp_output_t *, const uint8_t *, const int, const pgp_litdata_enum);
 pgp_pk_sesskey_t *pgp_create_pk_sesskey(const pgp_key_t *, const char *);
+pgp_pk_sesskey_t *pgp_create_pk_sesskey_for(const pgp_key_t *, const pgp_pk_sesskey_t *);
 unsigned          pgp_write_pk_sesskey(pgp_output_t *, pgp_pk_sesskey_t *);
 unsigned          pgp_write_xfer_pubkey(pgp_output_t *,
                                const pgp_key_t *,
                                const rnp_key_store_t *,
                                const unsigned);
+unsigned pgp_write_keyblock(pgp_output_t *, const pgp_key_t *);
 unsigned pgp_write_xfer_seckey(pgp_output_t *,
                                const pgp_key_t *,
                                const uint8_t *,
@@ -69,6 +69,8 @@ __RCSID("$NetBSD: crypto.c,v 1.36 2014/02/17 07:39:19 agc Exp $");
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include "types.h"
 #include "bn.h"
@@ -77,33 +79,36 @@ __RCSID("$NetBSD: crypto.c,v 1.36 2014/02/17 07:39:19 agc Exp $");
 #include "memory.h"
 #include "rnpdefs.h"
 #include "signature.h"
-
-/**
-\ingroup Core_MPI
-\brief Decrypt and unencode MPI
-\param buf Buffer in which to write decrypted unencoded MPI
-\param buflen Length of buffer
-\param encmpi
-\param seckey
-\return length of MPI
-\note only RSA at present
-*/
-int
-pgp_decrypt_decode_mpi(uint8_t *           buf,
-                       unsigned            buflen,
-                       const BIGNUM *      g_to_k,
-                       const BIGNUM *      encmpi,
-                       const pgp_seckey_t *seckey)
+#include "agent.h"
+#include "create.h"
+#include "seckeycache.h"
+
+/* most threads to try secret keys on a session key with */
+#define TRIAL_MAX_THREADS 16
+
+/* decrypt and unencode an MPI, saying why not unless quiet */
+static int
+decode_mpi(uint8_t *           buf,
+           unsigned            buflen,
+           const BIGNUM *      g_to_k,
+           const BIGNUM *      encmpi,
+           const pgp_seckey_t *seckey,
+           const unsigned      quiet)
 {
     unsigned mpisize;
     uint8_t  encmpibuf[RNP_BUFSIZ];
     uint8_t  gkbuf[RNP_BUFSIZ];
     int      n;
 
+    if (seckey->agent != NULL) {
+        return pgp_agent_decrypt(buf, buflen, g_to_k, encmpi, seckey);
+    }
     mpisize = (unsigned) BN_num_bytes(encmpi);
     /* MPI can't be more than 65,536 */
     if (mpisize > sizeof(encmpibuf)) {
-        (void) fprintf(stderr, "mpisize too big %u\n", mpisize);
+        if (!quiet) {
+            (void) fprintf(stderr, "mpisize too big %u\n", mpisize);
+        }
         return -1;
     }
     switch (seckey->pubkey.alg) {
@@ -119,7 +124,9 @@ pgp_decrypt_decode_mpi(uint8_t *           buf,
                                   &seckey->key.rsa,
                                   &seckey->pubkey.key.rsa);
         if (n <= 0) {
-            (void) fprintf(stderr, "ops_rsa_private_decrypt failure\n");
+            if (!quiet) {
+                (void) fprintf(stderr, "ops_rsa_private_decrypt failure\n");
+            }
             return -1;
         }
         if (rnp_get_debug(__FILE__)) {
@@ -140,7 +147,9 @@ pgp_decrypt_decode_mpi(uint8_t *           buf,
                                               &seckey->key.elgamal,
                                               &seckey->pubkey.key.elgamal);
         if (n <= 0) {
-            (void) fprintf(stderr, "ops_elgamal_private_decrypt failure\n");
+            if (!quiet) {
+                (void) fprintf(stderr, "ops_elgamal_private_decrypt failure\n");
+            }
             return -1;
         }
 
@@ -149,11 +158,141 @@ pgp_decrypt_decode_mpi(uint8_t *           buf,
         }
         return n;
     default:
-        (void) fprintf(stderr, "pubkey algorithm wrong\n");
+        if (!quiet) {
+            (void) fprintf(stderr, "pubkey algorithm wrong\n");
+        }
         return -1;
     }
 }
 
+/**
+\ingroup Core_MPI
+\brief Decrypt and unencode MPI
+\param buf Buffer in which to write decrypted unencoded MPI
+\param buflen Length of buffer
+\param encmpi
+\param seckey
+\return length of MPI
+\note only RSA at present
+*/
+int
+pgp_decrypt_decode_mpi(uint8_t *           buf,
+                       unsigned            buflen,
+                       const BIGNUM *      g_to_k,
+                       const BIGNUM *      encmpi,
+                       const pgp_seckey_t *seckey)
+{
+    return decode_mpi(buf, buflen, g_to_k, encmpi, seckey, 0);
+}
+
+/* the session key of a PKESK which seckey is the right key for, or 0 */
+static int
+trial_decrypt(const pgp_pk_sesskey_t *sesskey, const pgp_seckey_t *seckey)
+{
+    pgp_pk_sesskey_t recovered;
+    const BIGNUM *   g_to_k;
+    const BIGNUM *   enc_m;
+    uint8_t          buf[1024];
+    uint8_t          cs[2];
+    unsigned         k;
+    int              n;
+
+    if (sesskey->alg == PGP_PKA_RSA) {
+        g_to_k = NULL;
+        enc_m = sesskey->params.rsa.encrypted_m;
+    } else {
+        g_to_k = sesskey->params.elgamal.g_to_k;
+        enc_m = sesskey->params.elgamal.encrypted_m;
+    }
+    if ((n = decode_mpi(buf, (unsigned) sizeof(buf), g_to_k, enc_m, seckey, 1)) < 1) {
+        return 0;
+    }
+    recovered = *sesskey;
+    recovered.symm_alg = (pgp_symm_alg_t) buf[0];
+    if (!pgp_is_sa_supported(recovered.symm_alg)) {
+        return 0;
+    }
+    k = pgp_key_size(recovered.symm_alg);
+    if ((unsigned) n != k + 3 || k > sizeof(recovered.key)) {
+        return 0;
+    }
+    (void) memcpy(recovered.key, &buf[1], k);
+    return pgp_calc_sesskey_checksum(&recovered, cs) && buf[k + 1] == cs[0] &&
+           buf[k + 2] == cs[1];
+}
+
+/* the keys being tried on one session key, shared by the threads trying them */
+typedef struct trial_t {
+    const pgp_pk_sesskey_t *sesskey;
+    const pgp_seckey_t **   seckeys;
+    unsigned                seckeyc;
+    atomic_uint             next;  /* the next key to try */
+    atomic_int              found; /* the key which worked, or -1 */
+} trial_t;
+
+static void *
+trial_keys(void *arg)
+{
+    trial_t *trial = arg;
+    unsigned i;
+    int      none;
+
+    while (atomic_load(&trial->found) < 0 &&
+           (i = atomic_fetch_add(&trial->next, 1)) < trial->seckeyc) {
+        if (trial_decrypt(trial->sesskey, trial->seckeys[i])) {
+            none = -1;
+            (void) atomic_compare_exchange_strong(&trial->found, &none, (int) i);
+        }
+    }
+    return NULL;
+}
+
+/**
+\ingroup Core_MPI
+\brief Find which of a number of unlocked secret keys a session key was
+encrypted to, as for a hidden recipient, by trying them on threads of
+their own
+\param sesskey The public key encrypted session key
+\param seckeys The secret keys to try
+\param seckeyc The number of keys
+\return index of the first key found to give a session key with the right
+checksum; -1 if none does
+*/
+int
+pgp_find_sesskey_seckey(const pgp_pk_sesskey_t *sesskey,
+                        const pgp_seckey_t **   seckeys,
+                        unsigned                seckeyc)
+{
+    pthread_t threads[TRIAL_MAX_THREADS];
+    int       started[TRIAL_MAX_THREADS];
+    trial_t   trial;
+    unsigned  n;
+    unsigned  i;
+    long      cpus;
+
+    trial.sesskey = sesskey;
+    trial.seckeys = seckeys;
+    trial.seckeyc = seckeyc;
+    atomic_init(&trial.next, 0);
+    atomic_init(&trial.found, -1);
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = (cpus < 1) ? 1 : (cpus > TRIAL_MAX_THREADS) ? TRIAL_MAX_THREADS : (unsigned) cpus;
+    if (n > seckeyc) {
+        n = seckeyc;
+    }
+    /* this thread tries keys too */
+    for (i = 1; i < n; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, trial_keys, &trial) == 0);
+    }
+    (void) trial_keys(&trial);
+    for (i = 1; i < n; i++) {
+        if (started[i]) {
+            (void) pthread_join(threads[i], NULL);
+        }
+    }
+    return atomic_load(&trial.found);
+}
+
 /**
 \ingroup Core_MPI
 \brief Elgamal-encrypt an MPI
@@ -265,19 +404,21 @@ write_parsed_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
 Encrypt a file
 \param infile Name of file to be encrypted
 \param outfile Name of file to write to. If NULL, name is constructed from infile
-\param pubkey Public Key to encrypt file for
+\param keys Public Keys to encrypt file for
+\param keyc Number of keys
 \param use_armour Write armoured text, if set
 \param allow_overwrite Allow output file to be overwrwritten if it exists
 \return 1 if OK; else 0
 */
 unsigned
-pgp_encrypt_file(pgp_io_t *       io,
-                 const char *     infile,
-                 const char *     outfile,
-                 const pgp_key_t *key,
-                 const unsigned   use_armour,
-                 const unsigned   allow_overwrite,
-                 const char *     cipher)
+pgp_encrypt_file(pgp_io_t *        io,
+                 const char *      infile,
+                 const char *      outfile,
+                 const pgp_key_t **keys,
+                 unsigned          keyc,
+                 const unsigned    use_armour,
+                 const unsigned    allow_overwrite,
+                 const char *      cipher)
 {
     pgp_output_t *output;
     pgp_memory_t *inmem;
@@ -300,7 +441,7 @@ pgp_encrypt_file(pgp_io_t *       io,
     }
 
     /* Push the encrypted writer */
-    if (!pgp_push_enc_se_ip(output, key, cipher)) {
+    if (!pgp_push_enc_se_ip(output, keys, keyc, cipher)) {
         pgp_memory_free(inmem);
         return 0;
     }
@@ -317,12 +458,13 @@ pgp_encrypt_file(pgp_io_t *       io,
 
 /* encrypt the contents of the input buffer, and return the mem structure */
 pgp_memory_t *
-pgp_encrypt_buf(pgp_io_t *       io,
-                const void *     input,
-                const size_t     insize,
-                const pgp_key_t *pubkey,
-                const unsigned   use_armour,
-                const char *     cipher)
+pgp_encrypt_buf(pgp_io_t *        io,
+                const void *      input,
+                const size_t      insize,
+                const pgp_key_t **keys,
+                unsigned          keyc,
+                const unsigned    use_armour,
+                const char *      cipher)
 {
     pgp_output_t *output;
     pgp_memory_t *outmem;
@@ -341,7 +483,10 @@ pgp_encrypt_buf(pgp_io_t *       io,
     }
 
     /* Push the encrypted writer */
-    pgp_push_enc_se_ip(output, pubkey, cipher);
+    if (!pgp_push_enc_se_ip(output, keys, keyc, cipher)) {
+        pgp_teardown_memory_write(output, outmem);
+        return NULL;
+    }
 
     /* This does the writing */
     pgp_write(output, input, (unsigned) insize);
@@ -366,17 +511,19 @@ pgp_encrypt_buf(pgp_io_t *       io,
 */
 
 unsigned
-pgp_decrypt_file(pgp_io_t *       io,
-                 const char *     infile,
-                 const char *     outfile,
-                 rnp_key_store_t *secring,
-                 rnp_key_store_t *pubring,
-                 const unsigned   use_armour,
-                 const unsigned   allow_overwrite,
-                 const unsigned   sshkeys,
-                 void *           passfp,
-                 int              numtries,
-                 pgp_cbfunc_t *   getpassfunc)
+pgp_decrypt_file(pgp_io_t *          io,
+                 const char *        infile,
+                 const char *        outfile,
+                 rnp_key_store_t *   secring,
+                 rnp_key_store_t *   pubring,
+                 const unsigned      use_armour,
+                 const unsigned      allow_overwrite,
+                 const unsigned      sshkeys,
+                 void *              passfp,
+                 pgp_agent_t *       agent,
+                 pgp_seckey_cache_t *seckeys,
+                 int                 numtries,
+                 pgp_cbfunc_t *      getpassfunc)
 {
     pgp_stream_t *parse = NULL;
     const int     printerrors = 1;
@@ -386,7 +533,7 @@ pgp_decrypt_file(pgp_io_t *       io,
     int           ret;
 
     /* setup for reading from given input file */
-    fd_in = pgp_setup_file_read(io, &parse, infile, NULL, write_parsed_cb, 0);
+    fd_in = pgp_setup_file_read(io, &parse, infile, NULL, write_parsed_cb, 1);
     if (fd_in < 0) {
         perror(infile);
         return 0;
@@ -433,6 +580,8 @@ pgp_decrypt_file(pgp_io_t *       io,
     parse->cbinfo.passfp = passfp;
     parse->cbinfo.cryptinfo.getpassphrase = getpassfunc;
     parse->cbinfo.cryptinfo.pubring = pubring;
+    parse->cbinfo.cryptinfo.agent = agent;
+    parse->cbinfo.cryptinfo.seckeys = seckeys;
     parse->cbinfo.sshseckey = (sshkeys) ? &secring->keys[0].key.seckey : NULL;
     parse->cbinfo.numtries = numtries;
 
@@ -443,6 +592,7 @@ pgp_decrypt_file(pgp_io_t *       io,
 
     /* Do it */
     ret = pgp_parse(parse, printerrors);
+    pgp_forget_seckey(&parse->cbinfo.cryptinfo);
 
     /* Unsetup */
     if (use_armour) {
@@ -467,16 +617,18 @@ pgp_decrypt_file(pgp_io_t *       io,
 
 /* decrypt an area of memory */
 pgp_memory_t *
-pgp_decrypt_buf(pgp_io_t *       io,
-                const void *     input,
-                const size_t     insize,
-                rnp_key_store_t *secring,
-                rnp_key_store_t *pubring,
-                const unsigned   use_armour,
-                const unsigned   sshkeys,
-                void *           passfp,
-                int              numtries,
-                pgp_cbfunc_t *   getpassfunc)
+pgp_decrypt_buf(pgp_io_t *          io,
+                const void *        input,
+                const size_t        insize,
+                rnp_key_store_t *   secring,
+                rnp_key_store_t *   pubring,
+                const unsigned      use_armour,
+                const unsigned      sshkeys,
+                void *              passfp,
+                pgp_agent_t *       agent,
+                pgp_seckey_cache_t *seckeys,
+                int                 numtries,
+                pgp_cbfunc_t *      getpassfunc)
 {
     pgp_stream_t *parse = NULL;
     pgp_memory_t *outmem;
@@ -492,7 +644,7 @@ pgp_decrypt_buf(pgp_io_t *       io,
     pgp_memory_add(inmem, input, insize);
 
     /* set up to read from memory */
-    pgp_setup_memory_read(io, &parse, inmem, NULL, write_parsed_cb, 0);
+    pgp_setup_memory_read(io, &parse, inmem, NULL, write_parsed_cb, 1);
 
     /* setup for writing decrypted contents to given output file */
     pgp_setup_memory_write(&parse->cbinfo.output, &outmem, insize);
@@ -502,6 +654,8 @@ pgp_decrypt_buf(pgp_io_t *       io,
     parse->cbinfo.cryptinfo.pubring = pubring;
     parse->cbinfo.passfp = passfp;
     parse->cbinfo.cryptinfo.getpassphrase = getpassfunc;
+    parse->cbinfo.cryptinfo.agent = agent;
+    parse->cbinfo.cryptinfo.seckeys = seckeys;
     parse->cbinfo.sshseckey = (sshkeys) ? &secring->keys[0].key.seckey : NULL;
     parse->cbinfo.numtries = numtries;
 
@@ -512,6 +666,7 @@ pgp_decrypt_buf(pgp_io_t *       io,
 
     /* Do it */
     pgp_parse(parse, printerrors);
+    pgp_forget_seckey(&parse->cbinfo.cryptinfo);
 
     /* Unsetup */
     if (use_armour) {
@@ -540,7 +695,7 @@ new_BN_take_mp(botan_mp_t mp)
     PGPV_BIGNUM *a;
 
     a = calloc(1, sizeof(*a));
-    a->mp = mp;
+    atomic_init(&a->mp, mp);
     return a;
 }
 
@@ -56,6 +56,7 @@
 #define CRYPTO_H_
 
 #include <botan/ffi.h>
+#include <stdatomic.h>
 #include "hash.h"
 #include "key_store_pgp.h"
 #include "packet.h"
@@ -63,11 +64,17 @@
 #include "packet-parse.h"
 #include "symmetric.h"
 #include "bn.h"
+#include "arena.h"
+#include "stats.h"
 
 #define PGP_MIN_HASH_SIZE 16
 
+/* An integer read from a packet is only kept as its bytes until some
+ * arithmetic needs it; get_BN_mp() makes the botan_mp_t on first use. */
 struct PGPV_BIGNUM_st {
-    botan_mp_t mp;
+    _Atomic(botan_mp_t) mp;  /* NULL until needed */
+    uint8_t *           raw; /* big-endian value, while mp is NULL */
+    size_t              rawlen;
 };
 
 void pgp_crypto_finish(void);
@@ -119,6 +126,22 @@ int pgp_rsa_pkcs1_sign_hash(uint8_t *      sig_buf,
                             const pgp_rsa_seckey_t *,
                             const pgp_rsa_pubkey_t *);
 
+/*
+ * A private key loaded and checked once, for signing many hashes; it can
+ * sign from several threads at once. Set it as the signer of a secret key
+ * for pgp_rsa_pkcs1_sign_hash() to use it.
+ */
+typedef struct pgp_rsa_signer_t pgp_rsa_signer_t;
+
+pgp_rsa_signer_t *pgp_rsa_signer_new(const pgp_rsa_seckey_t *, const pgp_rsa_pubkey_t *);
+int               pgp_rsa_signer_sign_hash(pgp_rsa_signer_t *,
+                                           uint8_t *,
+                                           size_t,
+                                           pgp_hash_alg_t,
+                                           const uint8_t *,
+                                           size_t);
+void              pgp_rsa_signer_free(pgp_rsa_signer_t *);
+
 /*
  * Performs ElGamal encryption
  * Result of an encryption is composed of two parts - g2k and encm
@@ -174,6 +197,7 @@ void pgp_reader_pop_hash(pgp_stream_t *);
 
 int pgp_decrypt_decode_mpi(
   uint8_t *, unsigned, const BIGNUM *, const BIGNUM *, const pgp_seckey_t *);
+int pgp_find_sesskey_seckey(const pgp_pk_sesskey_t *, const pgp_seckey_t **, unsigned);
 
 /* Encrypt everything that's written */
 struct pgp_key_data;
@@ -182,10 +206,12 @@ void pgp_writer_push_encrypt(pgp_output_t *, const struct pgp_key_data *);
 unsigned pgp_encrypt_file(pgp_io_t *,
                           const char *,
                           const char *,
-                          const pgp_key_t *,
+                          const pgp_key_t **,
+                          unsigned,
                           const unsigned,
                           const unsigned,
                           const char *);
+struct pgp_seckey_cache_t;
 unsigned pgp_decrypt_file(pgp_io_t *,
                           const char *,
                           const char *,
@@ -195,11 +221,18 @@ unsigned pgp_decrypt_file(pgp_io_t *,
                           const unsigned,
                           const unsigned,
                           void *,
+                          struct pgp_agent_t *,
+                          struct pgp_seckey_cache_t *,
                           int,
                           pgp_cbfunc_t *);
 
-pgp_memory_t *pgp_encrypt_buf(
-  pgp_io_t *, const void *, const size_t, const pgp_key_t *, const unsigned, const char *);
+pgp_memory_t *pgp_encrypt_buf(pgp_io_t *,
+                              const void *,
+                              const size_t,
+                              const pgp_key_t **,
+                              unsigned,
+                              const unsigned,
+                              const char *);
 pgp_memory_t *pgp_decrypt_buf(pgp_io_t *,
                               const void *,
                               const size_t,
@@ -208,6 +241,8 @@ pgp_memory_t *pgp_decrypt_buf(pgp_io_t *,
                               const unsigned,
                               const unsigned,
                               void *,
+                              struct pgp_agent_t *,
+                              struct pgp_seckey_cache_t *,
                               int,
                               pgp_cbfunc_t *);
 
@@ -245,17 +280,21 @@ struct pgp_reader_t {
     unsigned                position;       /* reader-specific offset */
     pgp_reader_t *          next;
     pgp_stream_t *          parent; /* parent parse_info structure */
+    pgp_stage_stats_t *     stats;  /* counters, NULL unless collecting */
 };
 
 /** pgp_cryptinfo_t
  Encrypt/decrypt settings
 */
 struct pgp_cryptinfo_t {
-    char *           passphrase;
-    rnp_key_store_t *secring;
-    const pgp_key_t *keydata;
-    pgp_cbfunc_t *   getpassphrase;
-    rnp_key_store_t *pubring;
+    char *                     passphrase;
+    rnp_key_store_t *          secring;
+    const pgp_key_t *          keydata;
+    pgp_cbfunc_t *             getpassphrase;
+    rnp_key_store_t *          pubring;
+    struct pgp_agent_t *       agent;   /* rnp-agent to ask for secret keys */
+    struct pgp_seckey_cache_t *seckeys; /* secret keys unlocked before, or NULL */
+    const pgp_seckey_t *       seckey;  /* the secret key handed out last */
 };
 
 /** pgp_cbdata_t */
@@ -326,6 +365,8 @@ struct pgp_stream_t {
     unsigned virtualc;
     unsigned virtualoff;
     uint8_t *virtualpkt;
+    /* signature subpacket contents */
+    pgp_arena_t arena;
 };
 
 /**
@@ -334,4 +375,9 @@ struct pgp_stream_t {
 BIGNUM *new_BN_take_mp(botan_mp_t mp);
 void destroy_BN_mp(BIGNUM **a);
 
+/**
+ * \brief Returns the mp value of a BIGNUM, making it on first use
+ */
+botan_mp_t get_BN_mp(const BIGNUM *);
+
 #endif /* CRYPTO_H_ */
@@ -77,6 +77,8 @@
  */
 #include <stdlib.h>
 #include "crypto.h"
+#include "rng.h"
+#include "trace.h"
 
 unsigned
 pgp_dsa_verify(const uint8_t *         hash,
@@ -90,9 +92,14 @@ pgp_dsa_verify(const uint8_t *         hash,
     size_t               q_bytes = 0;
     unsigned int         valid;
 
-    botan_pubkey_load_dsa(&dsa_key, dsa->p->mp, dsa->q->mp, dsa->g->mp, dsa->y->mp);
+    PGP_TRACE_BEGIN("pgp_dsa_verify", NULL);
+    botan_pubkey_load_dsa(&dsa_key,
+                          get_BN_mp(dsa->p),
+                          get_BN_mp(dsa->q),
+                          get_BN_mp(dsa->g),
+                          get_BN_mp(dsa->y));
 
-    botan_mp_num_bytes(dsa->q->mp, &q_bytes);
+    botan_mp_num_bytes(get_BN_mp(dsa->q), &q_bytes);
 
     encoded_signature = calloc(2, q_bytes);
     BN_bn2bin(sig->r, encoded_signature);
@@ -105,6 +112,7 @@ pgp_dsa_verify(const uint8_t *         hash,
     botan_pubkey_destroy(dsa_key);
 
     free(encoded_signature);
+    PGP_TRACE_END("pgp_dsa_verify");
 
     return valid;
 }
@@ -140,31 +148,32 @@ pgp_dsa_sign(uint8_t *               hashbuf,
     uint8_t *          sigbuf = NULL;
     DSA_SIG *          ret;
 
-    botan_privkey_load_dsa(
-      &dsa_key, pubdsa->p->mp, pubdsa->q->mp, pubdsa->g->mp, secdsa->x->mp);
+    PGP_TRACE_BEGIN("pgp_dsa_sign", NULL);
+    botan_privkey_load_dsa(&dsa_key,
+                           get_BN_mp(pubdsa->p),
+                           get_BN_mp(pubdsa->q),
+                           get_BN_mp(pubdsa->g),
+                           get_BN_mp(secdsa->x));
 
-    botan_rng_init(&rng, NULL);
+    rng = pgp_rng_handle();
 
     botan_pk_op_sign_create(&sign_op, dsa_key, "Raw", 0);
     botan_pk_op_sign_update(sign_op, hashbuf, hashsize);
 
-    botan_mp_num_bytes(pubdsa->q->mp, &q_bytes);
+    botan_mp_num_bytes(get_BN_mp(pubdsa->q), &q_bytes);
     sigbuf_size = q_bytes * 2;
     sigbuf = calloc(sigbuf_size, 1);
 
     botan_pk_op_sign_finish(sign_op, rng, sigbuf, &sigbuf_size);
-    botan_rng_destroy(rng);
 
     botan_pk_op_sign_destroy(sign_op);
     botan_privkey_destroy(dsa_key);
+    PGP_TRACE_END("pgp_dsa_sign");
 
     // Now load the DSA (r,s) values from the signature
     ret = DSA_SIG_new();
-    botan_mp_init(&(ret->r->mp));
-    botan_mp_init(&(ret->s->mp));
-
-    botan_mp_from_bin(ret->r->mp, sigbuf, q_bytes);
-    botan_mp_from_bin(ret->s->mp, sigbuf + q_bytes, q_bytes);
+    BN_bin2bn(sigbuf, (int) q_bytes, ret->r);
+    BN_bin2bn(sigbuf + q_bytes, (int) q_bytes, ret->s);
 
     return ret;
 }
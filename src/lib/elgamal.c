@@ -80,6 +80,8 @@
 #include <string.h>
 
 #include "crypto.h"
+#include "rng.h"
+#include "trace.h"
 
 #define FAIL(str)                                                                      \
     do {                                                                               \
@@ -101,16 +103,18 @@ pgp_elgamal_public_encrypt_pkcs1(uint8_t *                   g2k,
     size_t                p_len = 0;
     uint8_t *             bt_ciphertext = NULL;
 
-    if (botan_rng_init(&rng, NULL)) {
+    PGP_TRACE_BEGIN("pgp_elgamal_public_encrypt_pkcs1", NULL);
+    if ((rng = pgp_rng_handle()) == NULL) {
         FAIL("Random initialization failure");
     }
 
-    if (botan_mp_num_bytes(pubkey->p->mp, &p_len)) {
+    if (botan_mp_num_bytes(get_BN_mp(pubkey->p), &p_len)) {
         FAIL("Wrong public key");
     }
 
     // Initialize RNG and encrypt
-    if (botan_pubkey_load_elgamal(&key, pubkey->p->mp, pubkey->g->mp, pubkey->y->mp)) {
+    if (botan_pubkey_load_elgamal(
+          &key, get_BN_mp(pubkey->p), get_BN_mp(pubkey->g), get_BN_mp(pubkey->y))) {
         FAIL("Failed to load public key");
     }
 
@@ -148,8 +152,8 @@ pgp_elgamal_public_encrypt_pkcs1(uint8_t *                   g2k,
 end:
     ret |= botan_pk_op_encrypt_destroy(op_ctx);
     ret |= botan_pubkey_destroy(key);
-    ret |= botan_rng_destroy(rng);
     free(bt_ciphertext);
+    PGP_TRACE_END("pgp_elgamal_public_encrypt_pkcs1");
 
     if (ret) {
         // Some error has occured
@@ -175,12 +179,13 @@ pgp_elgamal_private_decrypt_pkcs1(uint8_t *                   out,
     size_t                p_len = 0;
     uint8_t *             bt_plaintext = NULL;
 
-    if (botan_rng_init(&rng, NULL)) {
+    PGP_TRACE_BEGIN("pgp_elgamal_private_decrypt_pkcs1", NULL);
+    if ((rng = pgp_rng_handle()) == NULL) {
         FAIL("Random initialization failure");
     }
 
     // Output len is twice an order of underlying group
-    if (botan_mp_num_bytes(pubkey->p->mp, &p_len)) {
+    if (botan_mp_num_bytes(get_BN_mp(pubkey->p), &p_len)) {
         FAIL("Wrong public key");
     }
 
@@ -197,7 +202,8 @@ pgp_elgamal_private_decrypt_pkcs1(uint8_t *                   out,
         FAIL("Memory allocation failure");
     }
 
-    if (botan_privkey_load_elgamal(&key, pubkey->p->mp, pubkey->g->mp, seckey->x->mp)) {
+    if (botan_privkey_load_elgamal(
+          &key, get_BN_mp(pubkey->p), get_BN_mp(pubkey->g), get_BN_mp(seckey->x))) {
         FAIL("Failed to load private key");
     }
 
@@ -222,8 +228,8 @@ pgp_elgamal_private_decrypt_pkcs1(uint8_t *                   out,
 end:
     ret |= botan_pk_op_decrypt_destroy(op_ctx);
     ret |= botan_privkey_destroy(key);
-    ret |= botan_rng_destroy(rng);
     free(bt_plaintext);
+    PGP_TRACE_END("pgp_elgamal_private_decrypt_pkcs1");
 
     if (ret) {
         // Some error has occured
@@ -244,6 +244,30 @@ pgp_hash_finish(pgp_hash_t *hash, uint8_t *out)
     return outlen;
 }
 
+/**
+\ingroup Core_Hashes
+\brief Make one hash a copy of another, so that data hashed so far can be
+shared by several signatures
+\param dst Hash set up with pgp_hash_create(), whose state is replaced
+\param src Hash to copy
+\return 1 if OK; else 0
+*/
+int
+pgp_hash_copy(pgp_hash_t *dst, const pgp_hash_t *src)
+{
+    botan_hash_t impl;
+
+    if (botan_hash_copy_state(&impl, src->handle) != 0) {
+        (void) fprintf(stderr, "pgp_hash_copy: botan_hash_copy_state failed\n");
+        return 0;
+    }
+    botan_hash_destroy(dst->handle);
+    dst->handle = impl;
+    dst->_output_len = src->_output_len;
+    dst->_alg = src->_alg;
+    return 1;
+}
+
 /**
    \ingroup Core_Hashes
    \brief Get Hash name
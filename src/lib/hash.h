@@ -72,6 +72,7 @@ int pgp_hash_create(pgp_hash_t *hash, pgp_hash_alg_t alg);
 void pgp_hash_add(pgp_hash_t *hash, const uint8_t *input, size_t len);
 void pgp_hash_add_int(pgp_hash_t *hash, unsigned n, size_t bytes);
 size_t pgp_hash_finish(pgp_hash_t *hash, uint8_t *output);
+int pgp_hash_copy(pgp_hash_t *dst, const pgp_hash_t *src);
 
 size_t pgp_hash_output_length(const pgp_hash_t *hash);
 const char *pgp_hash_name(const pgp_hash_t *hash);
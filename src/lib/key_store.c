@@ -30,32 +30,47 @@
 
 #include "config.h"
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include "rnp.h"
 #include "rnpdefs.h"
 #include "key_store.h"
 #include "key_store_pgp.h"
 #include "key_store_ssh.h"
+#include "key_store_kbx.h"
 #include "packet-print.h"
 #include "packet-key.h"
 #include "packet.h"
+#include "trace.h"
 
 #include <regex.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+static const uint8_t nullid[PGP_KEY_ID_SIZE];
+
 int
 rnp_key_store_load_keys(rnp_t *rnp, char *homedir)
 {
+    int ret = 0;
+
+    PGP_TRACE_BEGIN("rnp_key_store_load_keys", NULL);
     switch (rnp->keyring_format) {
     case GPG_KEYRING:
-        return rnp_key_store_pgp_load_keys(rnp, homedir);
+    case KBX_KEYRING:
+        ret = rnp_key_store_pgp_load_keys(rnp, homedir);
+        break;
 
     case SSH_KEYRING:
-        return rnp_key_store_ssh_load_keys(rnp, homedir);
+        ret = rnp_key_store_ssh_load_keys(rnp, homedir);
+        break;
     }
+    PGP_TRACE_END("rnp_key_store_load_keys");
 
-    return 0;
+    return ret;
 }
 
 int
@@ -71,12 +86,31 @@ rnp_key_store_load_from_file(rnp_t *          rnp,
 
         case SSH_KEYRING:
             return rnp_key_store_ssh_from_file(rnp->io, keyring, filename);
+
+        case KBX_KEYRING:
+            return rnp_key_store_kbx_from_file(rnp->io, keyring, armour, filename);
         }
 
         return 0;
     }
 }
 
+/*
+ * note that the keyring holds the first `size' bytes of the file open on fd,
+ * so that anything written after them is picked up when the file is watched
+ */
+void
+rnp_key_store_note_file(rnp_key_store_t *keyring, int fd, off_t size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == 0) {
+        keyring->dev = st.st_dev;
+        keyring->ino = st.st_ino;
+        keyring->size = size;
+    }
+}
+
 int
 rnp_key_store_load_from_mem(rnp_t *          rnp,
                             rnp_key_store_t *keyring,
@@ -89,6 +123,9 @@ rnp_key_store_load_from_mem(rnp_t *          rnp,
 
     case SSH_KEYRING:
         return rnp_key_store_ssh_from_mem(rnp->io, keyring, memory);
+
+    case KBX_KEYRING:
+        return rnp_key_store_kbx_from_mem(rnp->io, keyring, armour, memory);
     }
 
     return 0;
@@ -135,7 +172,8 @@ rnp_key_store_format_key(char *buffer, uint8_t *sigid, int len)
 int
 rnp_key_store_get_first_ring(rnp_key_store_t *ring, char *id, size_t len, int last)
 {
-    uint8_t *src;
+    const pgp_key_t *key;
+    pgp_io_t         io = {stdout, stderr, stdout};
 
     /* The NULL test on the ring may not be necessary for non-debug
      * builds - it would be much better that a NULL ring never
@@ -155,8 +193,12 @@ rnp_key_store_get_first_ring(rnp_key_store_t *ring, char *id, size_t len, int la
 
     memset(id, 0x0, len);
 
-    src = (uint8_t *) &ring->keys[(last) ? ring->keyc - 1 : 0].sigid;
-    rnp_key_store_format_key(id, src, len);
+    /* a key still in a keybox may be being parsed by another thread */
+    if ((key = rnp_key_store_get_key(&io, ring, (last) ? ring->keyc - 1 : 0)) == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    rnp_key_store_format_key(id, (uint8_t *) key->sigid, len);
 
     return 1;
 }
@@ -168,14 +210,253 @@ rnp_key_store_get_first_ring(rnp_key_store_t *ring, char *id, size_t len, int la
 
    \param keyring Keyring whose data is to be freed
 
-   \note This does not free keyring itself, just the memory alloc-ed in it.
+   \note This does not free keyring itself, just the memory alloc-ed in it,
+   its keys' included. Keys moved to another keyring must be zeroed first.
  */
 void
 rnp_key_store_free(rnp_key_store_t *keyring)
 {
+    unsigned i;
+
+    for (i = 0; i < keyring->keyc; i++) {
+        pgp_key_free(&keyring->keys[i]);
+    }
     (void) free(keyring->keys);
     keyring->keys = NULL;
     keyring->keyc = keyring->keyvsize = 0;
+    (void) free(keyring->hots);
+    keyring->hots = NULL;
+    keyring->hotc = keyring->hotvsize = 0;
+    (void) free(keyring->ids);
+    keyring->ids = NULL;
+    keyring->idsize = keyring->idc = 0;
+    (void) free(keyring->blobs);
+    keyring->blobs = NULL;
+    keyring->blobc = keyring->blobvsize = 0;
+    for (i = 0; i < keyring->imagec; i++) {
+        pgp_memory_free(keyring->images[i]);
+    }
+    (void) free(keyring->images);
+    keyring->images = NULL;
+    keyring->imagec = keyring->imagevsize = 0;
+}
+
+/**
+   \ingroup HighLevel_KeyringFind
+
+   \brief Returns the n'th key in a keyring, parsing it first if only
+   the header of its keybox blob has been read
+
+   \return Pointer to key; NULL if n is out of range or it can't be parsed
+*/
+const pgp_key_t *
+rnp_key_store_get_key(pgp_io_t *io, const rnp_key_store_t *keyring, unsigned n)
+{
+    if (n >= keyring->keyc || !rnp_key_store_kbx_parse_key(io, keyring, n)) {
+        return NULL;
+    }
+    return &keyring->keys[n];
+}
+
+/* the first slot to look in for a key id whose low half is this */
+static unsigned
+id_slot(const rnp_key_store_t *keyring, const uint8_t *half)
+{
+    uint32_t h;
+
+    h = ((uint32_t) half[0] << 24) | ((uint32_t) half[1] << 16) | ((uint32_t) half[2] << 8) |
+        (uint32_t) half[3];
+    return (unsigned) ((h * 2654435761u) >> 8) & (keyring->idsize - 1);
+}
+
+static void
+add_id(rnp_key_store_t *keyring, const uint8_t *id, unsigned n)
+{
+    unsigned slot;
+
+    slot = id_slot(keyring, &id[PGP_KEY_ID_SIZE / 2]);
+    while (keyring->ids[slot] != 0) {
+        slot = (slot + 1) & (keyring->idsize - 1);
+    }
+    keyring->ids[slot] = n + 1;
+    keyring->idc += 1;
+}
+
+/*
+ * add the ids of hots from `from' on to the key id table, rebuilding it
+ * when it gets half full or when keys have moved. Entries left behind by
+ * keys that changed are harmless, as lookups compare the ids themselves.
+ */
+static void
+index_ids(rnp_key_store_t *keyring, unsigned from, int moved)
+{
+    unsigned i;
+    unsigned size;
+
+    if (moved || keyring->ids == NULL ||
+        (keyring->idc + 2 * (keyring->hotc - from)) * 2 > keyring->idsize) {
+        for (size = 64; size < 4 * keyring->hotc; size *= 2) {
+        }
+        (void) free(keyring->ids);
+        keyring->idc = 0;
+        if ((keyring->ids = calloc(size, sizeof(*keyring->ids))) == NULL) {
+            keyring->idsize = 0;
+            return;
+        }
+        keyring->idsize = size;
+        from = 0;
+    }
+    for (i = from; i < keyring->hotc; i++) {
+        add_id(keyring, keyring->hots[i].sigid, i);
+        if (keyring->hots[i].flags & PGP_KEY_HOT_ENCID) {
+            add_id(keyring, keyring->hots[i].encid, i);
+        }
+    }
+}
+
+/* copy what lookups look at from key into its hot entry */
+static void
+fill_hot(pgp_key_hot_t *hot, const pgp_key_t *key)
+{
+    (void) memcpy(hot->sigid, key->sigid, sizeof(hot->sigid));
+    (void) memcpy(hot->encid, key->encid, sizeof(hot->encid));
+    hot->flags = 0;
+    if (memcmp(key->encid, nullid, sizeof(nullid)) != 0) {
+        hot->flags |= PGP_KEY_HOT_ENCID;
+    }
+}
+
+/*
+ * bring the lookup index up to date with the keys from `from' on, after
+ * they were added or changed. Until it covers every key again, lookups
+ * fall back to looking at the keys themselves.
+ */
+void
+rnp_key_store_index(rnp_key_store_t *keyring, unsigned from)
+{
+    int moved;
+
+    /* fewer keys than hots means some were removed, and the rest moved up */
+    moved = (keyring->hotc > keyring->keyc);
+    if (from < keyring->hotc) {
+        keyring->hotc = from;
+    }
+    from = keyring->hotc;
+    while (keyring->hotc < keyring->keyc) {
+        EXPAND_ARRAY(keyring, hot);
+        if (keyring->hotc == keyring->hotvsize) {
+            return;
+        }
+        fill_hot(&keyring->hots[keyring->hotc], &keyring->keys[keyring->hotc]);
+        keyring->hotc += 1;
+    }
+    index_ids(keyring, from, moved);
+}
+
+/* wrap loaded keyrings, which the snapshot now owns, with one reference */
+rnp_key_snapshot_t *
+rnp_key_snapshot_new(rnp_key_store_t *pubring, rnp_key_store_t *secring)
+{
+    rnp_key_snapshot_t *snap;
+
+    if ((snap = calloc(1, sizeof(*snap))) == NULL) {
+        return NULL;
+    }
+    atomic_init(&snap->refs, 1);
+    snap->pubring = pubring;
+    snap->secring = secring;
+    return snap;
+}
+
+rnp_key_snapshot_t *
+rnp_key_snapshot_ref(rnp_key_snapshot_t *snap)
+{
+    atomic_fetch_add(&snap->refs, 1);
+    return snap;
+}
+
+void
+rnp_key_snapshot_unref(rnp_key_snapshot_t *snap)
+{
+    if (snap == NULL || atomic_fetch_sub(&snap->refs, 1) != 1) {
+        return;
+    }
+    if (snap->pubring) {
+        rnp_key_store_free(snap->pubring);
+        free(snap->pubring);
+    }
+    if (snap->secring) {
+        rnp_key_store_free(snap->secring);
+        free(snap->secring);
+    }
+    free(snap);
+}
+
+rnp_key_shared_t *
+rnp_key_shared_new(void)
+{
+    rnp_key_shared_t *shared;
+
+    if ((shared = calloc(1, sizeof(*shared))) == NULL) {
+        return NULL;
+    }
+    atomic_flag_clear(&shared->publishing);
+    return shared;
+}
+
+/* only once nobody can be acquiring any more */
+void
+rnp_key_shared_free(rnp_key_shared_t *shared)
+{
+    if (shared) {
+        rnp_key_snapshot_unref(atomic_load(&shared->current));
+        free(shared);
+    }
+}
+
+/* a reference to the current snapshot, or NULL if none was published yet */
+rnp_key_snapshot_t *
+rnp_key_shared_acquire(rnp_key_shared_t *shared)
+{
+    rnp_key_snapshot_t *snap;
+    unsigned            epoch;
+
+    /* announce ourselves under an epoch which is still current afterwards,
+     * so a publisher replacing the snapshot is bound to wait for us */
+    for (;;) {
+        epoch = atomic_load(&shared->epoch);
+        atomic_fetch_add(&shared->readers[epoch & 1], 1);
+        if (atomic_load(&shared->epoch) == epoch) {
+            break;
+        }
+        atomic_fetch_sub(&shared->readers[epoch & 1], 1);
+    }
+    if ((snap = atomic_load(&shared->current)) != NULL) {
+        rnp_key_snapshot_ref(snap);
+    }
+    atomic_fetch_sub(&shared->readers[epoch & 1], 1);
+    return snap;
+}
+
+/* make `snap' current, taking over its reference */
+void
+rnp_key_shared_publish(rnp_key_shared_t *shared, rnp_key_snapshot_t *snap)
+{
+    rnp_key_snapshot_t *old;
+    unsigned            epoch;
+
+    while (atomic_flag_test_and_set(&shared->publishing)) {
+        sched_yield();
+    }
+    old = atomic_exchange(&shared->current, snap);
+    /* anyone who could still be picking up `old' announced themselves
+     * under the epoch we are about to leave */
+    epoch = atomic_fetch_add(&shared->epoch, 1);
+    while (atomic_load(&shared->readers[epoch & 1]) != 0) {
+        sched_yield();
+    }
+    atomic_flag_clear(&shared->publishing);
+    rnp_key_snapshot_unref(old);
 }
 
 /**
@@ -190,9 +471,9 @@ rnp_key_store_free(rnp_key_store_t *keyring)
 int
 rnp_key_store_list(pgp_io_t *io, const rnp_key_store_t *keyring, const int psigs)
 {
-    pgp_key_t *key;
-    unsigned   n;
-    unsigned   keyc = (keyring != NULL) ? keyring->keyc : 0;
+    const pgp_key_t *key;
+    unsigned         n;
+    unsigned         keyc = (keyring != NULL) ? keyring->keyc : 0;
 
     (void) fprintf(io->res, "%u key%s\n", keyc, (keyc == 1) ? "" : "s");
 
@@ -200,7 +481,10 @@ rnp_key_store_list(pgp_io_t *io, const rnp_key_store_t *keyring, const int psigs
         return 1;
     }
 
-    for (n = 0, key = keyring->keys; n < keyring->keyc; ++n, ++key) {
+    for (n = 0; n < keyring->keyc; ++n) {
+        if ((key = rnp_key_store_get_key(io, keyring, n)) == NULL) {
+            continue;
+        }
         if (pgp_is_key_secret(key)) {
             pgp_print_keydata(io, keyring, key, "sec", &key->key.seckey.pubkey, 0);
         } else {
@@ -217,9 +501,12 @@ rnp_key_store_json(pgp_io_t *             io,
                    json_object *          obj,
                    const int              psigs)
 {
-    pgp_key_t *key;
-    unsigned   n;
-    for (n = 0, key = keyring->keys; n < keyring->keyc; ++n, ++key) {
+    const pgp_key_t *key;
+    unsigned         n;
+    for (n = 0; n < keyring->keyc; ++n) {
+        if ((key = rnp_key_store_get_key(io, keyring, n)) == NULL) {
+            continue;
+        }
         json_object *jso = json_object_new_object();
         if (pgp_is_key_secret(key)) {
             pgp_sprint_json(io, keyring, key, jso, "sec", &key->key.seckey.pubkey, psigs);
@@ -231,21 +518,419 @@ rnp_key_store_json(pgp_io_t *             io,
     return 1;
 }
 
-/* append one keyring to another */
+/* hand the keybox images that newring's blobs point into over to keyring */
+static void
+move_images(rnp_key_store_t *keyring, rnp_key_store_t *newring)
+{
+    unsigned i;
+
+    for (i = 0; i < newring->imagec; i++) {
+        EXPAND_ARRAY(keyring, image);
+        if (keyring->imagec < keyring->imagevsize) {
+            keyring->images[keyring->imagec++] = newring->images[i];
+            newring->images[i] = NULL;
+        }
+    }
+}
+
+/*
+ * append one keyring to another as it is, duplicates and all, so that a
+ * keyring read in parts ends up the same as one read in one go
+ */
 int
-rnp_key_store_append_keyring(rnp_key_store_t *keyring, rnp_key_store_t *newring)
+rnp_key_store_concat_keyring(rnp_key_store_t *keyring, rnp_key_store_t *newring)
 {
     unsigned i;
 
+    unsigned from = keyring->keyc;
+
     for (i = 0; i < newring->keyc; i++) {
         EXPAND_ARRAY(keyring, key);
         (void) memcpy(
           &keyring->keys[keyring->keyc], &newring->keys[i], sizeof(newring->keys[i]));
+        (void) memset(&newring->keys[i], 0x0, sizeof(newring->keys[i]));
         keyring->keyc += 1;
     }
+    /* keys read from keybox blob headers bring their blobs along */
+    while (newring->blobc > 0 && keyring->blobc < keyring->keyc) {
+        EXPAND_ARRAY(keyring, blob);
+        if (keyring->blobc == keyring->blobvsize) {
+            break;
+        }
+        i = keyring->blobc;
+        if (i >= from && i - from < newring->blobc) {
+            keyring->blobs[i] = newring->blobs[i - from];
+        } else {
+            atomic_init(&keyring->blobs[i].state, PGP_KBX_BLOB_PARSED);
+        }
+        keyring->blobc += 1;
+    }
+    move_images(keyring, newring);
+    rnp_key_store_index(keyring, from);
     return 1;
 }
 
+/* the key in keyring with the same fingerprint as key, if any */
+static pgp_key_t *
+find_fingerprint(pgp_io_t *io, const rnp_key_store_t *keyring, const pgp_key_t *key)
+{
+    const pgp_key_t *found;
+    unsigned         from;
+
+    for (from = 0;
+         (found = rnp_key_store_get_key_by_id(io, keyring, key->sigid, &from, NULL)) != NULL;
+         from++) {
+        if (found->sigfingerprint.length == key->sigfingerprint.length &&
+            memcmp(found->sigfingerprint.fingerprint,
+                   key->sigfingerprint.fingerprint,
+                   key->sigfingerprint.length) == 0) {
+            return &keyring->keys[from];
+        }
+    }
+    return NULL;
+}
+
+/* the user id in key that uid, one of dup's, is; uids maps the two */
+static uint32_t
+merged_uid(const pgp_key_t *dup, const uint32_t *uids, uint32_t uid)
+{
+    return (uid < dup->uidc) ? uids[uid] : uid;
+}
+
+static int
+same_subsig(const pgp_subsig_t *a, const pgp_subsig_t *b, uint32_t uid)
+{
+    return a->uid == uid && a->sig.info.type == b->sig.info.type &&
+           a->sig.info.birthtime == b->sig.info.birthtime &&
+           a->sig.info.v4_hashlen == b->sig.info.v4_hashlen &&
+           memcmp(a->sig.info.signer_id, b->sig.info.signer_id, PGP_KEY_ID_SIZE) == 0;
+}
+
+/* merge dup's user ids into key, filling in where each of them is in key */
+static int
+merge_uids(pgp_key_t *key, pgp_key_t *dup, uint32_t *uids, int *changed)
+{
+    unsigned i;
+    unsigned j;
+
+    for (i = 0; i < dup->uidc; i++) {
+        for (j = 0; j < key->uidc; j++) {
+            if (strcmp((char *) key->uids[j], (char *) dup->uids[i]) == 0) {
+                break;
+            }
+        }
+        if (j == key->uidc) {
+            EXPAND_ARRAY(key, uid);
+            if (key->uidc == key->uidvsize) {
+                return 0;
+            }
+            key->uids[key->uidc++] = dup->uids[i];
+            dup->uids[i] = NULL;
+            *changed = 1;
+        }
+        uids[i] = j;
+    }
+    return 1;
+}
+
+/* whether a raw packet starts a group of packets within a keyblock */
+static int
+group_start(const pgp_subpacket_t *packet)
+{
+    switch (pgp_subpacket_tag(packet)) {
+    case PGP_PTAG_CT_PUBLIC_KEY:
+    case PGP_PTAG_CT_SECRET_KEY:
+    case PGP_PTAG_CT_USER_ID:
+    case PGP_PTAG_CT_USER_ATTR:
+    case PGP_PTAG_CT_PUBLIC_SUBKEY:
+    case PGP_PTAG_CT_SECRET_SUBKEY:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* whether two raw packets are the same, whatever their headers */
+static int
+same_packet(const pgp_subpacket_t *a, const pgp_subpacket_t *b)
+{
+    const uint8_t *abody;
+    const uint8_t *bbody;
+    size_t         alen;
+    size_t         blen;
+
+    if ((abody = pgp_subpacket_body(a, &alen)) == NULL ||
+        (bbody = pgp_subpacket_body(b, &blen)) == NULL) {
+        return a->length == b->length && memcmp(a->raw, b->raw, a->length) == 0;
+    }
+    return pgp_subpacket_tag(a) == pgp_subpacket_tag(b) && alen == blen &&
+           memcmp(abody, bbody, alen) == 0;
+}
+
+/* the index of the raw packet in key the same as packet, or key->packetc */
+static unsigned
+find_packet(const pgp_key_t *key, const pgp_subpacket_t *packet)
+{
+    unsigned j;
+
+    for (j = 0; j < key->packetc; j++) {
+        if (same_packet(&key->packets[j], packet)) {
+            break;
+        }
+    }
+    return j;
+}
+
+/*
+ * where in key to put the i'th of dup's raw packets, which key lacks, so
+ * that the keyblock stays in order: a signature goes at the end of the
+ * group of packets of the key, user id or subkey it follows in dup, and a
+ * user id after the other user ids. A key made here keeps only its
+ * signatures, and those just go at the end.
+ */
+static unsigned
+packet_place(const pgp_key_t *key, const pgp_key_t *dup, unsigned i)
+{
+    unsigned tag;
+    unsigned j;
+    unsigned h;
+
+    if (key->packetc == 0 || !group_start(&key->packets[0])) {
+        return key->packetc;
+    }
+    tag = pgp_subpacket_tag(&dup->packets[i]);
+    if (tag == PGP_PTAG_CT_PUBLIC_SUBKEY || tag == PGP_PTAG_CT_SECRET_SUBKEY) {
+        return key->packetc;
+    }
+    if (tag == PGP_PTAG_CT_USER_ID || tag == PGP_PTAG_CT_USER_ATTR) {
+        for (j = 1; j < key->packetc; j++) {
+            tag = pgp_subpacket_tag(&key->packets[j]);
+            if (tag == PGP_PTAG_CT_PUBLIC_SUBKEY || tag == PGP_PTAG_CT_SECRET_SUBKEY) {
+                break;
+            }
+        }
+        return j;
+    }
+    h = i;
+    while (h > 0 && !group_start(&dup->packets[h])) {
+        h--;
+    }
+    /* the group was merged before its signatures, so it is in key */
+    if ((j = find_packet(key, &dup->packets[h])) == key->packetc) {
+        return key->packetc;
+    }
+    j += 1;
+    while (j < key->packetc && !group_start(&key->packets[j])) {
+        j++;
+    }
+    return j;
+}
+
+/* merge dup's raw packets and certifications into key */
+static int
+merge_sigs(pgp_key_t *key, pgp_key_t *dup, const uint32_t *uids, int *changed)
+{
+    pgp_subsig_t *subsig;
+    unsigned      i;
+    unsigned      j;
+
+    for (i = 0; i < dup->packetc; i++) {
+        if (find_packet(key, &dup->packets[i]) < key->packetc) {
+            continue;
+        }
+        j = packet_place(key, dup, i);
+        EXPAND_ARRAY(key, packet);
+        if (key->packetc == key->packetvsize) {
+            return 0;
+        }
+        (void) memmove(&key->packets[j + 1],
+                       &key->packets[j],
+                       (key->packetc - j) * sizeof(key->packets[j]));
+        key->packets[j] = dup->packets[i];
+        key->packetc += 1;
+        (void) memset(&dup->packets[i], 0x0, sizeof(dup->packets[i]));
+        *changed = 1;
+    }
+    for (i = 0; i < dup->subsigc; i++) {
+        subsig = &dup->subsigs[i];
+        for (j = 0; j < key->subsigc; j++) {
+            if (same_subsig(&key->subsigs[j], subsig, merged_uid(dup, uids, subsig->uid))) {
+                break;
+            }
+        }
+        if (j == key->subsigc) {
+            EXPAND_ARRAY(key, subsig);
+            if (key->subsigc == key->subsigvsize) {
+                return 0;
+            }
+            key->subsigs[key->subsigc] = *subsig;
+            key->subsigs[key->subsigc++].uid = merged_uid(dup, uids, subsig->uid);
+            (void) memset(subsig, 0x0, sizeof(*subsig));
+            *changed = 1;
+        }
+    }
+    return 1;
+}
+
+/* merge dup's revocations, of the key and of its user ids, into key */
+static int
+merge_revokes(pgp_key_t *key, pgp_key_t *dup, const uint32_t *uids, int *changed)
+{
+    pgp_revoke_t *revoke;
+    unsigned      i;
+    unsigned      j;
+
+    if (dup->revoked && !key->revoked) {
+        key->revoked = dup->revoked;
+        key->revocation = dup->revocation;
+        dup->revocation.reason = NULL;
+        *changed = 1;
+    }
+    for (i = 0; i < dup->revokec; i++) {
+        revoke = &dup->revokes[i];
+        for (j = 0; j < key->revokec; j++) {
+            if (key->revokes[j].uid == merged_uid(dup, uids, revoke->uid) &&
+                key->revokes[j].code == revoke->code) {
+                break;
+            }
+        }
+        if (j == key->revokec) {
+            EXPAND_ARRAY(key, revoke);
+            if (key->revokec == key->revokevsize) {
+                return 0;
+            }
+            key->revokes[key->revokec] = *revoke;
+            key->revokes[key->revokec++].uid = merged_uid(dup, uids, revoke->uid);
+            revoke->reason = NULL;
+            *changed = 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * give the n'th key of keyring whatever dup, a copy of it, has and it
+ * lacks, taking it from dup. There is room for one encryption subkey, so
+ * dup's is only taken if the key has none.
+ */
+static int
+merge_key(rnp_key_store_t *keyring, unsigned n, pgp_key_t *dup)
+{
+    pgp_key_t *key;
+    uint32_t * uids; /* where each of dup's user ids is in key */
+    int        changed;
+    int        encid;
+    int        ok;
+
+    key = &keyring->keys[n];
+    /* a public key takes only the public part of a secret copy */
+    if (!pgp_is_key_secret(key) && pgp_is_key_secret(dup) && !pgp_key_make_public(dup)) {
+        return 0;
+    }
+    if ((uids = calloc(dup->uidc + 1, sizeof(*uids))) == NULL) {
+        return 0;
+    }
+    changed = encid = 0;
+    ok = merge_uids(key, dup, uids, &changed) && merge_sigs(key, dup, uids, &changed) &&
+         merge_revokes(key, dup, uids, &changed);
+    free(uids);
+    if (memcmp(key->encid, nullid, sizeof(nullid)) == 0 &&
+        memcmp(dup->encid, nullid, sizeof(nullid)) != 0) {
+        (void) memcpy(key->encid, dup->encid, sizeof(key->encid));
+        key->enckey = dup->enckey;
+        key->encfingerprint = dup->encfingerprint;
+        (void) memset(&dup->enckey, 0x0, sizeof(dup->enckey));
+        changed = encid = 1;
+    }
+    if (!changed) {
+        return ok;
+    }
+    /* a changed key is written out again, rather than as its blob */
+    if (n < keyring->blobc) {
+        keyring->blobs[n].data = NULL;
+        atomic_store(&keyring->blobs[n].state, PGP_KBX_BLOB_PARSED);
+    }
+    if (n < keyring->hotc) {
+        fill_hot(&keyring->hots[n], key);
+        if (encid && keyring->ids != NULL && (keyring->idc + 1) * 2 <= keyring->idsize) {
+            add_id(keyring, key->encid, n);
+        } else if (encid) {
+            index_ids(keyring, keyring->hotc, 1);
+        }
+    }
+    return ok;
+}
+
+/* give the keyring's last key this blob, and any keys before it none */
+static void
+add_blob(rnp_key_store_t *keyring, const pgp_kbx_blob_t *blob)
+{
+    while (keyring->blobc < keyring->keyc) {
+        EXPAND_ARRAY(keyring, blob);
+        if (keyring->blobc == keyring->blobvsize) {
+            return;
+        }
+        if (keyring->blobc + 1 == keyring->keyc) {
+            keyring->blobs[keyring->blobc] = *blob;
+        } else {
+            atomic_init(&keyring->blobs[keyring->blobc].state, PGP_KBX_BLOB_PARSED);
+        }
+        keyring->blobc += 1;
+    }
+}
+
+/**
+   \ingroup HighLevel_KeyringRead
+
+   \brief Appends one keyring to another, merging keys by fingerprint
+
+   \param keyring Keyring to append to
+   \param newring Keyring whose keys are taken
+
+   \return 1 if OK; 0 if a key could not be read or merged
+
+   \note A key whose fingerprint is already in keyring, or earlier in
+   newring, is merged into the first copy. That gains the user ids,
+   certifications and revocations it lacked, and the encryption subkey if
+   it had none. Other keys are appended in order. Copies are found through
+   the key id index, so this takes time in proportion to newring's size.
+*/
+int
+rnp_key_store_append_keyring(pgp_io_t *io, rnp_key_store_t *keyring, rnp_key_store_t *newring)
+{
+    pgp_key_t *key;
+    pgp_key_t *dup;
+    unsigned   i;
+    int        ok;
+
+    ok = 1;
+    for (i = 0; i < newring->keyc; i++) {
+        dup = &newring->keys[i];
+        if ((key = find_fingerprint(io, keyring, dup)) != NULL) {
+            ok = rnp_key_store_get_key(io, newring, i) != NULL &&
+                 merge_key(keyring, (unsigned) (key - keyring->keys), dup) && ok;
+            /* whatever the key already had is left in dup */
+            pgp_key_free(dup);
+            (void) memset(dup, 0x0, sizeof(*dup));
+            continue;
+        }
+        EXPAND_ARRAY(keyring, key);
+        if (keyring->keyc == keyring->keyvsize) {
+            ok = 0;
+            break;
+        }
+        keyring->keys[keyring->keyc++] = *dup;
+        (void) memset(dup, 0x0, sizeof(*dup));
+        /* keys read from keybox blob headers bring their blobs along */
+        if (i < newring->blobc) {
+            add_blob(keyring, &newring->blobs[i]);
+        }
+        rnp_key_store_index(keyring, keyring->keyc - 1);
+    }
+    move_images(keyring, newring);
+    return ok;
+}
+
 /* add a key to keyring */
 int
 rnp_key_store_add_key(pgp_io_t *       io,
@@ -263,6 +948,7 @@ rnp_key_store_add_key(pgp_io_t *       io,
     newkey = &keyring->keys[keyring->keyc++];
     (void) memcpy(newkey, key, sizeof(pgp_key_t));
     newkey->type = tag;
+    rnp_key_store_index(keyring, keyring->keyc - 1);
 
     if (rnp_get_debug(__FILE__)) {
         fprintf(io->errs, "rnp_key_store_add_key: keyc %u\n", keyring->keyc);
@@ -296,9 +982,11 @@ rnp_key_store_add_keydata(pgp_io_t *         io,
         // TODO: move to the right way — support multiple subkeys
         key = &keyring->keys[keyring->keyc - 1];
         pgp_keyid(key->encid, PGP_KEY_ID_SIZE, &keydata->pubkey, keyring->hashtype);
+        pgp_pubkey_free(&key->enckey);
         (void) memcpy(&key->enckey, &keydata->pubkey, sizeof(key->enckey));
         key->enckey.duration = key->key.pubkey.duration;
     }
+    rnp_key_store_index(keyring, keyring->keyc - 1);
 
     if (rnp_get_debug(__FILE__)) {
         fprintf(io->errs, "rnp_key_store_add_keydata: keyc %u\n", keyring->keyc);
@@ -318,6 +1006,13 @@ rnp_key_store_remove_key(pgp_io_t *io, rnp_key_store_t *keyring, const pgp_key_t
                     &keyring->keys[i + 1],
                     sizeof(pgp_key_t) * (keyring->keyc - i));
             keyring->keyc--;
+            if (i < keyring->blobc) {
+                memmove(&keyring->blobs[i],
+                        &keyring->blobs[i + 1],
+                        sizeof(pgp_kbx_blob_t) * (keyring->blobc - i - 1));
+                keyring->blobc--;
+            }
+            rnp_key_store_index(keyring, i);
             return 1;
         }
     }
@@ -341,6 +1036,76 @@ rnp_key_store_remove_key_by_id(pgp_io_t *io, rnp_key_store_t *keyring, const uin
     return 0;
 }
 
+/* the n'th key, if either of its ids is keyid or ends with its first half */
+static const pgp_key_t *
+match_key(pgp_io_t *             io,
+          const rnp_key_store_t *keyring,
+          const uint8_t *        keyid,
+          unsigned               n,
+          int                    indexed,
+          pgp_pubkey_t **        pubkey)
+{
+    const uint8_t *sigid;
+    const uint8_t *encid;
+
+    /* keys still in a keybox are filled in when parsed, maybe by another
+     * thread right now, so without the index only a parsed key is looked at */
+    if (!indexed && rnp_key_store_get_key(io, keyring, n) == NULL) {
+        return NULL;
+    }
+    sigid = indexed ? keyring->hots[n].sigid : keyring->keys[n].sigid;
+    encid = indexed ? keyring->hots[n].encid : keyring->keys[n].encid;
+    if (rnp_get_debug(__FILE__)) {
+        hexdump(io->errs, "keyring keyid", sigid, PGP_KEY_ID_SIZE);
+        hexdump(io->errs, "keyid", keyid, PGP_KEY_ID_SIZE);
+    }
+    if (memcmp(sigid, keyid, PGP_KEY_ID_SIZE) == 0 ||
+        memcmp(&sigid[PGP_KEY_ID_SIZE / 2], keyid, PGP_KEY_ID_SIZE / 2) == 0) {
+        if (rnp_key_store_get_key(io, keyring, n) == NULL) {
+            return NULL;
+        }
+        if (pubkey) {
+            *pubkey = &keyring->keys[n].key.pubkey;
+        }
+        return &keyring->keys[n];
+    }
+    if (indexed ? !(keyring->hots[n].flags & PGP_KEY_HOT_ENCID) :
+                  memcmp(encid, nullid, sizeof(nullid)) == 0) {
+        return NULL;
+    }
+    if (memcmp(encid, keyid, PGP_KEY_ID_SIZE) == 0 ||
+        memcmp(&encid[PGP_KEY_ID_SIZE / 2], keyid, PGP_KEY_ID_SIZE / 2) == 0) {
+        if (rnp_key_store_get_key(io, keyring, n) == NULL) {
+            return NULL;
+        }
+        if (pubkey) {
+            *pubkey = &keyring->keys[n].enckey;
+        }
+        return &keyring->keys[n];
+    }
+    return NULL;
+}
+
+/* the first key from `from' on which the id table has under this low half */
+static unsigned
+next_id(const rnp_key_store_t *keyring, const uint8_t *half, unsigned from)
+{
+    unsigned slot;
+    unsigned next;
+    unsigned n;
+
+    next = keyring->keyc;
+    slot = id_slot(keyring, half);
+    while (keyring->ids[slot] != 0) {
+        n = keyring->ids[slot] - 1;
+        if (n >= from && n < next) {
+            next = n;
+        }
+        slot = (slot + 1) & (keyring->idsize - 1);
+    }
+    return next;
+}
+
 /**
    \ingroup HighLevel_KeyringFind
 
@@ -354,6 +1119,8 @@ rnp_key_store_remove_key_by_id(pgp_io_t *io, rnp_key_store_t *keyring, const uin
    \note This returns a pointer to the key inside the given keyring,
    not a copy.  Do not free it after use.
 
+   \note Once the keyring is indexed only the keys filed under either
+   half of keyid are looked at.
 */
 const pgp_key_t *
 rnp_key_store_get_key_by_id(pgp_io_t *             io,
@@ -362,34 +1129,33 @@ rnp_key_store_get_key_by_id(pgp_io_t *             io,
                             unsigned *             from,
                             pgp_pubkey_t **        pubkey)
 {
-    uint8_t nullid[PGP_KEY_ID_SIZE];
+    const pgp_key_t *key;
+    unsigned         full;
+    unsigned         half;
+    int              indexed;
 
-    (void) memset(nullid, 0x0, sizeof(nullid));
-    for (; keyring && *from < keyring->keyc; *from += 1) {
-        if (rnp_get_debug(__FILE__)) {
-            hexdump(io->errs, "keyring keyid", keyring->keys[*from].sigid, PGP_KEY_ID_SIZE);
-            hexdump(io->errs, "keyid", keyid, PGP_KEY_ID_SIZE);
-        }
-        if (memcmp(keyring->keys[*from].sigid, keyid, PGP_KEY_ID_SIZE) == 0 ||
-            memcmp(&keyring->keys[*from].sigid[PGP_KEY_ID_SIZE / 2],
-                   keyid,
-                   PGP_KEY_ID_SIZE / 2) == 0) {
-            if (pubkey) {
-                *pubkey = &keyring->keys[*from].key.pubkey;
+    if (keyring == NULL) {
+        return NULL;
+    }
+    /* the ids are read from the index, unless it is behind */
+    indexed = (keyring->hotc == keyring->keyc);
+    if (indexed && keyring->ids != NULL) {
+        while (*from < keyring->keyc) {
+            full = next_id(keyring, &keyid[PGP_KEY_ID_SIZE / 2], *from);
+            half = next_id(keyring, keyid, *from);
+            if ((*from = (full < half) ? full : half) == keyring->keyc) {
+                break;
             }
-            return &keyring->keys[*from];
-        }
-        if (memcmp(&keyring->keys[*from].encid, nullid, sizeof(nullid)) == 0) {
-            continue;
-        }
-        if (memcmp(&keyring->keys[*from].encid, keyid, PGP_KEY_ID_SIZE) == 0 ||
-            memcmp(&keyring->keys[*from].encid[PGP_KEY_ID_SIZE / 2],
-                   keyid,
-                   PGP_KEY_ID_SIZE / 2) == 0) {
-            if (pubkey) {
-                *pubkey = &keyring->keys[*from].enckey;
+            if ((key = match_key(io, keyring, keyid, *from, indexed, pubkey)) != NULL) {
+                return key;
             }
-            return &keyring->keys[*from];
+            *from += 1;
+        }
+        return NULL;
+    }
+    for (; *from < keyring->keyc; *from += 1) {
+        if ((key = match_key(io, keyring, keyid, *from, indexed, pubkey)) != NULL) {
+            return key;
         }
     }
     return NULL;
@@ -466,7 +1232,19 @@ get_key_by_name(pgp_io_t *io, const rnp_key_store_t *keyring, const char *name,
     }
     /* match on full name or email address as a NOSUB, ICASE regexp */
     (void) regcomp(&r, name, REG_EXTENDED | REG_ICASE);
-    for (keyp = &keyring->keys[*from]; *from < keyring->keyc; *from += 1, keyp++) {
+    for (; *from < keyring->keyc; *from += 1) {
+        /* keys still in a keybox are matched on the user ids in its
+         * blob header, and only parsed when one of them matches */
+        if (*from < keyring->blobc &&
+            atomic_load(&keyring->blobs[*from].state) != PGP_KBX_BLOB_PARSED) {
+            if (rnp_key_store_kbx_match_name(keyring, *from, &r) &&
+                (kp = rnp_key_store_get_key(io, keyring, *from)) != NULL) {
+                regfree(&r);
+                return kp;
+            }
+            continue;
+        }
+        keyp = &keyring->keys[*from];
         uidp = keyp->uids;
         for (i = 0; i < keyp->uidc; i++, uidp++) {
             if (regexec(&r, (char *) *uidp, 0, NULL, 0) == 0) {
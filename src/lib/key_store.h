@@ -34,27 +34,104 @@
 #include <rnp.h>
 #include <json.h>
 
+#include <sys/types.h>
+
+#include <stdatomic.h>
 #include <stdint.h>
 
 #include "packet.h"
 #include "memory.h"
 
+#define PGP_KEY_HOT_ENCID 0x01 /* has an encryption subkey */
+
+/*
+ * what key lookups look at, packed densely apart from the keys themselves.
+ * This is an index kept alongside keys[], not a split of pgp_key_t, which
+ * is unchanged: each key costs its 17 byte entry plus 16 to 32 bytes of ids
+ * slots more than it did, so that a lookup by id reads no pgp_key_t but the
+ * one it finds.
+ */
+typedef struct pgp_key_hot_t {
+    uint8_t sigid[PGP_KEY_ID_SIZE];
+    uint8_t encid[PGP_KEY_ID_SIZE];
+    uint8_t flags;
+} pgp_key_hot_t;
+
+#define PGP_KBX_BLOB_HEADER 0  /* only ids and fingerprint are filled in */
+#define PGP_KBX_BLOB_PARSING 1 /* being parsed by some thread */
+#define PGP_KBX_BLOB_PARSED 2  /* the key is complete */
+#define PGP_KBX_BLOB_FAILED 3  /* the keyblock could not be used */
+
+/* a key read from a keybox, which is parsed the first time it is looked at */
+typedef struct pgp_kbx_blob_t {
+    atomic_int     state; /* PGP_KBX_BLOB_* */
+    const uint8_t *data;  /* the blob, within one of the keyring's images */
+    size_t         len;
+} pgp_kbx_blob_t;
+
 typedef struct rnp_key_store_t {
     DYNARRAY(pgp_key_t, key);
+    DYNARRAY(pgp_key_hot_t, hot);    /* hots[i] describes keys[i] */
+    DYNARRAY(pgp_kbx_blob_t, blob);  /* blobs[i] holds keys[i], if read from a keybox */
+    DYNARRAY(pgp_memory_t *, image); /* keybox files the blobs point into */
+    uint32_t *     ids;    /* hots index + 1 by the low half of sigid and encid */
+    unsigned       idsize; /* slots in ids, a power of two */
+    unsigned       idc;    /* slots in use */
     pgp_hash_alg_t hashtype;
+    dev_t          dev;  /* the file the keyring was loaded from, */
+    ino_t          ino;  /* as it was when it was read */
+    off_t          size; /* and how much of it the keyring holds */
 } rnp_key_store_t;
 
+/* A pair of keyrings which is never modified once built, so that any
+ * number of threads can read it. It is freed with its last reference.
+ */
+typedef struct rnp_key_snapshot_t {
+    atomic_uint      refs;
+    rnp_key_store_t *pubring;
+    rnp_key_store_t *secring;
+} rnp_key_snapshot_t;
+
+/* The current snapshot of a set of keyrings that gets reloaded while in
+ * use. Readers take a reference without locking; publishing a new
+ * snapshot only waits for readers that are in the middle of taking one.
+ */
+typedef struct rnp_key_shared_t {
+    _Atomic(rnp_key_snapshot_t *) current;
+    atomic_uint                   epoch;
+    atomic_uint                   readers[2]; /* taking a reference, by epoch */
+    atomic_flag                   publishing;
+} rnp_key_shared_t;
+
 int rnp_key_store_load_keys(rnp_t *rnp, char *homedir);
 
 int rnp_key_store_load_from_file(rnp_t *rnp, rnp_key_store_t *, const unsigned, const char *);
 int rnp_key_store_load_from_mem(rnp_t *rnp, rnp_key_store_t *, const unsigned, pgp_memory_t *);
+void rnp_key_store_note_file(rnp_key_store_t *, int, off_t);
 
 void rnp_key_store_free(rnp_key_store_t *);
+void rnp_key_store_index(rnp_key_store_t *, unsigned);
+
+const pgp_key_t *rnp_key_store_get_key(pgp_io_t *, const rnp_key_store_t *, unsigned);
+
+int  rnp_key_store_watch(rnp_t *);
+int  rnp_key_store_update(rnp_t *, int *);
+void rnp_key_store_unwatch(rnp_t *);
+
+rnp_key_snapshot_t *rnp_key_snapshot_new(rnp_key_store_t *, rnp_key_store_t *);
+rnp_key_snapshot_t *rnp_key_snapshot_ref(rnp_key_snapshot_t *);
+void                rnp_key_snapshot_unref(rnp_key_snapshot_t *);
+
+rnp_key_shared_t *  rnp_key_shared_new(void);
+void                rnp_key_shared_free(rnp_key_shared_t *);
+rnp_key_snapshot_t *rnp_key_shared_acquire(rnp_key_shared_t *);
+void                rnp_key_shared_publish(rnp_key_shared_t *, rnp_key_snapshot_t *);
 
 int rnp_key_store_list(pgp_io_t *, const rnp_key_store_t *, const int);
 int rnp_key_store_json(pgp_io_t *, const rnp_key_store_t *, json_object *, const int);
 
-int rnp_key_store_append_keyring(rnp_key_store_t *, rnp_key_store_t *);
+int rnp_key_store_concat_keyring(rnp_key_store_t *, rnp_key_store_t *);
+int rnp_key_store_append_keyring(pgp_io_t *, rnp_key_store_t *, rnp_key_store_t *);
 
 int rnp_key_store_add_key(pgp_io_t *, rnp_key_store_t *, pgp_key_t *, pgp_content_enum);
 int rnp_key_store_add_keydata(pgp_io_t *,
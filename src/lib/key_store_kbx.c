@@ -0,0 +1,715 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* GnuPG keybox (pubring.kbx) keyrings.
+ *
+ * Each OpenPGP blob in a keybox starts with a table of the fingerprints
+ * and key ids of its keys and the offsets of its user ids, followed by
+ * the keyblock itself. Reading a keybox only goes through those tables:
+ * the keys are filled in with their ids and fingerprint, and the
+ * keyblock is parsed when a lookup first returns the key.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <regex.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "key_store_kbx.h"
+#include "key_store_pgp.h"
+#include "create.h"
+#include "readerwriter.h"
+#include "rnpdefs.h"
+#include "rnpsdk.h"
+
+#define KBX_HEADER_BLOB 1
+#define KBX_OPENPGP_BLOB 2
+#define KBX_HEADER_LEN 32
+#define KBX_FPR_LEN 20
+#define KBX_KEYINFO_LEN 28
+#define KBX_UIDINFO_LEN 12
+#define KBX_SIGINFO_LEN 4
+#define KBX_CHECKSUM_LEN 20
+
+/* where things are in an OpenPGP blob */
+typedef struct kbx_blob_info_t {
+    const uint8_t *keys; /* key information, nkeys * keyinfolen bytes */
+    unsigned       nkeys;
+    unsigned       keyinfolen;
+    const uint8_t *uids; /* user id information, nuids * uidinfolen bytes */
+    unsigned       nuids;
+    unsigned       uidinfolen;
+    const uint8_t *keyblock;
+    size_t         keyblocklen;
+} kbx_blob_info_t;
+
+static unsigned
+get16(const uint8_t *p)
+{
+    return ((unsigned) p[0] << 8) | p[1];
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void
+put_int(pgp_memory_t *mem, uint32_t n, size_t len)
+{
+    uint8_t buf[4];
+    size_t  i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (uint8_t)(n >> ((len - 1 - i) * 8));
+    }
+    pgp_memory_add(mem, buf, len);
+}
+
+/* a keybox starts with a header blob, or with an OpenPGP blob if it is
+ * the part of one appended since it was last read */
+static int
+is_keybox(const uint8_t *buf, size_t len)
+{
+    return len >= 6 && !(buf[0] & PGP_PTAG_ALWAYS_SET) &&
+           (buf[4] == KBX_HEADER_BLOB || buf[4] == KBX_OPENPGP_BLOB) && buf[5] == 1;
+}
+
+/* find the tables of an OpenPGP blob, making sure they lie within it */
+static int
+blob_info(const uint8_t *blob, size_t len, kbx_blob_info_t *info)
+{
+    size_t off;
+    size_t kboff;
+    size_t kblen;
+    size_t serial;
+
+    if (len < 20 + KBX_CHECKSUM_LEN || blob[4] != KBX_OPENPGP_BLOB || blob[5] != 1) {
+        return 0;
+    }
+    kboff = get32(&blob[8]);
+    kblen = get32(&blob[12]);
+    info->nkeys = get16(&blob[16]);
+    info->keyinfolen = get16(&blob[18]);
+    if (kboff > len || kblen > len - kboff || info->nkeys == 0 ||
+        info->keyinfolen < KBX_KEYINFO_LEN) {
+        return 0;
+    }
+    off = 20;
+    if ((size_t) info->nkeys * info->keyinfolen > len - off) {
+        return 0;
+    }
+    info->keys = &blob[off];
+    off += (size_t) info->nkeys * info->keyinfolen;
+    if (len - off < 2 || (serial = get16(&blob[off])) > len - off - 2) {
+        return 0;
+    }
+    off += 2 + serial;
+    if (len - off < 4) {
+        return 0;
+    }
+    info->nuids = get16(&blob[off]);
+    info->uidinfolen = get16(&blob[off + 2]);
+    off += 4;
+    if ((info->nuids && info->uidinfolen < KBX_UIDINFO_LEN) ||
+        (size_t) info->nuids * info->uidinfolen > len - off) {
+        return 0;
+    }
+    info->uids = &blob[off];
+    info->keyblock = &blob[kboff];
+    info->keyblocklen = kblen;
+    return 1;
+}
+
+/* the key id of the n'th key in a blob */
+static void
+blob_keyid(const uint8_t *        blob,
+           size_t                 len,
+           const kbx_blob_info_t *info,
+           unsigned               n,
+           uint8_t *              id)
+{
+    const uint8_t *keyinfo = &info->keys[(size_t) n * info->keyinfolen];
+    uint32_t       off = get32(&keyinfo[KBX_FPR_LEN]);
+
+    if (off != 0 && off <= len - PGP_KEY_ID_SIZE) {
+        (void) memcpy(id, &blob[off], PGP_KEY_ID_SIZE);
+    } else {
+        /* the low bytes of a v4 fingerprint */
+        (void) memcpy(id, &keyinfo[KBX_FPR_LEN - PGP_KEY_ID_SIZE], PGP_KEY_ID_SIZE);
+    }
+}
+
+/* give the keys that did not come from a keybox blob entries, as parsed */
+static int
+pad_blobs(rnp_key_store_t *keyring)
+{
+    while (keyring->blobc < keyring->keyc) {
+        EXPAND_ARRAY(keyring, blob);
+        if (keyring->blobc == keyring->blobvsize) {
+            return 0;
+        }
+        atomic_init(&keyring->blobs[keyring->blobc++].state, PGP_KBX_BLOB_PARSED);
+    }
+    return 1;
+}
+
+/* add a key for each OpenPGP blob in image, which the keyring takes */
+static int
+read_blobs(pgp_io_t *io, rnp_key_store_t *keyring, pgp_memory_t *image)
+{
+    const uint8_t * buf = image->buf;
+    kbx_blob_info_t info;
+    pgp_kbx_blob_t *blob;
+    pgp_key_t *     key;
+    unsigned        from = keyring->keyc;
+    size_t          bloblen;
+    size_t          off;
+    int             ok = 1;
+
+    EXPAND_ARRAY(keyring, image);
+    if (keyring->imagec == keyring->imagevsize || !pad_blobs(keyring)) {
+        pgp_memory_free(image);
+        return 0;
+    }
+    keyring->images[keyring->imagec++] = image;
+    for (off = 0; off < image->length; off += bloblen) {
+        if (image->length - off < 6 || (bloblen = get32(&buf[off])) < 6 ||
+            bloblen > image->length - off) {
+            (void) fprintf(io->errs, "rnp_key_store_kbx: bad blob at offset %zu\n", off);
+            ok = 0;
+            break;
+        }
+        if (buf[off + 4] != KBX_OPENPGP_BLOB) {
+            /* the header blob, X.509 certificates and deleted keys */
+            continue;
+        }
+        if (!blob_info(&buf[off], bloblen, &info)) {
+            (void) fprintf(io->errs, "rnp_key_store_kbx: bad key blob at offset %zu\n", off);
+            continue;
+        }
+        EXPAND_ARRAY(keyring, key);
+        EXPAND_ARRAY(keyring, blob);
+        if (keyring->keyc == keyring->keyvsize || keyring->blobc == keyring->blobvsize) {
+            ok = 0;
+            break;
+        }
+        key = &keyring->keys[keyring->keyc++];
+        (void) memset(key, 0x0, sizeof(*key));
+        key->type = PGP_PTAG_CT_PUBLIC_KEY;
+        blob_keyid(&buf[off], bloblen, &info, 0, key->sigid);
+        (void) memcpy(key->sigfingerprint.fingerprint, info.keys, KBX_FPR_LEN);
+        key->sigfingerprint.length = KBX_FPR_LEN;
+        key->sigfingerprint.hashtype = PGP_HASH_SHA1;
+        if (info.nkeys > 1) {
+            /* the last subkey is the encryption key, as when keys are parsed */
+            blob_keyid(&buf[off], bloblen, &info, info.nkeys - 1, key->encid);
+        }
+        blob = &keyring->blobs[keyring->blobc++];
+        atomic_init(&blob->state, PGP_KBX_BLOB_HEADER);
+        blob->data = &buf[off];
+        blob->len = bloblen;
+    }
+    rnp_key_store_index(keyring, from);
+    return ok;
+}
+
+/**
+ * \ingroup HighLevel_KeyringRead
+ * \brief Read the blob headers of a keybox file into a keyring
+ *
+ * A file that is not a keybox is read as OpenPGP packets, so that the
+ * secret keyring next to a pubring.kbx can be read the same way.
+ * \return 1 if OK; else 0
+ */
+int
+rnp_key_store_kbx_from_file(pgp_io_t *       io,
+                            rnp_key_store_t *keyring,
+                            const unsigned   armour,
+                            const char *     filename)
+{
+    pgp_memory_t *image;
+    int           fd;
+
+    if (armour) {
+        return rnp_key_store_pgp_read_from_file(io, keyring, armour, filename);
+    }
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        perror(filename);
+        return 0;
+    }
+    if ((image = pgp_memory_new()) == NULL) {
+        (void) fprintf(io->errs, "rnp_key_store_kbx_from_file: bad alloc\n");
+        (void) close(fd);
+        return 0;
+    }
+    if (!pgp_mem_readfd(image, fd)) {
+        pgp_memory_free(image);
+        (void) close(fd);
+        return 0;
+    }
+    if (!is_keybox(image->buf, image->length)) {
+        pgp_memory_free(image);
+        (void) close(fd);
+        return rnp_key_store_pgp_read_from_file(io, keyring, armour, filename);
+    }
+    rnp_key_store_note_file(keyring, fd, (off_t) image->length);
+    (void) close(fd);
+    return read_blobs(io, keyring, image);
+}
+
+/**
+ * \ingroup HighLevel_KeyringRead
+ * \brief Read the blob headers of a keybox in memory into a keyring
+ *
+ * The keyring keeps a copy of the blobs, so mem may be freed after.
+ * \return 1 if OK; else 0
+ */
+int
+rnp_key_store_kbx_from_mem(pgp_io_t *       io,
+                           rnp_key_store_t *keyring,
+                           const unsigned   armour,
+                           pgp_memory_t *   mem)
+{
+    pgp_memory_t *image;
+
+    if (armour || !is_keybox(mem->buf, mem->length)) {
+        return rnp_key_store_pgp_read_from_mem(io, keyring, armour, mem);
+    }
+    if ((image = pgp_memory_new()) == NULL) {
+        (void) fprintf(io->errs, "rnp_key_store_kbx_from_mem: bad alloc\n");
+        return 0;
+    }
+    pgp_memory_add(image, mem->buf, mem->length);
+    return read_blobs(io, keyring, image);
+}
+
+/* a blob ends with a SHA-1 of the rest of it, or MD5 if made by old
+ * versions of GnuPG, or zeros if nobody filled it in */
+static int
+blob_checksum_ok(const uint8_t *blob, size_t len)
+{
+    static const uint8_t zeros[KBX_CHECKSUM_LEN];
+    const uint8_t *      sum = &blob[len - KBX_CHECKSUM_LEN];
+    pgp_hash_t           hash;
+    uint8_t              out[PGP_MAX_HASH_SIZE];
+    size_t               n;
+
+    if (memcmp(sum, zeros, sizeof(zeros)) == 0) {
+        return 1;
+    }
+    if (!pgp_hash_create(&hash, PGP_HASH_SHA1)) {
+        return 0;
+    }
+    pgp_hash_add(&hash, blob, len - KBX_CHECKSUM_LEN);
+    n = pgp_hash_finish(&hash, out);
+    if (n == KBX_CHECKSUM_LEN && memcmp(out, sum, n) == 0) {
+        return 1;
+    }
+    if (memcmp(sum, zeros, 4) != 0 || !pgp_hash_create(&hash, PGP_HASH_MD5)) {
+        return 0;
+    }
+    pgp_hash_add(&hash, blob, len - KBX_CHECKSUM_LEN);
+    n = pgp_hash_finish(&hash, out);
+    return n == KBX_CHECKSUM_LEN - 4 && memcmp(out, &sum[4], n) == 0;
+}
+
+/* parse the keyblock of a blob into `out', checking it against the key
+ * made from the blob's header */
+static int
+parse_blob(pgp_io_t *             io,
+           const rnp_key_store_t *keyring,
+           const pgp_key_t *      key,
+           const pgp_kbx_blob_t * blob,
+           pgp_key_t *            out)
+{
+    kbx_blob_info_t info;
+    rnp_key_store_t parsed;
+    pgp_memory_t    mem;
+    int             ok;
+
+    if (!blob_info(blob->data, blob->len, &info) || !blob_checksum_ok(blob->data, blob->len)) {
+        (void) fprintf(io->errs, "rnp_key_store_kbx: bad checksum on blob\n");
+        return 0;
+    }
+    (void) memset(&parsed, 0x0, sizeof(parsed));
+    parsed.hashtype = keyring->hashtype;
+    (void) memset(&mem, 0x0, sizeof(mem));
+    mem.buf = (uint8_t *) info.keyblock;
+    mem.length = mem.allocated = info.keyblocklen;
+    ok = rnp_key_store_pgp_read_from_mem(io, &parsed, 0, &mem) && parsed.keyc == 1 &&
+         memcmp(parsed.keys[0].sigid, key->sigid, PGP_KEY_ID_SIZE) == 0 &&
+         memcmp(parsed.keys[0].encid, key->encid, PGP_KEY_ID_SIZE) == 0;
+    if (ok) {
+        *out = parsed.keys[0];
+        (void) memset(&parsed.keys[0], 0x0, sizeof(parsed.keys[0]));
+    } else {
+        (void) fprintf(io->errs, "rnp_key_store_kbx: keyblock does not match its blob\n");
+    }
+    rnp_key_store_free(&parsed);
+    return ok;
+}
+
+/**
+ * \ingroup HighLevel_KeyringRead
+ * \brief Parse the n'th key of a keyring, if only its blob header was read
+ *
+ * Keyrings may be shared between threads, so the first caller parses the
+ * key and others wait for it. The key is only written to once parsed, and
+ * must not be looked at before this returns, except through the index.
+ * \return 1 if the key is complete; else 0
+ */
+int
+rnp_key_store_kbx_parse_key(pgp_io_t *io, const rnp_key_store_t *keyring, unsigned n)
+{
+    pgp_kbx_blob_t *blob;
+    pgp_key_t       key;
+    int             state = PGP_KBX_BLOB_HEADER;
+
+    if (n >= keyring->blobc) {
+        return 1;
+    }
+    blob = &keyring->blobs[n];
+    if (!atomic_compare_exchange_strong(&blob->state, &state, PGP_KBX_BLOB_PARSING)) {
+        while (state == PGP_KBX_BLOB_PARSING) {
+            sched_yield();
+            state = atomic_load(&blob->state);
+        }
+        return state == PGP_KBX_BLOB_PARSED;
+    }
+    state = PGP_KBX_BLOB_FAILED;
+    if (parse_blob(io, keyring, &keyring->keys[n], blob, &key)) {
+        keyring->keys[n] = key;
+        state = PGP_KBX_BLOB_PARSED;
+    }
+    atomic_store(&blob->state, state);
+    return state == PGP_KBX_BLOB_PARSED;
+}
+
+/**
+ * \ingroup HighLevel_KeyringFind
+ * \brief Match the user ids in the blob header of the n'th key
+ * \return 1 if one matches; else 0
+ */
+int
+rnp_key_store_kbx_match_name(const rnp_key_store_t *keyring, unsigned n, const regex_t *re)
+{
+    const pgp_kbx_blob_t *blob = &keyring->blobs[n];
+    kbx_blob_info_t       info;
+    const uint8_t *       uidinfo;
+    uint32_t              off;
+    uint32_t              len;
+    char                  uid[1024];
+    unsigned              i;
+
+    if (!blob_info(blob->data, blob->len, &info)) {
+        return 0;
+    }
+    for (i = 0; i < info.nuids; i++) {
+        uidinfo = &info.uids[(size_t) i * info.uidinfolen];
+        off = get32(uidinfo);
+        len = get32(&uidinfo[4]);
+        if (off > blob->len || len > blob->len - off) {
+            continue;
+        }
+        /* longer user ids are cut short, as pgp_print_keydata does */
+        (void) snprintf(uid, sizeof(uid), "%.*s", (int) len, (const char *) &blob->data[off]);
+        if (regexec(re, uid, 0, NULL, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* length of the header of the packet at buf, with its tag and body
+ * length; 0 for partial or indeterminate lengths, which keys do not use */
+static size_t
+packet_header(const uint8_t *buf, size_t len, unsigned *tag, size_t *body)
+{
+    size_t hdr;
+
+    if (len < 2 || !(buf[0] & PGP_PTAG_ALWAYS_SET)) {
+        return 0;
+    }
+    if (buf[0] & PGP_PTAG_NEW_FORMAT) {
+        *tag = buf[0] & PGP_PTAG_NF_CONTENT_TAG_MASK;
+        if (buf[1] < 192) {
+            hdr = 2;
+            *body = buf[1];
+        } else if (buf[1] < 224 && len >= 3) {
+            hdr = 3;
+            *body = ((size_t)(buf[1] - 192) << 8) + buf[2] + 192;
+        } else if (buf[1] == 255 && len >= 6) {
+            hdr = 6;
+            *body = get32(&buf[2]);
+        } else {
+            return 0;
+        }
+    } else {
+        *tag = (buf[0] & PGP_PTAG_OF_CONTENT_TAG_MASK) >> PGP_PTAG_OF_CONTENT_TAG_SHIFT;
+        switch (buf[0] & PGP_PTAG_OF_LENGTH_TYPE_MASK) {
+        case PGP_PTAG_OLD_LEN_1:
+            hdr = 2;
+            *body = buf[1];
+            break;
+        case PGP_PTAG_OLD_LEN_2:
+            if (len < 3) {
+                return 0;
+            }
+            hdr = 3;
+            *body = get16(&buf[1]);
+            break;
+        case PGP_PTAG_OLD_LEN_4:
+            if (len < 5) {
+                return 0;
+            }
+            hdr = 5;
+            *body = get32(&buf[1]);
+            break;
+        default:
+            return 0;
+        }
+    }
+    return (hdr <= len && *body <= len - hdr) ? hdr : 0;
+}
+
+/* append an OpenPGP blob holding a public keyblock */
+static int
+write_blob(pgp_io_t *io, const uint8_t *kb, size_t kblen, pgp_memory_t *out)
+{
+    pgp_fingerprint_t fp;
+    pgp_hash_t        hash;
+    unsigned          nkeys = 0;
+    unsigned          nuids = 0;
+    unsigned          nsigs = 0;
+    unsigned          tag;
+    size_t            start = out->length;
+    size_t            kboff;
+    size_t            body;
+    size_t            hdr;
+    size_t            off;
+
+    for (off = 0; off < kblen; off += hdr + body) {
+        if ((hdr = packet_header(&kb[off], kblen - off, &tag, &body)) == 0) {
+            (void) fprintf(io->errs, "rnp_key_store_kbx: bad keyblock\n");
+            return 0;
+        }
+        if (tag == PGP_PTAG_CT_PUBLIC_KEY || tag == PGP_PTAG_CT_PUBLIC_SUBKEY) {
+            /* v4 only, and one primary key, first */
+            if (body == 0 || kb[off + hdr] != PGP_V4 ||
+                (nkeys == 0) != (tag == PGP_PTAG_CT_PUBLIC_KEY)) {
+                (void) fprintf(io->errs, "rnp_key_store_kbx: only v4 public keys are kept\n");
+                return 0;
+            }
+            nkeys += 1;
+        } else if (tag == PGP_PTAG_CT_USER_ID) {
+            nuids += 1;
+        } else if (tag == PGP_PTAG_CT_SIGNATURE) {
+            nsigs += 1;
+        } else if (tag == PGP_PTAG_CT_SECRET_KEY || tag == PGP_PTAG_CT_SECRET_SUBKEY) {
+            (void) fprintf(io->errs, "rnp_key_store_kbx: only v4 public keys are kept\n");
+            return 0;
+        }
+    }
+    if (nkeys == 0 || nkeys > 0xffff || nuids > 0xffff || nsigs > 0xffff) {
+        (void) fprintf(io->errs, "rnp_key_store_kbx: bad keyblock\n");
+        return 0;
+    }
+    kboff = 20 + (size_t) nkeys * KBX_KEYINFO_LEN + 2 + 4 + (size_t) nuids * KBX_UIDINFO_LEN +
+            4 + (size_t) nsigs * KBX_SIGINFO_LEN + 20;
+
+    put_int(out, (uint32_t)(kboff + kblen + KBX_CHECKSUM_LEN), 4);
+    put_int(out, KBX_OPENPGP_BLOB, 1);
+    put_int(out, 1, 1);
+    put_int(out, 0, 2);
+    put_int(out, (uint32_t) kboff, 4);
+    put_int(out, (uint32_t) kblen, 4);
+    put_int(out, nkeys, 2);
+    put_int(out, KBX_KEYINFO_LEN, 2);
+    for (off = 0; off < kblen; off += hdr + body) {
+        hdr = packet_header(&kb[off], kblen - off, &tag, &body);
+        if (tag == PGP_PTAG_CT_PUBLIC_KEY || tag == PGP_PTAG_CT_PUBLIC_SUBKEY) {
+            if (!pgp_fingerprint_v4(&fp, &kb[off + hdr], (unsigned) body)) {
+                return 0;
+            }
+            pgp_memory_add(out, fp.fingerprint, KBX_FPR_LEN);
+            /* the key id is the end of the fingerprint just written */
+            put_int(out, (uint32_t)(out->length - start - PGP_KEY_ID_SIZE), 4);
+            put_int(out, 0, 2);
+            put_int(out, 0, 2);
+        }
+    }
+    put_int(out, 0, 2); /* no serial number */
+    put_int(out, nuids, 2);
+    put_int(out, KBX_UIDINFO_LEN, 2);
+    for (off = 0; off < kblen; off += hdr + body) {
+        hdr = packet_header(&kb[off], kblen - off, &tag, &body);
+        if (tag == PGP_PTAG_CT_USER_ID) {
+            put_int(out, (uint32_t)(kboff + off + hdr), 4);
+            put_int(out, (uint32_t) body, 4);
+            put_int(out, 0, 2);
+            put_int(out, 0, 1);
+            put_int(out, 0, 1);
+        }
+    }
+    put_int(out, nsigs, 2);
+    put_int(out, KBX_SIGINFO_LEN, 2);
+    for (; nsigs > 0; nsigs--) {
+        put_int(out, 0, 4); /* not checked */
+    }
+    put_int(out, 0, 1); /* ownertrust */
+    put_int(out, 0, 1); /* validity */
+    put_int(out, 0, 2);
+    put_int(out, 0, 4); /* recheck after */
+    put_int(out, 0, 4); /* latest timestamp */
+    put_int(out, (uint32_t) time(NULL), 4);
+    put_int(out, 0, 4); /* no reserved space */
+    pgp_memory_add(out, kb, kblen);
+
+    if (!pgp_hash_create(&hash, PGP_HASH_SHA1)) {
+        return 0;
+    }
+    pgp_hash_add(&hash, &out->buf[start], out->length - start);
+    pgp_memory_pad(out, KBX_CHECKSUM_LEN);
+    out->length += pgp_hash_finish(&hash, &out->buf[out->length]);
+    return 1;
+}
+
+static void
+write_header(pgp_memory_t *out)
+{
+    uint32_t now = (uint32_t) time(NULL);
+
+    put_int(out, KBX_HEADER_LEN, 4);
+    put_int(out, KBX_HEADER_BLOB, 1);
+    put_int(out, 1, 1);
+    put_int(out, 2, 2); /* OpenPGP blobs only */
+    pgp_memory_add(out, (const uint8_t *) "KBXf", 4);
+    put_int(out, 0, 4);
+    put_int(out, 0, 4);
+    put_int(out, now, 4); /* last maintenance run */
+    put_int(out, now, 4); /* created */
+    put_int(out, 0, 4);
+}
+
+/**
+ * \ingroup HighLevel_KeyringWrite
+ * \brief Append the keybox blob for the public part of a key to out
+ * \return 1 if OK; else 0
+ */
+int
+rnp_key_store_kbx_write_key(pgp_io_t *io, const pgp_key_t *key, pgp_memory_t *out)
+{
+    pgp_output_t *output;
+    pgp_memory_t *mem;
+    int           ok;
+
+    pgp_setup_memory_write(&output, &mem, 128);
+    ok = pgp_write_keyblock(output, key) &&
+         write_blob(io, pgp_mem_data(mem), pgp_mem_len(mem), out);
+    pgp_teardown_memory_write(output, mem);
+    return ok;
+}
+
+/**
+ * \ingroup HighLevel_KeyringWrite
+ * \brief Write a keyring out as a keybox
+ *
+ * Keys read from a keybox are written out as the blobs they were read
+ * from, without being parsed.
+ * \return 1 if OK; else 0
+ */
+int
+rnp_key_store_kbx_to_mem(pgp_io_t *io, const rnp_key_store_t *keyring, pgp_memory_t *out)
+{
+    const pgp_kbx_blob_t *blob;
+    unsigned              i;
+
+    write_header(out);
+    for (i = 0; i < keyring->keyc; i++) {
+        blob = (i < keyring->blobc) ? &keyring->blobs[i] : NULL;
+        if (blob != NULL && blob->data != NULL &&
+            atomic_load(&blob->state) != PGP_KBX_BLOB_FAILED) {
+            pgp_memory_add(out, blob->data, blob->len);
+        } else if (!rnp_key_store_kbx_write_key(io, &keyring->keys[i], out)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * \ingroup HighLevel_KeyringWrite
+ * \brief Append a key to a keybox file, which is made if need be
+ * \return 1 if OK; else 0
+ */
+int
+rnp_key_store_kbx_append_key(pgp_io_t *io, const pgp_key_t *key, const char *filename)
+{
+    pgp_memory_t *mem;
+    struct stat   st;
+    ssize_t       n;
+    int           fd;
+
+    if ((fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0600)) < 0) {
+        (void) fprintf(io->errs, "cannot open keybox '%s'\n", filename);
+        return 0;
+    }
+    if ((mem = pgp_memory_new()) == NULL) {
+        (void) close(fd);
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        write_header(mem);
+    }
+    /* one write, so that blobs from processes appending at once do not mix */
+    n = -1;
+    if (rnp_key_store_kbx_write_key(io, key, mem)) {
+        n = write(fd, mem->buf, mem->length);
+    }
+    (void) close(fd);
+    if (n < 0 || (size_t) n != mem->length) {
+        (void) fprintf(io->errs, "cannot write keybox '%s'\n", filename);
+        pgp_memory_free(mem);
+        return 0;
+    }
+    pgp_memory_free(mem);
+    return 1;
+}
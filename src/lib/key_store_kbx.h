@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KEY_STORE_KBX_H_
+#define KEY_STORE_KBX_H_
+
+#include <regex.h>
+
+#include "rnp.h"
+#include "key_store.h"
+
+int rnp_key_store_kbx_from_file(pgp_io_t *, rnp_key_store_t *, const unsigned, const char *);
+int rnp_key_store_kbx_from_mem(pgp_io_t *, rnp_key_store_t *, const unsigned, pgp_memory_t *);
+
+int rnp_key_store_kbx_parse_key(pgp_io_t *, const rnp_key_store_t *, unsigned);
+int rnp_key_store_kbx_match_name(const rnp_key_store_t *, unsigned, const regex_t *);
+
+int rnp_key_store_kbx_write_key(pgp_io_t *, const pgp_key_t *, pgp_memory_t *);
+int rnp_key_store_kbx_to_mem(pgp_io_t *, const rnp_key_store_t *, pgp_memory_t *);
+int rnp_key_store_kbx_append_key(pgp_io_t *, const pgp_key_t *, const char *);
+
+#endif /* KEY_STORE_KBX_H_ */
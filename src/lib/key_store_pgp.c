@@ -97,7 +97,9 @@ __RCSID("$NetBSD: keyring.c,v 1.50 2011/06/25 00:37:44 agc Exp $");
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -141,18 +143,23 @@ readkeyring(rnp_t *rnp, const char *name, const char *homedir)
 {
     rnp_key_store_t *keyring;
     const unsigned   noarmor = 0;
+    const char *     suffix = "gpg";
     char             f[MAXPATHLEN];
     char *           filename;
 
     if ((filename = rnp_getvar(rnp, name)) == NULL) {
-        (void) snprintf(f, sizeof(f), "%s/%s.gpg", homedir, name);
+        /* gpg2 keeps public keys in a keybox, and secret keys elsewhere */
+        if (rnp->keyring_format == KBX_KEYRING && strcmp(name, "pubring") == 0) {
+            suffix = "kbx";
+        }
+        (void) snprintf(f, sizeof(f), "%s/%s.%s", homedir, name, suffix);
         filename = f;
     }
     if ((keyring = calloc(1, sizeof(*keyring))) == NULL) {
         (void) fprintf(stderr, "readkeyring: bad alloc\n");
         return NULL;
     }
-    if (!rnp_key_store_pgp_read_from_file(rnp->io, keyring, noarmor, filename)) {
+    if (!rnp_key_store_load_from_file(rnp, keyring, noarmor, filename)) {
         free(keyring);
         (void) fprintf(stderr, "cannot read %s %s\n", name, filename);
         return NULL;
@@ -338,6 +345,105 @@ cb_keyring_read(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
     return PGP_RELEASE_MEMORY;
 }
 
+/* keyrings smaller than this per thread are not worth splitting */
+#define PARSE_PART_BYTES (256 * 1024)
+#define PARSE_MAX_THREADS 32
+
+/* a run of whole keys, parsed into a keyring of its own */
+typedef struct parse_part_t {
+    pgp_io_t *      io;
+    const uint8_t * buf;
+    size_t          len;
+    rnp_key_store_t keyring;
+    int             res;
+} parse_part_t;
+
+static void *
+parse_part(void *arg)
+{
+    parse_part_t *part = arg;
+    pgp_stream_t *stream;
+    keyringcb_t   cb;
+
+    (void) memset(&cb, 0x0, sizeof(cb));
+    cb.keyring = &part->keyring;
+    stream = pgp_new(sizeof(*stream));
+    pgp_parse_options(stream, PGP_PTAG_SS_ALL, PGP_PARSE_PARSED);
+    pgp_reader_set_memory(stream, part->buf, part->len);
+    pgp_set_callback(stream, cb_keyring_read, &cb);
+    part->res = pgp_parse_and_accumulate(part->io, &part->keyring, stream);
+    pgp_print_errors(pgp_stream_get_errors(stream));
+    pgp_stream_delete(stream);
+    return NULL;
+}
+
+/*
+ * read a large unarmoured keyring by splitting it between keys, parsing the
+ * parts on a thread each and appending the keys in their original order.
+ * Returns -1 without reading anything if the file is not worth splitting.
+ */
+static int
+read_parallel(pgp_io_t *io, rnp_key_store_t *keyring, const char *filename)
+{
+    parse_part_t  parts[PARSE_MAX_THREADS];
+    pthread_t     threads[PARSE_MAX_THREADS];
+    int           started[PARSE_MAX_THREADS];
+    size_t        starts[PARSE_MAX_THREADS];
+    pgp_memory_t *mem;
+    struct stat   st;
+    unsigned      n;
+    unsigned      i;
+    long          cpus;
+    int           res;
+    int           fd;
+
+    if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 2 || (fd = open(filename, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 ||
+        (n = (unsigned) MIN((size_t) MIN(cpus, PARSE_MAX_THREADS),
+                            st.st_size / PARSE_PART_BYTES)) < 2 ||
+        (mem = pgp_memory_new()) == NULL) {
+        (void) close(fd);
+        return -1;
+    }
+    if (!pgp_mem_readfd(mem, fd) ||
+        (n = pgp_split_at_keys(mem->buf, mem->length, starts, n)) < 2) {
+        pgp_memory_free(mem);
+        (void) close(fd);
+        return -1;
+    }
+    rnp_key_store_note_file(keyring, fd, (off_t) mem->length);
+    (void) close(fd);
+    (void) memset(parts, 0x0, sizeof(parts));
+    for (i = 0; i < n; i++) {
+        parts[i].io = io;
+        parts[i].buf = &mem->buf[starts[i]];
+        parts[i].len = ((i + 1 < n) ? starts[i + 1] : mem->length) - starts[i];
+        parts[i].keyring.hashtype = keyring->hashtype;
+    }
+    /* the first part is ours to parse */
+    for (i = 1; i < n; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, parse_part, &parts[i]) == 0);
+    }
+    (void) parse_part(&parts[0]);
+    res = 1;
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            if (started[i]) {
+                (void) pthread_join(threads[i], NULL);
+            } else {
+                (void) parse_part(&parts[i]);
+            }
+        }
+        res = res && parts[i].res;
+        rnp_key_store_concat_keyring(keyring, &parts[i].keyring);
+        rnp_key_store_free(&parts[i].keyring);
+    }
+    pgp_memory_free(mem);
+    return res;
+}
+
 /**
    \ingroup HighLevel_KeyringRead
 
@@ -371,9 +477,15 @@ rnp_key_store_pgp_read_from_file(pgp_io_t *       io,
 {
     pgp_stream_t *stream;
     keyringcb_t   cb;
-    unsigned      res = 1;
+    struct stat   st;
+    unsigned      from;
+    off_t         end;
+    int           res = 1;
     int           fd;
 
+    if (!armour && (res = read_parallel(io, keyring, filename)) >= 0) {
+        return res;
+    }
     (void) memset(&cb, 0x0, sizeof(cb));
     cb.keyring = keyring;
     stream = pgp_new(sizeof(*stream));
@@ -397,6 +509,9 @@ rnp_key_store_pgp_read_from_file(pgp_io_t *       io,
         perror(filename);
         return 0;
     }
+    if (fstat(fd, &st) != 0) {
+        st.st_size = 0;
+    }
 #ifdef USE_MMAP_FOR_FILES
     pgp_reader_set_mmap(stream, fd);
 #else
@@ -408,13 +523,22 @@ rnp_key_store_pgp_read_from_file(pgp_io_t *       io,
     if (armour) {
         pgp_reader_push_dearmour(stream);
     }
+    from = keyring->keyc;
     res = pgp_parse_and_accumulate(io, keyring, stream);
     pgp_print_errors(pgp_stream_get_errors(stream));
+    /* signatures read after a key was added may have changed it */
+    rnp_key_store_index(keyring, from);
 
     if (armour) {
         pgp_reader_pop_dearmour(stream);
     }
 
+    /* a mapped file is read as fstat() found it, and leaves the offset alone;
+     * a file that could not be mapped is read up to wherever its end was */
+    if ((end = lseek(fd, 0, SEEK_CUR)) <= 0) {
+        end = st.st_size;
+    }
+    rnp_key_store_note_file(keyring, fd, end);
     (void) close(fd);
 
     pgp_stream_delete(stream);
@@ -454,6 +578,7 @@ rnp_key_store_pgp_read_from_mem(pgp_io_t *       io,
     pgp_stream_t * stream;
     const unsigned noaccum = 0;
     keyringcb_t    cb;
+    unsigned       from;
     unsigned       res;
 
     (void) memset(&cb, 0x0, sizeof(cb));
@@ -464,8 +589,10 @@ rnp_key_store_pgp_read_from_mem(pgp_io_t *       io,
     if (armour) {
         pgp_reader_push_dearmour(stream);
     }
+    from = keyring->keyc;
     res = (unsigned) pgp_parse_and_accumulate(io, keyring, stream);
     pgp_print_errors(pgp_stream_get_errors(stream));
+    rnp_key_store_index(keyring, from);
     if (armour) {
         pgp_reader_pop_dearmour(stream);
     }
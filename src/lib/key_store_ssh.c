@@ -358,7 +358,6 @@ ssh2seckey(
     uint8_t     sesskey[PGP_MAX_KEY_SIZE];
     unsigned    sesskey_len;
 
-    __PGP_USED(io);
     /* XXX - check for rsa/dsa */
     if (!read_pem_seckey(f, key, "ssh-rsa", 0)) {
         return 0;
@@ -375,7 +374,10 @@ ssh2seckey(
     key->key.seckey.s2k_specifier = PGP_S2KS_SALTED;
     key->key.seckey.hash_alg = PGP_HASH_SHA1;
 
-    pgp_random(key->key.seckey.salt, PGP_SALT_SIZE);
+    if (!pgp_random(key->key.seckey.salt, PGP_SALT_SIZE)) {
+        (void) fprintf(io->errs, "ssh2seckey: no random bytes\n");
+        return 0;
+    }
 
     if (key->key.seckey.pubkey.alg == PGP_PKA_RSA) {
         /* openssh and openssl have p and q swapped */
@@ -423,6 +425,7 @@ ssh2_readkeys(pgp_io_t *       io,
         pubkey = &pubring->keys[pubring->keyc++];
         (void) memcpy(pubkey, &key, sizeof(key));
         pubkey->type = PGP_PTAG_CT_PUBLIC_KEY;
+        rnp_key_store_index(pubring, pubring->keyc - 1);
     }
     if (secfile) {
         if (rnp_get_debug(__FILE__)) {
@@ -439,6 +442,7 @@ ssh2_readkeys(pgp_io_t *       io,
         seckey = &secring->keys[secring->keyc++];
         (void) memcpy(seckey, &key, sizeof(key));
         seckey->type = PGP_PTAG_CT_SECRET_KEY;
+        rnp_key_store_index(secring, secring->keyc - 1);
     }
     return 1;
 }
@@ -494,10 +498,10 @@ readsshkeys(rnp_t *rnp, char *homedir, const char *needseckey)
     if (rnp->pubring == NULL) {
         rnp->pubring = pubring;
     } else {
-        rnp_key_store_append_keyring(rnp->pubring, pubring);
+        rnp_key_store_append_keyring(rnp->io, rnp->pubring, pubring);
     }
+    rnp_setvar(rnp, "sshpubfile", filename);
     if (needseckey) {
-        rnp_setvar(rnp, "sshpubfile", filename);
         /* try to take the ".pub" off the end */
         if (filename == f) {
             f[strlen(f) - 4] = 0x0;
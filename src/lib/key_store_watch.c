@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rnp.h"
+#include "rnpdefs.h"
+#include "key_store.h"
+#include "memory.h"
+
+/* one keyring file; how much of it is held is kept in the keyring itself */
+typedef struct watch_file_t {
+    char        path[MAXPATHLEN];
+    const char *name; /* within path, as inotify reports it */
+    int         wd;
+    int         changed;
+} watch_file_t;
+
+/* pubring and secring files */
+typedef struct rnp_key_watch_t {
+    int          fd;
+    watch_file_t files[2];
+} rnp_key_watch_t;
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE)
+
+/* the files the keyrings were read from */
+static void
+ring_paths(rnp_t *rnp, const char **pub, const char **sec)
+{
+    if (rnp->keyring_format == SSH_KEYRING) {
+        *pub = rnp_getvar(rnp, "sshpubfile");
+        *sec = rnp_getvar(rnp, "sshsecfile");
+    } else {
+        *pub = rnp_getvar(rnp, "pubring");
+        *sec = rnp_getvar(rnp, "secring");
+    }
+}
+
+static int
+watch_file(rnp_key_watch_t *watch, watch_file_t *file, const char *path)
+{
+    char  dir[MAXPATHLEN];
+    char *slash;
+
+    if (snprintf(file->path, sizeof(file->path), "%s", path) >= (int) sizeof(file->path)) {
+        return 0;
+    }
+    (void) snprintf(dir, sizeof(dir), "%s", path);
+    if ((slash = strrchr(dir, '/')) == NULL) {
+        (void) snprintf(dir, sizeof(dir), ".");
+        file->name = file->path;
+    } else {
+        *slash = 0x0;
+        file->name = &file->path[slash - dir + 1];
+    }
+    /* files get replaced by rename, so it is their directory we watch */
+    if ((file->wd = inotify_add_watch(watch->fd, dir, WATCH_EVENTS)) < 0) {
+        return 0;
+    }
+    return 1;
+}
+
+/* note which of the files an event is about */
+static void
+read_events(rnp_key_watch_t *watch)
+{
+    const struct inotify_event *ev;
+    uint64_t                    buf[512]; /* aligned for the events */
+    ssize_t                     cc;
+    char *                      p;
+    unsigned                    i;
+
+    while ((cc = read(watch->fd, buf, sizeof(buf))) > 0) {
+        for (p = (char *) buf; p < (char *) buf + cc; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *) p;
+            for (i = 0; i < PGP_ARRAY_SIZE(watch->files); i++) {
+                if (watch->files[i].wd == ev->wd && ev->len > 0 &&
+                    strcmp(ev->name, watch->files[i].name) == 0) {
+                    watch->files[i].changed = 1;
+                }
+            }
+        }
+    }
+}
+
+/* read bytes [from, to) of an open file */
+static pgp_memory_t *
+read_range(int fd, off_t from, off_t to)
+{
+    pgp_memory_t *mem;
+    uint8_t       buf[8192];
+    ssize_t       cc;
+    size_t        n;
+
+    if (lseek(fd, from, SEEK_SET) != from || (mem = pgp_memory_new()) == NULL) {
+        return NULL;
+    }
+    while (from < to) {
+        n = (size_t)(to - from) < sizeof(buf) ? (size_t)(to - from) : sizeof(buf);
+        if ((cc = read(fd, buf, n)) <= 0) {
+            pgp_memory_free(mem);
+            return NULL;
+        }
+        pgp_memory_add(mem, buf, (size_t) cc);
+        from += cc;
+    }
+    return mem;
+}
+
+/*
+ * bring one keyring up to date with its file. Keys are only ever appended
+ * to a keyring file in place, so if it is the same file that the keyring
+ * was loaded from and it grew, only what was added gets parsed; anything
+ * else means reading it all again. Returns 1 if the keyring changed, 0 if
+ * there was nothing to do.
+ */
+static int
+update_ring(rnp_t *rnp, rnp_key_store_t **ring, watch_file_t *file)
+{
+    rnp_key_store_t *keyring = *ring;
+    rnp_key_store_t *fresh;
+    pgp_memory_t *   mem;
+    struct stat      st;
+    int              ok;
+    int              fd;
+
+    if ((fd = open(file->path, O_RDONLY)) < 0) {
+        /* gone, for now: keep what we have */
+        return 0;
+    }
+    /* what is read below comes from this descriptor, so it is the one to look at */
+    if (fstat(fd, &st) != 0) {
+        (void) close(fd);
+        return -1;
+    }
+    if (keyring != NULL && st.st_dev == keyring->dev && st.st_ino == keyring->ino &&
+        st.st_size >= keyring->size) {
+        if (st.st_size == keyring->size) {
+            (void) close(fd);
+            return 0;
+        }
+        mem = read_range(fd, keyring->size, st.st_size);
+        (void) close(fd);
+        if (mem == NULL) {
+            return -1;
+        }
+        if ((ok = rnp_key_store_load_from_mem(rnp, keyring, 0, mem)) != 0) {
+            keyring->size = st.st_size;
+        }
+        pgp_memory_free(mem);
+        return ok ? 1 : -1;
+    }
+    (void) close(fd);
+    if ((fresh = calloc(1, sizeof(*fresh))) == NULL) {
+        return -1;
+    }
+    if (!rnp_key_store_load_from_file(rnp, fresh, 0, file->path)) {
+        rnp_key_store_free(fresh);
+        free(fresh);
+        return -1;
+    }
+    if (keyring != NULL) {
+        rnp_key_store_free(keyring);
+        free(keyring);
+    }
+    *ring = fresh;
+    return 1;
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/* start watching the files the keyrings of `rnp' were loaded from */
+int
+rnp_key_store_watch(rnp_t *rnp)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    rnp_key_watch_t *watch;
+    const char *     pub;
+    const char *     sec;
+    pgp_io_t *       io = rnp->io;
+
+    if ((watch = rnp->watch) != NULL) {
+        return watch->fd;
+    }
+    ring_paths(rnp, &pub, &sec);
+    if (rnp->pubring == NULL || pub == NULL) {
+        (void) fprintf(io->errs, "rnp_key_store_watch: no keyring loaded from a file\n");
+        return -1;
+    }
+    if ((watch = calloc(1, sizeof(*watch))) == NULL) {
+        (void) fprintf(io->errs, "rnp_key_store_watch: bad alloc\n");
+        return -1;
+    }
+    watch->files[0].wd = watch->files[1].wd = -1;
+    if ((watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        (void) fprintf(io->errs, "rnp_key_store_watch: inotify: %s\n", strerror(errno));
+        free(watch);
+        return -1;
+    }
+    if (!watch_file(watch, &watch->files[0], pub) ||
+        (sec != NULL && rnp->secring != NULL && !watch_file(watch, &watch->files[1], sec))) {
+        (void) fprintf(io->errs, "rnp_key_store_watch: cannot watch '%s'\n", pub);
+        (void) close(watch->fd);
+        free(watch);
+        return -1;
+    }
+    rnp->watch = watch;
+    return watch->fd;
+#else
+    (void) fprintf(((pgp_io_t *) rnp->io)->errs, "rnp_key_store_watch: not supported\n");
+    return -1;
+#endif
+}
+
+/*
+ * apply whatever changed in the watched files since the last call. SSH key
+ * files hold a single key, so for them `reload' is set instead, asking the
+ * caller to load the keyrings afresh. Returns the number of keyrings that
+ * were updated, or -1.
+ */
+int
+rnp_key_store_update(rnp_t *rnp, int *reload)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    rnp_key_watch_t * watch = rnp->watch;
+    rnp_key_store_t **rings[2];
+    pgp_io_t *        io = rnp->io;
+    unsigned          i;
+    int               count = 0;
+    int               ret;
+
+    *reload = 0;
+    if (watch == NULL) {
+        return 0;
+    }
+    read_events(watch);
+    rings[0] = (rnp_key_store_t **) &rnp->pubring;
+    rings[1] = (rnp_key_store_t **) &rnp->secring;
+    for (i = 0; i < PGP_ARRAY_SIZE(watch->files); i++) {
+        if (!watch->files[i].changed) {
+            continue;
+        }
+        watch->files[i].changed = 0;
+        if (rnp->keyring_format == SSH_KEYRING) {
+            *reload = 1;
+            continue;
+        }
+        if ((ret = update_ring(rnp, rings[i], &watch->files[i])) < 0) {
+            (void) fprintf(
+              io->errs, "rnp_key_store_update: cannot read '%s'\n", watch->files[i].path);
+            return -1;
+        }
+        count += ret;
+    }
+    return count;
+#else
+    *reload = 0;
+    return 0;
+#endif
+}
+
+void
+rnp_key_store_unwatch(rnp_t *rnp)
+{
+    rnp_key_watch_t *watch = rnp->watch;
+
+    if (watch != NULL) {
+        (void) close(watch->fd);
+        free(watch);
+        rnp->watch = NULL;
+    }
+}
@@ -81,8 +81,9 @@ void pgp_writer_set_memory(pgp_output_t *, pgp_memory_t *);
 
 size_t pgp_mem_len(const pgp_memory_t *);
 void * pgp_mem_data(pgp_memory_t *);
+int    pgp_mem_readfd(pgp_memory_t *, int);
 int    pgp_mem_readfile(pgp_memory_t *, const char *);
 
-void pgp_random(void *, size_t);
+int pgp_random(void *, size_t);
 
 #endif /* MEMORY_H_ */
@@ -68,6 +68,7 @@ __RCSID("$NetBSD: misc.c,v 1.41 2012/03/05 02:20:18 christos Exp $");
 
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -91,6 +92,8 @@ __RCSID("$NetBSD: misc.c,v 1.41 2012/03/05 02:20:18 christos Exp $");
 #include "memory.h"
 #include "readerwriter.h"
 #include "rnpdigest.h"
+#include "rng.h"
+#include "trace.h"
 
 #ifdef WIN32
 #define vsnprintf _vsnprintf
@@ -378,8 +381,13 @@ pgp_fingerprint(pgp_fingerprint_t *fp, const pgp_pubkey_t *key, pgp_hash_alg_t h
     pgp_memory_t *mem;
     pgp_hash_t    hash;
     const char *  type;
-    uint32_t      len;
+    int           ok;
 
+    if (key->version == PGP_V4 && hashtype != PGP_HASH_MD5 && key->fingerprint.length != 0) {
+        /* worked out from the packet the key was read from */
+        *fp = key->fingerprint;
+        return 1;
+    }
     mem = pgp_memory_new();
     if (key->version == 2 || key->version == 3) {
         if (key->alg != PGP_PKA_RSA && key->alg != PGP_PKA_RSA_ENCRYPT_ONLY &&
@@ -427,20 +435,33 @@ pgp_fingerprint(pgp_fingerprint_t *fp, const pgp_pubkey_t *key, pgp_hash_alg_t h
         }
     } else {
         pgp_build_pubkey(mem, key, 0);
-        if (!pgp_hash_create(&hash, PGP_HASH_SHA1)) {
-            (void) fprintf(stderr, "pgp_fingerprint: bad sha1 alloc\n");
-            pgp_memory_free(mem);
-            return 0;
-        }
-        len = (unsigned) pgp_mem_len(mem);
-        pgp_hash_add_int(&hash, 0x99, 1);
-        pgp_hash_add_int(&hash, len, 2);
-        pgp_hash_add(&hash, pgp_mem_data(mem), len);
-        fp->length = pgp_hash_finish(&hash, fp->fingerprint);
+        ok = pgp_fingerprint_v4(fp, pgp_mem_data(mem), (unsigned) pgp_mem_len(mem));
         pgp_memory_free(mem);
-        if (rnp_get_debug(__FILE__)) {
-            hexdump(stderr, "sha1 fingerprint", fp->fingerprint, fp->length);
-        }
+        return ok;
+    }
+    return 1;
+}
+
+/**
+ * \ingroup Core_Keys
+ * \brief Calculate a v4 fingerprint from a serialized public key packet body
+ */
+int
+pgp_fingerprint_v4(pgp_fingerprint_t *fp, const uint8_t *body, unsigned len)
+{
+    pgp_hash_t hash;
+
+    if (!pgp_hash_create(&hash, PGP_HASH_SHA1)) {
+        (void) fprintf(stderr, "pgp_fingerprint: bad sha1 alloc\n");
+        return 0;
+    }
+    pgp_hash_add_int(&hash, 0x99, 1);
+    pgp_hash_add_int(&hash, len, 2);
+    pgp_hash_add(&hash, body, len);
+    fp->length = pgp_hash_finish(&hash, fp->fingerprint);
+    fp->hashtype = PGP_HASH_SHA1;
+    if (rnp_get_debug(__FILE__)) {
+        hexdump(stderr, "sha1 fingerprint", fp->fingerprint, fp->length);
     }
     return 1;
 }
@@ -529,14 +550,11 @@ pgp_calc_mdc_hash(const uint8_t *preamble,
     }
 }
 
-void
+/* fill `dest' with `length' random bytes, 1 on success */
+int
 pgp_random(void *dest, size_t length)
 {
-    // todo should this be a global instead?
-    botan_rng_t rng;
-    botan_rng_init(&rng, NULL);
-    botan_rng_get(rng, dest, length);
-    botan_rng_destroy(rng);
+    return pgp_rng_get(dest, length);
 }
 
 /**
@@ -741,42 +759,54 @@ pgp_mem_data(pgp_memory_t *mem)
     return mem->buf;
 }
 
-/* read a gile into an pgp_memory_t */
+/* read all of an open file, as it is when this is called, into a pgp_memory_t */
 int
-pgp_mem_readfile(pgp_memory_t *mem, const char *f)
+pgp_mem_readfd(pgp_memory_t *mem, int fd)
 {
     struct stat st;
-    FILE *      fp;
     int         cc;
 
-    if ((fp = fopen(f, "rb")) == NULL) {
-        (void) fprintf(stderr, "pgp_mem_readfile: can't open \"%s\"\n", f);
+    if (fstat(fd, &st) != 0) {
+        (void) fprintf(stderr, "pgp_mem_readfd: can't fstat\n");
         return 0;
     }
-    (void) fstat(fileno(fp), &st);
     mem->allocated = (size_t) st.st_size;
-    mem->buf = mmap(NULL, mem->allocated, PROT_READ, MAP_PRIVATE | MAP_FILE, fileno(fp), 0);
+    mem->buf = mmap(NULL, mem->allocated, PROT_READ, MAP_PRIVATE | MAP_FILE, fd, 0);
     if (mem->buf == MAP_FAILED) {
         /* mmap failed for some reason - try to allocate memory */
         if ((mem->buf = calloc(1, mem->allocated)) == NULL) {
-            (void) fprintf(stderr, "pgp_mem_readfile: calloc\n");
-            (void) fclose(fp);
+            (void) fprintf(stderr, "pgp_mem_readfd: calloc\n");
             return 0;
         }
         /* read into contents of mem */
-        for (mem->length = 0; (cc = (int) read(fileno(fp),
-                                               &mem->buf[mem->length],
-                                               (size_t)(mem->allocated - mem->length))) > 0;
+        for (mem->length = 0;
+             (cc = (int) read(
+                fd, &mem->buf[mem->length], (size_t)(mem->allocated - mem->length))) > 0;
              mem->length += (size_t) cc) {
         }
     } else {
         mem->length = mem->allocated;
         mem->mmapped = 1;
     }
-    (void) fclose(fp);
     return (mem->allocated == mem->length);
 }
 
+/* read a gile into an pgp_memory_t */
+int
+pgp_mem_readfile(pgp_memory_t *mem, const char *f)
+{
+    FILE *fp;
+    int   ret;
+
+    if ((fp = fopen(f, "rb")) == NULL) {
+        (void) fprintf(stderr, "pgp_mem_readfile: can't open \"%s\"\n", f);
+        return 0;
+    }
+    ret = pgp_mem_readfd(mem, fileno(fp));
+    (void) fclose(fp);
+    return ret;
+}
+
 typedef struct {
     uint16_t sum;
 } sum16_t;
@@ -908,6 +938,7 @@ pgp_reader_push_sum16(pgp_stream_t *stream)
         (void) fprintf(stderr, "pgp_reader_push_sum16: bad alloc\n");
     } else {
         pgp_reader_push(stream, sum16_reader, sum16_destroyer, arg);
+        pgp_reader_set_stage(stream, "sum16");
     }
 }
 
@@ -931,17 +962,21 @@ pgp_reader_pop_sum16(pgp_stream_t *stream)
 
 /* small useful functions for setting the file-level debugging levels */
 /* if the debugv list contains the filename in question, we're debugging it */
+/* names are only ever appended, so readers need no lock: a slot is claimed */
+/* by bumping debugc and may read as NULL until its name is stored */
 
 enum { MAX_DEBUG_NAMES = 32 };
 
-static int   debugc;
-static char *debugv[MAX_DEBUG_NAMES];
+static atomic_int      debugc;
+static _Atomic(char *) debugv[MAX_DEBUG_NAMES];
 
 /* set the debugging level per filename */
 int
 rnp_set_debug(const char *f)
 {
     const char *name;
+    char *      v;
+    int         c;
     int         i;
 
     if (f == NULL) {
@@ -952,15 +987,18 @@ rnp_set_debug(const char *f)
     } else {
         name += 1;
     }
-    for (i = 0; i < debugc && i < MAX_DEBUG_NAMES; i++) {
-        if (strcmp(debugv[i], name) == 0) {
+    c = atomic_load(&debugc);
+    for (i = 0; i < c; i++) {
+        if ((v = atomic_load(&debugv[i])) != NULL && strcmp(v, name) == 0) {
             return 1;
         }
     }
-    if (i == MAX_DEBUG_NAMES) {
-        return 0;
-    }
-    debugv[debugc++] = rnp_strdup(name);
+    do {
+        if (c == MAX_DEBUG_NAMES) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak(&debugc, &c, c + 1));
+    atomic_store(&debugv[c], rnp_strdup(name));
     return 1;
 }
 
@@ -969,22 +1007,45 @@ int
 rnp_get_debug(const char *f)
 {
     const char *name;
+    char *      v;
+    int         c;
     int         i;
 
+    if ((c = atomic_load(&debugc)) == 0) {
+        return 0;
+    }
     if ((name = strrchr(f, '/')) == NULL) {
         name = f;
     } else {
         name += 1;
     }
-    for (i = 0; i < debugc; i++) {
-        if (strcmp(debugv[i], "all") == 0 || strcmp(debugv[i], name) == 0) {
+    for (i = 0; i < c; i++) {
+        if ((v = atomic_load(&debugv[i])) == NULL) {
+            continue;
+        }
+        if (strcmp(v, "all") == 0 || strcmp(v, name) == 0) {
             return 1;
         }
     }
     return 0;
 }
 
-/* return the version for the library */
+/* switch reader/writer stage statistics on or off */
+int
+rnp_set_stats(int on)
+{
+    pgp_stats_enable(on);
+    return 1;
+}
+
+/* start writing a timeline to `path', or finish it if `path' is NULL */
+int
+rnp_set_trace(const char *path)
+{
+    return (path) ? pgp_trace_start(path) : pgp_trace_stop();
+}
+
+/* return the version for the library, or its statistics as JSON */
 const char *
 rnp_get_info(const char *type)
 {
@@ -994,6 +1055,9 @@ rnp_get_info(const char *type)
     if (strcmp(type, "maintainer") == 0) {
         return PACKAGE_BUGREPORT;
     }
+    if (strcmp(type, "stats") == 0) {
+        return pgp_stats_json();
+    }
     return "[unknown]";
 }
 
@@ -1003,10 +1067,11 @@ rnp_log(const char *fmt, ...)
     va_list vp;
     time_t  t;
     char    buf[BUFSIZ * 2];
+    char    tbuf[32];
     int     cc;
 
     (void) time(&t);
-    cc = snprintf(buf, sizeof(buf), "%.24s: rnp: ", ctime(&t));
+    cc = snprintf(buf, sizeof(buf), "%.24s: rnp: ", ctime_r(&t, tbuf));
     va_start(vp, fmt);
     (void) vsnprintf(&buf[cc], sizeof(buf) - (size_t) cc, fmt, vp);
     va_end(vp);
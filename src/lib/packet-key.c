@@ -80,37 +80,129 @@ pgp_keydata_new(void)
 /**
  \ingroup HighLevel_Keyring
 
- \brief Frees keydata and its memory
+ \brief Frees the memory alloc-ed by a key, but not the key itself
 
- \param keydata Key to be freed.
+ \param key Key whose contents are to be freed
 
- \note This frees the keydata itself, as well as any other memory alloc-ed by it.
+ \note The signatures in subsigs were freed by the parser when the key was
+ read, so only their array is freed here.
 */
 void
-pgp_keydata_free(pgp_key_t *keydata)
+pgp_key_free(pgp_key_t *key)
 {
     unsigned n;
 
-    for (n = 0; n < keydata->uidc; ++n) {
-        pgp_userid_free(&keydata->uids[n]);
+    for (n = 0; n < key->uidc; ++n) {
+        pgp_userid_free(&key->uids[n]);
     }
-    free(keydata->uids);
-    keydata->uids = NULL;
-    keydata->uidc = 0;
+    free(key->uids);
+    key->uids = NULL;
+    key->uidc = key->uidvsize = 0;
 
-    for (n = 0; n < keydata->packetc; ++n) {
-        pgp_subpacket_free(&keydata->packets[n]);
+    for (n = 0; n < key->packetc; ++n) {
+        pgp_subpacket_free(&key->packets[n]);
     }
-    free(keydata->packets);
-    keydata->packets = NULL;
-    keydata->packetc = 0;
+    free(key->packets);
+    key->packets = NULL;
+    key->packetc = key->packetvsize = 0;
 
-    if (keydata->type == PGP_PTAG_CT_PUBLIC_KEY) {
-        pgp_pubkey_free(&keydata->key.pubkey);
-    } else {
-        pgp_seckey_free(&keydata->key.seckey);
+    free(key->subsigs);
+    key->subsigs = NULL;
+    key->subsigc = key->subsigvsize = 0;
+
+    for (n = 0; n < key->revokec; ++n) {
+        free(key->revokes[n].reason);
+    }
+    free(key->revokes);
+    key->revokes = NULL;
+    key->revokec = key->revokevsize = 0;
+    free(key->revocation.reason);
+    key->revocation.reason = NULL;
+
+    switch (key->type) {
+    case PGP_PTAG_CT_PUBLIC_KEY:
+        pgp_pubkey_free(&key->key.pubkey);
+        break;
+    case PGP_PTAG_CT_SECRET_KEY:
+    case PGP_PTAG_CT_ENCRYPTED_SECRET_KEY:
+        pgp_seckey_free(&key->key.seckey);
+        break;
+    default:
+        /* not set up yet, or moved elsewhere and zeroed */
+        break;
     }
+    pgp_pubkey_free(&key->enckey);
+}
+
+/**
+ \ingroup HighLevel_Keyring
+
+ \brief Turns a secret key into the public key it holds
+
+ \param key Key whose secret key packets become public key packets, and
+ whose secret key material is freed
 
+ \return 1 if OK; 0 if a secret key packet could not be read, in which
+ case key is unchanged
+*/
+int
+pgp_key_make_public(pgp_key_t *key)
+{
+    pgp_subpacket_t *pubs = NULL;
+    pgp_pubkey_t     pubkey;
+    unsigned         tag;
+    unsigned         n;
+
+    if (key->packetc > 0 && (pubs = calloc(key->packetc, sizeof(*pubs))) == NULL) {
+        return 0;
+    }
+    for (n = 0; n < key->packetc; n++) {
+        tag = pgp_subpacket_tag(&key->packets[n]);
+        if ((tag == PGP_PTAG_CT_SECRET_KEY || tag == PGP_PTAG_CT_SECRET_SUBKEY) &&
+            !pgp_subpacket_public(&pubs[n], &key->packets[n])) {
+            break;
+        }
+    }
+    if (n < key->packetc) {
+        while (n-- > 0) {
+            pgp_subpacket_free(&pubs[n]);
+        }
+        free(pubs);
+        return 0;
+    }
+    for (n = 0; n < key->packetc; n++) {
+        if (pubs[n].raw != NULL) {
+            pgp_subpacket_free(&key->packets[n]);
+            key->packets[n] = pubs[n];
+        }
+    }
+    free(pubs);
+    if (pgp_is_key_secret(key)) {
+        /* the public part moves out, the rest is wiped as it is freed */
+        pubkey = key->key.seckey.pubkey;
+        (void) memset(&key->key.seckey.pubkey, 0x0, sizeof(key->key.seckey.pubkey));
+        key->key.seckey.pubkey.alg = pubkey.alg;
+        pgp_seckey_free(&key->key.seckey);
+        (void) memset(&key->key, 0x0, sizeof(key->key));
+        key->key.pubkey = pubkey;
+        key->type = PGP_PTAG_CT_PUBLIC_KEY;
+    }
+    return 1;
+}
+
+/**
+ \ingroup HighLevel_Keyring
+
+ \brief Frees keydata and its memory
+
+ \param keydata Key to be freed.
+
+ \note This frees the keydata itself, as well as any other memory alloc-ed by it.
+*/
+void
+pgp_keydata_free(pgp_key_t *keydata)
+{
+    pgp_key_free(keydata);
     free(keydata);
 }
 
@@ -59,6 +59,10 @@ struct pgp_key_t *pgp_keydata_new(void);
 
 void pgp_keydata_free(pgp_key_t *);
 
+void pgp_key_free(pgp_key_t *);
+
+int pgp_key_make_public(pgp_key_t *);
+
 const pgp_pubkey_t *pgp_get_pubkey(const pgp_key_t *);
 
 unsigned pgp_is_key_secret(const pgp_key_t *);
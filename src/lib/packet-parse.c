@@ -92,6 +92,7 @@ __RCSID("$NetBSD: packet-parse.c,v 1.51 2012/03/05 02:20:18 christos Exp $");
 #include "crypto.h"
 #include "rnpdigest.h"
 #include "s2k.h"
+#include "trace.h"
 
 #define ERRP(cbinfo, cont, err)                    \
     do {                                           \
@@ -106,10 +107,18 @@ typedef struct {
     rnp_key_store_t *keyring;
 } accumulate_t;
 
+/* zeroed memory for packet contents, from `arena' if there is one */
+static void *
+parse_calloc(pgp_arena_t *arena, size_t size)
+{
+    return (arena) ? pgp_arena_alloc(arena, size) : calloc(1, size);
+}
+
 /**
  * limread_data reads the specified amount of the subregion's data
  * into a data_t structure
  *
+ * \param arena    Arena to allocate the contents from, or NULL for the heap
  * \param data    Empty structure which will be filled with data
  * \param len    Number of octets to read
  * \param subregion
@@ -118,7 +127,11 @@ typedef struct {
  * \return 1 on success, 0 on failure
  */
 static int
-limread_data(pgp_data_t *data, unsigned len, pgp_region_t *subregion, pgp_stream_t *stream)
+limread_data(pgp_arena_t * arena,
+             pgp_data_t *  data,
+             unsigned      len,
+             pgp_region_t *subregion,
+             pgp_stream_t *stream)
 {
     data->len = len;
 
@@ -127,7 +140,7 @@ limread_data(pgp_data_t *data, unsigned len, pgp_region_t *subregion, pgp_stream
         return 0;
     }
 
-    data->contents = calloc(1, data->len);
+    data->contents = parse_calloc(arena, data->len);
     if (!data->contents) {
         return 0;
     }
@@ -145,6 +158,7 @@ limread_data(pgp_data_t *data, unsigned len, pgp_region_t *subregion, pgp_stream
  * read_data reads the remainder of the subregion's data
  * into a data_t structure
  *
+ * \param arena
  * \param data
  * \param subregion
  * \param stream
@@ -152,26 +166,30 @@ limread_data(pgp_data_t *data, unsigned len, pgp_region_t *subregion, pgp_stream
  * \return 1 on success, 0 on failure
  */
 static int
-read_data(pgp_data_t *data, pgp_region_t *region, pgp_stream_t *stream)
+read_data(pgp_arena_t *arena, pgp_data_t *data, pgp_region_t *region, pgp_stream_t *stream)
 {
     int cc;
 
     cc = region->length - region->readc;
-    return (cc >= 0) ? limread_data(data, (unsigned) cc, region, stream) : 0;
+    return (cc >= 0) ? limread_data(arena, data, (unsigned) cc, region, stream) : 0;
 }
 
 /**
  * Reads the remainder of the subregion as a string.
- * It is the user's responsibility to free the memory allocated here.
+ * It is the user's responsibility to free the memory allocated here,
+ * unless it came from an arena.
  */
 
 static int
-read_unsig_str(uint8_t **str, pgp_region_t *subregion, pgp_stream_t *stream)
+read_unsig_str(pgp_arena_t * arena,
+               uint8_t **    str,
+               pgp_region_t *subregion,
+               pgp_stream_t *stream)
 {
     size_t len;
 
     len = subregion->length - subregion->readc;
-    if ((*str = calloc(1, len + 1)) == NULL) {
+    if ((*str = parse_calloc(arena, len + 1)) == NULL) {
         return 0;
     }
     if (len &&
@@ -184,9 +202,9 @@ read_unsig_str(uint8_t **str, pgp_region_t *subregion, pgp_stream_t *stream)
 }
 
 static int
-read_string(char **str, pgp_region_t *subregion, pgp_stream_t *stream)
+read_string(pgp_arena_t *arena, char **str, pgp_region_t *subregion, pgp_stream_t *stream)
 {
-    return read_unsig_str((uint8_t **) str, subregion, stream);
+    return read_unsig_str(arena, (uint8_t **) str, subregion, stream);
 }
 
 void
@@ -229,6 +247,27 @@ pgp_init_subregion(pgp_region_t *subregion, pgp_region_t *region)
  * \sa #pgp_reader_ret_t for details of return codes
  */
 
+/* call one reader, counting it if statistics are being collected */
+static int
+stage_read(pgp_stream_t *stream,
+           void *        dest,
+           size_t        length,
+           pgp_error_t **errors,
+           pgp_reader_t *readinfo,
+           pgp_cbdata_t *cbinfo)
+{
+    pgp_stage_frame_t frame;
+    int               r;
+
+    if (readinfo->stats == NULL) {
+        return readinfo->reader(stream, dest, length, errors, readinfo, cbinfo);
+    }
+    pgp_stats_enter(&frame);
+    r = readinfo->reader(stream, dest, length, errors, readinfo, cbinfo);
+    pgp_stats_leave(&frame, readinfo->stats, (r > 0) ? (uint64_t) r : 0);
+    return r;
+}
+
 static int
 sub_base_read(pgp_stream_t *stream,
               void *        dest,
@@ -246,7 +285,7 @@ sub_base_read(pgp_stream_t *stream,
     for (n = 0; n < length;) {
         int r;
 
-        r = readinfo->reader(stream, (char *) dest + n, length - n, errors, readinfo, cbinfo);
+        r = stage_read(stream, (char *) dest + n, length - n, errors, readinfo, cbinfo);
         if (r > (int) (length - n)) {
             (void) fprintf(stderr, "sub_base_read: bad read\n");
             return 0;
@@ -722,12 +761,12 @@ streamread(pgp_stream_t *stream, unsigned c)
     int cc;
 
     stream->virtualpkt = realloc(stream->virtualpkt, stream->virtualc + c);
-    cc = stream->readinfo.reader(stream,
-                                 &stream->virtualpkt[stream->virtualc],
-                                 c,
-                                 &stream->errors,
-                                 &stream->readinfo,
-                                 &stream->cbinfo);
+    cc = stage_read(stream,
+                    &stream->virtualpkt[stream->virtualc],
+                    c,
+                    &stream->errors,
+                    &stream->readinfo,
+                    &stream->cbinfo);
     stream->virtualc += cc;
 }
 
@@ -891,6 +930,170 @@ pgp_subpacket_free(pgp_subpacket_t *packet)
     packet->raw = NULL;
 }
 
+/**
+\ingroup Core_ReadPackets
+\brief The content tag of a raw packet
+\return The tag, or PGP_PTAG_CT_RESERVED if it is not a packet
+*/
+unsigned
+pgp_subpacket_tag(const pgp_subpacket_t *packet)
+{
+    if (packet->length == 0 || (packet->raw[0] & PGP_PTAG_ALWAYS_SET) == 0) {
+        return PGP_PTAG_CT_RESERVED;
+    }
+    if (packet->raw[0] & PGP_PTAG_NEW_FORMAT) {
+        return packet->raw[0] & PGP_PTAG_NF_CONTENT_TAG_MASK;
+    }
+    return (packet->raw[0] & PGP_PTAG_OF_CONTENT_TAG_MASK) >> PGP_PTAG_OF_CONTENT_TAG_SHIFT;
+}
+
+/**
+\ingroup Core_ReadPackets
+\brief The body of a raw packet, without its header
+\param len Where to put the length of the body
+\return The body, or NULL if the packet has no definite length
+*/
+const uint8_t *
+pgp_subpacket_body(const pgp_subpacket_t *packet, size_t *len)
+{
+    size_t hdr;
+
+    if (pgp_subpacket_tag(packet) == PGP_PTAG_CT_RESERVED || packet->length < 2) {
+        return NULL;
+    }
+    if (packet->raw[0] & PGP_PTAG_NEW_FORMAT) {
+        if (packet->raw[1] < 192) {
+            hdr = 2;
+        } else if (packet->raw[1] < 224) {
+            hdr = 3;
+        } else if (packet->raw[1] == 255) {
+            hdr = 6;
+        } else {
+            return NULL; /* partial length */
+        }
+    } else {
+        switch (packet->raw[0] & PGP_PTAG_OF_LENGTH_TYPE_MASK) {
+        case PGP_PTAG_OLD_LEN_1:
+            hdr = 2;
+            break;
+        case PGP_PTAG_OLD_LEN_2:
+            hdr = 3;
+            break;
+        case PGP_PTAG_OLD_LEN_4:
+            hdr = 5;
+            break;
+        default:
+            return NULL; /* indeterminate length */
+        }
+    }
+    if (hdr > packet->length) {
+        return NULL;
+    }
+    *len = packet->length - hdr;
+    return &packet->raw[hdr];
+}
+
+/* the length of a public key packet body whose key material starts at off
+ * with mpic numbers, or 0 if it does not fit in len */
+static size_t
+pubkey_body_len(const uint8_t *body, size_t len, size_t off, unsigned mpic)
+{
+    for (; mpic > 0; mpic--) {
+        if (off + 2 > len) {
+            return 0;
+        }
+        off += 2 + ((((size_t) body[off] << 8) | body[off + 1]) + 7) / 8;
+    }
+    return (off <= len) ? off : 0;
+}
+
+/**
+\ingroup Core_ReadPackets
+\brief Make the public key packet a secret key packet starts with
+\param out Where to put the public key or subkey packet, which is freed
+with pgp_subpacket_free()
+\return 1 if OK; 0 if packet is not a secret key packet which can be read
+*/
+int
+pgp_subpacket_public(pgp_subpacket_t *out, const pgp_subpacket_t *packet)
+{
+    const uint8_t *body;
+    unsigned       mpic;
+    unsigned       tag;
+    size_t         publen;
+    size_t         hdr;
+    size_t         len;
+    size_t         off;
+
+    switch (pgp_subpacket_tag(packet)) {
+    case PGP_PTAG_CT_SECRET_KEY:
+        tag = PGP_PTAG_CT_PUBLIC_KEY;
+        break;
+    case PGP_PTAG_CT_SECRET_SUBKEY:
+        tag = PGP_PTAG_CT_PUBLIC_SUBKEY;
+        break;
+    default:
+        return 0;
+    }
+    if ((body = pgp_subpacket_body(packet, &len)) == NULL || len < 1) {
+        return 0;
+    }
+    /* version, creation time and, before v4, days of validity */
+    switch (body[0]) {
+    case PGP_V2:
+    case PGP_V3:
+        off = 7;
+        break;
+    case PGP_V4:
+        off = 5;
+        break;
+    default:
+        return 0;
+    }
+    if (off >= len) {
+        return 0;
+    }
+    switch (body[off]) {
+    case PGP_PKA_RSA:
+    case PGP_PKA_RSA_ENCRYPT_ONLY:
+    case PGP_PKA_RSA_SIGN_ONLY:
+        mpic = 2;
+        break;
+    case PGP_PKA_DSA:
+        mpic = 4;
+        break;
+    case PGP_PKA_ELGAMAL:
+    case PGP_PKA_ELGAMAL_ENCRYPT_OR_SIGN:
+        mpic = 3;
+        break;
+    default:
+        return 0;
+    }
+    if ((publen = pubkey_body_len(body, len, off + 1, mpic)) == 0) {
+        return 0;
+    }
+    hdr = (publen < 192) ? 2 : (publen < 8192 + 192) ? 3 : 6;
+    if ((out->raw = malloc(hdr + publen)) == NULL) {
+        return 0;
+    }
+    out->raw[0] = PGP_PTAG_ALWAYS_SET | PGP_PTAG_NEW_FORMAT | tag;
+    if (publen < 192) {
+        out->raw[1] = (uint8_t) publen;
+    } else if (publen < 8192 + 192) {
+        out->raw[1] = (uint8_t)((publen - 192) >> 8) + 192;
+        out->raw[2] = (uint8_t)(publen - 192);
+    } else {
+        out->raw[1] = 0xff;
+        out->raw[2] = (uint8_t)(publen >> 24);
+        out->raw[3] = (uint8_t)(publen >> 16);
+        out->raw[4] = (uint8_t)(publen >> 8);
+        out->raw[5] = (uint8_t) publen;
+    }
+    (void) memcpy(&out->raw[hdr], body, publen);
+    out->length = hdr + publen;
+    return 1;
+}
+
 /**
 \ingroup Core_Create
 \brief Free allocated memory
@@ -1223,7 +1426,7 @@ pgp_pubkey_free(pgp_pubkey_t *p)
    \ingroup Core_ReadPackets
 */
 static int
-parse_pubkey_data(pgp_pubkey_t *key, pgp_region_t *region, pgp_stream_t *stream)
+read_pubkey_data(pgp_pubkey_t *key, pgp_region_t *region, pgp_stream_t *stream)
 {
     uint8_t c = 0x0;
 
@@ -1302,6 +1505,25 @@ parse_pubkey_data(pgp_pubkey_t *key, pgp_region_t *region, pgp_stream_t *stream)
     return 1;
 }
 
+/* read public key data, and the fingerprint of the bytes it was read from */
+static int
+parse_pubkey_data(pgp_pubkey_t *key, pgp_region_t *region, pgp_stream_t *stream)
+{
+    unsigned start = stream->readinfo.alength;
+
+    if (!read_pubkey_data(key, region, stream)) {
+        return 0;
+    }
+    (void) memset(&key->fingerprint, 0x0, sizeof(key->fingerprint));
+    if (key->version == PGP_V4 && stream->readinfo.accumulate &&
+        stream->readinfo.alength > start) {
+        (void) pgp_fingerprint_v4(&key->fingerprint,
+                                  stream->readinfo.accumulated + start,
+                                  stream->readinfo.alength - start);
+    }
+    return 1;
+}
+
 /**
  * \ingroup Core_ReadPackets
  * \brief Parse a public key packet.
@@ -1365,7 +1587,7 @@ parse_userattr(pgp_region_t *region, pgp_stream_t *stream)
         (void) fprintf(stderr, "parse_userattr: bad length\n");
         return 0;
     }
-    if (!read_data(&pkt.u.userattr, region, stream)) {
+    if (!read_data(NULL, &pkt.u.userattr, region, stream)) {
         return 0;
     }
     CALLBACK(PGP_PTAG_CT_USER_ATTR, &stream->cbinfo, &pkt);
@@ -1576,8 +1798,12 @@ parse_v3_sig(pgp_region_t *region, pgp_stream_t *stream)
  * \see RFC4880 5.2.3
  */
 static int
-parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stream)
+read_one_sig_subpacket(pgp_sig_t *   sig,
+                       pgp_region_t *region,
+                       pgp_stream_t *stream,
+                       pgp_cb_ret_t *cbret)
 {
+    pgp_arena_t *arena = &stream->arena;
     pgp_region_t subregion = {0};
     pgp_packet_t pkt = {0};
     uint8_t      bools = 0x0;
@@ -1609,15 +1835,16 @@ parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stre
     if (stream->ss_raw[t8] & t7) {
         pkt.u.ss_raw.tag = pkt.tag;
         pkt.u.ss_raw.length = subregion.length - 1;
-        pkt.u.ss_raw.raw = calloc(1, pkt.u.ss_raw.length);
+        pkt.u.ss_raw.raw = pgp_arena_alloc(arena, pkt.u.ss_raw.length);
         if (pkt.u.ss_raw.raw == NULL) {
-            (void) fprintf(stderr, "parse_one_sig_subpacket: bad alloc\n");
+            (void) fprintf(stderr, "read_one_sig_subpacket: bad alloc\n");
             return 0;
         }
         if (!limread(pkt.u.ss_raw.raw, (unsigned) pkt.u.ss_raw.length, &subregion, stream)) {
             return 0;
         }
-        CALLBACK(PGP_PTAG_RAW_SS, &stream->cbinfo, &pkt);
+        pkt.tag = PGP_PTAG_RAW_SS;
+        *cbret = pgp_callback(&pkt, &stream->cbinfo);
         return 1;
     }
     switch (pkt.tag) {
@@ -1659,19 +1886,19 @@ parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stre
         break;
 
     case PGP_PTAG_SS_PREFERRED_SKA:
-        if (!read_data(&pkt.u.ss_skapref, &subregion, stream)) {
+        if (!read_data(arena, &pkt.u.ss_skapref, &subregion, stream)) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_PREFERRED_HASH:
-        if (!read_data(&pkt.u.ss_hashpref, &subregion, stream)) {
+        if (!read_data(arena, &pkt.u.ss_hashpref, &subregion, stream)) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_PREF_COMPRESS:
-        if (!read_data(&pkt.u.ss_zpref, &subregion, stream)) {
+        if (!read_data(arena, &pkt.u.ss_zpref, &subregion, stream)) {
             return 0;
         }
         break;
@@ -1684,45 +1911,45 @@ parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stre
         break;
 
     case PGP_PTAG_SS_KEY_FLAGS:
-        if (!read_data(&pkt.u.ss_key_flags, &subregion, stream)) {
+        if (!read_data(arena, &pkt.u.ss_key_flags, &subregion, stream)) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_KEYSERV_PREFS:
-        if (!read_data(&pkt.u.ss_key_server_prefs, &subregion, stream)) {
+        if (!read_data(arena, &pkt.u.ss_key_server_prefs, &subregion, stream)) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_FEATURES:
-        if (!read_data(&pkt.u.ss_features, &subregion, stream)) {
+        if (!read_data(arena, &pkt.u.ss_features, &subregion, stream)) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_SIGNERS_USER_ID:
-        if (!read_unsig_str(&pkt.u.ss_signer, &subregion, stream)) {
+        if (!read_unsig_str(arena, &pkt.u.ss_signer, &subregion, stream)) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_EMBEDDED_SIGNATURE:
         /* \todo should do something with this sig? */
-        if (!read_data(&pkt.u.ss_embedded_sig, &subregion, stream)) {
+        if (!read_data(arena, &pkt.u.ss_embedded_sig, &subregion, stream)) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_ISSUER_FPR:
-        if (!read_data(&pkt.u.ss_issuer_fpr, &subregion, stream) ||
+        if (!read_data(arena, &pkt.u.ss_issuer_fpr, &subregion, stream) ||
             pkt.u.ss_issuer_fpr.len != 21 || pkt.u.ss_issuer_fpr.contents[0] != 0x04) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_NOTATION_DATA:
-        if (!limread_data(&pkt.u.ss_notation.flags, 4, &subregion, stream)) {
+        if (!limread_data(arena, &pkt.u.ss_notation.flags, 4, &subregion, stream)) {
             return 0;
         }
         if (!limread_size_t(&pkt.u.ss_notation.name.len, 2, &subregion, stream)) {
@@ -1731,13 +1958,15 @@ parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stre
         if (!limread_size_t(&pkt.u.ss_notation.value.len, 2, &subregion, stream)) {
             return 0;
         }
-        if (!limread_data(&pkt.u.ss_notation.name,
+        if (!limread_data(arena,
+                          &pkt.u.ss_notation.name,
                           (unsigned) pkt.u.ss_notation.name.len,
                           &subregion,
                           stream)) {
             return 0;
         }
-        if (!limread_data(&pkt.u.ss_notation.value,
+        if (!limread_data(arena,
+                          &pkt.u.ss_notation.value,
                           (unsigned) pkt.u.ss_notation.value.len,
                           &subregion,
                           stream)) {
@@ -1746,19 +1975,19 @@ parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stre
         break;
 
     case PGP_PTAG_SS_POLICY_URI:
-        if (!read_string(&pkt.u.ss_policy, &subregion, stream)) {
+        if (!read_string(arena, &pkt.u.ss_policy, &subregion, stream)) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_REGEXP:
-        if (!read_string(&pkt.u.ss_regexp, &subregion, stream)) {
+        if (!read_string(arena, &pkt.u.ss_regexp, &subregion, stream)) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_PREF_KEYSERV:
-        if (!read_string(&pkt.u.ss_keyserv, &subregion, stream)) {
+        if (!read_string(arena, &pkt.u.ss_keyserv, &subregion, stream)) {
             return 0;
         }
         break;
@@ -1774,13 +2003,13 @@ parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stre
     case PGP_PTAG_SS_USERDEFINED08:
     case PGP_PTAG_SS_USERDEFINED09:
     case PGP_PTAG_SS_USERDEFINED10:
-        if (!read_data(&pkt.u.ss_userdef, &subregion, stream)) {
+        if (!read_data(arena, &pkt.u.ss_userdef, &subregion, stream)) {
             return 0;
         }
         break;
 
     case PGP_PTAG_SS_RESERVED:
-        if (!read_data(&pkt.u.ss_unknown, &subregion, stream)) {
+        if (!read_data(arena, &pkt.u.ss_unknown, &subregion, stream)) {
             return 0;
         }
         break;
@@ -1791,7 +2020,7 @@ parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stre
             return 0;
         }
         /* the rest is a human-readable UTF-8 string */
-        if (!read_string(&pkt.u.ss_revocation.reason, &subregion, stream)) {
+        if (!read_string(arena, &pkt.u.ss_revocation.reason, &subregion, stream)) {
             return 0;
         }
         break;
@@ -1841,9 +2070,6 @@ parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stre
         if (!doread && !limskip(subregion.length - 1, &subregion, stream)) {
             return 0;
         }
-        if (doread) {
-            pgp_parser_content_free(&pkt);
-        }
         return 1;
     }
     if (doread && subregion.readc != subregion.length) {
@@ -1853,10 +2079,28 @@ parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stre
                     subregion.length - subregion.readc);
         return 0;
     }
-    CALLBACK(pkt.tag, &stream->cbinfo, &pkt);
+    *cbret = pgp_callback(&pkt, &stream->cbinfo);
     return 1;
 }
 
+/* Subpacket contents are allocated from the stream's arena and given back
+ * once the callback is done with them, unless it asked to keep them: then
+ * they stay put until the stream is deleted. */
+static int
+parse_one_sig_subpacket(pgp_sig_t *sig, pgp_region_t *region, pgp_stream_t *stream)
+{
+    pgp_arena_mark_t mark;
+    pgp_cb_ret_t     cbret = PGP_RELEASE_MEMORY;
+    int              ret;
+
+    mark = pgp_arena_mark(&stream->arena);
+    ret = read_one_sig_subpacket(sig, region, stream, &cbret);
+    if (!ret || cbret != PGP_KEEP_MEMORY) {
+        pgp_arena_release(&stream->arena, mark);
+    }
+    return ret;
+}
+
 /**
  * \ingroup Core_ReadPackets
  * \brief Parse several signature subpackets.
@@ -2063,7 +2307,7 @@ parse_v4_sig(pgp_region_t *region, pgp_stream_t *stream)
     case PGP_PKA_PRIVATE08:
     case PGP_PKA_PRIVATE09:
     case PGP_PKA_PRIVATE10:
-        if (!read_data(&pkt.u.sig.info.sig.unknown, region, stream)) {
+        if (!read_data(NULL, &pkt.u.sig.info.sig.unknown, region, stream)) {
             return 0;
         }
         break;
@@ -2238,7 +2482,7 @@ parse_trust(pgp_region_t *region, pgp_stream_t *stream)
 {
     pgp_packet_t pkt = {0};
 
-    if (!read_data(&pkt.u.trust, region, stream)) {
+    if (!read_data(NULL, &pkt.u.trust, region, stream)) {
         return 0;
     }
     CALLBACK(PGP_PTAG_CT_TRUST, &stream->cbinfo, &pkt);
@@ -2348,7 +2592,7 @@ consume_packet(pgp_region_t *region, pgp_stream_t *stream, unsigned warn)
         ERRP(&stream->cbinfo, pkt, "Can't consume indeterminate packets");
     }
 
-    if (read_data(&remainder, region, stream)) {
+    if (read_data(NULL, &remainder, region, stream)) {
         /* now throw it away */
         pgp_data_free(&remainder);
         if (warn) {
@@ -2724,6 +2968,12 @@ parse_pk_sesskey(pgp_region_t *region, pgp_stream_t *stream)
         return 0;
     }
 
+    if (pgp_get_decrypt(stream) != NULL) {
+        /* an earlier session key packet already gave us the key */
+        CALLBACK(PGP_PTAG_CT_ENCRYPTED_PK_SESSION_KEY, &stream->cbinfo, &pkt);
+        return 1;
+    }
+
     (void) memset(&sesskey, 0x0, sizeof(sesskey));
     secret = NULL;
     sesskey.u.get_seckey.seckey = &secret;
@@ -3097,6 +3347,7 @@ parse_packet(pgp_stream_t *stream, uint32_t *pktlen)
     if (rnp_get_debug(__FILE__)) {
         (void) fprintf(stderr, "parse_packet: type %u\n", pkt.u.ptag.type);
     }
+    PGP_TRACE_BEGIN("parse_packet", pgp_show_packet_tag((pgp_content_enum) pkt.u.ptag.type));
     switch (pkt.u.ptag.type) {
     case PGP_PTAG_CT_SIGNATURE:
         ret = parse_sig(&region, stream);
@@ -3188,6 +3439,7 @@ parse_packet(pgp_stream_t *stream, uint32_t *pktlen)
         CALLBACK(PGP_PARSER_PACKET_END, &stream->cbinfo, &pkt);
     }
     stream->readinfo.alength = 0;
+    PGP_TRACE_END("parse_packet");
 
     return (ret < 0) ? -1 : (ret) ? 1 : 0;
 }
@@ -3227,9 +3479,11 @@ pgp_parse(pgp_stream_t *stream, const int perrors)
     uint32_t pktlen;
     int      r;
 
+    PGP_TRACE_BEGIN("pgp_parse", NULL);
     do {
         r = parse_packet(stream, &pktlen);
     } while (r != -1);
+    PGP_TRACE_END("pgp_parse");
     if (perrors) {
         pgp_print_errors(stream->errors);
     }
@@ -3307,6 +3561,7 @@ pgp_stream_delete(pgp_stream_t *stream)
     if (stream->readinfo.accumulated) {
         free(stream->readinfo.accumulated);
     }
+    pgp_arena_free(&stream->arena);
     free(stream);
 }
 
@@ -3506,3 +3761,114 @@ pgp_parse_and_accumulate(pgp_io_t *io, rnp_key_store_t *keyring, pgp_stream_t *p
 
     return ret;
 }
+
+/* length of the packet starting at buf, header included; 0 if it is cut short */
+static size_t
+scan_packet(const uint8_t *buf, size_t len, pgp_content_enum *tag)
+{
+    size_t   hdr;
+    size_t   body;
+    unsigned partial;
+    uint8_t  c;
+
+    if (len < 2 || !(buf[0] & PGP_PTAG_ALWAYS_SET)) {
+        return 0;
+    }
+    if (!(buf[0] & PGP_PTAG_NEW_FORMAT)) {
+        *tag = (buf[0] & PGP_PTAG_OF_CONTENT_TAG_MASK) >> PGP_PTAG_OF_CONTENT_TAG_SHIFT;
+        switch (buf[0] & PGP_PTAG_OF_LENGTH_TYPE_MASK) {
+        case PGP_PTAG_OLD_LEN_1:
+            hdr = 2;
+            body = buf[1];
+            break;
+        case PGP_PTAG_OLD_LEN_2:
+            if (len < 3) {
+                return 0;
+            }
+            hdr = 3;
+            body = ((size_t) buf[1] << 8) | buf[2];
+            break;
+        case PGP_PTAG_OLD_LEN_4:
+            if (len < 5) {
+                return 0;
+            }
+            hdr = 5;
+            body = ((size_t) buf[1] << 24) | ((size_t) buf[2] << 16) |
+                   ((size_t) buf[3] << 8) | buf[4];
+            break;
+        default:
+            /* runs to the end of the data */
+            return len;
+        }
+        return (hdr + body <= len) ? hdr + body : 0;
+    }
+    /* new format, with the length rules of read_new_length() */
+    *tag = buf[0] & PGP_PTAG_NF_CONTENT_TAG_MASK;
+    hdr = 1;
+    do {
+        if (hdr >= len) {
+            return 0;
+        }
+        c = buf[hdr++];
+        partial = 0;
+        if (c < 192) {
+            body = c;
+        } else if (c < 224) {
+            if (hdr >= len) {
+                return 0;
+            }
+            body = ((size_t)(c - 192) << 8) + buf[hdr++] + 192;
+        } else if (c < 255) {
+            body = (size_t) 1 << (c & 0x1f);
+            partial = 1;
+        } else {
+            if (len - hdr < 4) {
+                return 0;
+            }
+            body = ((size_t) buf[hdr] << 24) | ((size_t) buf[hdr + 1] << 16) |
+                   ((size_t) buf[hdr + 2] << 8) | buf[hdr + 3];
+            hdr += 4;
+        }
+        if (body > len - hdr) {
+            return 0;
+        }
+        /* partial lengths are followed by the length of the next chunk */
+        hdr += body;
+    } while (partial);
+    return hdr;
+}
+
+/**
+ * \ingroup Core_Parse
+ *
+ * Split a run of transferable keys into at most n parts of roughly equal
+ * size, only looking at the packet headers. Each part but the first starts
+ * with a primary key packet, so the parts can be parsed independently.
+ *
+ * \param starts Filled with the offset at which each part starts
+ * \return the number of parts, or 0 if the data is not a packet stream
+ */
+unsigned
+pgp_split_at_keys(const uint8_t *buf, size_t len, size_t *starts, unsigned n)
+{
+    pgp_content_enum tag;
+    unsigned         parts;
+    size_t           off;
+    size_t           cc;
+
+    if (n == 0) {
+        return 0;
+    }
+    starts[0] = 0;
+    parts = 1;
+    for (off = 0; off < len; off += cc) {
+        if ((cc = scan_packet(&buf[off], len - off, &tag)) == 0) {
+            return 0;
+        }
+        if ((tag == PGP_PTAG_CT_PUBLIC_KEY || tag == PGP_PTAG_CT_SECRET_KEY) && parts < n &&
+            off > 0 && off >= (len / n) * parts) {
+            starts[parts++] = off;
+        }
+    }
+    return parts;
+}
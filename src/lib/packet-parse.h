@@ -72,7 +72,12 @@ typedef struct pgp_region_t {
 
 void pgp_init_subregion(pgp_region_t *, pgp_region_t *);
 
-/** pgp_cb_ret_t */
+/** pgp_cb_ret_t
+ *
+ * Signature subpacket contents live in the parsing stream's arena: a
+ * callback that keeps them may use them until the stream is deleted, but
+ * must not free them.
+ */
 typedef enum { PGP_RELEASE_MEMORY, PGP_KEEP_MEMORY, PGP_FINISHED } pgp_cb_ret_t;
 
 typedef struct pgp_cbdata_t pgp_cbdata_t;
@@ -120,6 +125,7 @@ void *pgp_callback_errors(pgp_cbdata_t *);
 void  pgp_reader_set(pgp_stream_t *, pgp_reader_func_t *, pgp_reader_destroyer_t *, void *);
 void  pgp_reader_push(pgp_stream_t *, pgp_reader_func_t *, pgp_reader_destroyer_t *, void *);
 void  pgp_reader_pop(pgp_stream_t *);
+void  pgp_reader_set_stage(pgp_stream_t *, const char *);
 
 void *pgp_reader_get_arg(pgp_reader_t *);
 
@@ -163,6 +169,7 @@ pgp_reader_func_t pgp_stacked_read;
 int      pgp_decompress(pgp_region_t *, pgp_stream_t *, pgp_compression_type_t);
 unsigned pgp_writez(pgp_output_t *, const uint8_t *, const unsigned);
 
-int pgp_parse_and_accumulate(pgp_io_t *io, rnp_key_store_t *, pgp_stream_t *);
+int      pgp_parse_and_accumulate(pgp_io_t *io, rnp_key_store_t *, pgp_stream_t *);
+unsigned pgp_split_at_keys(const uint8_t *, size_t, size_t *, unsigned);
 
 #endif /* PACKET_PARSE_H_ */
@@ -143,7 +143,9 @@ print_uint(int indent, const char *name, unsigned val)
 static void
 showtime(const char *name, time_t t)
 {
-    printf("%s=%" PRItime "d (%.24s)", name, (long long) t, ctime(&t));
+    char buf[32];
+
+    printf("%s=%" PRItime "d (%.24s)", name, (long long) t, ctime_r(&t, buf));
 }
 
 static void
@@ -370,9 +372,10 @@ strhexdump(char *dest, const uint8_t *src, size_t length, const char *sep)
 static char *
 ptimestr(char *dest, size_t size, time_t t)
 {
+    struct tm  tmbuf;
     struct tm *tm;
 
-    tm = gmtime(&t);
+    tm = gmtime_r(&t, &tmbuf);
 
     /* Remember - we guarantee that the time string will be PTIMESTR_LEN
      * characters long.
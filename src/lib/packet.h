@@ -411,6 +411,16 @@ typedef enum {
     PGP_V4 = 4  /* Version 4 */
 } pgp_version_t;
 
+#define PGP_KEY_ID_SIZE 8
+#define PGP_FINGERPRINT_SIZE 20
+
+/** pgp_fingerprint_t */
+typedef struct {
+    uint8_t        fingerprint[PGP_FINGERPRINT_SIZE];
+    unsigned       length;
+    pgp_hash_alg_t hashtype;
+} pgp_fingerprint_t;
+
 /** Structure to hold a pgp public key */
 typedef struct {
     pgp_version_t version; /* version of the key (v3, v4...) */
@@ -427,15 +437,17 @@ typedef struct {
         pgp_rsa_pubkey_t     rsa;     /* An RSA public key */
         pgp_elgamal_pubkey_t elgamal; /* An ElGamal public key */
     } key;                            /* Public Key Parameters */
+    pgp_fingerprint_t fingerprint;    /* v4, of the packet read; if length */
 } pgp_pubkey_t;
 
 /** Structure to hold data for one RSA secret key
  */
 typedef struct {
-    BIGNUM *d;
-    BIGNUM *p;
-    BIGNUM *q;
-    BIGNUM *u;
+    BIGNUM *                 d;
+    BIGNUM *                 p;
+    BIGNUM *                 q;
+    BIGNUM *                 u;
+    struct pgp_rsa_signer_t *signer; /* key loaded once to sign with, if any */
 } pgp_rsa_seckey_t;
 
 /** pgp_dsa_seckey_t */
@@ -521,8 +533,9 @@ typedef struct pgp_seckey_t {
         pgp_dsa_seckey_t     dsa;
         pgp_elgamal_seckey_t elgamal;
     } key;
-    unsigned checksum;
-    uint8_t *checkhash;
+    unsigned            checksum;
+    uint8_t *           checkhash;
+    struct pgp_agent_t *agent; /* holds the secret part, if it is not here */
 } pgp_seckey_t;
 
 /** Signature Type.
@@ -582,9 +595,6 @@ typedef struct pgp_elgamal_sig_t {
     BIGNUM *s;
 } pgp_elgamal_sig_t;
 
-#define PGP_KEY_ID_SIZE 8
-#define PGP_FINGERPRINT_SIZE 20
-
 /** Struct to hold a signature packet.
  *
  * \see RFC4880 5.2.2
@@ -847,15 +857,9 @@ struct pgp_packet_t {
     pgp_contents_t   u;        /* union for contents */
 };
 
-/** pgp_fingerprint_t */
-typedef struct {
-    uint8_t        fingerprint[PGP_FINGERPRINT_SIZE];
-    unsigned       length;
-    pgp_hash_alg_t hashtype;
-} pgp_fingerprint_t;
-
 int pgp_keyid(uint8_t *, const size_t, const pgp_pubkey_t *, pgp_hash_alg_t);
 int pgp_fingerprint(pgp_fingerprint_t *, const pgp_pubkey_t *, pgp_hash_alg_t);
+int pgp_fingerprint_v4(pgp_fingerprint_t *, const uint8_t *, unsigned);
 
 void pgp_finish(void);
 void pgp_pubkey_free(pgp_pubkey_t *);
@@ -866,10 +870,13 @@ void pgp_ss_notation_free(pgp_ss_notation_t *);
 void pgp_ss_revocation_free(pgp_ss_revocation_t *);
 void pgp_ss_sig_target_free(pgp_ss_sig_target_t *);
 
-void pgp_subpacket_free(pgp_subpacket_t *);
-void pgp_parser_content_free(pgp_packet_t *);
-void pgp_seckey_free(pgp_seckey_t *);
-void pgp_pk_sesskey_free(pgp_pk_sesskey_t *);
+void           pgp_subpacket_free(pgp_subpacket_t *);
+unsigned       pgp_subpacket_tag(const pgp_subpacket_t *);
+const uint8_t *pgp_subpacket_body(const pgp_subpacket_t *, size_t *);
+int            pgp_subpacket_public(pgp_subpacket_t *, const pgp_subpacket_t *);
+void           pgp_parser_content_free(pgp_packet_t *);
+void           pgp_seckey_free(pgp_seckey_t *);
+void           pgp_pk_sesskey_free(pgp_pk_sesskey_t *);
 
 int pgp_print_packet(pgp_printstate_t *, const pgp_packet_t *);
 
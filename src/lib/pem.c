@@ -84,6 +84,7 @@
 
 #include "crypto.h"
 #include "rnpdefs.h"
+#include "rng.h"
 
 int
 read_pem_seckey(const char *f, pgp_key_t *key, const char *type, int verbose)
@@ -114,7 +115,7 @@ read_pem_seckey(const char *f, pgp_key_t *key, const char *type, int verbose)
     }
     (void) fclose(fp);
 
-    botan_rng_init(&rng, NULL);
+    rng = pgp_rng_handle();
 
     if (strcmp(type, "ssh-rsa") == 0) {
         if (botan_privkey_load(&priv_key, rng, keybuf, read, NULL) != 0) {
@@ -162,7 +163,6 @@ read_pem_seckey(const char *f, pgp_key_t *key, const char *type, int verbose)
         ok = 0;
     }
 
-    botan_rng_destroy(rng);
 
     return ok;
 }
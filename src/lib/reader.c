@@ -120,6 +120,8 @@ __RCSID("$NetBSD: reader.c,v 1.49 2012/03/05 02:20:18 christos Exp $");
 #include "rnpdefs.h"
 #include "rnpdigest.h"
 #include "packet-key.h"
+#include "agent.h"
+#include "seckeycache.h"
 
 /* data from partial blocks is queued up in virtual block in stream */
 static int
@@ -183,6 +185,7 @@ pgp_reader_set(pgp_stream_t *          stream,
     stream->readinfo.reader = reader;
     stream->readinfo.destroyer = destroyer;
     stream->readinfo.arg = vp;
+    stream->readinfo.stats = NULL;
 }
 
 /**
@@ -230,6 +233,19 @@ pgp_reader_pop(pgp_stream_t *stream)
     free(next);
 }
 
+/**
+ * \ingroup Internal_Readers_Generic
+ * \brief Names the top of the reader stack for statistics
+ * \param stream Parse settings
+ * \param name Stage name, must be a constant string
+ * \note Does nothing unless statistics are being collected
+ */
+void
+pgp_reader_set_stage(pgp_stream_t *stream, const char *name)
+{
+    stream->readinfo.stats = pgp_stats_stage(name, PGP_STAGE_READER);
+}
+
 /**
  * \ingroup Internal_Readers_Generic
  * \brief Gets arg from reader
@@ -1311,6 +1327,7 @@ pgp_reader_push_dearmour(pgp_stream_t *parse_info)
         dearmour->got_sig = 0;
 
         pgp_reader_push(parse_info, armoured_data_reader, armoured_data_destroyer, dearmour);
+        pgp_reader_set_stage(parse_info, "dearmour");
     }
 }
 
@@ -1470,6 +1487,7 @@ pgp_reader_push_decrypt(pgp_stream_t *stream, pgp_crypt_t *decrypt, pgp_region_t
         encrypted->region = region;
         pgp_decrypt_init(encrypted->decrypt);
         pgp_reader_push(stream, encrypted_data_reader, encrypted_data_destroyer, encrypted);
+        pgp_reader_set_stage(stream, "decrypt");
     }
 }
 
@@ -1658,6 +1676,7 @@ pgp_reader_push_se_ip_data(pgp_stream_t *stream, pgp_crypt_t *decrypt, pgp_regio
         se_ip->region = region;
         se_ip->decrypt = decrypt;
         pgp_reader_push(stream, se_ip_data_reader, se_ip_data_destroyer, se_ip);
+        pgp_reader_set_stage(stream, "se-ip");
     }
 }
 
@@ -1753,6 +1772,7 @@ pgp_reader_set_fd(pgp_stream_t *stream, int fd)
     } else {
         reader->fd = fd;
         pgp_reader_set(stream, fd_reader, reader_fd_destroyer, reader);
+        pgp_reader_set_stage(stream, "fd");
     }
 }
 
@@ -1817,6 +1837,7 @@ pgp_reader_set_memory(pgp_stream_t *stream, const void *buffer, size_t length)
         mem->length = length;
         mem->offset = 0;
         pgp_reader_set(stream, mem_reader, mem_destroyer, mem);
+        pgp_reader_set_stage(stream, "memory");
     }
 }
 
@@ -2088,6 +2109,9 @@ pgp_litdata_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
     return PGP_RELEASE_MEMORY;
 }
 
+/* the key id of a session key encrypted to a hidden recipient */
+static const uint8_t wildcard[PGP_KEY_ID_SIZE];
+
 pgp_cb_ret_t
 pgp_pk_sesskey_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
 {
@@ -2109,6 +2133,10 @@ pgp_pk_sesskey_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
             (void) fprintf(io->errs, "pgp_pk_sesskey_cb: bad keyring\n");
             return (pgp_cb_ret_t) 0;
         }
+        if (memcmp(content->pk_sesskey.key_id, wildcard, sizeof(wildcard)) == 0) {
+            /* the key was found by trying them */
+            break;
+        }
         from = 0;
         cbinfo->cryptinfo.keydata = rnp_key_store_get_key_by_id(
           io, cbinfo->cryptinfo.secring, content->pk_sesskey.key_id, &from, NULL);
@@ -2124,6 +2152,138 @@ pgp_pk_sesskey_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
     return PGP_RELEASE_MEMORY;
 }
 
+/* the secret key of a key pair, from rnp-agent, the keys unlocked before,
+ * or unlocked now with the passphrase */
+static const pgp_seckey_t *
+unlock_seckey(pgp_cbdata_t *cbinfo, const pgp_key_t *keypair, const pgp_key_t *pubkey)
+{
+    pgp_cryptinfo_t *cryptinfo = &cbinfo->cryptinfo;
+    pgp_seckey_t *   secret;
+    pgp_seckey_t *   cached;
+    int              i;
+
+    if (cryptinfo->agent != NULL &&
+        (secret = pgp_agent_seckey(cryptinfo->agent, keypair)) != NULL) {
+        /* rnp-agent will do the decryption */
+        return secret;
+    }
+    if (cryptinfo->seckeys != NULL &&
+        (secret = pgp_seckey_cache_get(cryptinfo->seckeys, keypair)) != NULL) {
+        return secret;
+    }
+    secret = NULL;
+    for (i = 0; cbinfo->numtries == -1 || i < cbinfo->numtries; i++) {
+        /* print out the user id */
+        pgp_print_keydata(
+          cbinfo->io, cryptinfo->pubring, pubkey, "signature ", &pubkey->key.pubkey, 0);
+        /* now decrypt key */
+        secret = pgp_decrypt_seckey(keypair, cbinfo->passfp);
+        if (secret != NULL) {
+            break;
+        }
+        (void) fprintf(cbinfo->io->errs, "Bad passphrase\n");
+    }
+    if (secret == NULL) {
+        (void) fprintf(cbinfo->io->errs, "Exhausted passphrase attempts\n");
+        return NULL;
+    }
+    if (cryptinfo->seckeys != NULL &&
+        (cached = pgp_seckey_cache_put(cryptinfo->seckeys, keypair, secret)) != NULL) {
+        return cached;
+    }
+    return secret;
+}
+
+/*
+ * find the secret key for a session key encrypted to a hidden recipient.
+ * The keys unlocked before are all tried at once; only if none of them is
+ * the one are the other secret keys unlocked, with one passphrase each, and
+ * tried in turn.
+ */
+static const pgp_seckey_t *
+hidden_recipient_seckey(pgp_cbdata_t *cbinfo, const pgp_pk_sesskey_t *sesskey)
+{
+    pgp_cryptinfo_t *    cryptinfo = &cbinfo->cryptinfo;
+    rnp_key_store_t *    secring = cryptinfo->secring;
+    const pgp_seckey_t **seckeys;
+    const pgp_key_t **   owners;
+    const pgp_key_t *    key;
+    pgp_seckey_t *       secret;
+    pgp_seckey_t *       cached;
+    uint8_t *            tried;
+    unsigned             seckeyc;
+    unsigned             i;
+    int                  found;
+
+    if (secring == NULL || secring->keyc == 0) {
+        return NULL;
+    }
+    seckeys = calloc(secring->keyc, sizeof(*seckeys));
+    owners = calloc(secring->keyc, sizeof(*owners));
+    tried = calloc(secring->keyc, sizeof(*tried));
+    if (seckeys == NULL || owners == NULL || tried == NULL) {
+        (void) fprintf(cbinfo->io->errs, "hidden_recipient_seckey: bad alloc\n");
+        free(seckeys);
+        free(owners);
+        free(tried);
+        return NULL;
+    }
+    seckeyc = 0;
+    for (i = 0; cryptinfo->seckeys != NULL && i < secring->keyc; i++) {
+        if ((key = rnp_key_store_get_key(cbinfo->io, secring, i)) == NULL ||
+            !pgp_is_key_secret(key) ||
+            (secret = pgp_seckey_cache_get(cryptinfo->seckeys, key)) == NULL) {
+            continue;
+        }
+        tried[i] = 1;
+        if (secret->pubkey.alg != sesskey->alg) {
+            (void) pgp_seckey_cache_release(cryptinfo->seckeys, secret);
+            continue;
+        }
+        owners[seckeyc] = key;
+        seckeys[seckeyc++] = secret;
+    }
+    found = (seckeyc > 0) ? pgp_find_sesskey_seckey(sesskey, seckeys, seckeyc) : -1;
+    for (i = 0; i < seckeyc; i++) {
+        if ((int) i != found) {
+            (void) pgp_seckey_cache_release(cryptinfo->seckeys, seckeys[i]);
+        }
+    }
+    secret = NULL;
+    if (found >= 0) {
+        cryptinfo->keydata = owners[found];
+        secret = (pgp_seckey_t *) seckeys[found];
+    }
+    for (i = 0; secret == NULL && i < secring->keyc; i++) {
+        if (tried[i] || (key = rnp_key_store_get_key(cbinfo->io, secring, i)) == NULL ||
+            !pgp_is_key_secret(key) || key->key.pubkey.alg != sesskey->alg) {
+            continue;
+        }
+        pgp_print_keydata(
+          cbinfo->io, cryptinfo->pubring, key, "signature ", &key->key.pubkey, 0);
+        if ((secret = pgp_decrypt_seckey(key, cbinfo->passfp)) == NULL) {
+            (void) fprintf(cbinfo->io->errs, "Bad passphrase\n");
+            continue;
+        }
+        if (cryptinfo->seckeys != NULL &&
+            (cached = pgp_seckey_cache_put(cryptinfo->seckeys, key, secret)) != NULL) {
+            secret = cached;
+        }
+        seckeys[0] = secret;
+        if (pgp_find_sesskey_seckey(sesskey, seckeys, 1) == 0) {
+            cryptinfo->keydata = key;
+        } else {
+            cryptinfo->seckey = secret;
+            pgp_forget_seckey(cryptinfo);
+            secret = NULL;
+        }
+    }
+    free(seckeys);
+    free(owners);
+    free(tried);
+    return secret;
+}
+
 /**
  \ingroup Core_Callbacks
 
@@ -2147,7 +2307,6 @@ pgp_get_seckey_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
     const pgp_key_t *     keypair;
     unsigned              from;
     pgp_io_t *            io;
-    int                   i;
 
     io = cbinfo->io;
     if (rnp_get_debug(__FILE__)) {
@@ -2155,6 +2314,22 @@ pgp_get_seckey_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
     }
     switch (pkt->tag) {
     case PGP_GET_SECKEY:
+        /* the parser is done with the last one */
+        pgp_forget_seckey(&cbinfo->cryptinfo);
+        if (memcmp(content->get_seckey.pk_sesskey->key_id, wildcard, sizeof(wildcard)) == 0) {
+            if (cbinfo->gotpass) {
+                /* already have the session key */
+                break;
+            }
+            if ((secret = hidden_recipient_seckey(cbinfo, content->get_seckey.pk_sesskey)) ==
+                NULL) {
+                return (pgp_cb_ret_t) 0;
+            }
+            cbinfo->cryptinfo.seckey = secret;
+            cbinfo->gotpass = 1;
+            *content->get_seckey.seckey = secret;
+            break;
+        }
         /* print key from pubring */
         from = 0;
         pubkey = rnp_key_store_get_key_by_id(
@@ -2170,23 +2345,11 @@ pgp_get_seckey_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
         if (pubkey == NULL) {
             pubkey = keypair;
         }
-        secret = NULL;
         cbinfo->gotpass = 0;
-        for (i = 0; cbinfo->numtries == -1 || i < cbinfo->numtries; i++) {
-            /* print out the user id */
-            pgp_print_keydata(
-              io, cbinfo->cryptinfo.pubring, pubkey, "signature ", &pubkey->key.pubkey, 0);
-            /* now decrypt key */
-            secret = pgp_decrypt_seckey(keypair, cbinfo->passfp);
-            if (secret != NULL) {
-                break;
-            }
-            (void) fprintf(io->errs, "Bad passphrase\n");
-        }
-        if (secret == NULL) {
-            (void) fprintf(io->errs, "Exhausted passphrase attempts\n");
+        if ((secret = unlock_seckey(cbinfo, keypair, pubkey)) == NULL) {
             return (pgp_cb_ret_t) PGP_RELEASE_MEMORY;
         }
+        cbinfo->cryptinfo.seckey = secret;
         cbinfo->gotpass = 1;
         *content->get_seckey.seckey = secret;
         break;
@@ -2198,6 +2361,31 @@ pgp_get_seckey_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
     return PGP_RELEASE_MEMORY;
 }
 
+/**
+ \ingroup Core_Callbacks
+ \brief Give back the secret key pgp_get_seckey_cb() last handed out, to the
+ keys unlocked before if it came from them
+*/
+void
+pgp_forget_seckey(pgp_cryptinfo_t *cryptinfo)
+{
+    pgp_seckey_t *seckey = (pgp_seckey_t *) cryptinfo->seckey;
+
+    if (seckey == NULL) {
+        return;
+    }
+    cryptinfo->seckey = NULL;
+    if (seckey->agent != NULL) {
+        /* holds nothing secret, and shares the public part */
+        free(seckey);
+        return;
+    }
+    if (cryptinfo->seckeys == NULL || !pgp_seckey_cache_release(cryptinfo->seckeys, seckey)) {
+        pgp_seckey_free(seckey);
+        free(seckey);
+    }
+}
+
 /**
  \ingroup HighLevel_Callbacks
  \brief Callback to use when you need to prompt user for passphrase
@@ -2269,6 +2457,7 @@ void
 pgp_reader_push_hash(pgp_stream_t *stream, pgp_hash_t *hash)
 {
     pgp_reader_push(stream, hash_reader, NULL, hash);
+    pgp_reader_set_stage(stream, "hash");
 }
 
 /**
@@ -2337,8 +2526,10 @@ pgp_reader_set_mmap(pgp_stream_t *stream, int fd)
         mem->mem = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE | MAP_FILE, fd, 0);
         if (mem->mem == MAP_FAILED) {
             pgp_reader_set(stream, fd_reader, reader_fd_destroyer, mem);
+            pgp_reader_set_stage(stream, "fd");
         } else {
             pgp_reader_set(stream, mmap_reader, mmap_destroyer, mem);
+            pgp_reader_set_stage(stream, "mmap");
         }
     }
 }
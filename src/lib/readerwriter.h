@@ -77,7 +77,7 @@ unsigned pgp_write_se_ip_pktset(pgp_output_t *,
                                 const unsigned,
                                 pgp_crypt_t *);
 void pgp_push_enc_crypt(pgp_output_t *, pgp_crypt_t *);
-int  pgp_push_enc_se_ip(pgp_output_t *, const pgp_key_t *, const char *);
+int  pgp_push_enc_se_ip(pgp_output_t *, const pgp_key_t **, unsigned, const char *);
 
 /* Secret Key checksum */
 void     pgp_push_checksum_writer(pgp_output_t *, pgp_seckey_t *);
@@ -119,6 +119,7 @@ unsigned pgp_reader_set_accumulate(pgp_stream_t *, unsigned);
 pgp_cb_ret_t pgp_litdata_cb(const pgp_packet_t *, pgp_cbdata_t *);
 pgp_cb_ret_t pgp_pk_sesskey_cb(const pgp_packet_t *, pgp_cbdata_t *);
 pgp_cb_ret_t pgp_get_seckey_cb(const pgp_packet_t *, pgp_cbdata_t *);
+void         pgp_forget_seckey(pgp_cryptinfo_t *);
 
 int pgp_getpassphrase(void *, char *, size_t);
 
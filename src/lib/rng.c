@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Shared per-thread random number generator, see rng.h */
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <pthread.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rng.h"
+
+#define RNG_BUFSIZE 256
+
+/* ask the system for fresh entropy after this much output */
+#define RNG_RESEED_BYTES (1024 * 1024)
+#define RNG_RESEED_BITS 256
+
+typedef struct rng_state_t {
+    botan_rng_t rng;
+    pid_t       pid;
+    size_t      drawn; /* bytes handed out since the last reseed */
+    size_t      avail; /* unread bytes at the end of buf */
+    uint8_t     buf[RNG_BUFSIZE];
+} rng_state_t;
+
+static _Thread_local rng_state_t *rng_state;
+
+/* frees a thread's generator when the thread exits without cleaning up */
+static pthread_key_t  rng_key;
+static pthread_once_t rng_key_once = PTHREAD_ONCE_INIT;
+static int            rng_key_ok;
+
+static void
+rng_state_free(rng_state_t *state)
+{
+    botan_rng_destroy(state->rng);
+    (void) memset(state, 0x0, sizeof(*state));
+    free(state);
+}
+
+static void
+rng_state_destroy(void *vp)
+{
+    rng_state_free(vp);
+}
+
+static void
+rng_key_create(void)
+{
+    rng_key_ok = (pthread_key_create(&rng_key, rng_state_destroy) == 0);
+}
+
+/* make state the calling thread's generator; NULL for none */
+static void
+rng_state_set(rng_state_t *state)
+{
+    rng_state = state;
+    if (rng_key_ok) {
+        (void) pthread_setspecific(rng_key, state);
+    }
+}
+
+/* this thread's generator, (re)created on first use and after fork() */
+static rng_state_t *
+rng_state_get(void)
+{
+    rng_state_t *state = rng_state;
+    pid_t        pid = getpid();
+
+    if (state && state->pid == pid) {
+        return state;
+    }
+    if (state) {
+        rng_state_free(state);
+        rng_state_set(NULL);
+    }
+    (void) pthread_once(&rng_key_once, rng_key_create);
+    if ((state = calloc(1, sizeof(*state))) == NULL) {
+        return NULL;
+    }
+    if (botan_rng_init(&state->rng, "user") != 0) {
+        free(state);
+        return NULL;
+    }
+    state->pid = pid;
+    rng_state_set(state);
+    return state;
+}
+
+/* the calling thread's generator, for passing to Botan; not to be destroyed */
+botan_rng_t
+pgp_rng_handle(void)
+{
+    rng_state_t *state = rng_state_get();
+
+    return (state) ? state->rng : NULL;
+}
+
+/* fill `dest' with `length' random bytes, 1 on success */
+int
+pgp_rng_get(void *dest, size_t length)
+{
+    rng_state_t *state;
+    uint8_t *    out = dest;
+    size_t       n;
+
+    if ((state = rng_state_get()) == NULL) {
+        return 0;
+    }
+    if (state->drawn >= RNG_RESEED_BYTES) {
+        if (botan_rng_reseed(state->rng, RNG_RESEED_BITS) != 0) {
+            return 0;
+        }
+        state->drawn = 0;
+    }
+    state->drawn += length;
+    if (length > RNG_BUFSIZE / 2) {
+        return botan_rng_get(state->rng, out, length) == 0;
+    }
+    while (length > 0) {
+        if (state->avail == 0) {
+            if (botan_rng_get(state->rng, state->buf, RNG_BUFSIZE) != 0) {
+                return 0;
+            }
+            state->avail = RNG_BUFSIZE;
+        }
+        n = (length < state->avail) ? length : state->avail;
+        (void) memcpy(out, &state->buf[RNG_BUFSIZE - state->avail], n);
+        /* never hand out the same bytes twice */
+        (void) memset(&state->buf[RNG_BUFSIZE - state->avail], 0x0, n);
+        state->avail -= n;
+        out += n;
+        length -= n;
+    }
+    return 1;
+}
+
+/* release the calling thread's generator now, rather than when it exits */
+void
+pgp_rng_cleanup(void)
+{
+    if (rng_state) {
+        rng_state_free(rng_state);
+        rng_state_set(NULL);
+    }
+}
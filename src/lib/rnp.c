@@ -52,9 +52,12 @@ __RCSID("$NetBSD: rnp.c,v 1.98 2016/06/28 16:34:40 christos Exp $");
 #include <fcntl.h>
 #endif
 
+#include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -76,6 +79,9 @@ __RCSID("$NetBSD: rnp.c,v 1.98 2016/06/28 16:34:40 christos Exp $");
 #include "packet-parse.h"
 #include "packet-print.h"
 #include "key_store.h"
+#include "key_store_kbx.h"
+#include "seckeycache.h"
+#include "agent.h"
 #include "errors.h"
 #include "packet-show.h"
 #include "create.h"
@@ -89,6 +95,7 @@ __RCSID("$NetBSD: rnp.c,v 1.98 2016/06/28 16:34:40 christos Exp $");
 #include "defs.h"
 #include "../common/constants.h"
 #include "packet-key.h"
+#include "trace.h"
 
 #include <json.h>
 
@@ -117,15 +124,16 @@ resultp(pgp_io_t *io, const char *f, pgp_validation_t *res, rnp_key_store_t *rin
     unsigned         i;
     time_t           t;
     char             id[MAX_ID_LENGTH + 1];
+    char             tbuf[32];
 
     for (i = 0; i < res->validc; i++) {
         (void) fprintf(io->res,
                        "Good signature for %s made %s",
                        (f) ? f : "<stdin>",
-                       ctime(&res->valid_sigs[i].birthtime));
+                       ctime_r(&res->valid_sigs[i].birthtime, tbuf));
         if (res->duration > 0) {
             t = res->birthtime + res->duration;
-            (void) fprintf(io->res, "Valid until %s", ctime(&t));
+            (void) fprintf(io->res, "Valid until %s", ctime_r(&t, tbuf));
         }
         (void) fprintf(io->res,
                        "using %s key %s\n",
@@ -263,15 +271,15 @@ findvar(rnp_t *rnp, const char *name)
 static int
 grabdate(char *s, int64_t *t)
 {
-    static regex_t r;
-    static int     compiled;
-    regmatch_t     matches[10];
-    struct tm      tm;
+    regex_t    r;
+    regmatch_t matches[10];
+    struct tm  tm;
+    int        ok = 0;
 
-    if (!compiled) {
-        compiled = 1;
-        (void) regcomp(
-          &r, "([0-9][0-9][0-9][0-9])[-/]([0-9][0-9])[-/]([0-9][0-9])", REG_EXTENDED);
+    /* compiled per call: this is only used when generating keys */
+    if (regcomp(
+          &r, "([0-9][0-9][0-9][0-9])[-/]([0-9][0-9])[-/]([0-9][0-9])", REG_EXTENDED) != 0) {
+        return 0;
     }
     if (regexec(&r, s, 10, matches, 0) == 0) {
         (void) memset(&tm, 0x0, sizeof(tm));
@@ -279,9 +287,10 @@ grabdate(char *s, int64_t *t)
         tm.tm_mon = (int) strtol(&s[(int) matches[2].rm_so], NULL, 10) - 1;
         tm.tm_mday = (int) strtol(&s[(int) matches[3].rm_so], NULL, 10);
         *t = mktime(&tm);
-        return 1;
+        ok = 1;
     }
-    return 0;
+    regfree(&r);
+    return ok;
 }
 
 /* get expiration in seconds */
@@ -352,6 +361,91 @@ resolve_userid(rnp_t *rnp, const rnp_key_store_t *keyring, const char *userid)
     return key;
 }
 
+/* the cache of unlocked secret keys, made when first needed if the
+ * "seckey_ttl" variable asks for one */
+static pgp_seckey_cache_t *
+seckey_cache(rnp_t *rnp)
+{
+    char *ttl;
+    char *uses;
+
+    if (rnp->seckeys == NULL && (ttl = rnp_getvar(rnp, "seckey_ttl")) != NULL &&
+        atoi(ttl) > 0) {
+        uses = rnp_getvar(rnp, "seckey_uses");
+        rnp->seckeys =
+          pgp_seckey_cache_new((unsigned) atoi(ttl), (uses) ? (unsigned) atoi(uses) : 0);
+    }
+    return rnp->seckeys;
+}
+
+/* the connection to rnp-agent, made when first needed if the "agent"
+ * variable is set; an empty value means the socket in the key directory */
+static pgp_agent_t *
+agent_connect(rnp_t *rnp)
+{
+    char  path[MAXPATHLEN];
+    char *sock;
+
+    if (rnp->agent != NULL || (sock = rnp_getvar(rnp, "agent")) == NULL) {
+        return rnp->agent;
+    }
+    if (*sock == 0x0) {
+        if (keydir_gnupg(rnp, path, sizeof(path) - sizeof(PGP_AGENT_SOCKET) - 1) != 0) {
+            return NULL;
+        }
+        (void) strcat(path, "/" PGP_AGENT_SOCKET);
+        sock = path;
+    }
+    if ((rnp->agent = pgp_agent_connect(sock)) == NULL) {
+        (void) fprintf(((pgp_io_t *) rnp->io)->errs, "can't connect to agent at %s\n", sock);
+    }
+    return rnp->agent;
+}
+
+/* unlock the secret key of a key pair, or take it from the cache */
+static pgp_seckey_t *
+unlock_seckey(rnp_t *rnp, const pgp_key_t *keypair)
+{
+    pgp_seckey_cache_t *cache;
+    pgp_seckey_t *      seckey;
+    pgp_seckey_t *      cached;
+    pgp_agent_t *       agent;
+
+    if ((agent = agent_connect(rnp)) != NULL &&
+        (seckey = pgp_agent_seckey(agent, keypair)) != NULL) {
+        return seckey;
+    }
+    cache = seckey_cache(rnp);
+    if (cache != NULL && (seckey = pgp_seckey_cache_get(cache, keypair)) != NULL) {
+        return seckey;
+    }
+    seckey = pgp_decrypt_seckey(keypair, rnp->passfp);
+    if (seckey != NULL && cache != NULL &&
+        (cached = pgp_seckey_cache_put(cache, keypair, seckey)) != NULL) {
+        return cached;
+    }
+    return seckey;
+}
+
+/* done with a secret key used for signing */
+static void
+forget_seckey(rnp_t *rnp, pgp_seckey_t *seckey)
+{
+    if (use_ssh_keys(rnp)) {
+        /* it is the one in the keyring */
+        return;
+    }
+    if (seckey->agent != NULL) {
+        /* holds nothing secret, and shares the public part */
+        free(seckey);
+        return;
+    }
+    if (rnp->seckeys == NULL || !pgp_seckey_cache_release(rnp->seckeys, seckey)) {
+        pgp_seckey_free(seckey);
+        free(seckey);
+    }
+}
+
 /* append a key to a keyring */
 static int
 appendkey(pgp_io_t *io, pgp_key_t *key, char *ringfile)
@@ -476,9 +570,10 @@ pobj(FILE *fp, json_object *obj, int depth)
 static char *
 ptimestr(char *dest, size_t size, time_t t)
 {
+    struct tm  tmbuf;
     struct tm *tm;
 
-    tm = gmtime(&t);
+    tm = gmtime_r(&t, &tmbuf);
     (void) snprintf(
       dest, size, "%04d-%02d-%02d", tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday);
     return dest;
@@ -849,6 +944,8 @@ parse_keyring_format(rnp_t *rnp, enum keyring_format_t *keyring_format, char *fo
         *keyring_format = GPG_KEYRING;
     } else if (rnp_strcasecmp(format, "SSH") == 0) {
         *keyring_format = SSH_KEYRING;
+    } else if (rnp_strcasecmp(format, "KBX") == 0) {
+        *keyring_format = KBX_KEYRING;
     } else {
         fprintf(stderr, "rnp: unsupported keyring format: \"%s\"\n", format);
         return 0;
@@ -861,9 +958,10 @@ static void
 init_touch_initialized(rnp_t *rnp)
 {
     time_t t;
+    char   buf[32];
 
     t = time(NULL);
-    rnp_setvar(rnp, "initialised", ctime(&t));
+    rnp_setvar(rnp, "initialised", ctime_r(&t, buf));
 }
 
 static int
@@ -965,6 +1063,28 @@ rnp_init(rnp_t *rnp)
     return 1;
 }
 
+/* let go of the keyrings, which are either our own or a shared snapshot */
+static void
+drop_keys(rnp_t *rnp)
+{
+    if (rnp->keys != NULL) {
+        rnp_key_snapshot_unref(rnp->keys);
+        rnp->keys = NULL;
+        rnp->pubring = rnp->secring = NULL;
+        return;
+    }
+    if (rnp->pubring != NULL) {
+        rnp_key_store_free(rnp->pubring);
+        free(rnp->pubring);
+        rnp->pubring = NULL;
+    }
+    if (rnp->secring != NULL) {
+        rnp_key_store_free(rnp->secring);
+        free(rnp->secring);
+        rnp->secring = NULL;
+    }
+}
+
 /* finish off with the rnp_t struct */
 int
 rnp_end(rnp_t *rnp)
@@ -985,17 +1105,29 @@ rnp_end(rnp_t *rnp)
     if (rnp->value != NULL) {
         free(rnp->value);
     }
-    if (rnp->pubring != NULL) {
-        rnp_key_store_free(rnp->pubring);
-        free(rnp->pubring);
-        rnp->pubring = NULL;
+    rnp_key_store_unwatch(rnp);
+    drop_keys(rnp);
+    pgp_seckey_cache_free(rnp->seckeys);
+    rnp->seckeys = NULL;
+    pgp_agent_close(rnp->agent);
+    rnp->agent = NULL;
+    free(rnp->io);
+    return 1;
+}
+
+/* make now what would otherwise be made when first needed, so that the
+ * rnp_t can be used by several threads at once: the cache of unlocked
+ * secret keys, and the connection to rnp-agent. What cannot be made is
+ * not tried again later, and keys are then unlocked as usual */
+int
+rnp_share(rnp_t *rnp)
+{
+    if (seckey_cache(rnp) == NULL) {
+        (void) rnp_unsetvar(rnp, "seckey_ttl");
     }
-    if (rnp->secring != NULL) {
-        rnp_key_store_free(rnp->secring);
-        free(rnp->secring);
-        rnp->secring = NULL;
+    if (agent_connect(rnp) == NULL) {
+        (void) rnp_unsetvar(rnp, "agent");
     }
-    free(rnp->io);
     return 1;
 }
 
@@ -1040,10 +1172,106 @@ rnp_load_keys(rnp_t *rnp)
     if (keydir(rnp, path, sizeof(path)) == -1) {
         return 0;
     }
+    if (rnp->keys != NULL) {
+        drop_keys(rnp);
+    }
 
     return rnp_key_store_load_keys(rnp, path);
 }
 
+/*
+ * watch the files the keyrings were loaded from, so that changes to them
+ * can be picked up by rnp_update_keys(). Returns a descriptor which polls
+ * readable when there may be changes, or -1.
+ */
+int
+rnp_watch_keys(rnp_t *rnp)
+{
+    pgp_io_t *io = rnp->io;
+
+    if (rnp->keys != NULL) {
+        (void) fprintf(io->errs, "cannot watch a shared keyring\n");
+        return -1;
+    }
+    return rnp_key_store_watch(rnp);
+}
+
+/* apply changes to the watched keyring files, returning how many changed */
+int
+rnp_update_keys(rnp_t *rnp)
+{
+    int reload;
+    int ret;
+
+    if ((ret = rnp_key_store_update(rnp, &reload)) < 0 || !reload) {
+        return ret;
+    }
+    drop_keys(rnp);
+    return rnp_load_keys(rnp) ? 1 : -1;
+}
+
+void
+rnp_unwatch_keys(rnp_t *rnp)
+{
+    rnp_key_store_unwatch(rnp);
+}
+
+/* make a new, empty, set of shared keyrings */
+void *
+rnp_shared_keys_new(void)
+{
+    return rnp_key_shared_new();
+}
+
+/* free shared keyrings; no rnp_t may attach to them any more */
+void
+rnp_shared_keys_free(void *shared)
+{
+    rnp_key_shared_free(shared);
+}
+
+/*
+ * hand the keyrings loaded into `rnp' over to `shared', as the snapshot
+ * that from now on gets attached. Operations which are running on the
+ * previous snapshot carry on with it; it is freed after the last one.
+ */
+int
+rnp_publish_keys(rnp_t *rnp, void *shared)
+{
+    rnp_key_snapshot_t *snap;
+    pgp_io_t *          io = rnp->io;
+
+    if (rnp->keys != NULL || rnp->pubring == NULL) {
+        (void) fprintf(io->errs, "rnp_publish_keys: no keyrings of our own loaded\n");
+        return 0;
+    }
+    if ((snap = rnp_key_snapshot_new(rnp->pubring, rnp->secring)) == NULL) {
+        (void) fprintf(io->errs, "rnp_publish_keys: bad alloc\n");
+        return 0;
+    }
+    rnp->pubring = rnp->secring = NULL;
+    rnp_key_store_unwatch(rnp);
+    rnp_key_shared_publish(shared, snap);
+    return 1;
+}
+
+/* use the current snapshot of `shared' in place of our own keyrings */
+int
+rnp_attach_keys(rnp_t *rnp, void *shared)
+{
+    rnp_key_snapshot_t *snap;
+
+    if ((snap = rnp_key_shared_acquire(shared)) == NULL) {
+        return 0;
+    }
+    rnp_key_store_unwatch(rnp);
+    drop_keys(rnp);
+    rnp->keys = snap;
+    rnp->pubring = snap->pubring;
+    rnp->secring = snap->secring;
+    return 1;
+}
+
 DEFINE_ARRAY(strings_t, char *);
 
 #ifndef HKP_VERSION
@@ -1221,23 +1449,294 @@ rnp_export_key(rnp_t *rnp, char *name)
 }
 
 #define IMPORT_ARMOR_HEAD "-----BEGIN PGP PUBLIC KEY BLOCK-----"
+#define IMPORT_MAX_THREADS 16
 
-/* import a key into our keyring */
+/* files being imported, each read into a keyring of its own */
+typedef struct import_t {
+    DYNARRAY(char *, file);
+    pgp_io_t *       io;
+    rnp_key_store_t *rings; /* rings[i] holds the keys read from files[i] */
+    int *            results;
+    atomic_uint      next;
+} import_t;
+
+/* add f to the files to import, or the files in it if it is a directory */
+static int
+import_add(import_t *imp, const char *f)
+{
+    struct dirent **names;
+    struct stat     st;
+    char            path[MAXPATHLEN];
+    int             namec;
+    int             ok;
+    int             i;
+
+    if (stat(f, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        EXPAND_ARRAY(imp, file);
+        if (imp->filec == imp->filevsize || (imp->files[imp->filec] = strdup(f)) == NULL) {
+            return 0;
+        }
+        imp->filec += 1;
+        return 1;
+    }
+    if ((namec = scandir(f, &names, NULL, alphasort)) < 0) {
+        (void) fprintf(imp->io->errs, "cannot read directory %s\n", f);
+        return 0;
+    }
+    ok = 1;
+    for (i = 0; i < namec; i++) {
+        (void) snprintf(path, sizeof(path), "%s/%s", f, names[i]->d_name);
+        if (ok && names[i]->d_name[0] != '.' && stat(path, &st) == 0 &&
+            S_ISREG(st.st_mode)) {
+            ok = import_add(imp, path);
+        }
+        free(names[i]);
+    }
+    free(names);
+    return ok;
+}
+
+static void *
+import_worker(void *arg)
+{
+    import_t *imp = arg;
+    unsigned  armour;
+    unsigned  i;
+
+    while ((i = atomic_fetch_add(&imp->next, 1)) < imp->filec) {
+        armour = isarmoured(imp->io, imp->files[i], NULL, IMPORT_ARMOR_HEAD);
+        imp->results[i] =
+          rnp_key_store_pgp_read_from_file(imp->io, &imp->rings[i], armour, imp->files[i]);
+    }
+    return NULL;
+}
+
+/* leave only the public part of any secret keys read, for the pubring */
+static int
+import_public(rnp_key_store_t *ring)
+{
+    unsigned i;
+
+    for (i = 0; i < ring->keyc; i++) {
+        if (pgp_is_key_secret(&ring->keys[i]) && !pgp_key_make_public(&ring->keys[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* replace a file with buf, once buf has been synced to disk */
+static int
+replace_file(pgp_io_t *io, const char *filename, const uint8_t *buf, size_t len)
+{
+    char    tmp[MAXPATHLEN];
+    ssize_t n;
+    int     fd;
+
+    (void) snprintf(tmp, sizeof(tmp), "%s.XXXXXX", filename);
+    if ((fd = mkstemp(tmp)) < 0) {
+        (void) fprintf(io->errs, "cannot create '%s'\n", tmp);
+        return 0;
+    }
+    for (; len > 0; buf += n, len -= (size_t) n) {
+        if ((n = write(fd, buf, len)) <= 0) {
+            break;
+        }
+    }
+    if (len > 0 || fsync(fd) != 0) {
+        (void) close(fd);
+    } else if (close(fd) == 0 && rename(tmp, filename) == 0) {
+        return 1;
+    }
+    (void) fprintf(io->errs, "cannot write '%s': %s\n", filename, strerror(errno));
+    (void) unlink(tmp);
+    return 0;
+}
+
+/* write all of keyring to its file, in one go */
+static int
+write_keyring(rnp_t *rnp, const rnp_key_store_t *keyring, const char *ringfile)
+{
+    const pgp_key_t *key;
+    pgp_output_t *   output;
+    pgp_memory_t *   mem;
+    unsigned         i;
+    int              ok;
+
+    if (rnp->keyring_format == KBX_KEYRING) {
+        if ((mem = pgp_memory_new()) == NULL) {
+            return 0;
+        }
+        ok = rnp_key_store_kbx_to_mem(rnp->io, keyring, mem) &&
+             replace_file(rnp->io, ringfile, pgp_mem_data(mem), pgp_mem_len(mem));
+        pgp_memory_free(mem);
+        return ok;
+    }
+    pgp_setup_memory_write(&output, &mem, 4096);
+    ok = 1;
+    for (i = 0; ok && i < keyring->keyc; i++) {
+        ok = (key = rnp_key_store_get_key(rnp->io, keyring, i)) != NULL &&
+             pgp_write_keyblock(output, key);
+    }
+    ok = ok && replace_file(rnp->io, ringfile, pgp_mem_data(mem), pgp_mem_len(mem));
+    pgp_teardown_memory_write(output, mem);
+    return ok;
+}
+
+/**
+   \ingroup HighLevel_KeyringRead
+
+   \brief Imports the keys in a number of files, or directories of them,
+   into the public keyring, and writes it out
+
+   Only the public part of a secret key is imported.
+
+   \return 1 if every file was read and the keyring written; else 0
+
+   \note The files are read on up to IMPORT_MAX_THREADS threads, and
+   their keys merged into the keyring in the order given, directories in
+   name order, by rnp_key_store_append_keyring(), so that a key already
+   there is merged with its new copy. The keyring file is replaced once,
+   after everything is merged.
+*/
 int
-rnp_import_key(rnp_t *rnp, char *f)
+rnp_import_keys(rnp_t *rnp, char **files, unsigned filec)
 {
-    pgp_io_t *io;
-    unsigned  realarmor;
-    int       done;
+    rnp_key_store_t *pubring;
+    pthread_t        threads[IMPORT_MAX_THREADS];
+    int              started[IMPORT_MAX_THREADS];
+    import_t         imp;
+    pgp_io_t *       io;
+    unsigned         keyc;
+    unsigned         keys;
+    unsigned         n;
+    unsigned         i;
+    char *           ringfile;
+    long             cpus;
+    int              ok;
+
+    io = rnp->io;
+    if (rnp->keys != NULL) {
+        (void) fprintf(io->errs, "cannot import into a shared keyring\n");
+        return 0;
+    }
+    pubring = rnp->pubring;
+    if (pubring == NULL || rnp->keyring_format == SSH_KEYRING ||
+        (ringfile = rnp_getvar(rnp, "pubring")) == NULL) {
+        (void) fprintf(io->errs, "cannot import without a pgp pubring\n");
+        return 0;
+    }
+    (void) memset(&imp, 0x0, sizeof(imp));
+    imp.io = io;
+    ok = 1;
+    for (i = 0; ok && i < filec; i++) {
+        ok = import_add(&imp, files[i]);
+    }
+    if (ok && imp.filec > 0) {
+        imp.rings = calloc(imp.filec, sizeof(*imp.rings));
+        imp.results = calloc(imp.filec, sizeof(*imp.results));
+        ok = (imp.rings != NULL && imp.results != NULL);
+    }
+    if (ok && imp.filec > 0) {
+        for (i = 0; i < imp.filec; i++) {
+            imp.rings[i].hashtype = pubring->hashtype;
+        }
+        atomic_init(&imp.next, 0);
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = (unsigned) MIN(MIN(cpus, IMPORT_MAX_THREADS), (long) imp.filec);
+        /* we read files too, so start one thread fewer */
+        for (i = 1; i < n; i++) {
+            started[i] = (pthread_create(&threads[i], NULL, import_worker, &imp) == 0);
+        }
+        (void) import_worker(&imp);
+        for (i = 1; i < n; i++) {
+            if (started[i]) {
+                (void) pthread_join(threads[i], NULL);
+            }
+        }
+        keyc = pubring->keyc;
+        keys = 0;
+        for (i = 0; i < imp.filec; i++) {
+            if (!imp.results[i] || !import_public(&imp.rings[i]) ||
+                !rnp_key_store_append_keyring(io, pubring, &imp.rings[i])) {
+                (void) fprintf(io->errs, "cannot import key from file %s\n", imp.files[i]);
+                ok = 0;
+            }
+            keys += imp.rings[i].keyc;
+            rnp_key_store_free(&imp.rings[i]);
+        }
+        ok = write_keyring(rnp, pubring, ringfile) && ok;
+        (void) fprintf(io->res,
+                       "%u keys read from %u files, %u of them new\n",
+                       keys,
+                       imp.filec,
+                       pubring->keyc - keyc);
+    }
+    for (i = 0; i < imp.filec; i++) {
+        free(imp.files[i]);
+    }
+    free(imp.files);
+    free(imp.rings);
+    free(imp.results);
+    return ok;
+}
+
+/**
+   \ingroup HighLevel_KeyringWrite
+
+   \brief Rewrites the public keyring with each key in it once
+
+   \return 1 if the keyring was written; else 0
+
+   \note Copies of a key, by fingerprint, are merged into the first, in
+   the same way as rnp_import_keys() merges keys. The keyring in memory is
+   replaced with the compacted one even if it can't be written.
+*/
+int
+rnp_compact_keys(rnp_t *rnp)
+{
+    rnp_key_store_t *compact;
+    rnp_key_store_t *pubring;
+    pgp_io_t *       io;
+    unsigned         keyc;
+    char *           ringfile;
+    int              ok;
 
     io = rnp->io;
-    realarmor = isarmoured(io, f, NULL, IMPORT_ARMOR_HEAD);
-    done = rnp_key_store_pgp_read_from_file(rnp->io, rnp->pubring, realarmor, f);
-    if (!done) {
-        (void) fprintf(io->errs, "cannot import key from file %s\n", f);
+    if (rnp->keys != NULL) {
+        (void) fprintf(io->errs, "cannot compact a shared keyring\n");
+        return 0;
+    }
+    pubring = rnp->pubring;
+    if (pubring == NULL || rnp->keyring_format == SSH_KEYRING ||
+        (ringfile = rnp_getvar(rnp, "pubring")) == NULL) {
+        (void) fprintf(io->errs, "cannot compact without a pgp pubring\n");
+        return 0;
+    }
+    if ((compact = calloc(1, sizeof(*compact))) == NULL) {
+        (void) fprintf(io->errs, "rnp_compact_keys: bad alloc\n");
         return 0;
     }
-    return rnp_key_store_list(io, rnp->pubring, 0);
+    compact->hashtype = pubring->hashtype;
+    keyc = pubring->keyc;
+    /* the keys move over, so the old keyring goes whatever happens */
+    ok = rnp_key_store_append_keyring(io, compact, pubring);
+    rnp_key_store_free(pubring);
+    free(pubring);
+    rnp->pubring = compact;
+    ok = ok && write_keyring(rnp, compact, ringfile);
+    (void) fprintf(io->res, "%u keys, %u after compacting\n", keyc, compact->keyc);
+    return ok;
+}
+
+/* import a key into our keyring */
+int
+rnp_import_key(rnp_t *rnp, char *f)
+{
+    if (!rnp_import_keys(rnp, &f, 1)) {
+        return 0;
+    }
+    return rnp_key_store_list(rnp->io, rnp->pubring, 0);
 }
 
 #define ID_OFFSET 38
@@ -1263,10 +1762,15 @@ rnp_generate_key(rnp_t *rnp, char *id, int numbits)
     int            passc;
     int            fd;
     int            cc;
+    int            ok;
     int            rv = 0;
 
     uid = NULL;
     io = rnp->io;
+    /* the rings get rewritten and reread, so stop using any shared ones */
+    if (rnp->keys != NULL) {
+        drop_keys(rnp);
+    }
     /* generate a new key */
     if (id) {
         snprintf(newid, sizeof(newid), "%s", id);
@@ -1305,8 +1809,14 @@ rnp_generate_key(rnp_t *rnp, char *id, int numbits)
     }
 
     (void) fprintf(io->errs, "rnp: generated keys in directory %s\n", dir);
-    (void) snprintf(ringfile = filename, sizeof(filename), "%s/pubring.gpg", dir);
-    if (!appendkey(io, key, ringfile)) {
+    if (rnp->keyring_format == KBX_KEYRING) {
+        (void) snprintf(ringfile = filename, sizeof(filename), "%s/pubring.kbx", dir);
+        ok = rnp_key_store_kbx_append_key(io, key, ringfile);
+    } else {
+        (void) snprintf(ringfile = filename, sizeof(filename), "%s/pubring.gpg", dir);
+        ok = appendkey(io, key, ringfile);
+    }
+    if (!ok) {
         (void) fprintf(io->errs, "cannot write pubkey to '%s'\n", ringfile);
         goto out;
     }
@@ -1352,32 +1862,69 @@ out:
     return rv;
 }
 
+/* resolve the userids of the recipients of an encryption */
+static const pgp_key_t **
+resolve_recipients(rnp_t *rnp, const char **userids, unsigned userc)
+{
+    const pgp_key_t **keys;
+    unsigned          i;
+
+    if (userc == 0 || (keys = calloc(userc, sizeof(*keys))) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < userc; i++) {
+        if ((keys[i] = resolve_userid(rnp, rnp->pubring, userids[i])) == NULL) {
+            free(keys);
+            return NULL;
+        }
+    }
+    return keys;
+}
+
 /* encrypt a file */
 int
 rnp_encrypt_file(rnp_t *rnp, const char *userid, const char *f, char *out, int armored)
 {
-    const pgp_key_t *key;
-    const unsigned   overwrite = 1;
-    const char *     suffix;
-    pgp_io_t *       io;
-    char             outname[MAXPATHLEN];
+    return rnp_encrypt_file_multi(rnp, &userid, 1, f, out, armored);
+}
+
+/* encrypt a file once, for any number of recipients */
+int
+rnp_encrypt_file_multi(rnp_t *      rnp,
+                       const char **userids,
+                       unsigned     userc,
+                       const char * f,
+                       char *       out,
+                       int          armored)
+{
+    const pgp_key_t **keys;
+    const unsigned    overwrite = 1;
+    const char *      suffix;
+    pgp_io_t *        io;
+    char              outname[MAXPATHLEN];
+    int               ret;
 
     io = rnp->io;
     if (f == NULL) {
         (void) fprintf(io->errs, "rnp_encrypt_file: no filename specified\n");
         return 0;
     }
+    PGP_TRACE_BEGIN("rnp_encrypt_file", NULL);
     suffix = (armored) ? ".asc" : ".gpg";
-    /* get key with which to sign */
-    if ((key = resolve_userid(rnp, rnp->pubring, userid)) == NULL) {
+    /* get keys to encrypt for */
+    if ((keys = resolve_recipients(rnp, userids, userc)) == NULL) {
+        PGP_TRACE_END("rnp_encrypt_file");
         return 0;
     }
     if (out == NULL) {
         (void) snprintf(outname, sizeof(outname), "%s%s", f, suffix);
         out = outname;
     }
-    return (int) pgp_encrypt_file(
-      io, f, out, key, (unsigned) armored, overwrite, rnp_getvar(rnp, "cipher"));
+    ret = (int) pgp_encrypt_file(
+      io, f, out, keys, userc, (unsigned) armored, overwrite, rnp_getvar(rnp, "cipher"));
+    free(keys);
+    PGP_TRACE_END("rnp_encrypt_file");
+    return ret;
 }
 
 #define ARMOR_HEAD "-----BEGIN PGP MESSAGE-----"
@@ -1392,6 +1939,7 @@ rnp_decrypt_file(rnp_t *rnp, const char *f, char *out, int armored)
     unsigned       sshkeys;
     char *         numtries;
     int            attempts;
+    int            ret;
 
     __PGP_USED(armored);
     io = rnp->io;
@@ -1399,6 +1947,7 @@ rnp_decrypt_file(rnp_t *rnp, const char *f, char *out, int armored)
         (void) fprintf(io->errs, "rnp_decrypt_file: no filename specified\n");
         return 0;
     }
+    PGP_TRACE_BEGIN("rnp_decrypt_file", NULL);
     realarmor = isarmoured(io, f, NULL, ARMOR_HEAD);
     sshkeys = (unsigned) use_ssh_keys(rnp);
     if ((numtries = rnp_getvar(rnp, "numtries")) == NULL || (attempts = atoi(numtries)) <= 0) {
@@ -1406,17 +1955,21 @@ rnp_decrypt_file(rnp_t *rnp, const char *f, char *out, int armored)
     } else if (strcmp(numtries, "unlimited") == 0) {
         attempts = INFINITE_ATTEMPTS;
     }
-    return pgp_decrypt_file(rnp->io,
-                            f,
-                            out,
-                            rnp->secring,
-                            rnp->pubring,
-                            realarmor,
-                            overwrite,
-                            sshkeys,
-                            rnp->passfp,
-                            attempts,
-                            get_passphrase_cb);
+    ret = pgp_decrypt_file(rnp->io,
+                           f,
+                           out,
+                           rnp->secring,
+                           rnp->pubring,
+                           realarmor,
+                           overwrite,
+                           sshkeys,
+                           rnp->passfp,
+                           agent_connect(rnp),
+                           seckey_cache(rnp),
+                           attempts,
+                           get_passphrase_cb);
+    PGP_TRACE_END("rnp_decrypt_file");
+    return ret;
 }
 
 /* sign a file */
@@ -1445,8 +1998,10 @@ rnp_sign_file(rnp_t *     rnp,
         (void) fprintf(io->errs, "rnp_sign_file: no filename specified\n");
         return 0;
     }
+    PGP_TRACE_BEGIN("rnp_sign_file", NULL);
     /* get key with which to sign */
     if ((keypair = resolve_userid(rnp, rnp->secring, userid)) == NULL) {
+        PGP_TRACE_END("rnp_sign_file");
         return 0;
     }
     ret = 1;
@@ -1471,7 +2026,7 @@ rnp_sign_file(rnp_t *     rnp,
         }
         if (!use_ssh_keys(rnp)) {
             /* now decrypt key */
-            seckey = pgp_decrypt_seckey(keypair, rnp->passfp);
+            seckey = unlock_seckey(rnp, keypair);
             if (seckey == NULL) {
                 (void) fprintf(io->errs, "Bad passphrase\n");
             }
@@ -1484,6 +2039,7 @@ rnp_sign_file(rnp_t *     rnp,
     }
     if (seckey == NULL) {
         (void) fprintf(io->errs, "Bad passphrase\n");
+        PGP_TRACE_END("rnp_sign_file");
         return 0;
     }
     /* sign file */
@@ -1513,7 +2069,223 @@ rnp_sign_file(rnp_t *     rnp,
                             (unsigned) cleartext,
                             overwrite);
     }
-    pgp_forget(seckey, sizeof(*seckey));
+    forget_seckey(rnp, seckey);
+    PGP_TRACE_END("rnp_sign_file");
+    return ret;
+}
+
+/* the secret key to sign with for userid, asking for the passphrase as needed */
+static pgp_seckey_t *
+unlock_signer(rnp_t *rnp, const char *userid)
+{
+    const pgp_key_t *keypair;
+    pgp_seckey_t *   seckey;
+    char *           numtries;
+    int              attempts;
+    int              i;
+
+    if ((keypair = resolve_userid(rnp, rnp->secring, userid)) == NULL) {
+        return NULL;
+    }
+    if ((numtries = rnp_getvar(rnp, "numtries")) == NULL || (attempts = atoi(numtries)) <= 0) {
+        attempts = MAX_PASSPHRASE_ATTEMPTS;
+    } else if (strcmp(numtries, "unlimited") == 0) {
+        attempts = INFINITE_ATTEMPTS;
+    }
+    for (i = 0, seckey = NULL; !seckey && (i < attempts || attempts == INFINITE_ATTEMPTS);
+         i++) {
+        if (use_ssh_keys(rnp)) {
+            seckey = &((rnp_key_store_t *) rnp->secring)->keys[0].key.seckey;
+        } else if ((seckey = unlock_seckey(rnp, keypair)) == NULL) {
+            (void) fprintf(((pgp_io_t *) rnp->io)->errs, "Bad passphrase\n");
+        }
+    }
+    return seckey;
+}
+
+/* the hash algorithm to sign with, given the key */
+static const char *
+signing_hashalg(rnp_t *rnp, const pgp_seckey_t *seckey)
+{
+    return (seckey->pubkey.alg == PGP_PKA_DSA) ? "sha1" : rnp_getvar(rnp, "hash");
+}
+
+/* unlock the keys of all the signers, or none of them */
+static pgp_seckey_t **
+unlock_signers(rnp_t *rnp, const char **userids, unsigned userc)
+{
+    pgp_seckey_t **seckeys;
+    unsigned       i;
+
+    if (userc == 0 || (seckeys = calloc(userc, sizeof(*seckeys))) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < userc; i++) {
+        if ((seckeys[i] = unlock_signer(rnp, userids[i])) == NULL) {
+            while (i-- > 0) {
+                forget_seckey(rnp, seckeys[i]);
+            }
+            free(seckeys);
+            return NULL;
+        }
+    }
+    return seckeys;
+}
+
+static void
+forget_signers(rnp_t *rnp, pgp_seckey_t **seckeys, unsigned userc)
+{
+    unsigned i;
+
+    for (i = 0; i < userc; i++) {
+        forget_seckey(rnp, seckeys[i]);
+    }
+    free(seckeys);
+}
+
+/* sign a file once with several keys */
+int
+rnp_sign_file_multi(rnp_t *      rnp,
+                    const char **userids,
+                    unsigned     userc,
+                    const char * f,
+                    char *       out,
+                    int          armored,
+                    int          detached)
+{
+    const unsigned overwrite = 1;
+    pgp_seckey_t **seckeys;
+    pgp_io_t *     io;
+    int            ret;
+
+    io = rnp->io;
+    if (f == NULL) {
+        (void) fprintf(io->errs, "rnp_sign_file_multi: no filename specified\n");
+        return 0;
+    }
+    PGP_TRACE_BEGIN("rnp_sign_file_multi", NULL);
+    if ((seckeys = unlock_signers(rnp, userids, userc)) == NULL) {
+        PGP_TRACE_END("rnp_sign_file_multi");
+        return 0;
+    }
+    if (detached) {
+        ret = pgp_sign_detached_multi(io,
+                                      f,
+                                      out,
+                                      (const pgp_seckey_t **) seckeys,
+                                      userc,
+                                      rnp_getvar(rnp, "hash"),
+                                      get_birthtime(rnp_getvar(rnp, "birthtime")),
+                                      get_duration(rnp_getvar(rnp, "duration")),
+                                      (unsigned) armored,
+                                      overwrite);
+    } else {
+        ret = (int) pgp_sign_file_multi(io,
+                                        f,
+                                        out,
+                                        (const pgp_seckey_t **) seckeys,
+                                        userc,
+                                        rnp_getvar(rnp, "hash"),
+                                        get_birthtime(rnp_getvar(rnp, "birthtime")),
+                                        get_duration(rnp_getvar(rnp, "duration")),
+                                        (unsigned) armored,
+                                        overwrite);
+    }
+    forget_signers(rnp, seckeys, userc);
+    PGP_TRACE_END("rnp_sign_file_multi");
+    return ret;
+}
+
+/* sign some memory once with several keys */
+int
+rnp_sign_memory_multi(rnp_t *        rnp,
+                      const char **  userids,
+                      unsigned       userc,
+                      char *         mem,
+                      size_t         size,
+                      char *         out,
+                      size_t         outsize,
+                      const unsigned armored)
+{
+    pgp_seckey_t **seckeys;
+    pgp_memory_t * signedmem;
+    pgp_io_t *     io;
+    size_t         m;
+
+    io = rnp->io;
+    if (mem == NULL) {
+        (void) fprintf(io->errs, "rnp_sign_memory_multi: no memory to sign\n");
+        return 0;
+    }
+    if ((seckeys = unlock_signers(rnp, userids, userc)) == NULL) {
+        return 0;
+    }
+    signedmem = pgp_sign_buf_multi(io,
+                                   mem,
+                                   size,
+                                   (const pgp_seckey_t **) seckeys,
+                                   userc,
+                                   get_birthtime(rnp_getvar(rnp, "birthtime")),
+                                   get_duration(rnp_getvar(rnp, "duration")),
+                                   rnp_getvar(rnp, "hash"),
+                                   armored);
+    forget_signers(rnp, seckeys, userc);
+    if (signedmem == NULL) {
+        return 0;
+    }
+    (void) memset(out, 0x0, outsize);
+    m = MIN(pgp_mem_len(signedmem), outsize);
+    (void) memcpy(out, pgp_mem_data(signedmem), m);
+    pgp_memory_free(signedmem);
+    return (int) m;
+}
+
+/* sign and encrypt a file in one pass */
+int
+rnp_sign_encrypt_file(rnp_t *      rnp,
+                      const char * signer,
+                      const char **userids,
+                      unsigned     userc,
+                      const char * f,
+                      char *       out,
+                      int          armored)
+{
+    const pgp_key_t **keys;
+    const unsigned    overwrite = 1;
+    pgp_seckey_t *    seckey;
+    pgp_io_t *        io;
+    int               ret;
+
+    io = rnp->io;
+    if (f == NULL) {
+        (void) fprintf(io->errs, "rnp_sign_encrypt_file: no filename specified\n");
+        return 0;
+    }
+    PGP_TRACE_BEGIN("rnp_sign_encrypt_file", NULL);
+    if ((keys = resolve_recipients(rnp, userids, userc)) == NULL) {
+        PGP_TRACE_END("rnp_sign_encrypt_file");
+        return 0;
+    }
+    if ((seckey = unlock_signer(rnp, signer)) == NULL) {
+        free(keys);
+        PGP_TRACE_END("rnp_sign_encrypt_file");
+        return 0;
+    }
+    ret = (int) pgp_sign_encrypt_file(io,
+                                      f,
+                                      out,
+                                      seckey,
+                                      signing_hashalg(rnp, seckey),
+                                      get_birthtime(rnp_getvar(rnp, "birthtime")),
+                                      get_duration(rnp_getvar(rnp, "duration")),
+                                      keys,
+                                      userc,
+                                      rnp_getvar(rnp, "cipher"),
+                                      (unsigned) armored,
+                                      overwrite);
+    forget_seckey(rnp, seckey);
+    free(keys);
+    PGP_TRACE_END("rnp_sign_encrypt_file");
     return ret;
 }
 
@@ -1526,6 +2298,7 @@ rnp_verify_file(rnp_t *rnp, const char *in, const char *out, int armored)
     pgp_validation_t result;
     pgp_io_t *       io;
     unsigned         realarmor;
+    unsigned         valid;
 
     __PGP_USED(armored);
     (void) memset(&result, 0x0, sizeof(result));
@@ -1534,8 +2307,11 @@ rnp_verify_file(rnp_t *rnp, const char *in, const char *out, int armored)
         (void) fprintf(io->errs, "rnp_verify_file: no filename specified\n");
         return 0;
     }
+    PGP_TRACE_BEGIN("rnp_verify_file", NULL);
     realarmor = isarmoured(io, in, NULL, ARMOR_SIG_HEAD);
-    if (pgp_validate_file(io, &result, in, out, (const int) realarmor, rnp->pubring)) {
+    valid = pgp_validate_file(io, &result, in, out, (const int) realarmor, rnp->pubring);
+    PGP_TRACE_END("rnp_verify_file");
+    if (valid) {
         resultp(io, in, &result, rnp->pubring);
         return 1;
     }
@@ -1607,7 +2383,7 @@ rnp_sign_memory(rnp_t *        rnp,
         }
         if (!use_ssh_keys(rnp)) {
             /* now decrypt key */
-            seckey = pgp_decrypt_seckey(keypair, rnp->passfp);
+            seckey = unlock_seckey(rnp, keypair);
             if (seckey == NULL) {
                 (void) fprintf(io->errs, "Bad passphrase\n");
             }
@@ -1647,10 +2423,128 @@ rnp_sign_memory(rnp_t *        rnp,
     } else {
         ret = 0;
     }
-    pgp_forget(seckey, sizeof(*seckey));
+    forget_seckey(rnp, seckey);
     return ret;
 }
 
+/* a secret key unlocked once, to sign any number of messages with */
+typedef struct rnp_signer_t {
+    rnp_t *           rnp;
+    pgp_seckey_t *    unlocked; /* as unlocked, to be given back when done */
+    pgp_seckey_t      seckey;   /* the same, signing through rsa if set */
+    pgp_rsa_signer_t *rsa;
+} rnp_signer_t;
+
+/* unlock a key for rnp_signer_sign_memory(), and load it ready to sign */
+void *
+rnp_signer_open(rnp_t *rnp, const char *userid)
+{
+    const pgp_key_t *keypair;
+    rnp_signer_t *   signer;
+    pgp_seckey_t *   seckey;
+    pgp_io_t *       io;
+    char *           numtries;
+    int              attempts;
+    int              i;
+
+    io = rnp->io;
+    if ((keypair = resolve_userid(rnp, rnp->secring, userid)) == NULL) {
+        return NULL;
+    }
+    if ((numtries = rnp_getvar(rnp, "numtries")) == NULL || (attempts = atoi(numtries)) <= 0) {
+        attempts = MAX_PASSPHRASE_ATTEMPTS;
+    } else if (strcmp(numtries, "unlimited") == 0) {
+        attempts = INFINITE_ATTEMPTS;
+    }
+    for (i = 0, seckey = NULL; !seckey && (i < attempts || attempts == INFINITE_ATTEMPTS);
+         i++) {
+        if (use_ssh_keys(rnp)) {
+            seckey = &((rnp_key_store_t *) rnp->secring)->keys[0].key.seckey;
+        } else if ((seckey = unlock_seckey(rnp, keypair)) == NULL) {
+            (void) fprintf(io->errs, "Bad passphrase\n");
+        }
+    }
+    if (seckey == NULL) {
+        return NULL;
+    }
+    if ((signer = calloc(1, sizeof(*signer))) == NULL) {
+        forget_seckey(rnp, seckey);
+        return NULL;
+    }
+    signer->rnp = rnp;
+    signer->unlocked = seckey;
+    signer->seckey = *seckey;
+    if (seckey->agent == NULL && (seckey->pubkey.alg == PGP_PKA_RSA ||
+                                  seckey->pubkey.alg == PGP_PKA_RSA_SIGN_ONLY)) {
+        signer->rsa = pgp_rsa_signer_new(&seckey->key.rsa, &seckey->pubkey.key.rsa);
+        if (signer->rsa == NULL) {
+            (void) fprintf(io->errs, "rnp_signer_open: bad RSA key\n");
+            rnp_signer_close(signer);
+            return NULL;
+        }
+        signer->seckey.key.rsa.signer = signer->rsa;
+    }
+    return signer;
+}
+
+/* sign some memory with an open signer, as rnp_sign_memory() does */
+int
+rnp_signer_sign_memory(void *         arg,
+                       const void *   mem,
+                       size_t         size,
+                       char *         out,
+                       size_t         outsize,
+                       const unsigned armored,
+                       const unsigned cleartext)
+{
+    rnp_signer_t *signer = arg;
+    pgp_memory_t *signedmem;
+    const char *  hashalg;
+    rnp_t *       rnp = signer->rnp;
+    size_t        m;
+
+    if (mem == NULL) {
+        (void) fprintf(((pgp_io_t *) rnp->io)->errs, "rnp_signer_sign_memory: no memory\n");
+        return 0;
+    }
+    hashalg = rnp_getvar(rnp, "hash");
+    if (signer->seckey.pubkey.alg == PGP_PKA_DSA) {
+        hashalg = "sha1";
+    }
+    signedmem = pgp_sign_buf(rnp->io,
+                             mem,
+                             size,
+                             &signer->seckey,
+                             get_birthtime(rnp_getvar(rnp, "birthtime")),
+                             get_duration(rnp_getvar(rnp, "duration")),
+                             hashalg,
+                             armored,
+                             cleartext);
+    if (signedmem == NULL) {
+        return 0;
+    }
+    (void) memset(out, 0x0, outsize);
+    m = MIN(pgp_mem_len(signedmem), outsize);
+    (void) memcpy(out, pgp_mem_data(signedmem), m);
+    pgp_memory_free(signedmem);
+    return (int) m;
+}
+
+/* finish with a signer, once no thread is signing with it */
+void
+rnp_signer_close(void *arg)
+{
+    rnp_signer_t *signer = arg;
+
+    if (signer == NULL) {
+        return;
+    }
+    pgp_rsa_signer_free(signer->rsa);
+    forget_seckey(signer->rnp, signer->unlocked);
+    pgp_forget(signer, sizeof(*signer));
+    free(signer);
+}
+
 /* verify memory */
 int
 rnp_verify_memory(
@@ -1711,19 +2605,30 @@ rnp_encrypt_memory(rnp_t *      rnp,
                    size_t       outsize,
                    int          armored)
 {
-    const pgp_key_t *keypair;
-    pgp_memory_t *   enc;
-    pgp_io_t *       io;
-    size_t           m;
+    return rnp_encrypt_memory_multi(rnp, &userid, 1, in, insize, out, outsize, armored);
+}
+
+/* encrypt some memory once, for any number of recipients */
+int
+rnp_encrypt_memory_multi(rnp_t *      rnp,
+                         const char **userids,
+                         unsigned     userc,
+                         void *       in,
+                         const size_t insize,
+                         char *       out,
+                         size_t       outsize,
+                         int          armored)
+{
+    const pgp_key_t **keys;
+    pgp_memory_t *    enc;
+    pgp_io_t *        io;
+    size_t            m;
 
     io = rnp->io;
     if (in == NULL) {
         (void) fprintf(io->errs, "rnp_encrypt_buf: no memory to encrypt\n");
         return 0;
     }
-    if ((keypair = resolve_userid(rnp, rnp->pubring, userid)) == NULL) {
-        return 0;
-    }
     if (in == out) {
         (void) fprintf(io->errs,
                        "rnp_encrypt_buf: input and output bufs need to be different\n");
@@ -1733,8 +2638,72 @@ rnp_encrypt_memory(rnp_t *      rnp,
         (void) fprintf(io->errs, "rnp_encrypt_buf: input size is larger than output size\n");
         return 0;
     }
-    enc =
-      pgp_encrypt_buf(io, in, insize, keypair, (unsigned) armored, rnp_getvar(rnp, "cipher"));
+    if ((keys = resolve_recipients(rnp, userids, userc)) == NULL) {
+        return 0;
+    }
+    enc = pgp_encrypt_buf(
+      io, in, insize, keys, userc, (unsigned) armored, rnp_getvar(rnp, "cipher"));
+    free(keys);
+    if (enc == NULL) {
+        return 0;
+    }
+    m = MIN(pgp_mem_len(enc), outsize);
+    (void) memcpy(out, pgp_mem_data(enc), m);
+    pgp_memory_free(enc);
+    return (int) m;
+}
+
+/* sign and encrypt some memory in one pass */
+int
+rnp_sign_encrypt_memory(rnp_t *      rnp,
+                        const char * signer,
+                        const char **userids,
+                        unsigned     userc,
+                        void *       in,
+                        const size_t insize,
+                        char *       out,
+                        size_t       outsize,
+                        int          armored)
+{
+    const pgp_key_t **keys;
+    pgp_seckey_t *    seckey;
+    pgp_memory_t *    enc;
+    pgp_io_t *        io;
+    size_t            m;
+
+    io = rnp->io;
+    if (in == NULL) {
+        (void) fprintf(io->errs, "rnp_sign_encrypt_memory: no memory to encrypt\n");
+        return 0;
+    }
+    if (in == out) {
+        (void) fprintf(
+          io->errs, "rnp_sign_encrypt_memory: input and output bufs need to be different\n");
+        return 0;
+    }
+    if ((keys = resolve_recipients(rnp, userids, userc)) == NULL) {
+        return 0;
+    }
+    if ((seckey = unlock_signer(rnp, signer)) == NULL) {
+        free(keys);
+        return 0;
+    }
+    enc = pgp_sign_encrypt_buf(io,
+                               in,
+                               insize,
+                               seckey,
+                               signing_hashalg(rnp, seckey),
+                               get_birthtime(rnp_getvar(rnp, "birthtime")),
+                               get_duration(rnp_getvar(rnp, "duration")),
+                               keys,
+                               userc,
+                               rnp_getvar(rnp, "cipher"),
+                               (unsigned) armored);
+    forget_seckey(rnp, seckey);
+    free(keys);
+    if (enc == NULL) {
+        return 0;
+    }
     m = MIN(pgp_mem_len(enc), outsize);
     (void) memcpy(out, pgp_mem_data(enc), m);
     pgp_memory_free(enc);
@@ -1779,6 +2748,8 @@ rnp_decrypt_memory(rnp_t *      rnp,
                           realarmour,
                           sshkeys,
                           rnp->passfp,
+                          agent_connect(rnp),
+                          seckey_cache(rnp),
                           attempts,
                           get_passphrase_cb);
     if (mem == NULL) {
@@ -1968,8 +2939,23 @@ int
 rnp_validate_sigs(rnp_t *rnp)
 {
     pgp_validation_t result;
+    pgp_sig_cache_t *cache = NULL;
+    char             dir[MAXPATHLEN];
+    char             path[MAXPATHLEN + sizeof("/sigcache")];
+    char *           cachefile;
+    int              ret;
 
-    return (int) pgp_validate_all_sigs(&result, rnp->pubring, NULL);
+    /* results are kept between runs, so unchanged keys are not checked again */
+    if ((cachefile = rnp_getvar(rnp, "sigcache")) == NULL &&
+        keydir(rnp, dir, sizeof(dir)) == 0) {
+        (void) snprintf(cachefile = path, sizeof(path), "%s/sigcache", dir);
+    }
+    if (cachefile != NULL && *cachefile != 0x0) {
+        cache = pgp_sig_cache_open(cachefile);
+    }
+    ret = (int) pgp_validate_all_sigs(&result, rnp->pubring, cache, NULL);
+    pgp_sig_cache_close(cache);
+    return ret;
 }
 
 /* print the json out on 'fp' */
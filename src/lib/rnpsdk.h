@@ -35,6 +35,7 @@
 #include "crypto.h"
 #include "signature.h"
 #include "packet-show.h"
+#include "sigcache.h"
 
 #ifndef __printflike
 #define __printflike(n, m) __attribute__((format(printf, n, m)))
@@ -56,10 +57,12 @@ void pgp_validate_result_free(pgp_validation_t *);
 unsigned pgp_validate_key_sigs(pgp_validation_t *,
                                const pgp_key_t *,
                                const rnp_key_store_t *,
+                               pgp_sig_cache_t *,
                                pgp_cb_ret_t cb(const pgp_packet_t *, pgp_cbdata_t *));
 
 unsigned pgp_validate_all_sigs(pgp_validation_t *,
                                const rnp_key_store_t *,
+                               pgp_sig_cache_t *,
                                pgp_cb_ret_t cb(const pgp_packet_t *, pgp_cbdata_t *));
 
 unsigned pgp_check_sig(const uint8_t *, unsigned, const pgp_sig_t *, const pgp_pubkey_t *);
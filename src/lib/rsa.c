@@ -75,6 +75,8 @@
 
 /** \file
  */
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
@@ -84,6 +86,8 @@
 #include "rnpdefs.h"
 #include "s2k.h"
 #include "packet-key.h"
+#include "rng.h"
+#include "trace.h"
 #include "../common/utils.h"
 /**
    \ingroup Core_Crypto
@@ -106,11 +110,12 @@ pgp_rsa_encrypt_pkcs1(uint8_t *               out,
     botan_pk_op_encrypt_t enc_op = NULL;
     botan_rng_t           rng = NULL;
 
-    if (botan_rng_init(&rng, NULL) != 0) {
+    PGP_TRACE_BEGIN("pgp_rsa_encrypt_pkcs1", NULL);
+    if ((rng = pgp_rng_handle()) == NULL) {
         goto done;
     }
 
-    if (botan_pubkey_load_rsa(&rsa_key, pubkey->n->mp, pubkey->e->mp) != 0) {
+    if (botan_pubkey_load_rsa(&rsa_key, get_BN_mp(pubkey->n), get_BN_mp(pubkey->e)) != 0) {
         goto done;
     }
 
@@ -129,7 +134,7 @@ pgp_rsa_encrypt_pkcs1(uint8_t *               out,
 done:
     botan_pk_op_encrypt_destroy(enc_op);
     botan_pubkey_destroy(rsa_key);
-    botan_rng_destroy(rng);
+    PGP_TRACE_END("pgp_rsa_encrypt_pkcs1");
 
     return retval;
 }
@@ -153,9 +158,10 @@ pgp_rsa_pkcs1_verify_hash(const uint8_t *         sig_buf,
              "EMSA-PKCS1-v1_5(Raw,%s)",
              pgp_hash_name_botan(hash_alg));
 
-    botan_rng_init(&rng, NULL);
+    PGP_TRACE_BEGIN("pgp_rsa_pkcs1_verify_hash", NULL);
+    rng = pgp_rng_handle();
 
-    botan_pubkey_load_rsa(&rsa_key, pubkey->n->mp, pubkey->e->mp);
+    botan_pubkey_load_rsa(&rsa_key, get_BN_mp(pubkey->n), get_BN_mp(pubkey->e));
 
     if (botan_pubkey_check_key(rsa_key, rng, 1) != 0) {
         goto done;
@@ -174,7 +180,7 @@ pgp_rsa_pkcs1_verify_hash(const uint8_t *         sig_buf,
 done:
     botan_pk_op_verify_destroy(verify_op);
     botan_pubkey_destroy(rsa_key);
-    botan_rng_destroy(rng);
+    PGP_TRACE_END("pgp_rsa_pkcs1_verify_hash");
     return result;
 }
 
@@ -202,6 +208,10 @@ pgp_rsa_pkcs1_sign_hash(uint8_t *               sig_buf,
     botan_pk_op_sign_t sign_op;
     botan_rng_t        rng;
 
+    if (seckey->signer != NULL) {
+        return pgp_rsa_signer_sign_hash(
+          seckey->signer, sig_buf, sig_buf_size, hash_alg, hash_buf, hash_len);
+    }
     if (seckey->q == NULL) {
         (void) fprintf(stderr, "private key not set in pgp_rsa_private_encrypt\n");
         return 0;
@@ -212,20 +222,22 @@ pgp_rsa_pkcs1_sign_hash(uint8_t *               sig_buf,
              "EMSA-PKCS1-v1_5(Raw,%s)",
              pgp_hash_name_botan(hash_alg));
 
-    botan_rng_init(&rng, NULL);
+    PGP_TRACE_BEGIN("pgp_rsa_pkcs1_sign_hash", NULL);
+    rng = pgp_rng_handle();
 
     /* p and q are reversed from normal usage in PGP */
-    botan_privkey_load_rsa(&rsa_key, seckey->q->mp, seckey->p->mp, pubkey->e->mp);
+    botan_privkey_load_rsa(
+      &rsa_key, get_BN_mp(seckey->q), get_BN_mp(seckey->p), get_BN_mp(pubkey->e));
 
     if (botan_privkey_check_key(rsa_key, rng, 0) != 0) {
         botan_privkey_destroy(rsa_key);
-        botan_rng_destroy(rng);
+        PGP_TRACE_END("pgp_rsa_pkcs1_sign_hash");
         return 0;
     }
 
     if (botan_pk_op_sign_create(&sign_op, rsa_key, padding_name, 0) != 0) {
         botan_privkey_destroy(rsa_key);
-        botan_rng_destroy(rng);
+        PGP_TRACE_END("pgp_rsa_pkcs1_sign_hash");
         return 0;
     }
 
@@ -233,17 +245,154 @@ pgp_rsa_pkcs1_sign_hash(uint8_t *               sig_buf,
         botan_pk_op_sign_finish(sign_op, rng, sig_buf, &sig_buf_size) != 0) {
         botan_pk_op_sign_destroy(sign_op);
         botan_privkey_destroy(rsa_key);
-        botan_rng_destroy(rng);
+        PGP_TRACE_END("pgp_rsa_pkcs1_sign_hash");
         return 0;
     }
 
     botan_pk_op_sign_destroy(sign_op);
     botan_privkey_destroy(rsa_key);
-    botan_rng_destroy(rng);
+    PGP_TRACE_END("pgp_rsa_pkcs1_sign_hash");
 
     return (int) sig_buf_size;
 }
 
+/* a sign operation on the signer's key, waiting to be used again */
+typedef struct rsa_sign_op_t {
+    botan_pk_op_sign_t    op;
+    pgp_hash_alg_t        hash_alg; /* the padding it was made for */
+    struct rsa_sign_op_t *next;
+} rsa_sign_op_t;
+
+struct pgp_rsa_signer_t {
+    botan_privkey_t key;
+    pthread_mutex_t lock; /* protects idle */
+    rsa_sign_op_t * idle;
+};
+
+/**
+   \ingroup Core_Crypto
+   \brief Load and check an RSA private key once, to sign with many times
+   \param seckey RSA secret key
+   \param pubkey RSA public key
+   \return the signer, to be freed with pgp_rsa_signer_free(); NULL if the
+   key is not valid
+*/
+pgp_rsa_signer_t *
+pgp_rsa_signer_new(const pgp_rsa_seckey_t *seckey, const pgp_rsa_pubkey_t *pubkey)
+{
+    pgp_rsa_signer_t *signer;
+    botan_rng_t       rng;
+
+    if (seckey->q == NULL || (rng = pgp_rng_handle()) == NULL ||
+        (signer = calloc(1, sizeof(*signer))) == NULL) {
+        return NULL;
+    }
+    PGP_TRACE_BEGIN("pgp_rsa_signer_new", NULL);
+    /* p and q are reversed from normal usage in PGP */
+    if (botan_privkey_load_rsa(&signer->key,
+                               get_BN_mp(seckey->q),
+                               get_BN_mp(seckey->p),
+                               get_BN_mp(pubkey->e)) != 0 ||
+        botan_privkey_check_key(signer->key, rng, 0) != 0) {
+        botan_privkey_destroy(signer->key);
+        free(signer);
+        PGP_TRACE_END("pgp_rsa_signer_new");
+        return NULL;
+    }
+    (void) pthread_mutex_init(&signer->lock, NULL);
+    PGP_TRACE_END("pgp_rsa_signer_new");
+    return signer;
+}
+
+/**
+   \ingroup Core_Crypto
+   \brief Sign a hash with a loaded RSA key, as pgp_rsa_pkcs1_sign_hash() does
+
+   Each thread signing at the same time gets a sign operation of its own,
+   which is kept for the next signature once it is done with.
+   \return number of bytes written to sig_buf; 0 on error
+*/
+int
+pgp_rsa_signer_sign_hash(pgp_rsa_signer_t *signer,
+                         uint8_t *         sig_buf,
+                         size_t            sig_buf_size,
+                         pgp_hash_alg_t    hash_alg,
+                         const uint8_t *   hash_buf,
+                         size_t            hash_len)
+{
+    rsa_sign_op_t **prev;
+    rsa_sign_op_t * op;
+    botan_rng_t     rng;
+    char            padding_name[64] = {0};
+    int             ret = 0;
+
+    if ((rng = pgp_rng_handle()) == NULL) {
+        return 0;
+    }
+    PGP_TRACE_BEGIN("pgp_rsa_pkcs1_sign_hash", NULL);
+    (void) pthread_mutex_lock(&signer->lock);
+    for (prev = &signer->idle; (op = *prev) != NULL && op->hash_alg != hash_alg;
+         prev = &op->next) {
+    }
+    if (op != NULL) {
+        *prev = op->next;
+    }
+    (void) pthread_mutex_unlock(&signer->lock);
+
+    if (op == NULL) {
+        snprintf(padding_name,
+                 sizeof(padding_name),
+                 "EMSA-PKCS1-v1_5(Raw,%s)",
+                 pgp_hash_name_botan(hash_alg));
+        if ((op = calloc(1, sizeof(*op))) == NULL ||
+            botan_pk_op_sign_create(&op->op, signer->key, padding_name, 0) != 0) {
+            free(op);
+            PGP_TRACE_END("pgp_rsa_pkcs1_sign_hash");
+            return 0;
+        }
+        op->hash_alg = hash_alg;
+    }
+
+    if (botan_pk_op_sign_update(op->op, hash_buf, hash_len) == 0 &&
+        botan_pk_op_sign_finish(op->op, rng, sig_buf, &sig_buf_size) == 0) {
+        ret = (int) sig_buf_size;
+    }
+    if (ret == 0) {
+        /* don't keep an operation in an unknown state */
+        botan_pk_op_sign_destroy(op->op);
+        free(op);
+    } else {
+        (void) pthread_mutex_lock(&signer->lock);
+        op->next = signer->idle;
+        signer->idle = op;
+        (void) pthread_mutex_unlock(&signer->lock);
+    }
+    PGP_TRACE_END("pgp_rsa_pkcs1_sign_hash");
+    return ret;
+}
+
+/**
+   \ingroup Core_Crypto
+   \brief Free a signer, which must no longer be in use
+*/
+void
+pgp_rsa_signer_free(pgp_rsa_signer_t *signer)
+{
+    rsa_sign_op_t *op;
+
+    if (signer == NULL) {
+        return;
+    }
+    while ((op = signer->idle) != NULL) {
+        signer->idle = op->next;
+        botan_pk_op_sign_destroy(op->op);
+        free(op);
+    }
+    botan_privkey_destroy(signer->key);
+    (void) pthread_mutex_destroy(&signer->lock);
+    free(signer);
+}
+
 /**
 \ingroup Core_Crypto
 \brief Decrypts RSA-encrypted data
@@ -267,11 +416,13 @@ pgp_rsa_decrypt_pkcs1(uint8_t *               out,
     botan_rng_t           rng = NULL;
     botan_pk_op_decrypt_t decrypt_op = NULL;
 
-    if (botan_privkey_load_rsa(&rsa_key, seckey->q->mp, seckey->p->mp, pubkey->e->mp) != 0) {
+    PGP_TRACE_BEGIN("pgp_rsa_decrypt_pkcs1", NULL);
+    if (botan_privkey_load_rsa(
+          &rsa_key, get_BN_mp(seckey->q), get_BN_mp(seckey->p), get_BN_mp(pubkey->e)) != 0) {
         goto done;
     }
 
-    if (botan_rng_init(&rng, NULL) != 0) {
+    if ((rng = pgp_rng_handle()) == NULL) {
         goto done;
     }
 
@@ -288,9 +439,9 @@ pgp_rsa_decrypt_pkcs1(uint8_t *               out,
     }
 
 done:
-    botan_rng_destroy(rng);
     botan_privkey_destroy(rsa_key);
     botan_pk_op_decrypt_destroy(decrypt_op);
+    PGP_TRACE_END("pgp_rsa_decrypt_pkcs1");
     return retval;
 }
 
@@ -336,7 +487,9 @@ rsa_generate_keypair(pgp_key_t *         keydata,
     botan_mp_init(&rsa_q);
     botan_mp_init(&rsa_u);
 
-    CHECK_BOTAN(botan_rng_init(&rng, NULL), false);
+    if ((rng = pgp_rng_handle()) == NULL) {
+        return false;
+    }
     CHECK_BOTAN(botan_privkey_create_rsa(&rsa_key, rng, numbits), false);
     CHECK_BOTAN(botan_privkey_check_key(rsa_key, rng, 1), false);
 
@@ -422,7 +575,6 @@ end:
 
     pgp_teardown_memory_write(output, mem);
     botan_privkey_destroy(rsa_key);
-    botan_rng_destroy(rng);
     return ret;
 }
 
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "seckeycache.h"
+#include "packet.h"
+#include "rnpdefs.h"
+
+/* signing services use a handful of keys, so a few slots are plenty */
+#define CACHE_SLOTS 32
+
+typedef struct seckey_slot_t {
+    pgp_seckey_t seckey;
+    uint8_t      fingerprint[PGP_FINGERPRINT_SIZE];
+    unsigned     fplen;   /* 0 if the slot is free */
+    time_t       expires; /* no longer handed out from then on */
+    time_t       used;    /* last handed out */
+    unsigned     uses;    /* times it may still be handed out, if limited */
+    unsigned     refs;    /* handed out, and not given back yet */
+    unsigned     stale;   /* no longer handed out, wiped when not in use */
+} seckey_slot_t;
+
+struct pgp_seckey_cache_t {
+    pthread_mutex_t lock;
+    seckey_slot_t * slots; /* CACHE_SLOTS of them, wiped as they are emptied */
+    unsigned        ttl;
+    unsigned        maxuses; /* 0 for no limit */
+};
+
+/* free and wipe the key in a slot, which makes the slot free */
+static void
+wipe_slot(seckey_slot_t *slot)
+{
+    pgp_seckey_free(&slot->seckey);
+    pgp_forget(slot, sizeof(*slot));
+}
+
+/* stop handing out keys which are out of time or uses, and wipe those of
+ * them which are not in use */
+static void
+expire_slots(pgp_seckey_cache_t *cache, time_t now)
+{
+    seckey_slot_t *slot;
+    unsigned       i;
+
+    for (i = 0, slot = cache->slots; i < CACHE_SLOTS; i++, slot++) {
+        if (slot->fplen == 0) {
+            continue;
+        }
+        if (now >= slot->expires) {
+            slot->stale = 1;
+        }
+        if (slot->stale && slot->refs == 0) {
+            wipe_slot(slot);
+        }
+    }
+}
+
+/* the slot still handing out the key unlocked from `key', if any */
+static seckey_slot_t *
+find_slot(pgp_seckey_cache_t *cache, const pgp_key_t *key)
+{
+    const pgp_fingerprint_t *fp = &key->sigfingerprint;
+    seckey_slot_t *          slot;
+    unsigned                 i;
+
+    if (fp->length == 0) {
+        return NULL;
+    }
+    for (i = 0, slot = cache->slots; i < CACHE_SLOTS; i++, slot++) {
+        if (slot->fplen == fp->length && !slot->stale &&
+            memcmp(slot->fingerprint, fp->fingerprint, fp->length) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/* hand out the key in a slot */
+static pgp_seckey_t *
+use_slot(pgp_seckey_cache_t *cache, seckey_slot_t *slot, time_t now)
+{
+    slot->refs += 1;
+    slot->used = now;
+    if (cache->maxuses > 0 && --slot->uses == 0) {
+        slot->stale = 1;
+    }
+    return &slot->seckey;
+}
+
+/**
+ * \ingroup Core_Keys
+ * \brief Make a cache for unlocked secret keys
+ * \param ttl Seconds for which a key is handed out after it was unlocked
+ * \param maxuses Times a key is handed out after it was unlocked, or 0
+ * \return the new cache, or NULL if it could not be made
+ */
+pgp_seckey_cache_t *
+pgp_seckey_cache_new(unsigned ttl, unsigned maxuses)
+{
+    pgp_seckey_cache_t *cache;
+
+    if ((cache = calloc(1, sizeof(*cache))) == NULL) {
+        return NULL;
+    }
+    if ((cache->slots = calloc(CACHE_SLOTS, sizeof(seckey_slot_t))) == NULL) {
+        free(cache);
+        return NULL;
+    }
+    (void) pthread_mutex_init(&cache->lock, NULL);
+    cache->ttl = ttl;
+    cache->maxuses = maxuses;
+    return cache;
+}
+
+/**
+ * \ingroup Core_Keys
+ * \brief Find the unlocked secret key of a key
+ * \param key Key which was unlocked
+ * \return the secret key, to be given back with pgp_seckey_cache_release(),
+ * or NULL if it is not in the cache
+ */
+pgp_seckey_t *
+pgp_seckey_cache_get(pgp_seckey_cache_t *cache, const pgp_key_t *key)
+{
+    seckey_slot_t *slot;
+    pgp_seckey_t * seckey = NULL;
+    time_t         now = time(NULL);
+
+    (void) pthread_mutex_lock(&cache->lock);
+    expire_slots(cache, now);
+    if ((slot = find_slot(cache, key)) != NULL) {
+        seckey = use_slot(cache, slot, now);
+    }
+    (void) pthread_mutex_unlock(&cache->lock);
+    return seckey;
+}
+
+/**
+ * \ingroup Core_Keys
+ * \brief Keep a secret key which has just been unlocked
+ *
+ * The cache takes over the key's contents, and frees `seckey' itself.
+ * \param key Key from which the secret key was unlocked
+ * \param seckey Secret key as given by pgp_decrypt_seckey()
+ * \return the secret key, to be given back with pgp_seckey_cache_release(),
+ * or NULL if it could not be kept, in which case `seckey' is untouched
+ */
+pgp_seckey_t *
+pgp_seckey_cache_put(pgp_seckey_cache_t *cache, const pgp_key_t *key, pgp_seckey_t *seckey)
+{
+    seckey_slot_t *slot;
+    seckey_slot_t *lru = NULL;
+    seckey_slot_t *old;
+    time_t         now = time(NULL);
+    unsigned       i;
+
+    if (key->sigfingerprint.length == 0) {
+        return NULL;
+    }
+    (void) pthread_mutex_lock(&cache->lock);
+    expire_slots(cache, now);
+    if ((old = find_slot(cache, key)) != NULL) {
+        /* unlocked again meanwhile, perhaps by another thread */
+        old->stale = 1;
+        if (old->refs == 0) {
+            wipe_slot(old);
+        }
+    }
+    for (i = 0, slot = cache->slots; i < CACHE_SLOTS && slot->fplen != 0; i++, slot++) {
+        if (slot->refs == 0 && (lru == NULL || slot->used < lru->used)) {
+            lru = slot;
+        }
+    }
+    if (i == CACHE_SLOTS) {
+        if (lru == NULL) {
+            /* all of them are in use */
+            (void) pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+        wipe_slot(slot = lru);
+    }
+    slot->seckey = *seckey;
+    (void) memcpy(slot->fingerprint, key->sigfingerprint.fingerprint, PGP_FINGERPRINT_SIZE);
+    slot->fplen = key->sigfingerprint.length;
+    slot->expires = now + cache->ttl;
+    slot->uses = cache->maxuses;
+    pgp_forget(seckey, sizeof(*seckey));
+    free(seckey);
+    seckey = use_slot(cache, slot, now);
+    (void) pthread_mutex_unlock(&cache->lock);
+    return seckey;
+}
+
+/**
+ * \ingroup Core_Keys
+ * \brief Give back a secret key handed out by the cache
+ * \return 1 if it was handed out by the cache; 0 if it was not, in which
+ * case it is left alone
+ */
+int
+pgp_seckey_cache_release(pgp_seckey_cache_t *cache, const pgp_seckey_t *seckey)
+{
+    seckey_slot_t *slot;
+    unsigned       i;
+
+    (void) pthread_mutex_lock(&cache->lock);
+    for (i = 0, slot = cache->slots; i < CACHE_SLOTS; i++, slot++) {
+        if (&slot->seckey == seckey && slot->refs > 0) {
+            if (--slot->refs == 0 && slot->stale) {
+                wipe_slot(slot);
+            }
+            break;
+        }
+    }
+    (void) pthread_mutex_unlock(&cache->lock);
+    return i < CACHE_SLOTS;
+}
+
+/**
+ * \ingroup Core_Keys
+ * \brief Wipe all keys in the cache, and free it
+ */
+void
+pgp_seckey_cache_free(pgp_seckey_cache_t *cache)
+{
+    unsigned i;
+
+    if (cache == NULL) {
+        return;
+    }
+    for (i = 0; i < CACHE_SLOTS; i++) {
+        if (cache->slots[i].fplen != 0) {
+            wipe_slot(&cache->slots[i]);
+        }
+    }
+    free(cache->slots);
+    (void) pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
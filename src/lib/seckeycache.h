@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RNP_SECKEYCACHE_H_
+#define RNP_SECKEYCACHE_H_
+
+#include "packet.h"
+
+/* Secret keys which have been unlocked, so that signing with the same key
+ * again need not rerun the S2K to get at it.
+ *
+ * Keys are found by the fingerprint of the key they were unlocked from,
+ * and are handed out until their time to live is up, or they have been
+ * handed out as many times as allowed. Each key handed out must be given
+ * back with pgp_seckey_cache_release(); keys which are no longer handed
+ * out are wiped once the last user gives them back. The keys, and the big
+ * numbers they refer to, are wiped when they are freed; they are not kept
+ * in locked memory, so they may be swapped out meanwhile like any other.
+ */
+
+typedef struct pgp_seckey_cache_t pgp_seckey_cache_t;
+
+pgp_seckey_cache_t *pgp_seckey_cache_new(unsigned, unsigned);
+pgp_seckey_t *      pgp_seckey_cache_get(pgp_seckey_cache_t *, const pgp_key_t *);
+pgp_seckey_t *      pgp_seckey_cache_put(pgp_seckey_cache_t *,
+                                         const pgp_key_t *,
+                                         pgp_seckey_t *);
+int                 pgp_seckey_cache_release(pgp_seckey_cache_t *, const pgp_seckey_t *);
+void                pgp_seckey_cache_free(pgp_seckey_cache_t *);
+
+#endif
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sigcache.h"
+#include "rnpsdk.h"
+
+/* the file is this header followed by records of key and result */
+#define CACHE_MAGIC "rnpsigc1"
+#define CACHE_MAGIC_LEN 8
+#define CACHE_RECORD (PGP_SIG_CACHE_KEY_SIZE + 1)
+#define CACHE_MIN_SLOTS 1024
+
+enum { SLOT_EMPTY = 0, SLOT_FAILED = 1, SLOT_VERIFIED = 2 };
+
+typedef struct sig_cache_slot_t {
+    uint8_t key[PGP_SIG_CACHE_KEY_SIZE];
+    uint8_t state;
+    uint8_t dirty; /* not in the file yet */
+} sig_cache_slot_t;
+
+struct pgp_sig_cache_t {
+    char *            path;
+    sig_cache_slot_t *slots;
+    size_t            size; /* power of two */
+    size_t            used;
+    size_t            dirty;
+    int               rewrite; /* file missing or not ours: start it afresh */
+};
+
+/* keys are digests already, so their first bytes index the table */
+static size_t
+slot_index(const pgp_sig_cache_t *cache, const uint8_t *key)
+{
+    size_t n = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(n); i++) {
+        n = (n << 8) | key[i];
+    }
+    return n & (cache->size - 1);
+}
+
+static sig_cache_slot_t *
+find_slot(const pgp_sig_cache_t *cache, const uint8_t *key)
+{
+    sig_cache_slot_t *slot;
+    size_t            i;
+
+    for (i = slot_index(cache, key);; i = (i + 1) & (cache->size - 1)) {
+        slot = &cache->slots[i];
+        if (slot->state == SLOT_EMPTY ||
+            memcmp(slot->key, key, PGP_SIG_CACHE_KEY_SIZE) == 0) {
+            return slot;
+        }
+    }
+}
+
+static int
+grow(pgp_sig_cache_t *cache)
+{
+    sig_cache_slot_t *old = cache->slots;
+    size_t            oldsize = cache->size;
+    size_t            i;
+
+    cache->size = oldsize ? oldsize * 2 : CACHE_MIN_SLOTS;
+    if ((cache->slots = calloc(cache->size, sizeof(*cache->slots))) == NULL) {
+        (void) fprintf(stderr, "pgp_sig_cache: bad alloc\n");
+        cache->slots = old;
+        cache->size = oldsize;
+        return 0;
+    }
+    for (i = 0; i < oldsize; i++) {
+        if (old[i].state != SLOT_EMPTY) {
+            *find_slot(cache, old[i].key) = old[i];
+        }
+    }
+    free(old);
+    return 1;
+}
+
+static int
+insert(pgp_sig_cache_t *cache, const uint8_t *key, uint8_t state, uint8_t dirty)
+{
+    sig_cache_slot_t *slot;
+
+    /* keep the table at most half full */
+    if ((cache->used + 1) * 2 > cache->size && !grow(cache)) {
+        return 0;
+    }
+    slot = find_slot(cache, key);
+    if (slot->state == SLOT_EMPTY) {
+        (void) memcpy(slot->key, key, PGP_SIG_CACHE_KEY_SIZE);
+        cache->used += 1;
+    } else if (slot->state == state) {
+        return 1;
+    }
+    slot->state = state;
+    if (dirty && !slot->dirty) {
+        slot->dirty = 1;
+        cache->dirty += 1;
+    }
+    return 1;
+}
+
+static void
+load(pgp_sig_cache_t *cache)
+{
+    uint8_t rec[CACHE_RECORD];
+    char    magic[CACHE_MAGIC_LEN];
+    FILE *  fp;
+
+    if ((fp = fopen(cache->path, "rb")) == NULL) {
+        cache->rewrite = 1;
+        return;
+    }
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+        memcmp(magic, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0) {
+        cache->rewrite = 1;
+        (void) fclose(fp);
+        return;
+    }
+    /* a torn record at the end is dropped, and written again if needed */
+    while (fread(rec, 1, sizeof(rec), fp) == sizeof(rec)) {
+        if ((rec[PGP_SIG_CACHE_KEY_SIZE] == SLOT_FAILED ||
+             rec[PGP_SIG_CACHE_KEY_SIZE] == SLOT_VERIFIED) &&
+            !insert(cache, rec, rec[PGP_SIG_CACHE_KEY_SIZE], 0)) {
+            break;
+        }
+    }
+    (void) fclose(fp);
+}
+
+/**
+ * \brief Read the signature cache kept in a file
+ * \param path The cache file, which need not exist yet
+ * \return the cache, or NULL on allocation failure
+ */
+pgp_sig_cache_t *
+pgp_sig_cache_open(const char *path)
+{
+    pgp_sig_cache_t *cache;
+
+    if ((cache = calloc(1, sizeof(*cache))) == NULL ||
+        (cache->path = rnp_strdup(path)) == NULL || !grow(cache)) {
+        (void) fprintf(stderr, "pgp_sig_cache_open: bad alloc\n");
+        pgp_sig_cache_close(cache);
+        return NULL;
+    }
+    load(cache);
+    return cache;
+}
+
+/**
+ * \brief Look up an earlier result
+ * \param cache The cache, may be NULL
+ * \param key PGP_SIG_CACHE_KEY_SIZE bytes naming the check
+ * \param valid Set to the result when found
+ * \return 1 if the check was found; else 0
+ */
+int
+pgp_sig_cache_get(const pgp_sig_cache_t *cache, const uint8_t *key, unsigned *valid)
+{
+    const sig_cache_slot_t *slot;
+
+    if (cache == NULL) {
+        return 0;
+    }
+    slot = find_slot(cache, key);
+    if (slot->state == SLOT_EMPTY) {
+        return 0;
+    }
+    *valid = (slot->state == SLOT_VERIFIED);
+    return 1;
+}
+
+/**
+ * \brief Record the result of a check, to be written out on flush
+ * \return 1 if OK; else 0
+ */
+int
+pgp_sig_cache_put(pgp_sig_cache_t *cache, const uint8_t *key, unsigned valid)
+{
+    if (cache == NULL) {
+        return 0;
+    }
+    return insert(cache, key, valid ? SLOT_VERIFIED : SLOT_FAILED, 1);
+}
+
+/**
+ * \brief Append results recorded since the last flush to the file
+ *
+ * Records go out in a single O_APPEND write, so processes sharing a
+ * cache file do not interleave their records.
+ * \return 1 if OK; else 0
+ */
+int
+pgp_sig_cache_flush(pgp_sig_cache_t *cache)
+{
+    uint8_t *buf;
+    uint8_t *cp;
+    size_t   len;
+    size_t   i;
+    ssize_t  n;
+    int      flags;
+    int      fd;
+
+    if (cache == NULL || cache->dirty == 0) {
+        return 1;
+    }
+    len = cache->dirty * CACHE_RECORD + (cache->rewrite ? CACHE_MAGIC_LEN : 0);
+    if ((buf = cp = malloc(len)) == NULL) {
+        (void) fprintf(stderr, "pgp_sig_cache_flush: bad alloc\n");
+        return 0;
+    }
+    if (cache->rewrite) {
+        (void) memcpy(cp, CACHE_MAGIC, CACHE_MAGIC_LEN);
+        cp += CACHE_MAGIC_LEN;
+    }
+    for (i = 0; i < cache->size; i++) {
+        if (cache->slots[i].dirty) {
+            (void) memcpy(cp, cache->slots[i].key, PGP_SIG_CACHE_KEY_SIZE);
+            cp[PGP_SIG_CACHE_KEY_SIZE] = cache->slots[i].state;
+            cp += CACHE_RECORD;
+        }
+    }
+    flags = O_WRONLY | O_CREAT | (cache->rewrite ? O_TRUNC : O_APPEND);
+    if ((fd = open(cache->path, flags, 0600)) < 0) {
+        (void) fprintf(stderr, "pgp_sig_cache_flush: can't open '%s'\n", cache->path);
+        free(buf);
+        return 0;
+    }
+    n = write(fd, buf, len);
+    (void) close(fd);
+    free(buf);
+    if (n < 0 || (size_t) n != len) {
+        (void) fprintf(stderr, "pgp_sig_cache_flush: short write to '%s'\n", cache->path);
+        return 0;
+    }
+    for (i = 0; i < cache->size; i++) {
+        cache->slots[i].dirty = 0;
+    }
+    cache->dirty = 0;
+    cache->rewrite = 0;
+    return 1;
+}
+
+/**
+ * \brief Flush and free the cache
+ */
+void
+pgp_sig_cache_close(pgp_sig_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    if (cache->slots) {
+        (void) pgp_sig_cache_flush(cache);
+    }
+    free(cache->slots);
+    free(cache->path);
+    free(cache);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RNP_SIGCACHE_H_
+#define RNP_SIGCACHE_H_
+
+#include <stdint.h>
+
+/* Results of earlier signature checks, kept in a file between runs.
+ *
+ * Entries are keyed by a digest the caller makes of everything the
+ * result depends on (signer, signed material, signature packet), so an
+ * entry can never be found for anything but the check it records. New
+ * results are appended to the file by pgp_sig_cache_flush().
+ */
+
+#define PGP_SIG_CACHE_KEY_SIZE 32
+
+typedef struct pgp_sig_cache_t pgp_sig_cache_t;
+
+pgp_sig_cache_t *pgp_sig_cache_open(const char *);
+int              pgp_sig_cache_get(const pgp_sig_cache_t *, const uint8_t *, unsigned *);
+int              pgp_sig_cache_put(pgp_sig_cache_t *, const uint8_t *, unsigned);
+int              pgp_sig_cache_flush(pgp_sig_cache_t *);
+void             pgp_sig_cache_close(pgp_sig_cache_t *);
+
+#endif
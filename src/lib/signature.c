@@ -85,6 +85,8 @@ __RCSID("$NetBSD: signature.c,v 1.34 2012/03/05 02:20:18 christos Exp $");
 #include "validate.h"
 #include "rnpdefs.h"
 #include "rnpdigest.h"
+#include "agent.h"
+#include "writer.h"
 
 /** \ingroup Core_Create
  * needed for signature creation
@@ -633,14 +635,14 @@ pgp_write_sig(pgp_output_t *      output,
     case PGP_PKA_RSA:
     case PGP_PKA_RSA_ENCRYPT_ONLY:
     case PGP_PKA_RSA_SIGN_ONLY:
-        if (seckey->key.rsa.d == NULL) {
+        if (seckey->key.rsa.d == NULL && seckey->agent == NULL) {
             (void) fprintf(stderr, "pgp_write_sig: null rsa.d\n");
             return 0;
         }
         break;
 
     case PGP_PKA_DSA:
-        if (seckey->key.dsa.x == NULL) {
+        if (seckey->key.dsa.x == NULL && seckey->agent == NULL) {
             (void) fprintf(stderr, "pgp_write_sig: null dsa.x\n");
             return 0;
         }
@@ -675,26 +677,34 @@ pgp_write_sig(pgp_output_t *      output,
     }
     /* XXX: technically, we could figure out how big the signature is */
     /* and write it directly to the output instead of via memory. */
-    switch (seckey->pubkey.alg) {
-    case PGP_PKA_RSA:
-    case PGP_PKA_RSA_ENCRYPT_ONLY:
-    case PGP_PKA_RSA_SIGN_ONLY:
-        if (!rsa_sign(&sig->hash, &key->key.rsa, &seckey->key.rsa, sig->output)) {
-            (void) fprintf(stderr, "pgp_write_sig: rsa_sign failure\n");
+    if (seckey->agent != NULL) {
+        /* rnp-agent has the secret part */
+        if (!pgp_agent_sign(&sig->hash, seckey, sig->output)) {
+            (void) fprintf(stderr, "pgp_write_sig: agent sign failure\n");
             return 0;
         }
-        break;
-
-    case PGP_PKA_DSA:
-        if (!dsa_sign(&sig->hash, &key->key.dsa, &seckey->key.dsa, sig->output)) {
-            (void) fprintf(stderr, "pgp_write_sig: dsa_sign failure\n");
+    } else {
+        switch (seckey->pubkey.alg) {
+        case PGP_PKA_RSA:
+        case PGP_PKA_RSA_ENCRYPT_ONLY:
+        case PGP_PKA_RSA_SIGN_ONLY:
+            if (!rsa_sign(&sig->hash, &key->key.rsa, &seckey->key.rsa, sig->output)) {
+                (void) fprintf(stderr, "pgp_write_sig: rsa_sign failure\n");
+                return 0;
+            }
+            break;
+
+        case PGP_PKA_DSA:
+            if (!dsa_sign(&sig->hash, &key->key.dsa, &seckey->key.dsa, sig->output)) {
+                (void) fprintf(stderr, "pgp_write_sig: dsa_sign failure\n");
+                return 0;
+            }
+            break;
+
+        default:
+            (void) fprintf(stderr, "Unsupported algorithm %d\n", seckey->pubkey.alg);
             return 0;
         }
-        break;
-
-    default:
-        (void) fprintf(stderr, "Unsupported algorithm %d\n", seckey->pubkey.alg);
-        return 0;
     }
 
     ret = pgp_write_ptag(output, PGP_PTAG_CT_SIGNATURE);
@@ -1074,17 +1084,306 @@ pgp_sign_buf(pgp_io_t *          io,
     return mem;
 }
 
+/* the data is hashed and written a chunk at a time, while it is in cache */
+#define SIGN_CHUNK 65536
+
+/* one of several signatures being made over the same data */
+typedef struct {
+    const pgp_seckey_t *seckey;
+    pgp_create_sig_t *  sig;
+    unsigned            owner; /* signer whose hash is fed the data */
+} signer_t;
+
+static void
+free_signers(signer_t *signers, unsigned signerc)
+{
+    unsigned i;
+
+    for (i = 0; i < signerc; i++) {
+        if (signers[i].sig) {
+            pgp_create_sig_delete(signers[i].sig);
+        }
+    }
+    free(signers);
+}
+
+/*
+ * Starts a signature for each key. Signatures using the same hash algorithm
+ * share one hash context: only the first of them is given the data, and the
+ * others take a copy of its state when the data is done.
+ */
+static signer_t *
+start_signers(const pgp_seckey_t **seckeys, unsigned seckeyc, pgp_hash_alg_t hash_alg)
+{
+    pgp_hash_alg_t alg;
+    signer_t *     signers;
+    unsigned       i;
+
+    if (seckeyc == 0 || (signers = calloc(seckeyc, sizeof(*signers))) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < seckeyc; i++) {
+        /* DSA keys are used with SHA1, as rnp_sign_file() does */
+        alg = (seckeys[i]->pubkey.alg == PGP_PKA_DSA) ? PGP_HASH_SHA1 : hash_alg;
+        signers[i].seckey = seckeys[i];
+        if ((signers[i].sig = pgp_create_sig_new()) == NULL) {
+            free_signers(signers, i);
+            return NULL;
+        }
+        pgp_start_sig(signers[i].sig, seckeys[i], alg, PGP_SIG_BINARY);
+        for (signers[i].owner = 0;
+             pgp_hash_alg_type(pgp_sig_get_hash(signers[signers[i].owner].sig)) != alg;
+             signers[i].owner++) {
+        }
+    }
+    return signers;
+}
+
+/* add data to each distinct hash */
+static void
+hash_signers(signer_t *signers, unsigned signerc, const uint8_t *data, size_t len)
+{
+    unsigned i;
+
+    for (i = 0; i < signerc; i++) {
+        if (signers[i].owner == i) {
+            pgp_hash_add(pgp_sig_get_hash(signers[i].sig), data, len);
+        }
+    }
+}
+
+/*
+ * Writes the signatures, last one first if reversed (to close nested one-pass
+ * signatures), after giving every signature the state of its shared hash.
+ */
+static unsigned
+write_signers(pgp_output_t * output,
+              signer_t *     signers,
+              unsigned       signerc,
+              const int64_t  from,
+              const uint64_t duration,
+              const unsigned reversed)
+{
+    pgp_create_sig_t *sig;
+    pgp_hash_alg_t    alg;
+    unsigned          ret;
+    unsigned          i;
+    uint8_t           keyid[PGP_KEY_ID_SIZE];
+
+    for (i = 0; i < signerc; i++) {
+        if (signers[i].owner != i &&
+            !pgp_hash_copy(pgp_sig_get_hash(signers[i].sig),
+                           pgp_sig_get_hash(signers[signers[i].owner].sig))) {
+            return 0;
+        }
+    }
+    for (ret = 1, i = 0; ret && i < signerc; i++) {
+        signer_t *signer = &signers[(reversed) ? signerc - 1 - i : i];
+
+        sig = signer->sig;
+        alg = pgp_hash_alg_type(pgp_sig_get_hash(sig));
+        pgp_keyid(keyid, PGP_KEY_ID_SIZE, &signer->seckey->pubkey, alg);
+        ret = pgp_add_time(sig, from, "birth") &&
+              pgp_add_time(sig, (int64_t) duration, "expiration") &&
+              pgp_add_issuer_keyid(sig, keyid) && pgp_end_hashed_subpkts(sig) &&
+              pgp_write_sig(output, sig, &signer->seckey->pubkey, signer->seckey);
+    }
+    return ret;
+}
+
+/*
+ * Writes data as a one-pass signed message (one-pass signatures, literal data,
+ * signatures) to output. Each chunk of the data is hashed and then pushed down
+ * the writer stack, so it is only read once whatever the stack does with it,
+ * and however many keys sign it.
+ */
+static unsigned
+write_one_pass_signed(pgp_output_t *       output,
+                      const uint8_t *      data,
+                      size_t               len,
+                      const pgp_seckey_t **seckeys,
+                      unsigned             seckeyc,
+                      pgp_hash_alg_t       hash_alg,
+                      const int64_t        from,
+                      const uint64_t       duration)
+{
+    pgp_hash_alg_t alg;
+    signer_t *     signers;
+    unsigned       ret;
+    unsigned       i;
+    size_t         off;
+    size_t         n;
+
+    if (len > UINT32_MAX - (1 + 1 + 4)) {
+        (void) fprintf(stderr, "write_one_pass_signed: message too long\n");
+        return 0;
+    }
+    if ((signers = start_signers(seckeys, seckeyc, hash_alg)) == NULL) {
+        return 0;
+    }
+    for (ret = 1, i = 0; ret && i < seckeyc; i++) {
+        alg = pgp_hash_alg_type(pgp_sig_get_hash(signers[i].sig));
+        ret = pgp_write_nested_one_pass_sig(
+          output, seckeys[i], alg, PGP_SIG_BINARY, i == seckeyc - 1);
+    }
+    ret = ret && pgp_write_ptag(output, PGP_PTAG_CT_LITDATA) &&
+          pgp_write_length(output, (unsigned) (1 + 1 + 4 + len)) &&
+          pgp_write_scalar(output, (unsigned) PGP_LDT_BINARY, 1) &&
+          pgp_write_scalar(output, 0, 1) && pgp_write_scalar(output, 0, 4);
+    for (off = 0; ret && off < len; off += n) {
+        n = MIN(len - off, SIGN_CHUNK);
+        hash_signers(signers, seckeyc, &data[off], n);
+        ret = pgp_write(output, &data[off], (unsigned) n);
+    }
+    ret = ret && write_signers(output, signers, seckeyc, from, duration, 1);
+    free_signers(signers, seckeyc);
+    return ret;
+}
+
+/* push the writers which encrypt a signed message */
+static unsigned
+push_sign_encrypt(pgp_output_t *    output,
+                  const pgp_key_t **keys,
+                  unsigned          keyc,
+                  const char *      cipher,
+                  const unsigned    armored)
+{
+    if (armored) {
+        pgp_writer_push_armor_msg(output);
+    }
+    return pgp_push_stream_enc_se_ip_pkts(output, keys, keyc, cipher);
+}
+
+/**
+\ingroup HighLevel_Sign
+\brief Signs and encrypts a file in one pass
+\note The plaintext is hashed for a one-pass signature as it is encrypted,
+so it is read once rather than once per operation. It is not compressed, so
+that the encrypted data can be written with partial lengths as it goes.
+\param inname Input filename
+\param outname Output filename. If NULL, a name is constructed from the input filename.
+\param seckey Secret Key to use for signing
+\param keys Keys of the recipients
+\param keyc Number of recipients
+\param cipher Name of the symmetric cipher
+\param armored Write armoured text, if set.
+\param overwrite May overwrite existing file, if set.
+\return 1 if OK; else 0
+*/
+unsigned
+pgp_sign_encrypt_file(pgp_io_t *          io,
+                      const char *        inname,
+                      const char *        outname,
+                      const pgp_seckey_t *seckey,
+                      const char *        hashname,
+                      const int64_t       from,
+                      const uint64_t      duration,
+                      const pgp_key_t **  keys,
+                      unsigned            keyc,
+                      const char *        cipher,
+                      const unsigned      armored,
+                      const unsigned      overwrite)
+{
+    pgp_hash_alg_t hash_alg;
+    pgp_memory_t * infile;
+    pgp_output_t * output;
+    unsigned       ret;
+    int            fd_out;
+
+    hash_alg = pgp_str_to_hash_alg(hashname);
+    if (hash_alg == PGP_HASH_UNKNOWN) {
+        (void) fprintf(
+          io->errs, "pgp_sign_encrypt_file: unknown hash algorithm: \"%s\"\n", hashname);
+        return 0;
+    }
+    infile = pgp_memory_new();
+    if (!pgp_mem_readfile(infile, inname)) {
+        pgp_memory_free(infile);
+        return 0;
+    }
+    fd_out = open_output_file(&output, inname, outname, (armored) ? "asc" : "gpg", overwrite);
+    if (fd_out < 0) {
+        pgp_memory_free(infile);
+        return 0;
+    }
+    ret = push_sign_encrypt(output, keys, keyc, cipher, armored) &&
+          write_one_pass_signed(output,
+                                pgp_mem_data(infile),
+                                pgp_mem_len(infile),
+                                &seckey,
+                                1,
+                                hash_alg,
+                                from,
+                                duration);
+    pgp_teardown_file_write(output, fd_out);
+    pgp_memory_free(infile);
+    return ret;
+}
+
+/**
+\ingroup HighLevel_Sign
+\brief Signs and encrypts a buffer in one pass
+\param input Input data
+\param insize Length of input data
+\param seckey Secret Key to use for signing
+\param keys Keys of the recipients
+\param keyc Number of recipients
+\param cipher Name of the symmetric cipher
+\param armored Write armoured text, if set
+\return New pgp_memory_t struct containing the message, or NULL
+\note It is the caller's responsibility to call pgp_memory_free(me)
+*/
+pgp_memory_t *
+pgp_sign_encrypt_buf(pgp_io_t *          io,
+                     const void *        input,
+                     const size_t        insize,
+                     const pgp_seckey_t *seckey,
+                     const char *        hashname,
+                     const int64_t       from,
+                     const uint64_t      duration,
+                     const pgp_key_t **  keys,
+                     unsigned            keyc,
+                     const char *        cipher,
+                     const unsigned      armored)
+{
+    pgp_hash_alg_t hash_alg;
+    pgp_output_t * output;
+    pgp_memory_t * mem;
+    unsigned       ret;
+
+    if (input == NULL) {
+        (void) fprintf(io->errs, "pgp_sign_encrypt_buf: null input\n");
+        return NULL;
+    }
+    hash_alg = pgp_str_to_hash_alg(hashname);
+    if (hash_alg == PGP_HASH_UNKNOWN) {
+        (void) fprintf(
+          io->errs, "pgp_sign_encrypt_buf: unknown hash algorithm: \"%s\"\n", hashname);
+        return NULL;
+    }
+    pgp_setup_memory_write(&output, &mem, insize);
+    ret = push_sign_encrypt(output, keys, keyc, cipher, armored) &&
+          write_one_pass_signed(output, input, insize, &seckey, 1, hash_alg, from, duration);
+    pgp_writer_close(output);
+    pgp_output_delete(output);
+    if (!ret) {
+        pgp_memory_free(mem);
+        return NULL;
+    }
+    return mem;
+}
+
 /* sign a file, and put the signature in a separate file */
 int
-pgp_sign_detached(pgp_io_t *     io,
-                  const char *   f,
-                  char *         sigfile,
-                  pgp_seckey_t * seckey,
-                  const char *   hash,
-                  const int64_t  from,
-                  const uint64_t duration,
-                  const unsigned armored,
-                  const unsigned overwrite)
+pgp_sign_detached(pgp_io_t *          io,
+                  const char *        f,
+                  char *              sigfile,
+                  const pgp_seckey_t *seckey,
+                  const char *        hash,
+                  const int64_t       from,
+                  const uint64_t      duration,
+                  const unsigned      armored,
+                  const unsigned      overwrite)
 {
     pgp_create_sig_t *sig;
     pgp_hash_alg_t    hash_alg;
@@ -1132,7 +1431,178 @@ pgp_sign_detached(pgp_io_t *     io,
     pgp_end_hashed_subpkts(sig);
     pgp_write_sig(output, sig, &seckey->pubkey, seckey);
     pgp_teardown_file_write(output, fd);
-    pgp_seckey_free(seckey);
 
     return 1;
 }
+
+/**
+\ingroup HighLevel_Sign
+\brief Signs a file with several keys in one pass
+\note The data is read and hashed once, with one hash per distinct hash
+algorithm, and the signatures are written as nested one-pass signatures
+\param inname Input filename
+\param outname Output filename. If NULL, a name is constructed from the input filename.
+\param seckeys Secret Keys to use for signing
+\param seckeyc Number of keys
+\param armored Write armoured text, if set.
+\param overwrite May overwrite existing file, if set.
+\return 1 if OK; else 0
+*/
+unsigned
+pgp_sign_file_multi(pgp_io_t *           io,
+                    const char *         inname,
+                    const char *         outname,
+                    const pgp_seckey_t **seckeys,
+                    unsigned             seckeyc,
+                    const char *         hashname,
+                    const int64_t        from,
+                    const uint64_t       duration,
+                    const unsigned       armored,
+                    const unsigned       overwrite)
+{
+    pgp_hash_alg_t hash_alg;
+    pgp_memory_t * infile;
+    pgp_output_t * output;
+    unsigned       ret;
+    int            fd_out;
+
+    hash_alg = pgp_str_to_hash_alg(hashname);
+    if (hash_alg == PGP_HASH_UNKNOWN) {
+        (void) fprintf(
+          io->errs, "pgp_sign_file_multi: unknown hash algorithm: \"%s\"\n", hashname);
+        return 0;
+    }
+    infile = pgp_memory_new();
+    if (!pgp_mem_readfile(infile, inname)) {
+        pgp_memory_free(infile);
+        return 0;
+    }
+    fd_out = open_output_file(&output, inname, outname, (armored) ? "asc" : "gpg", overwrite);
+    if (fd_out < 0) {
+        pgp_memory_free(infile);
+        return 0;
+    }
+    if (armored) {
+        pgp_writer_push_armor_msg(output);
+    }
+    ret = write_one_pass_signed(output,
+                                pgp_mem_data(infile),
+                                pgp_mem_len(infile),
+                                seckeys,
+                                seckeyc,
+                                hash_alg,
+                                from,
+                                duration);
+    pgp_teardown_file_write(output, fd_out);
+    pgp_memory_free(infile);
+    return ret;
+}
+
+/**
+\ingroup HighLevel_Sign
+\brief Signs a buffer with several keys in one pass
+\param input Input text to be signed
+\param insize Length of input text
+\param seckeys Secret Keys to use for signing
+\param seckeyc Number of keys
+\param armored Write armoured text, if set
+\return New pgp_memory_t struct containing signed text, or NULL
+\note It is the caller's responsibility to call pgp_memory_free(me)
+*/
+pgp_memory_t *
+pgp_sign_buf_multi(pgp_io_t *           io,
+                   const void *         input,
+                   const size_t         insize,
+                   const pgp_seckey_t **seckeys,
+                   unsigned             seckeyc,
+                   const int64_t        from,
+                   const uint64_t       duration,
+                   const char *         hashname,
+                   const unsigned       armored)
+{
+    pgp_hash_alg_t hash_alg;
+    pgp_output_t * output;
+    pgp_memory_t * mem;
+    unsigned       ret;
+
+    if (input == NULL) {
+        (void) fprintf(io->errs, "pgp_sign_buf_multi: null input\n");
+        return NULL;
+    }
+    hash_alg = pgp_str_to_hash_alg(hashname);
+    if (hash_alg == PGP_HASH_UNKNOWN) {
+        (void) fprintf(
+          io->errs, "pgp_sign_buf_multi: unknown hash algorithm: \"%s\"\n", hashname);
+        return NULL;
+    }
+    pgp_setup_memory_write(&output, &mem, insize);
+    if (armored) {
+        pgp_writer_push_armor_msg(output);
+    }
+    ret =
+      write_one_pass_signed(output, input, insize, seckeys, seckeyc, hash_alg, from, duration);
+    pgp_writer_close(output);
+    pgp_output_delete(output);
+    if (!ret) {
+        pgp_memory_free(mem);
+        return NULL;
+    }
+    return mem;
+}
+
+/* sign a file with several keys, and put the signatures in a separate file */
+int
+pgp_sign_detached_multi(pgp_io_t *           io,
+                        const char *         f,
+                        char *               sigfile,
+                        const pgp_seckey_t **seckeys,
+                        unsigned             seckeyc,
+                        const char *         hash,
+                        const int64_t        from,
+                        const uint64_t       duration,
+                        const unsigned       armored,
+                        const unsigned       overwrite)
+{
+    pgp_hash_alg_t hash_alg;
+    pgp_output_t * output;
+    pgp_memory_t * mem;
+    signer_t *     signers;
+    size_t         off;
+    size_t         n;
+    int            ret;
+    int            fd;
+
+    hash_alg = pgp_str_to_hash_alg(hash);
+    if (hash_alg == PGP_HASH_UNKNOWN) {
+        (void) fprintf(io->errs, "Unknown hash algorithm: %s\n", hash);
+        return 0;
+    }
+    mem = pgp_memory_new();
+    if (!pgp_mem_readfile(mem, f)) {
+        pgp_memory_free(mem);
+        return 0;
+    }
+    if ((signers = start_signers(seckeys, seckeyc, hash_alg)) == NULL) {
+        pgp_memory_free(mem);
+        return 0;
+    }
+    for (off = 0; off < pgp_mem_len(mem); off += n) {
+        n = MIN(pgp_mem_len(mem) - off, SIGN_CHUNK);
+        hash_signers(signers, seckeyc, (uint8_t *) pgp_mem_data(mem) + off, n);
+    }
+    pgp_memory_free(mem);
+
+    fd = open_output_file(&output, f, sigfile, (armored) ? "asc" : "sig", overwrite);
+    if (fd < 0) {
+        (void) fprintf(io->errs, "Can't open output file: %s\n", f);
+        free_signers(signers, seckeyc);
+        return 0;
+    }
+    if (armored) {
+        pgp_writer_push_armor_msg(output);
+    }
+    ret = (int) write_signers(output, signers, seckeyc, from, duration, 0);
+    pgp_teardown_file_write(output, fd);
+    free_signers(signers, seckeyc);
+    return ret;
+}
@@ -127,13 +127,48 @@ unsigned pgp_sign_file(pgp_io_t *,
 int pgp_sign_detached(pgp_io_t *,
                       const char *,
                       char *,
-                      pgp_seckey_t *,
+                      const pgp_seckey_t *,
                       const char *,
                       const int64_t,
                       const uint64_t,
                       const unsigned,
                       const unsigned);
 
+unsigned pgp_sign_encrypt_file(pgp_io_t *,
+                               const char *,
+                               const char *,
+                               const pgp_seckey_t *,
+                               const char *,
+                               const int64_t,
+                               const uint64_t,
+                               const pgp_key_t **,
+                               unsigned,
+                               const char *,
+                               const unsigned,
+                               const unsigned);
+
+unsigned pgp_sign_file_multi(pgp_io_t *,
+                             const char *,
+                             const char *,
+                             const pgp_seckey_t **,
+                             unsigned,
+                             const char *,
+                             const int64_t,
+                             const uint64_t,
+                             const unsigned,
+                             const unsigned);
+
+int pgp_sign_detached_multi(pgp_io_t *,
+                            const char *,
+                            char *,
+                            const pgp_seckey_t **,
+                            unsigned,
+                            const char *,
+                            const int64_t,
+                            const uint64_t,
+                            const unsigned,
+                            const unsigned);
+
 /* armoured stuff */
 unsigned pgp_crc24(unsigned, uint8_t);
 
@@ -168,4 +203,26 @@ pgp_memory_t *pgp_sign_buf(pgp_io_t *,
                            const unsigned,
                            const unsigned);
 
+pgp_memory_t *pgp_sign_buf_multi(pgp_io_t *,
+                                 const void *,
+                                 const size_t,
+                                 const pgp_seckey_t **,
+                                 unsigned,
+                                 const int64_t,
+                                 const uint64_t,
+                                 const char *,
+                                 const unsigned);
+
+pgp_memory_t *pgp_sign_encrypt_buf(pgp_io_t *,
+                                   const void *,
+                                   const size_t,
+                                   const pgp_seckey_t *,
+                                   const char *,
+                                   const int64_t,
+                                   const uint64_t,
+                                   const pgp_key_t **,
+                                   unsigned,
+                                   const char *,
+                                   const unsigned);
+
 #endif /* SIGNATURE_H_ */
@@ -0,0 +1,601 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Per-algorithm speed test, in the spirit of `openssl speed`.
+ *
+ * Every primitive is driven through the same entry points the rest of
+ * the library uses (pgp_cipher_cfb_*, pgp_hash_*, the RSA/DSA/ElGamal
+ * wrappers and pgp_s2k_iterated), so the numbers include our overhead
+ * and not just Botan's.
+ */
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <botan/ffi.h>
+#include <rnp.h>
+
+#include "crypto.h"
+#include "hash.h"
+#include "packet-key.h"
+#include "rng.h"
+#include "rnpsdk.h"
+#include "s2k.h"
+#include "symmetric.h"
+
+#define SPEED_DEFAULT_SECONDS 1
+
+/* buffer sizes for the symmetric and hash tests */
+static const size_t speed_sizes[] = {16, 64, 256, 1024, 8192, 16384};
+
+#define SPEED_NSIZES (sizeof(speed_sizes) / sizeof(speed_sizes[0]))
+#define SPEED_MAXSIZE 16384
+
+static const pgp_symm_alg_t speed_ciphers[] = {PGP_SA_IDEA,
+                                               PGP_SA_TRIPLEDES,
+                                               PGP_SA_CAST5,
+                                               PGP_SA_BLOWFISH,
+                                               PGP_SA_AES_128,
+                                               PGP_SA_AES_192,
+                                               PGP_SA_AES_256,
+                                               PGP_SA_TWOFISH,
+                                               PGP_SA_CAMELLIA_128,
+                                               PGP_SA_CAMELLIA_192,
+                                               PGP_SA_CAMELLIA_256};
+
+static const pgp_hash_alg_t speed_hashes[] = {PGP_HASH_MD5,
+                                              PGP_HASH_SHA1,
+                                              PGP_HASH_RIPEMD,
+                                              PGP_HASH_SHA224,
+                                              PGP_HASH_SHA256,
+                                              PGP_HASH_SHA384,
+                                              PGP_HASH_SHA512,
+                                              PGP_HASH_SM3};
+
+/* public key algorithms and the sizes/groups they are tested with */
+static const struct {
+    const char *family;
+    int         bits;
+    const char *params; /* Botan group name for DSA and ElGamal */
+} speed_pubkeys[] = {
+  {"rsa", 1024, NULL},
+  {"rsa", 2048, NULL},
+  {"rsa", 4096, NULL},
+  {"dsa", 1024, "dsa/jce/1024"},
+  {"dsa", 2048, "dsa/botan/2048"},
+  {"elgamal", 1024, "modp/ietf/1024"},
+  {"elgamal", 2048, "modp/ietf/2048"},
+};
+
+#define SPEED_NPUBKEYS (sizeof(speed_pubkeys) / sizeof(speed_pubkeys[0]))
+
+typedef struct speed_t {
+    FILE *   out;
+    FILE *   errs;
+    double   secs; /* wall time per measurement */
+    int      argc; /* algorithm filter, all if 0 */
+    char **  argv;
+    uint8_t *buf; /* SPEED_MAXSIZE scratch */
+} speed_t;
+
+static double
+speed_now(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* is `name' (or its family) selected on the command line? */
+static int
+speed_wanted(const speed_t *speed, const char *family, const char *name)
+{
+    int i;
+
+    if (speed->argc == 0) {
+        return 1;
+    }
+    for (i = 0; i < speed->argc; i++) {
+        if (rnp_strcasecmp(speed->argv[i], family) == 0 ||
+            rnp_strcasecmp(speed->argv[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* print a throughput figure in 1000s of bytes per second */
+static void
+speed_print_rate(const speed_t *speed, double bytes, double secs)
+{
+    (void) fprintf(speed->out, " %11.2fk", (secs > 0) ? bytes / secs / 1000.0 : 0.0);
+}
+
+static void
+speed_print_header(const speed_t *speed)
+{
+    unsigned i;
+
+    (void) fprintf(speed->out, "%-20s", "type");
+    for (i = 0; i < SPEED_NSIZES; i++) {
+        (void) fprintf(speed->out, " %6u bytes", (unsigned) speed_sizes[i]);
+    }
+    (void) fprintf(speed->out, "\n");
+}
+
+/* CFB encryption and decryption of each buffer size */
+static int
+speed_cipher(const speed_t *speed, pgp_symm_alg_t alg, const char *name, int decrypt)
+{
+    pgp_crypt_t crypt;
+    uint8_t     iv[PGP_MAX_BLOCK_SIZE];
+    uint64_t    count;
+    double      start;
+    double      elapsed;
+    unsigned    i;
+
+    if (!pgp_crypt_any(&crypt, alg)) {
+        return 0;
+    }
+    (void) memset(iv, 0x0, sizeof(iv));
+    (void) memset(crypt.key, 0x42, crypt.keysize);
+    pgp_encrypt_init(&crypt);
+    (void) fprintf(speed->out, "%-16s %s", name, (decrypt) ? "dec" : "enc");
+    for (i = 0; i < SPEED_NSIZES; i++) {
+        pgp_cipher_set_iv(&crypt, iv);
+        start = speed_now();
+        count = 0;
+        do {
+            if (decrypt) {
+                pgp_cipher_cfb_decrypt(&crypt, speed->buf, speed->buf, speed_sizes[i]);
+            } else {
+                pgp_cipher_cfb_encrypt(&crypt, speed->buf, speed->buf, speed_sizes[i]);
+            }
+            count++;
+        } while ((elapsed = speed_now() - start) < speed->secs);
+        speed_print_rate(speed, (double) count * speed_sizes[i], elapsed);
+    }
+    (void) fprintf(speed->out, "\n");
+    pgp_cipher_finish(&crypt);
+    return 1;
+}
+
+/* a full create/add/finish cycle per buffer, as signing does */
+static int
+speed_hash(const speed_t *speed, pgp_hash_alg_t alg, const char *name)
+{
+    pgp_hash_t hash;
+    uint8_t    digest[PGP_MAX_HASH_SIZE];
+    uint64_t   count;
+    double     start;
+    double     elapsed;
+    unsigned   i;
+
+    (void) fprintf(speed->out, "%-20s", name);
+    for (i = 0; i < SPEED_NSIZES; i++) {
+        start = speed_now();
+        count = 0;
+        do {
+            if (!pgp_hash_create(&hash, alg)) {
+                (void) fprintf(speed->out, "\n");
+                return 0;
+            }
+            pgp_hash_add(&hash, speed->buf, speed_sizes[i]);
+            pgp_hash_finish(&hash, digest);
+            count++;
+        } while ((elapsed = speed_now() - start) < speed->secs);
+        speed_print_rate(speed, (double) count * speed_sizes[i], elapsed);
+    }
+    (void) fprintf(speed->out, "\n");
+    return 1;
+}
+
+/* the unit of work for one public key operation */
+typedef struct speed_pkop_t {
+    pgp_pubkey_alg_t alg;
+    int              op;
+    uint8_t *        digest;
+    size_t           digestlen;
+    uint8_t          sig[1024];
+    size_t           siglen;
+    uint8_t          g2k[1024];
+    uint8_t          encm[1024];
+    size_t           enclen;
+    pgp_dsa_sig_t    dsasig;
+    pgp_pubkey_t *   pubkey;
+    pgp_seckey_t *   seckey;
+} speed_pkop_t;
+
+enum { SPEED_SIGN, SPEED_VERIFY, SPEED_ENCRYPT, SPEED_DECRYPT, SPEED_NPKOPS };
+
+static int
+speed_pkop_once(speed_pkop_t *pk)
+{
+    const pgp_rsa_pubkey_t *    rsa = &pk->pubkey->key.rsa;
+    const pgp_dsa_pubkey_t *    dsa = &pk->pubkey->key.dsa;
+    const pgp_elgamal_pubkey_t *elg = &pk->pubkey->key.elgamal;
+    uint8_t                     plain[1024];
+    DSA_SIG *                   dsasig;
+    int                         n;
+
+    switch (pk->alg) {
+    case PGP_PKA_RSA:
+        switch (pk->op) {
+        case SPEED_SIGN:
+            n = pgp_rsa_pkcs1_sign_hash(pk->sig,
+                                        sizeof(pk->sig),
+                                        PGP_HASH_SHA256,
+                                        pk->digest,
+                                        pk->digestlen,
+                                        &pk->seckey->key.rsa,
+                                        rsa);
+            pk->siglen = (n > 0) ? (size_t) n : 0;
+            return n > 0;
+        case SPEED_VERIFY:
+            return pgp_rsa_pkcs1_verify_hash(
+              pk->sig, pk->siglen, PGP_HASH_SHA256, pk->digest, pk->digestlen, rsa);
+        case SPEED_ENCRYPT:
+            n = pgp_rsa_encrypt_pkcs1(pk->encm, sizeof(pk->encm), pk->digest, 32, rsa);
+            pk->enclen = (n > 0) ? (size_t) n : 0;
+            return n > 0;
+        case SPEED_DECRYPT:
+            return pgp_rsa_decrypt_pkcs1(
+                     plain, sizeof(plain), pk->encm, pk->enclen, &pk->seckey->key.rsa, rsa) >
+                   0;
+        }
+        break;
+    case PGP_PKA_DSA:
+        switch (pk->op) {
+        case SPEED_SIGN:
+            if ((dsasig = pgp_dsa_sign(pk->digest,
+                                       (unsigned) pk->digestlen,
+                                       &pk->seckey->key.dsa,
+                                       dsa)) == NULL) {
+                return 0;
+            }
+            if (pk->dsasig.r) {
+                BN_clear_free(pk->dsasig.r);
+                BN_clear_free(pk->dsasig.s);
+            }
+            pk->dsasig.r = dsasig->r;
+            pk->dsasig.s = dsasig->s;
+            free(dsasig);
+            return 1;
+        case SPEED_VERIFY:
+            return pgp_dsa_verify(pk->digest, pk->digestlen, &pk->dsasig, dsa);
+        }
+        break;
+    case PGP_PKA_ELGAMAL:
+        switch (pk->op) {
+        case SPEED_ENCRYPT:
+            n = pgp_elgamal_public_encrypt_pkcs1(pk->g2k, pk->encm, pk->digest, 32, elg);
+            pk->enclen = (n > 0) ? (size_t) n / 2 : 0;
+            return n > 0;
+        case SPEED_DECRYPT:
+            return pgp_elgamal_private_decrypt_pkcs1(plain,
+                                                     pk->g2k,
+                                                     pk->encm,
+                                                     pk->enclen,
+                                                     &pk->seckey->key.elgamal,
+                                                     elg) > 0;
+        }
+        break;
+    default:
+        break;
+    }
+    return -1; /* not applicable */
+}
+
+/* fill in a DSA or ElGamal key from a freshly generated Botan key */
+static int
+speed_botan_key(pgp_seckey_t *seckey, pgp_pubkey_alg_t alg, const char *params)
+{
+    botan_privkey_t key;
+    botan_rng_t     rng;
+    pgp_pubkey_t *  pub = &seckey->pubkey;
+    BIGNUM **       fields[4];
+    BIGNUM **       x;
+    const char *    names[4];
+    unsigned        i;
+    int             ok = 1;
+
+    if ((rng = pgp_rng_handle()) == NULL) {
+        return 0;
+    }
+    if (alg == PGP_PKA_DSA) {
+        fields[0] = &pub->key.dsa.p, names[0] = "p";
+        fields[1] = &pub->key.dsa.q, names[1] = "q";
+        fields[2] = &pub->key.dsa.g, names[2] = "g";
+        fields[3] = &pub->key.dsa.y, names[3] = "y";
+        ok = (botan_privkey_create(&key, "DSA", params, rng) == 0);
+    } else {
+        fields[0] = &pub->key.elgamal.p, names[0] = "p";
+        fields[1] = &pub->key.elgamal.g, names[1] = "g";
+        fields[2] = &pub->key.elgamal.y, names[2] = "y";
+        fields[3] = NULL, names[3] = NULL;
+        ok = (botan_privkey_create(&key, "ElGamal", params, rng) == 0);
+    }
+    if (!ok) {
+        return 0;
+    }
+    for (i = 0; ok && i < 4 && fields[i]; i++) {
+        *fields[i] = BN_new();
+        ok = (botan_privkey_get_field(get_BN_mp(*fields[i]), key, names[i]) == 0);
+    }
+    x = (alg == PGP_PKA_DSA) ? &seckey->key.dsa.x : &seckey->key.elgamal.x;
+    *x = BN_new();
+    ok = ok && (botan_privkey_get_field(get_BN_mp(*x), key, "x") == 0);
+    pub->alg = alg;
+    botan_privkey_destroy(key);
+    return ok;
+}
+
+static void
+speed_botan_key_free(pgp_seckey_t *seckey)
+{
+    pgp_pubkey_t *pub = &seckey->pubkey;
+
+    if (pub->alg == PGP_PKA_DSA) {
+        BN_clear_free(pub->key.dsa.p);
+        BN_clear_free(pub->key.dsa.q);
+        BN_clear_free(pub->key.dsa.g);
+        BN_clear_free(pub->key.dsa.y);
+        BN_clear_free(seckey->key.dsa.x);
+    } else {
+        BN_clear_free(pub->key.elgamal.p);
+        BN_clear_free(pub->key.elgamal.g);
+        BN_clear_free(pub->key.elgamal.y);
+        BN_clear_free(seckey->key.elgamal.x);
+    }
+}
+
+static int
+speed_pubkey(const speed_t *speed, unsigned idx)
+{
+    static const char *opnames[SPEED_NPKOPS] = {"sign", "verify", "encrypt", "decrypt"};
+    speed_pkop_t       pk;
+    pgp_seckey_t       botankey;
+    pgp_key_t *        rsakey = NULL;
+    uint8_t            digest[32];
+    uint64_t           count[SPEED_NPKOPS];
+    double             elapsed[SPEED_NPKOPS];
+    double             start;
+    int                result[SPEED_NPKOPS];
+    int                rc;
+    int                op;
+
+    (void) memset(&pk, 0x0, sizeof(pk));
+    (void) memset(&botankey, 0x0, sizeof(botankey));
+    (void) memset(digest, 0x5a, sizeof(digest));
+    pk.digest = digest;
+    pk.digestlen = sizeof(digest);
+    if (strcmp(speed_pubkeys[idx].family, "rsa") == 0) {
+        if ((rsakey = pgp_rsa_new_key(speed_pubkeys[idx].bits, 65537UL, "speed", "AES-128")) ==
+            NULL) {
+            return 0;
+        }
+        pk.seckey = &rsakey->key.seckey;
+        pk.alg = PGP_PKA_RSA;
+    } else {
+        pk.alg =
+          (strcmp(speed_pubkeys[idx].family, "dsa") == 0) ? PGP_PKA_DSA : PGP_PKA_ELGAMAL;
+        if (!speed_botan_key(&botankey, pk.alg, speed_pubkeys[idx].params)) {
+            (void) fprintf(speed->errs,
+                           "%s %d bits: key generation failed\n",
+                           speed_pubkeys[idx].family,
+                           speed_pubkeys[idx].bits);
+            speed_botan_key_free(&botankey);
+            return 0;
+        }
+        pk.seckey = &botankey;
+    }
+    pk.pubkey = &pk.seckey->pubkey;
+    rc = 1;
+    for (op = 0; op < SPEED_NPKOPS; op++) {
+        pk.op = op;
+        count[op] = 0;
+        elapsed[op] = 0.0;
+        /* the first run also leaves its output behind for verify and decrypt */
+        if ((result[op] = speed_pkop_once(&pk)) <= 0) {
+            if (result[op] == 0) {
+                (void) fprintf(speed->errs,
+                               "%s %d bits: %s failed\n",
+                               speed_pubkeys[idx].family,
+                               speed_pubkeys[idx].bits,
+                               opnames[op]);
+                rc = 0;
+            }
+            continue;
+        }
+        start = speed_now();
+        do {
+            (void) speed_pkop_once(&pk);
+            count[op]++;
+        } while ((elapsed[op] = speed_now() - start) < speed->secs);
+    }
+    (void) fprintf(speed->out,
+                   "%-8s %4d bits",
+                   speed_pubkeys[idx].family,
+                   speed_pubkeys[idx].bits);
+    for (op = 0; op < SPEED_NPKOPS; op++) {
+        if (count[op] == 0) {
+            (void) fprintf(speed->out, " %10s %9s", "-", "-");
+        } else {
+            (void) fprintf(speed->out,
+                           " %9.6fs %9.1f",
+                           elapsed[op] / count[op],
+                           count[op] / elapsed[op]);
+        }
+    }
+    (void) fprintf(speed->out, "\n");
+    if (pk.dsasig.r) {
+        BN_clear_free(pk.dsasig.r);
+        BN_clear_free(pk.dsasig.s);
+    }
+    if (rsakey) {
+        pgp_keydata_free(rsakey);
+    } else {
+        speed_botan_key_free(&botankey);
+    }
+    return rc;
+}
+
+/* S2K throughput, expressed as the iteration count (octets hashed) per second */
+static int
+speed_s2k(const speed_t *speed, pgp_hash_alg_t alg, const char *name)
+{
+    const size_t iterations = 1 << 20;
+    uint8_t      salt[PGP_SALT_SIZE];
+    uint8_t      key[PGP_MAX_KEY_SIZE];
+    uint64_t     count;
+    double       start;
+    double       elapsed;
+    double       rate;
+
+    (void) memset(salt, 0x11, sizeof(salt));
+    start = speed_now();
+    count = 0;
+    do {
+        pgp_s2k_iterated(alg, key, sizeof(key), "passphrase", salt, iterations);
+        count++;
+    } while ((elapsed = speed_now() - start) < speed->secs);
+    rate = (double) count * iterations / elapsed;
+    (void) fprintf(speed->out,
+                   "%-20s %14.0f %14lu\n",
+                   name,
+                   rate,
+                   (unsigned long) pgp_s2k_round_iterations((size_t)(rate / 10)));
+    return 1;
+}
+
+/**
+ * \ingroup HighLevel_General
+ *
+ * Measure the speed of each supported cipher, hash, public key algorithm
+ * and S2K, printing a table to the context's output stream.
+ *
+ * \param rnp the context; "speed seconds" sets the time per measurement
+ * \param argc number of algorithm names or families to restrict to
+ * \param argv the names, e.g. "AES-128", "SHA-256", "rsa", "hash", "s2k"
+ * \return 1 if every selected test ran, otherwise 0
+ */
+int
+rnp_speed(rnp_t *rnp, int argc, char **argv)
+{
+    speed_t     speed;
+    pgp_io_t *  io = rnp->io;
+    const char *name;
+    char        label[64];
+    char *      secs;
+    unsigned    i;
+    int         header;
+    int         ret = 1;
+
+    (void) memset(&speed, 0x0, sizeof(speed));
+    speed.out = io->outs;
+    speed.errs = io->errs;
+    speed.argc = argc;
+    speed.argv = argv;
+    speed.secs = SPEED_DEFAULT_SECONDS;
+    if ((secs = rnp_getvar(rnp, "speed seconds")) != NULL && atof(secs) > 0) {
+        speed.secs = atof(secs);
+    }
+    if ((speed.buf = calloc(1, SPEED_MAXSIZE)) == NULL) {
+        (void) fprintf(io->errs, "rnp_speed: bad alloc\n");
+        return 0;
+    }
+
+    (void) fprintf(speed.out,
+                   "The 'numbers' are in 1000s of bytes per second processed, "
+                   "%.1fs per test.\n",
+                   speed.secs);
+    for (header = 0, i = 0; i < sizeof(speed_ciphers) / sizeof(speed_ciphers[0]); i++) {
+        if ((name = pgp_sa_to_botan_string(speed_ciphers[i])) == NULL ||
+            !speed_wanted(&speed, "cipher", name)) {
+            continue;
+        }
+        if (!header++) {
+            speed_print_header(&speed);
+        }
+        (void) snprintf(label, sizeof(label), "%s-CFB", name);
+        ret &= speed_cipher(&speed, speed_ciphers[i], label, 0);
+        ret &= speed_cipher(&speed, speed_ciphers[i], label, 1);
+    }
+    for (i = 0; i < sizeof(speed_hashes) / sizeof(speed_hashes[0]); i++) {
+        if ((name = pgp_hash_name_botan(speed_hashes[i])) == NULL ||
+            !speed_wanted(&speed, "hash", name)) {
+            continue;
+        }
+        if (!header++) {
+            speed_print_header(&speed);
+        }
+        ret &= speed_hash(&speed, speed_hashes[i], name);
+    }
+    for (header = 0, i = 0; i < SPEED_NPUBKEYS; i++) {
+        (void) snprintf(
+          label, sizeof(label), "%s%d", speed_pubkeys[i].family, speed_pubkeys[i].bits);
+        if (!speed_wanted(&speed, speed_pubkeys[i].family, label) &&
+            !speed_wanted(&speed, "pubkey", label)) {
+            continue;
+        }
+        if (!header++) {
+            (void) fprintf(speed.out,
+                           "\n%-18s %10s %9s %10s %9s %10s %9s %10s %9s\n",
+                           "",
+                           "sign",
+                           "sign/s",
+                           "verify",
+                           "verify/s",
+                           "encrypt",
+                           "encrypt/s",
+                           "decrypt",
+                           "decrypt/s");
+        }
+        ret &= speed_pubkey(&speed, i);
+    }
+    for (header = 0, i = 0; i < sizeof(speed_hashes) / sizeof(speed_hashes[0]); i++) {
+        if ((name = pgp_hash_name_botan(speed_hashes[i])) == NULL ||
+            !speed_wanted(&speed, "s2k", name)) {
+            continue;
+        }
+        if (!header++) {
+            (void) fprintf(speed.out, "\n%-20s %14s %14s\n", "s2k", "count/s", "count@100ms");
+        }
+        ret &= speed_s2k(&speed, speed_hashes[i], name);
+    }
+    free(speed.buf);
+    return ret;
+}
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Reader/writer stack statistics, see stats.h */
+#include "config.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <json.h>
+
+#include "stats.h"
+
+enum { MAX_STAGES = 32 };
+
+static atomic_int        stats_on;
+static atomic_flag       stages_lock = ATOMIC_FLAG_INIT;
+static atomic_uint       stagec;
+static pgp_stage_stats_t stagev[MAX_STAGES];
+
+static _Thread_local char *stats_text;
+
+/* frees a thread's last JSON document when the thread exits */
+static pthread_key_t  text_key;
+static pthread_once_t text_key_once = PTHREAD_ONCE_INIT;
+static int            text_key_ok;
+
+/* a stage's counters as read at one moment, for reporting */
+typedef struct stage_snap_t {
+    const char *     name;
+    pgp_stage_type_t type;
+    uint64_t         calls;
+    uint64_t         bytes_in;
+    uint64_t         bytes_out;
+    uint64_t         usec;
+    uint64_t         self_usec;
+} stage_snap_t;
+
+/* time and bytes accounted to the stage currently being called */
+static _Thread_local uint64_t child_usec;
+static _Thread_local uint64_t child_bytes;
+
+/* the slot table only changes under this lock; counters never need it */
+static void
+stages_lock_take(void)
+{
+    while (atomic_flag_test_and_set_explicit(&stages_lock, memory_order_acquire)) {
+    }
+}
+
+static void
+stages_lock_drop(void)
+{
+    atomic_flag_clear_explicit(&stages_lock, memory_order_release);
+}
+
+static void
+text_key_create(void)
+{
+    text_key_ok = (pthread_key_create(&text_key, free) == 0);
+}
+
+static uint64_t
+stats_now(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/* turning statistics on starts a fresh set of counters */
+void
+pgp_stats_enable(int on)
+{
+    if (on && !stats_on) {
+        pgp_stats_reset();
+    }
+    stats_on = on;
+}
+
+int
+pgp_stats_enabled(void)
+{
+    return stats_on;
+}
+
+/*
+ * readers and writers hold on to their stage's slot, and may be counting
+ * into it right now, so the slots stay registered and only the counters
+ * are cleared
+ */
+void
+pgp_stats_reset(void)
+{
+    unsigned c;
+    unsigned i;
+
+    stages_lock_take();
+    c = atomic_load(&stagec);
+    for (i = 0; i < c; i++) {
+        atomic_store(&stagev[i].calls, 0);
+        atomic_store(&stagev[i].bytes_in, 0);
+        atomic_store(&stagev[i].bytes_out, 0);
+        atomic_store(&stagev[i].usec, 0);
+        atomic_store(&stagev[i].self_usec, 0);
+    }
+    stages_lock_drop();
+    child_usec = child_bytes = 0;
+}
+
+/* return the counters for a named stage, or NULL if not collecting */
+pgp_stage_stats_t *
+pgp_stats_stage(const char *name, pgp_stage_type_t type)
+{
+    pgp_stage_stats_t *stage = NULL;
+    unsigned           c;
+    unsigned           i;
+
+    if (!stats_on) {
+        return NULL;
+    }
+    stages_lock_take();
+    c = atomic_load(&stagec);
+    for (i = 0; i < c; i++) {
+        if (stagev[i].type == type && strcmp(stagev[i].name, name) == 0) {
+            stage = &stagev[i];
+            break;
+        }
+    }
+    if (stage == NULL && c < MAX_STAGES) {
+        stage = &stagev[c];
+        stage->name = name;
+        stage->type = type;
+        atomic_store(&stagec, c + 1);
+    }
+    stages_lock_drop();
+    return stage;
+}
+
+void
+pgp_stats_enter(pgp_stage_frame_t *frame)
+{
+    frame->child_usec = child_usec;
+    frame->child_bytes = child_bytes;
+    child_usec = child_bytes = 0;
+    frame->start = stats_now();
+}
+
+/*
+ * `flow' is the number of bytes crossing the boundary with the caller:
+ * returned by a reader, or accepted by a writer. Whatever the nested
+ * stages reported while we ran is the other side of this stage.
+ */
+void
+pgp_stats_leave(pgp_stage_frame_t *frame, pgp_stage_stats_t *stage, uint64_t flow)
+{
+    uint64_t elapsed;
+
+    elapsed = stats_now() - frame->start;
+    atomic_fetch_add(&stage->calls, 1);
+    atomic_fetch_add(&stage->usec, elapsed);
+    atomic_fetch_add(&stage->self_usec, (elapsed > child_usec) ? elapsed - child_usec : 0);
+    if (stage->type == PGP_STAGE_READER) {
+        atomic_fetch_add(&stage->bytes_in, child_bytes);
+        atomic_fetch_add(&stage->bytes_out, flow);
+    } else {
+        atomic_fetch_add(&stage->bytes_in, flow);
+        atomic_fetch_add(&stage->bytes_out, child_bytes);
+    }
+    child_usec = frame->child_usec + elapsed;
+    child_bytes = frame->child_bytes + flow;
+}
+
+/* the counters as a JSON document; valid until the thread's next call */
+const char *
+pgp_stats_json(void)
+{
+    stage_snap_t snap[MAX_STAGES];
+    json_object *stages;
+    json_object *obj;
+    json_object *stage;
+    unsigned     c;
+    unsigned     i;
+
+    /* copy the counters under the lock, so that a reset is not seen halfway */
+    stages_lock_take();
+    c = atomic_load(&stagec);
+    for (i = 0; i < c; i++) {
+        snap[i].name = stagev[i].name;
+        snap[i].type = stagev[i].type;
+        snap[i].calls = atomic_load(&stagev[i].calls);
+        snap[i].bytes_in = atomic_load(&stagev[i].bytes_in);
+        snap[i].bytes_out = atomic_load(&stagev[i].bytes_out);
+        snap[i].usec = atomic_load(&stagev[i].usec);
+        snap[i].self_usec = atomic_load(&stagev[i].self_usec);
+    }
+    stages_lock_drop();
+    obj = json_object_new_object();
+    stages = json_object_new_array();
+    for (i = 0; i < c; i++) {
+        stage = json_object_new_object();
+        json_object_object_add(stage, "stage", json_object_new_string(snap[i].name));
+        json_object_object_add(
+          stage,
+          "type",
+          json_object_new_string(snap[i].type == PGP_STAGE_READER ? "reader" : "writer"));
+        json_object_object_add(stage, "calls", json_object_new_int64(snap[i].calls));
+        json_object_object_add(stage, "bytes_in", json_object_new_int64(snap[i].bytes_in));
+        json_object_object_add(stage, "bytes_out", json_object_new_int64(snap[i].bytes_out));
+        json_object_object_add(stage, "usec", json_object_new_int64(snap[i].usec));
+        json_object_object_add(stage, "self_usec", json_object_new_int64(snap[i].self_usec));
+        json_object_array_add(stages, stage);
+    }
+    json_object_object_add(obj, "enabled", json_object_new_boolean(stats_on));
+    json_object_object_add(obj, "stages", stages);
+    (void) pthread_once(&text_key_once, text_key_create);
+    free(stats_text);
+    stats_text = strdup(json_object_to_json_string(obj));
+    if (text_key_ok) {
+        (void) pthread_setspecific(text_key, stats_text);
+    }
+    json_object_put(obj);
+    return (stats_text) ? stats_text : "{}";
+}
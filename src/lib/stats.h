@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RNP_STATS_H_
+#define RNP_STATS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Per-stage counters for the reader and writer stacks.
+ *
+ * Collection is off by default. A stage only gets a counter slot if
+ * statistics were enabled when it was pushed, so a disabled build pays
+ * for one NULL pointer test per read or write and nothing else.
+ *
+ * bytes_in and bytes_out are measured at the stage's own boundaries:
+ * a reader's bytes_in is what it pulled from the reader below it and
+ * its bytes_out is what it handed upwards; a writer's bytes_in is what
+ * it was given and its bytes_out is what it passed down. usec includes
+ * the time spent in the stages below, self_usec does not.
+ *
+ * The counters are process-wide and shared by all threads: they are
+ * updated atomically, and the time and bytes of nested stages are
+ * tracked per thread.
+ */
+
+typedef enum { PGP_STAGE_READER, PGP_STAGE_WRITER } pgp_stage_type_t;
+
+typedef struct pgp_stage_stats_t {
+    const char *     name;
+    pgp_stage_type_t type;
+    _Atomic uint64_t calls;
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t usec;
+    _Atomic uint64_t self_usec;
+} pgp_stage_stats_t;
+
+/* saved state of the enclosing stage while a nested one runs */
+typedef struct pgp_stage_frame_t {
+    uint64_t start;
+    uint64_t child_usec;
+    uint64_t child_bytes;
+} pgp_stage_frame_t;
+
+void pgp_stats_enable(int);
+int  pgp_stats_enabled(void);
+void pgp_stats_reset(void);
+
+pgp_stage_stats_t *pgp_stats_stage(const char *, pgp_stage_type_t);
+
+void pgp_stats_enter(pgp_stage_frame_t *);
+void pgp_stats_leave(pgp_stage_frame_t *, pgp_stage_stats_t *, uint64_t);
+
+const char *pgp_stats_json(void);
+
+#endif
@@ -193,7 +193,7 @@ pgp_str_to_cipher(const char *cipher)
     return PGP_SA_DEFAULT_CIPHER;
 }
 
-static const char *
+const char *
 pgp_sa_to_botan_string(pgp_symm_alg_t alg)
 {
     switch (alg) {
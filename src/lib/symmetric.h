@@ -68,6 +68,7 @@ struct pgp_crypt_t {
 };
 
 pgp_symm_alg_t pgp_str_to_cipher(const char *name);
+const char *   pgp_sa_to_botan_string(pgp_symm_alg_t);
 unsigned pgp_block_size(pgp_symm_alg_t);
 unsigned pgp_key_size(pgp_symm_alg_t);
 unsigned pgp_is_sa_supported(pgp_symm_alg_t);
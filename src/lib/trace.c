@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Chrome trace-event timeline, see trace.h */
+#include "config.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "trace.h"
+
+typedef struct trace_event_t {
+    uint64_t    ns; /* CLOCK_MONOTONIC */
+    const char *name;
+    const char *detail;
+    char        phase; /* 'B'egin or 'E'nd */
+} trace_event_t;
+
+/* one per recording thread, never freed so that threads can keep them */
+typedef struct trace_buf_t {
+    struct trace_buf_t *next; /* all buffers, see trace_bufs */
+    unsigned            tid;
+    unsigned            c;
+    unsigned            size;
+    trace_event_t *     v;
+} trace_buf_t;
+
+atomic_int pgp_trace_enabled;
+
+static FILE *                 trace_fp;
+static uint64_t               trace_epoch;
+static _Atomic(trace_buf_t *) trace_bufs;
+static atomic_uint            trace_tids;
+static _Thread_local trace_buf_t *trace_buf;
+
+static uint64_t
+trace_now(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* find, or make and publish, the calling thread's buffer */
+static trace_buf_t *
+trace_thread_buf(void)
+{
+    trace_buf_t *buf;
+
+    if (trace_buf != NULL) {
+        return trace_buf;
+    }
+    if ((buf = calloc(1, sizeof(*buf))) == NULL) {
+        return NULL;
+    }
+    buf->tid = atomic_fetch_add(&trace_tids, 1) + 1;
+    buf->next = atomic_load(&trace_bufs);
+    while (!atomic_compare_exchange_weak(&trace_bufs, &buf->next, buf)) {
+    }
+    return trace_buf = buf;
+}
+
+void
+pgp_trace_event(char phase, const char *name, const char *detail)
+{
+    trace_buf_t *  buf;
+    trace_event_t *ev;
+    uint64_t       ns;
+
+    ns = trace_now();
+    if ((buf = trace_thread_buf()) == NULL) {
+        return;
+    }
+    if (buf->c == buf->size) {
+        unsigned newsize = (buf->size) ? buf->size * 2 : 4096;
+
+        if ((ev = realloc(buf->v, newsize * sizeof(*ev))) == NULL) {
+            return;
+        }
+        buf->v = ev;
+        buf->size = newsize;
+    }
+    ev = &buf->v[buf->c++];
+    ev->ns = ns;
+    ev->name = name;
+    ev->detail = detail;
+    ev->phase = phase;
+}
+
+/* start recording a timeline which will be written to `path' */
+int
+pgp_trace_start(const char *path)
+{
+    trace_buf_t *buf;
+
+    if (trace_fp != NULL) {
+        (void) fprintf(stderr, "pgp_trace_start: already tracing\n");
+        return 0;
+    }
+    if ((trace_fp = fopen(path, "w")) == NULL) {
+        (void) fprintf(stderr, "pgp_trace_start: can't open '%s'\n", path);
+        return 0;
+    }
+    for (buf = atomic_load(&trace_bufs); buf; buf = buf->next) {
+        buf->c = 0;
+    }
+    trace_epoch = trace_now();
+    atomic_store(&pgp_trace_enabled, 1);
+    return 1;
+}
+
+static void
+trace_print_string(FILE *fp, const char *s)
+{
+    (void) fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            (void) fputc('\\', fp);
+        }
+        (void) fputc(*s, fp);
+    }
+    (void) fputc('"', fp);
+}
+
+/* stop recording, and write out every thread's events */
+int
+pgp_trace_stop(void)
+{
+    trace_buf_t *buf;
+    unsigned     i;
+    int          pid;
+    int          first;
+    int          ret;
+
+    if (trace_fp == NULL) {
+        return 0;
+    }
+    atomic_store(&pgp_trace_enabled, 0);
+    pid = (int) getpid();
+    first = 1;
+    (void) fprintf(trace_fp, "{\"traceEvents\":[\n");
+    for (buf = atomic_load(&trace_bufs); buf; buf = buf->next) {
+        for (i = 0; i < buf->c; i++) {
+            const trace_event_t *ev = &buf->v[i];
+
+            (void) fprintf(trace_fp, "%s{\"name\":", (first) ? "" : ",\n");
+            trace_print_string(trace_fp, ev->name);
+            (void) fprintf(trace_fp,
+                           ",\"cat\":\"rnp\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u",
+                           ev->phase,
+                           (double) (ev->ns - trace_epoch) / 1000.0,
+                           pid,
+                           buf->tid);
+            if (ev->detail) {
+                (void) fprintf(trace_fp, ",\"args\":{\"detail\":");
+                trace_print_string(trace_fp, ev->detail);
+                (void) fputc('}', trace_fp);
+            }
+            (void) fputc('}', trace_fp);
+            first = 0;
+        }
+        buf->c = 0;
+    }
+    (void) fprintf(trace_fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    ret = (fclose(trace_fp) == 0);
+    trace_fp = NULL;
+    return ret;
+}
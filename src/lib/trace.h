@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RNP_TRACE_H_
+#define RNP_TRACE_H_
+
+#include <stdatomic.h>
+
+/* Timeline tracing in the Chrome trace-event format.
+ *
+ * Spans are opened and closed with PGP_TRACE_BEGIN and PGP_TRACE_END,
+ * which must pair up on every path through the traced code. Events go
+ * into a buffer owned by the recording thread, so tracing takes no
+ * locks; the buffers are only gathered when the trace is written out by
+ * pgp_trace_stop(), which must not race with traced work. When tracing
+ * is off a span costs a single relaxed load of pgp_trace_enabled.
+ *
+ * Span names and details are stored by reference and must be constant
+ * strings.
+ */
+
+extern atomic_int pgp_trace_enabled;
+
+void pgp_trace_event(char, const char *, const char *);
+int  pgp_trace_start(const char *);
+int  pgp_trace_stop(void);
+
+#define PGP_TRACE_BEGIN(name, detail)                                         \
+    do {                                                                      \
+        if (atomic_load_explicit(&pgp_trace_enabled, memory_order_relaxed)) { \
+            pgp_trace_event('B', (name), (detail));                           \
+        }                                                                     \
+    } while (/* CONSTCOND */ 0)
+
+#define PGP_TRACE_END(name)                                                   \
+    do {                                                                      \
+        if (atomic_load_explicit(&pgp_trace_enabled, memory_order_relaxed)) { \
+            pgp_trace_event('E', (name), NULL);                               \
+        }                                                                     \
+    } while (/* CONSTCOND */ 0)
+
+#endif
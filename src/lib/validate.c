@@ -87,6 +87,8 @@ __RCSID("$NetBSD: validate.c,v 1.44 2012/03/05 02:20:18 christos Exp $");
 #include "crypto.h"
 #include "validate.h"
 #include "packet-key.h"
+#include "create.h"
+#include "trace.h"
 
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
@@ -231,8 +233,74 @@ check_binary_sig(const uint8_t *     data,
     return pgp_check_sig(hashout, n, sig, signer);
 }
 
-pgp_cb_ret_t
-pgp_validate_key_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
+/*
+ * Key for the signature cache: the signer, the key material and user id,
+ * attribute or subkey the signature covers, and the signature packet.
+ * Keys go in as the public key packet body the signature hash takes from
+ * them, so that keys which only share a fingerprint are told apart.
+ */
+static int
+sig_cache_key(const validate_key_cb_t *key,
+              const pgp_sig_t *        sig,
+              const pgp_pubkey_t *     signer,
+              uint8_t *                out)
+{
+    const pgp_subpacket_t *raw = &key->reader->key->packets[key->reader->packet];
+    const pgp_pubkey_t *   keys[3];
+    pgp_memory_t *         mem;
+    const uint8_t *        obj = NULL;
+    pgp_hash_t             hash;
+    unsigned               keyc = 2;
+    unsigned               objlen = 0;
+    unsigned               tag = 0x99;
+    unsigned               i;
+
+    switch (sig->info.type) {
+    case PGP_CERT_GENERIC:
+    case PGP_CERT_PERSONA:
+    case PGP_CERT_CASUAL:
+    case PGP_CERT_POSITIVE:
+    case PGP_SIG_REV_CERT:
+        if (key->last_seen == ID) {
+            tag = 0xb4;
+            obj = key->userid;
+            objlen = (unsigned) strlen((const char *) key->userid);
+        } else {
+            tag = 0xd1;
+            obj = key->userattr.contents;
+            objlen = (unsigned) key->userattr.len;
+        }
+        break;
+    case PGP_SIG_SUBKEY:
+        keyc = 3;
+        break;
+    case PGP_SIG_DIRECT:
+        break;
+    default:
+        return 0;
+    }
+    keys[0] = signer;
+    keys[1] = &key->pubkey;
+    keys[2] = &key->subkey;
+    if (!pgp_hash_create(&hash, PGP_HASH_SHA256)) {
+        return 0;
+    }
+    mem = pgp_memory_new();
+    for (i = 0; i < keyc; i++) {
+        pgp_build_pubkey(mem, keys[i], 0);
+        pgp_hash_add_int(&hash, (unsigned) pgp_mem_len(mem), 4);
+        pgp_hash_add(&hash, pgp_mem_data(mem), (unsigned) pgp_mem_len(mem));
+    }
+    pgp_memory_free(mem);
+    pgp_hash_add_int(&hash, tag, 1);
+    pgp_hash_add_int(&hash, objlen, 4);
+    pgp_hash_add(&hash, obj, objlen);
+    pgp_hash_add(&hash, raw->raw, raw->length);
+    return pgp_hash_finish(&hash, out) == PGP_SIG_CACHE_KEY_SIZE;
+}
+
+static pgp_cb_ret_t
+validate_key_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
 {
     const pgp_contents_t *content = &pkt->u;
     const pgp_key_t *     signer;
@@ -242,6 +310,10 @@ pgp_validate_key_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
     pgp_io_t *            io;
     unsigned              from;
     unsigned              valid = 0;
+    unsigned              checked = 0;
+    int                   cached = 0;
+    uint8_t               cachekey[PGP_SIG_CACHE_KEY_SIZE];
+    const uint8_t *       rawsig;
 
     io = cbinfo->io;
     if (rnp_get_debug(__FILE__)) {
@@ -307,62 +379,76 @@ pgp_validate_key_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
         if (sigkey == &signer->enckey) {
             (void) fprintf(io->errs, "WARNING: signature made with encryption key\n");
         }
-        switch (content->sig.info.type) {
-        case PGP_CERT_GENERIC:
-        case PGP_CERT_PERSONA:
-        case PGP_CERT_CASUAL:
-        case PGP_CERT_POSITIVE:
-        case PGP_SIG_REV_CERT:
-            valid =
-              (key->last_seen == ID) ?
-                pgp_check_useridcert_sig(&key->pubkey,
-                                         key->userid,
-                                         &content->sig,
-                                         pgp_get_pubkey(signer),
-                                         key->reader->key->packets[key->reader->packet].raw) :
-                pgp_check_userattrcert_sig(&key->pubkey,
-                                           &key->userattr,
-                                           &content->sig,
-                                           pgp_get_pubkey(signer),
-                                           key->reader->key->packets[key->reader->packet].raw);
-            break;
-
-        case PGP_SIG_SUBKEY:
-            /*
-             * XXX: we should also check that the signer is the
-             * key we are validating, I think.
-             */
-            valid = pgp_check_subkey_sig(&key->pubkey,
-                                         &key->subkey,
-                                         &content->sig,
-                                         pgp_get_pubkey(signer),
-                                         key->reader->key->packets[key->reader->packet].raw);
-            break;
-
-        case PGP_SIG_DIRECT:
-            valid = pgp_check_direct_sig(&key->pubkey,
-                                         &content->sig,
-                                         pgp_get_pubkey(signer),
-                                         key->reader->key->packets[key->reader->packet].raw);
-            break;
-
-        case PGP_SIG_STANDALONE:
-        case PGP_SIG_PRIMARY:
-        case PGP_SIG_REV_KEY:
-        case PGP_SIG_REV_SUBKEY:
-        case PGP_SIG_TIMESTAMP:
-        case PGP_SIG_3RD_PARTY:
-            PGP_ERROR_1(errors,
-                        PGP_E_UNIMPLEMENTED,
-                        "Sig Verification type 0x%02x not done yet\n",
-                        content->sig.info.type);
-            break;
-
-        default:
-            PGP_ERROR_1(errors,
-                        PGP_E_UNIMPLEMENTED,
-                        "Unexpected signature type 0x%02x\n",
-                        content->sig.info.type);
+        rawsig = key->reader->key->packets[key->reader->packet].raw;
+        if (key->cache) {
+            cached = sig_cache_key(key, &content->sig, pgp_get_pubkey(signer), cachekey);
+        }
+        if (cached && pgp_sig_cache_get(key->cache, cachekey, &valid)) {
+            /* checked on an earlier run */
+        } else {
+            switch (content->sig.info.type) {
+            case PGP_CERT_GENERIC:
+            case PGP_CERT_PERSONA:
+            case PGP_CERT_CASUAL:
+            case PGP_CERT_POSITIVE:
+            case PGP_SIG_REV_CERT:
+                valid =
+                  (key->last_seen == ID) ?
+                    pgp_check_useridcert_sig(&key->pubkey,
+                                             key->userid,
+                                             &content->sig,
+                                             pgp_get_pubkey(signer),
+                                             rawsig) :
+                    pgp_check_userattrcert_sig(&key->pubkey,
+                                               &key->userattr,
+                                               &content->sig,
+                                               pgp_get_pubkey(signer),
+                                               rawsig);
+                checked = 1;
+                break;
+
+            case PGP_SIG_SUBKEY:
+                /*
+                 * XXX: we should also check that the signer is the
+                 * key we are validating, I think.
+                 */
+                valid = pgp_check_subkey_sig(&key->pubkey,
+                                             &key->subkey,
+                                             &content->sig,
+                                             pgp_get_pubkey(signer),
+                                             rawsig);
+                checked = 1;
+                break;
+
+            case PGP_SIG_DIRECT:
+                valid = pgp_check_direct_sig(&key->pubkey,
+                                             &content->sig,
+                                             pgp_get_pubkey(signer),
+                                             rawsig);
+                checked = 1;
+                break;
+
+            case PGP_SIG_STANDALONE:
+            case PGP_SIG_PRIMARY:
+            case PGP_SIG_REV_KEY:
+            case PGP_SIG_REV_SUBKEY:
+            case PGP_SIG_TIMESTAMP:
+            case PGP_SIG_3RD_PARTY:
+                PGP_ERROR_1(errors,
+                            PGP_E_UNIMPLEMENTED,
+                            "Sig Verification type 0x%02x not done yet\n",
+                            content->sig.info.type);
+                break;
+
+            default:
+                PGP_ERROR_1(errors,
+                            PGP_E_UNIMPLEMENTED,
+                            "Unexpected signature type 0x%02x\n",
+                            content->sig.info.type);
+            }
+        }
+        if (cached && checked) {
+            (void) pgp_sig_cache_put(key->cache, cachekey, valid);
         }
 
         if (valid) {
@@ -407,6 +493,17 @@ pgp_validate_key_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
     return PGP_RELEASE_MEMORY;
 }
 
+pgp_cb_ret_t
+pgp_validate_key_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
+{
+    pgp_cb_ret_t ret;
+
+    PGP_TRACE_BEGIN("pgp_validate_key_cb", pgp_show_packet_tag(pkt->tag));
+    ret = validate_key_cb(pkt, cbinfo);
+    PGP_TRACE_END("pgp_validate_key_cb");
+    return ret;
+}
+
 pgp_cb_ret_t
 validate_data_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
 {
@@ -569,6 +666,7 @@ pgp_keydata_reader_set(pgp_stream_t *stream, const pgp_key_t *key)
         data->packet = 0;
         data->offset = 0;
         pgp_reader_set(stream, keydata_reader, keydata_destroyer, data);
+        pgp_reader_set_stage(stream, "keydata");
     }
 }
 
@@ -617,6 +715,7 @@ validate_result_status(FILE *errs, const char *f, pgp_validation_t *val)
     time_t now;
     time_t t;
     char   buf[128];
+    char   tbuf[32];
 
     now = time(NULL);
     if (now < val->birthtime) {
@@ -628,7 +727,7 @@ validate_result_status(FILE *errs, const char *f, pgp_validation_t *val)
         }
         (void) fprintf(errs,
                        "signature not valid until %.24s (%s)\n",
-                       ctime(&val->birthtime),
+                       ctime_r(&val->birthtime, tbuf),
                        fmtsecs((int64_t)(val->birthtime - now), buf, sizeof(buf)));
         return 0;
     }
@@ -642,7 +741,7 @@ validate_result_status(FILE *errs, const char *f, pgp_validation_t *val)
         }
         (void) fprintf(errs,
                        "signature not valid after %.24s (%s ago)\n",
-                       ctime(&t),
+                       ctime_r(&t, tbuf),
                        fmtsecs((int64_t)(now - t), buf, sizeof(buf)));
         return 0;
     }
@@ -655,6 +754,7 @@ validate_result_status(FILE *errs, const char *f, pgp_validation_t *val)
  * \param result Where to put the result
  * \param key Key to validate
  * \param keyring Keyring to use for validation
+ * \param cache Results of earlier checks, or NULL to check every signature
  * \param cb_get_passphrase Callback to use to get passphrase
  * \return 1 if all signatures OK; else 0
  * \note It is the caller's responsiblity to free result after use.
@@ -664,6 +764,7 @@ unsigned
 pgp_validate_key_sigs(pgp_validation_t *     result,
                       const pgp_key_t *      key,
                       const rnp_key_store_t *keyring,
+                      pgp_sig_cache_t *      cache,
                       pgp_cb_ret_t cb_get_passphrase(const pgp_packet_t *, pgp_cbdata_t *))
 {
     pgp_stream_t *    stream;
@@ -672,6 +773,7 @@ pgp_validate_key_sigs(pgp_validation_t *     result,
 
     (void) memset(&keysigs, 0x0, sizeof(keysigs));
     keysigs.result = result;
+    keysigs.cache = cache;
     keysigs.getpassphrase = cb_get_passphrase;
 
     stream = pgp_new(sizeof(*stream));
@@ -705,6 +807,7 @@ pgp_validate_key_sigs(pgp_validation_t *     result,
    \ingroup HighLevel_Verify
    \param result Where to put the result
    \param ring Keyring to use
+   \param cache Results of earlier checks, or NULL to check every signature
    \param cb_get_passphrase Callback to use to get passphrase
    \note It is the caller's responsibility to free result after use.
    \sa pgp_validate_result_free()
@@ -712,13 +815,19 @@ pgp_validate_key_sigs(pgp_validation_t *     result,
 unsigned
 pgp_validate_all_sigs(pgp_validation_t *     result,
                       const rnp_key_store_t *ring,
+                      pgp_sig_cache_t *      cache,
                       pgp_cb_ret_t cb_get_passphrase(const pgp_packet_t *, pgp_cbdata_t *))
 {
-    unsigned n;
+    const pgp_key_t *key;
+    pgp_io_t         io = {stdout, stderr, stdout};
+    unsigned         n;
 
     (void) memset(result, 0x0, sizeof(*result));
     for (n = 0; n < ring->keyc; ++n) {
-        pgp_validate_key_sigs(result, &ring->keys[n], ring, cb_get_passphrase);
+        /* keys still in a keybox are parsed first */
+        if ((key = rnp_key_store_get_key(&io, ring, n)) != NULL) {
+            pgp_validate_key_sigs(result, key, ring, cache, cb_get_passphrase);
+        }
     }
     return validate_result_status(stderr, "keyring", result);
 }
@@ -69,6 +69,7 @@ typedef struct {
     const rnp_key_store_t *keyring;
     validate_reader_t *    reader;
     pgp_validation_t *     result;
+    pgp_sig_cache_t *      cache; /* earlier results, may be NULL */
     pgp_cb_ret_t (*getpassphrase)(const pgp_packet_t *, pgp_cbdata_t *);
 } validate_key_cb_t;
 
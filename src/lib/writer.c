@@ -84,13 +84,29 @@ __RCSID("$NetBSD: writer.c,v 1.33 2012/03/05 02:20:18 christos Exp $");
 #include "rnpdefs.h"
 #include "rnpdigest.h"
 
+/* call one writer, counting it if statistics are being collected */
+static unsigned
+stage_write(pgp_writer_t *writer, const void *src, unsigned len, pgp_error_t **errors)
+{
+    pgp_stage_frame_t frame;
+    unsigned          ret;
+
+    if (writer->stats == NULL) {
+        return writer->writer(src, len, errors, writer);
+    }
+    pgp_stats_enter(&frame);
+    ret = writer->writer(src, len, errors, writer);
+    pgp_stats_leave(&frame, writer->stats, len);
+    return ret;
+}
+
 /*
  * return 1 if OK, otherwise 0
  */
 static unsigned
 base_write(pgp_output_t *out, const void *src, unsigned len)
 {
-    return out->writer.writer(src, len, &out->errors, &out->writer);
+    return stage_write(&out->writer, src, len, &out->errors);
 }
 
 /**
@@ -257,6 +273,7 @@ pgp_writer_set(pgp_output_t *          output,
         output->writer.finaliser = finaliser;
         output->writer.destroyer = destroyer;
         output->writer.arg = arg;
+        output->writer.stats = NULL;
     }
 }
 
@@ -292,6 +309,7 @@ pgp_writer_push(pgp_output_t *          output,
         output->writer.finaliser = finaliser;
         output->writer.destroyer = destroyer;
         output->writer.arg = arg;
+        output->writer.stats = NULL;
     }
 }
 
@@ -315,6 +333,21 @@ pgp_writer_pop(pgp_output_t *output)
     }
 }
 
+/**
+ * \ingroup Core_Writers
+ *
+ * Name the writer on top of the stack for statistics purposes. Does
+ * nothing unless statistics are being collected.
+ *
+ * \param output The output structure
+ * \param name Stage name, must be a constant string
+ */
+void
+pgp_writer_set_stage(pgp_output_t *output, const char *name)
+{
+    output->writer.stats = pgp_stats_stage(name, PGP_STAGE_WRITER);
+}
+
 /**
  * \ingroup Core_Writers
  *
@@ -360,7 +393,7 @@ pgp_writer_get_arg(pgp_writer_t *writer)
 static unsigned
 stacked_write(pgp_writer_t *writer, const void *src, unsigned len, pgp_error_t **errors)
 {
-    return writer->next->writer(src, len, errors, writer->next);
+    return stage_write(writer->next, src, len, errors);
 }
 
 /**
@@ -509,6 +542,7 @@ pgp_writer_push_clearsigned(pgp_output_t *output, pgp_create_sig_t *sig)
     dash->sig = sig;
     dash->trailing = pgp_memory_new();
     pgp_writer_push(output, dash_esc_writer, NULL, dash_escaped_destroyer, dash);
+    pgp_writer_set_stage(output, "dash-escape");
     return ret;
 }
 
@@ -665,6 +699,7 @@ pgp_writer_use_armored_sig(pgp_output_t *output)
         return 0;
     }
     pgp_writer_push(output, linebreak_writer, NULL, generic_destroyer, linebreak);
+    pgp_writer_set_stage(output, "linebreak");
     base64 = calloc(1, sizeof(*base64));
     if (!base64) {
         PGP_MEMORY_ERROR(&output->errors);
@@ -672,6 +707,7 @@ pgp_writer_use_armored_sig(pgp_output_t *output)
     }
     base64->checksum = CRC24_INIT;
     pgp_writer_push(output, base64_writer, sig_finaliser, generic_destroyer, base64);
+    pgp_writer_set_stage(output, "base64");
     return 1;
 }
 
@@ -732,6 +768,7 @@ pgp_writer_push_armor_msg(pgp_output_t *output)
         return;
     }
     pgp_writer_push(output, linebreak_writer, NULL, generic_destroyer, linebreak);
+    pgp_writer_set_stage(output, "linebreak");
     if ((base64 = calloc(1, sizeof(*base64))) == NULL) {
         (void) fprintf(stderr, "pgp_writer_push_armor_msg: bad alloc\n");
         return;
@@ -739,6 +776,7 @@ pgp_writer_push_armor_msg(pgp_output_t *output)
     base64->checksum = CRC24_INIT;
     pgp_writer_push(
       output, base64_writer, armoured_message_finaliser, generic_destroyer, base64);
+    pgp_writer_set_stage(output, "base64");
 }
 
 static unsigned
@@ -847,12 +885,14 @@ pgp_writer_push_armoured(pgp_output_t *output, pgp_armor_type_t type)
     }
     pgp_write(output, header, hdrsize);
     pgp_writer_push(output, linebreak_writer, NULL, generic_destroyer, linebreak);
+    pgp_writer_set_stage(output, "linebreak");
     if ((base64 = calloc(1, sizeof(*base64))) == NULL) {
         (void) fprintf(stderr, "pgp_writer_push_armoured: bad alloc\n");
         return;
     }
     base64->checksum = CRC24_INIT;
     pgp_writer_push(output, base64_writer, finaliser, generic_destroyer, base64);
+    pgp_writer_set_stage(output, "base64");
 }
 
 /**************************************************************************/
@@ -936,6 +976,7 @@ pgp_push_enc_crypt(pgp_output_t *output, pgp_crypt_t *pgp_crypt)
         pgp_encrypt->free_crypt = 0;
         /* And push writer on stack */
         pgp_writer_push(output, encrypt_writer, NULL, encrypt_destroyer, pgp_encrypt);
+        pgp_writer_set_stage(output, "encrypt");
     }
 }
 
@@ -953,12 +994,59 @@ static void encrypt_se_ip_destroyer(pgp_writer_t *);
 
 /* */
 
+/* make one session key, and write it encrypted for each of the keys; the
+ * first of the session key packets is returned, for the caller to free */
+static pgp_pk_sesskey_t *
+write_pk_sesskeys(pgp_output_t *    output,
+                  const pgp_key_t **keys,
+                  unsigned          keyc,
+                  const char *      cipher)
+{
+    pgp_pk_sesskey_t *first;
+    pgp_pk_sesskey_t *other;
+    unsigned          i;
+
+    if (keyc == 0 || (first = pgp_create_pk_sesskey(keys[0], cipher)) == NULL) {
+        return NULL;
+    }
+    if (!pgp_write_pk_sesskey(output, first)) {
+        goto fail;
+    }
+    for (i = 1; i < keyc; i++) {
+        if ((other = pgp_create_pk_sesskey_for(keys[i], first)) == NULL) {
+            goto fail;
+        }
+        if (!pgp_write_pk_sesskey(output, other)) {
+            pgp_pk_sesskey_free(other);
+            free(other);
+            goto fail;
+        }
+        pgp_pk_sesskey_free(other);
+        pgp_forget(other, sizeof(*other));
+        free(other);
+    }
+    return first;
+
+fail:
+    pgp_pk_sesskey_free(first);
+    pgp_forget(first, sizeof(*first));
+    free(first);
+    return NULL;
+}
+
 /**
 \ingroup Core_WritersNext
 \brief Push Encrypted SE IP Writer onto stack
+\param output
+\param keys Keys of the recipients, which all get the same session key
+\param keyc Number of recipients
+\param cipher
 */
 int
-pgp_push_enc_se_ip(pgp_output_t *output, const pgp_key_t *pubkey, const char *cipher)
+pgp_push_enc_se_ip(pgp_output_t *    output,
+                   const pgp_key_t **keys,
+                   unsigned          keyc,
+                   const char *      cipher)
 {
     pgp_pk_sesskey_t *encrypted_pk_sesskey;
     encrypt_se_ip_t * se_ip;
@@ -970,13 +1058,12 @@ pgp_push_enc_se_ip(pgp_output_t *output, const pgp_key_t *pubkey, const char *ci
         return 0;
     }
 
-    /* Create and write encrypted PK session key */
-    if ((encrypted_pk_sesskey = pgp_create_pk_sesskey(pubkey, cipher)) == NULL) {
+    /* Create and write encrypted PK session keys */
+    if ((encrypted_pk_sesskey = write_pk_sesskeys(output, keys, keyc, cipher)) == NULL) {
         (void) fprintf(stderr, "pgp_push_enc_se_ip: null pk sesskey\n");
         free(se_ip);
         return 0;
     }
-    pgp_write_pk_sesskey(output, encrypted_pk_sesskey);
 
     /* Setup the se_ip */
     if ((encrypted = calloc(1, sizeof(*encrypted))) == NULL) {
@@ -1003,6 +1090,7 @@ pgp_push_enc_se_ip(pgp_output_t *output, const pgp_key_t *pubkey, const char *ci
 
     /* And push writer on stack */
     pgp_writer_push(output, encrypt_se_ip_writer, NULL, encrypt_se_ip_destroyer, se_ip);
+    pgp_writer_set_stage(output, "encrypt-se-ip");
     /* tidy up */
     pgp_pk_sesskey_free(encrypted_pk_sesskey);
     free(encrypted_pk_sesskey);
@@ -1096,7 +1184,11 @@ pgp_write_se_ip_pktset(pgp_output_t * output,
         free(preamble);
         return 0;
     }
-    pgp_random(preamble, crypted->blocksize);
+    if (!pgp_random(preamble, crypted->blocksize)) {
+        (void) fprintf(stderr, "pgp_write_se_ip_pktset: no random bytes\n");
+        free(preamble);
+        return 0;
+    }
     preamble[crypted->blocksize] = preamble[crypted->blocksize - 2];
     preamble[crypted->blocksize + 1] = preamble[crypted->blocksize - 1];
 
@@ -1192,6 +1284,7 @@ pgp_writer_set_fd(pgp_output_t *output, int fd)
     } else {
         writer->fd = fd;
         pgp_writer_set(output, fd_writer, NULL, writer_fd_destroyer, writer);
+        pgp_writer_set_stage(output, "fd");
     }
 }
 
@@ -1222,6 +1315,7 @@ void
 pgp_writer_set_memory(pgp_output_t *output, pgp_memory_t *mem)
 {
     pgp_writer_set(output, memory_writer, NULL, NULL, mem);
+    pgp_writer_set_stage(output, "memory");
 }
 
 /**************************************************************************/
@@ -1302,6 +1396,7 @@ pgp_push_checksum_writer(pgp_output_t *output, pgp_seckey_t *seckey)
         }
         pgp_writer_push(
           output, skey_checksum_writer, skey_checksum_finaliser, skey_checksum_destroyer, sum);
+        pgp_writer_set_stage(output, "skey-checksum");
     }
 }
 
@@ -1317,6 +1412,8 @@ typedef struct {
     pgp_memory_t *se_ip_mem;
     pgp_output_t *se_ip_out;
     pgp_hash_t    hash;
+    unsigned      pkts;    /* input is already packets, not literal data */
+    unsigned      started; /* first partial SE-IP chunk written */
 } str_enc_se_ip_t;
 
 static unsigned str_enc_se_ip_writer(const uint8_t *src,
@@ -1330,13 +1427,12 @@ static void str_enc_se_ip_destroyer(pgp_writer_t *writer);
 
 /* */
 
-/**
-\ingroup Core_WritersNext
-\param output
-\param pubkey
-*/
-void
-pgp_push_stream_enc_se_ip(pgp_output_t *output, const pgp_key_t *pubkey, const char *cipher)
+static unsigned
+push_stream_enc_se_ip(pgp_output_t *    output,
+                      const pgp_key_t **keys,
+                      unsigned          keyc,
+                      const char *      cipher,
+                      unsigned          pkts)
 {
     pgp_pk_sesskey_t *encrypted_pk_sesskey;
     str_enc_se_ip_t * se_ip;
@@ -1346,29 +1442,33 @@ pgp_push_stream_enc_se_ip(pgp_output_t *output, const pgp_key_t *pubkey, const c
 
     if ((se_ip = calloc(1, sizeof(*se_ip))) == NULL) {
         (void) fprintf(stderr, "pgp_push_stream_enc_se_ip: bad alloc\n");
-        return;
+        return 0;
+    }
+    if ((encrypted_pk_sesskey = write_pk_sesskeys(output, keys, keyc, cipher)) == NULL) {
+        (void) fprintf(stderr, "pgp_push_stream_enc_se_ip: null pk sesskey\n");
+        free(se_ip);
+        return 0;
     }
-    encrypted_pk_sesskey = pgp_create_pk_sesskey(pubkey, cipher);
-    pgp_write_pk_sesskey(output, encrypted_pk_sesskey);
 
     /* Setup the se_ip */
     if ((encrypted = calloc(1, sizeof(*encrypted))) == NULL) {
         free(se_ip);
         (void) fprintf(stderr, "pgp_push_stream_enc_se_ip: bad alloc\n");
-        return;
+        return 0;
     }
     pgp_crypt_any(encrypted, encrypted_pk_sesskey->symm_alg);
     if ((iv = calloc(1, encrypted->blocksize)) == NULL) {
         free(encrypted);
         free(se_ip);
         (void) fprintf(stderr, "pgp_push_stream_enc_se_ip: bad alloc\n");
-        return;
+        return 0;
     }
     pgp_cipher_set_iv(encrypted, iv);
     pgp_cipher_set_key(encrypted, &encrypted_pk_sesskey->key[0]);
     pgp_encrypt_init(encrypted);
 
     se_ip->crypt = encrypted;
+    se_ip->pkts = pkts;
 
     se_ip->mem_data = pgp_memory_new();
     pgp_memory_init(se_ip->mem_data, bufsz);
@@ -1381,11 +1481,51 @@ pgp_push_stream_enc_se_ip(pgp_output_t *output, const pgp_key_t *pubkey, const c
     /* And push writer on stack */
     pgp_writer_push(
       output, str_enc_se_ip_writer, str_enc_se_ip_finaliser, str_enc_se_ip_destroyer, se_ip);
+    pgp_writer_set_stage(output, "stream-encrypt-se-ip");
     /* tidy up */
     free(encrypted_pk_sesskey);
     free(iv);
+    return 1;
+}
+
+/**
+\ingroup Core_WritersNext
+\param output
+\param keys Keys of the recipients, which all get the same session key
+\param keyc Number of recipients
+\param cipher
+*/
+void
+pgp_push_stream_enc_se_ip(pgp_output_t *    output,
+                          const pgp_key_t **keys,
+                          unsigned          keyc,
+                          const char *      cipher)
+{
+    (void) push_stream_enc_se_ip(output, keys, keyc, cipher, 0);
 }
 
+/**
+\ingroup Core_WritersNext
+\brief Pushes a streaming SE-IP writer which encrypts the packets written to it
+\note Unlike pgp_push_stream_enc_se_ip() the data is not wrapped in a literal
+data packet, so the caller can write a whole message (one-pass signature,
+literal data and signature, or a compressed packet holding them).
+\param output
+\param keys Keys of the recipients, which all get the same session key
+\param keyc Number of recipients
+\param cipher
+\return 1 if OK; else 0
+*/
+unsigned
+pgp_push_stream_enc_se_ip_pkts(pgp_output_t *    output,
+                               const pgp_key_t **keys,
+                               unsigned          keyc,
+                               const char *      cipher)
+{
+    return push_stream_enc_se_ip(output, keys, keyc, cipher, 1);
+}
+
+
 /* calculate the partial data length */
 static unsigned
 partial_data_len(unsigned len)
@@ -1426,8 +1566,15 @@ write_partial_len(pgp_output_t *output, unsigned len)
     return pgp_write(output, &c, 1);
 }
 
-static unsigned
-stream_write_litdata(pgp_output_t *output, const uint8_t *data, unsigned len)
+/**
+\ingroup Core_WritePackets
+\brief Writes packet body data as a run of Partial Body Length chunks
+\note The caller writes the packet tag, makes the first chunk at least 512
+octets long, and ends the packet with a chunk of definite length
+\return 1 if OK; else 0
+*/
+unsigned
+pgp_write_partial_body(pgp_output_t *output, const uint8_t *data, unsigned len)
 {
     size_t pdlen;
 
@@ -1470,7 +1617,7 @@ stream_write_litdata_first(pgp_output_t *         output,
     data += (sz_pd - 6);
     sz_towrite -= (unsigned) sz_pd;
 
-    return stream_write_litdata(output, data, (unsigned) sz_towrite);
+    return pgp_write_partial_body(output, data, (unsigned) sz_towrite);
 }
 
 static unsigned
@@ -1534,7 +1681,11 @@ stream_write_se_ip_first(pgp_output_t *   output,
     pgp_write_scalar(output, PGP_SE_IP_DATA_VERSION, 1);
     pgp_push_enc_crypt(output, se_ip->crypt);
 
-    pgp_random(preamble, blocksize);
+    if (!pgp_random(preamble, blocksize)) {
+        free(preamble);
+        (void) fprintf(stderr, "stream_write_se_ip_first: no random bytes\n");
+        return 0;
+    }
     preamble[blocksize] = preamble[blocksize - 2];
     preamble[blocksize + 1] = preamble[blocksize - 1];
     if (!pgp_hash_create(&se_ip->hash, PGP_HASH_SHA1)) {
@@ -1611,7 +1762,21 @@ str_enc_se_ip_writer(const uint8_t *src,
 
     se_ip = pgp_writer_get_arg(writer);
     ret = 1;
-    if (se_ip->litoutput == NULL) {
+    if (se_ip->pkts) {
+        if (!se_ip->started) {
+            pgp_memory_add(se_ip->mem_data, src, len);
+            if (pgp_mem_len(se_ip->mem_data) < 512) {
+                return 1;
+            }
+            stream_write_se_ip_first(se_ip->se_ip_out,
+                                     pgp_mem_data(se_ip->mem_data),
+                                     (unsigned) pgp_mem_len(se_ip->mem_data),
+                                     se_ip);
+            se_ip->started = 1;
+        } else {
+            stream_write_se_ip(se_ip->se_ip_out, src, len, se_ip);
+        }
+    } else if (se_ip->litoutput == NULL) {
         /* first literal data chunk is not yet written */
 
         pgp_memory_add(se_ip->mem_data, src, len);
@@ -1634,7 +1799,7 @@ str_enc_se_ip_writer(const uint8_t *src,
                                  (unsigned) pgp_mem_len(se_ip->litmem),
                                  se_ip);
     } else {
-        stream_write_litdata(se_ip->litoutput, src, len);
+        pgp_write_partial_body(se_ip->litoutput, src, len);
         stream_write_se_ip(se_ip->se_ip_out,
                            pgp_mem_data(se_ip->litmem),
                            (unsigned) pgp_mem_len(se_ip->litmem),
@@ -1647,7 +1812,9 @@ str_enc_se_ip_writer(const uint8_t *src,
                         (unsigned) pgp_mem_len(se_ip->se_ip_mem),
                         errors);
 
-    pgp_memory_clear(se_ip->litmem);
+    if (se_ip->litmem) {
+        pgp_memory_clear(se_ip->litmem);
+    }
     pgp_memory_clear(se_ip->se_ip_mem);
 
     return ret;
@@ -1660,7 +1827,16 @@ str_enc_se_ip_finaliser(pgp_error_t **errors, pgp_writer_t *writer)
     str_enc_se_ip_t *se_ip;
 
     se_ip = pgp_writer_get_arg(writer);
-    if (se_ip->litoutput == NULL) {
+    if (se_ip->pkts) {
+        if (!se_ip->started) {
+            pgp_write_se_ip_pktset(se_ip->se_ip_out,
+                                   pgp_mem_data(se_ip->mem_data),
+                                   (unsigned) pgp_mem_len(se_ip->mem_data),
+                                   se_ip->crypt);
+        } else {
+            stream_write_se_ip_last(se_ip->se_ip_out, NULL, 0, se_ip);
+        }
+    } else if (se_ip->litoutput == NULL) {
         /* first literal data chunk was not written */
         /* so we know the total length of data, write a simple packet */
 
@@ -79,6 +79,7 @@ struct pgp_writer_t {
     void *                  arg;       /* writer-specific argument */
     pgp_writer_t *          next;      /* next writer in the stack */
     pgp_io_t *              io;        /* IO for errors and output */
+    pgp_stage_stats_t *     stats;     /* counters, NULL unless collecting */
 };
 
 void *pgp_writer_get_arg(pgp_writer_t *);
@@ -94,6 +95,7 @@ void pgp_writer_push(pgp_output_t *,
                      pgp_writer_destroyer_t *,
                      void *);
 void     pgp_writer_pop(pgp_output_t *);
+void     pgp_writer_set_stage(pgp_output_t *, const char *);
 unsigned pgp_writer_passthrough(const uint8_t *, unsigned, pgp_error_t **, pgp_writer_t *);
 
 void     pgp_writer_set_fd(pgp_output_t *, int);
@@ -104,10 +106,15 @@ unsigned pgp_write_length(pgp_output_t *, unsigned);
 unsigned pgp_write_ptag(pgp_output_t *, pgp_content_enum);
 unsigned pgp_write_scalar(pgp_output_t *, unsigned, unsigned);
 unsigned pgp_write_mpi(pgp_output_t *, const BIGNUM *);
+unsigned pgp_write_partial_body(pgp_output_t *, const uint8_t *, unsigned);
 
 void     pgp_writer_info_delete(pgp_writer_t *);
 unsigned pgp_writer_info_finalise(pgp_error_t **, pgp_writer_t *);
 
-void pgp_push_stream_enc_se_ip(pgp_output_t *, const pgp_key_t *, const char *);
+void     pgp_push_stream_enc_se_ip(pgp_output_t *, const pgp_key_t **, unsigned, const char *);
+unsigned pgp_push_stream_enc_se_ip_pkts(pgp_output_t *,
+                                        const pgp_key_t **,
+                                        unsigned,
+                                        const char *);
 
 #endif /* WRITER_H_ */
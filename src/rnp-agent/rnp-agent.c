@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* rnp-agent: keep secret keys unlocked for other rnp processes.
+ *
+ * The keys are unlocked once, when the agent starts, and kept in locked
+ * memory until their time to live is up. Other processes then sign and
+ * decrypt with them through a Unix domain socket in the key directory,
+ * without running the S2K or asking for a passphrase themselves.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rnp.h>
+
+#include "packet.h"
+#include "packet-key.h"
+#include "key_store.h"
+#include "seckeycache.h"
+#include "agent.h"
+
+extern char *__progname;
+
+#define DEFAULT_TTL 3600 /* seconds */
+#define MAX_CLIENTS 64
+
+static const char *usage = "[options]\n"
+                           "where options are:\n"
+                           "\t[--homedir=<homedir>] AND/OR\n"
+                           "\t[--keyring-format=<format>] AND/OR\n"
+                           "\t[--pass-fd=<fd>] AND/OR\n"
+                           "\t[--socket=<socket>] AND/OR\n"
+                           "\t[--ttl=<seconds>] AND/OR\n"
+                           "\t[--userid=<userid>] OR\n"
+                           "\t--help OR\n"
+                           "\t--version\n";
+
+enum optdefs {
+    HOMEDIR = 260,
+    KEYRING_FORMAT,
+    PASSWDFD,
+    SOCKET,
+    TTL,
+    USERID,
+    HELP_CMD,
+    VERSION_CMD
+};
+
+static struct option options[] = {
+  {"home", required_argument, NULL, HOMEDIR},
+  {"homedir", required_argument, NULL, HOMEDIR},
+  {"keyring-format", required_argument, NULL, KEYRING_FORMAT},
+  {"pass-fd", required_argument, NULL, PASSWDFD},
+  {"socket", required_argument, NULL, SOCKET},
+  {"ttl", required_argument, NULL, TTL},
+  {"userid", required_argument, NULL, USERID},
+  {"help", no_argument, NULL, HELP_CMD},
+  {"version", no_argument, NULL, VERSION_CMD},
+  {NULL, 0, NULL, 0},
+};
+
+static volatile sig_atomic_t stopping;
+
+static void
+print_praise(void)
+{
+    fprintf(stderr,
+            "%s\nAll bug reports, praise and chocolate, please, to:\n%s\n",
+            rnp_get_info("version"),
+            rnp_get_info("maintainer"));
+}
+
+static void
+print_usage(const char *usagemsg)
+{
+    print_praise();
+    fprintf(stderr, "Usage: %s %s", __progname, usagemsg);
+}
+
+static void
+stop(int sig)
+{
+    stopping = sig;
+}
+
+/* unlock the secret key of a key pair, and keep it in the cache */
+static int
+unlock_key(rnp_t *rnp, pgp_seckey_cache_t *cache, const pgp_key_t *key)
+{
+    pgp_seckey_t *seckey;
+    pgp_seckey_t *cached;
+    pgp_io_t *    io = rnp->io;
+
+    if ((seckey = pgp_decrypt_seckey(key, rnp->passfp)) == NULL) {
+        (void) fprintf(io->errs, "%s: can't unlock key\n", __progname);
+        return 0;
+    }
+    if ((cached = pgp_seckey_cache_put(cache, key, seckey)) == NULL) {
+        (void) fprintf(io->errs, "%s: no room for key\n", __progname);
+        pgp_seckey_free(seckey);
+        free(seckey);
+        return 0;
+    }
+    (void) pgp_seckey_cache_release(cache, cached);
+    return 1;
+}
+
+/* unlock the key asked for, or else every secret key in the keyring */
+static int
+unlock_keys(rnp_t *rnp, pgp_seckey_cache_t *cache, const char *userid)
+{
+    const pgp_key_t *key;
+    rnp_key_store_t *secring = rnp->secring;
+    unsigned         i;
+    int              n = 0;
+
+    if (userid != NULL) {
+        if ((key = rnp_key_store_get_key_by_name(rnp->io, secring, userid)) == NULL) {
+            (void) fprintf(stderr, "%s: cannot find key '%s'\n", __progname, userid);
+            return 0;
+        }
+        return unlock_key(rnp, cache, key);
+    }
+    for (i = 0; i < secring->keyc; i++) {
+        key = rnp_key_store_get_key(rnp->io, secring, i);
+        if (key != NULL && pgp_is_key_secret(key)) {
+            n += unlock_key(rnp, cache, key);
+        }
+    }
+    return n;
+}
+
+/* the default socket is next to the secret keyring */
+static int
+default_socket(rnp_t *rnp, char *path, size_t size)
+{
+    const char *secring;
+    const char *slash;
+
+    if ((secring = rnp_getvar(rnp, "secring")) == NULL ||
+        (slash = strrchr(secring, '/')) == NULL) {
+        return 0;
+    }
+    return snprintf(
+             path, size, "%.*s/%s", (int) (slash - secring), secring, PGP_AGENT_SOCKET) <
+           (int) size;
+}
+
+/* answer requests until told to stop */
+static void
+serve(rnp_t *rnp, pgp_seckey_cache_t *cache, int listenfd)
+{
+    pgp_agent_conn_t *conns[MAX_CLIENTS + 1];
+    pgp_agent_conn_t *conn;
+    struct pollfd     fds[MAX_CLIENTS + 1];
+    nfds_t            nfds = 1;
+    nfds_t            i;
+
+    fds[0].fd = listenfd;
+    fds[0].events = POLLIN;
+    while (!stopping) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            (void) fprintf(stderr, "%s: poll: %s\n", __progname, strerror(errno));
+            break;
+        }
+        /* clients are answered one request each time round, and only once
+         * all of it has come in */
+        for (i = nfds - 1; i > 0; i--) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if ((fds[i].revents & POLLIN) == 0 ||
+                !pgp_agent_serve(rnp->io, conns[i], rnp->secring, cache)) {
+                pgp_agent_conn_close(conns[i]);
+                fds[i] = fds[--nfds];
+                conns[i] = conns[nfds];
+            }
+        }
+        if ((fds[0].revents & POLLIN) != 0 && (conn = pgp_agent_accept(listenfd)) != NULL) {
+            if (nfds > MAX_CLIENTS) {
+                pgp_agent_conn_close(conn);
+                continue;
+            }
+            conns[nfds] = conn;
+            fds[nfds].fd = pgp_agent_conn_fd(conn);
+            fds[nfds].events = POLLIN;
+            fds[nfds++].revents = 0;
+        }
+    }
+    for (i = 1; i < nfds; i++) {
+        pgp_agent_conn_close(conns[i]);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    pgp_seckey_cache_t *cache;
+    struct sigaction    sa;
+    const char *        userid = NULL;
+    const char *        sock = NULL;
+    const char *        homedir = NULL;
+    const char *        format = NULL;
+    const char *        passfd = NULL;
+    unsigned            ttl = DEFAULT_TTL;
+    rnp_t               rnp;
+    char                path[MAXPATHLEN];
+    int                 optindex;
+    int                 listenfd;
+    int                 ch;
+
+    optindex = 0;
+    while ((ch = getopt_long(argc, argv, "", options, &optindex)) != -1) {
+        switch (ch) {
+        case HOMEDIR:
+            homedir = optarg;
+            break;
+        case KEYRING_FORMAT:
+            format = optarg;
+            break;
+        case PASSWDFD:
+            passfd = optarg;
+            break;
+        case SOCKET:
+            sock = optarg;
+            break;
+        case TTL:
+            if (atoi(optarg) <= 0) {
+                (void) fprintf(stderr, "%s: bad ttl '%s'\n", __progname, optarg);
+                exit(EXIT_FAILURE);
+            }
+            ttl = (unsigned) atoi(optarg);
+            break;
+        case USERID:
+            userid = optarg;
+            break;
+        case VERSION_CMD:
+            print_praise();
+            exit(EXIT_SUCCESS);
+        default:
+            print_usage(usage);
+            exit((ch == HELP_CMD) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    memset(&rnp, '\0', sizeof(rnp));
+    rnp_setvar(&rnp, "need seckey", "1");
+    if (passfd != NULL) {
+        rnp_setvar(&rnp, "pass-fd", passfd);
+    }
+    if (format != NULL) {
+        rnp_setvar(&rnp, "keyring_format", format);
+    }
+    if (!rnp_init(&rnp)) {
+        (void) fprintf(stderr, "fatal: cannot initialise\n");
+        return EXIT_FAILURE;
+    }
+    if (homedir != NULL && !rnp_set_homedir(&rnp, (char *) homedir, 0)) {
+        rnp_end(&rnp);
+        return EXIT_FAILURE;
+    }
+    if (!rnp_load_keys(&rnp) || rnp.secring == NULL) {
+        (void) fprintf(stderr, "fatal: failed to load keys\n");
+        rnp_end(&rnp);
+        return EXIT_FAILURE;
+    }
+    if (sock == NULL) {
+        if (!default_socket(&rnp, path, sizeof(path))) {
+            (void) fprintf(stderr, "%s: no socket path\n", __progname);
+            rnp_end(&rnp);
+            return EXIT_FAILURE;
+        }
+        sock = path;
+    }
+
+    if ((cache = pgp_seckey_cache_new(ttl, 0)) == NULL) {
+        (void) fprintf(stderr, "%s: can't make key cache\n", __progname);
+        rnp_end(&rnp);
+        return EXIT_FAILURE;
+    }
+    if (!unlock_keys(&rnp, cache, userid)) {
+        (void) fprintf(stderr, "%s: no keys unlocked\n", __progname);
+        pgp_seckey_cache_free(cache);
+        rnp_end(&rnp);
+        return EXIT_FAILURE;
+    }
+    if ((listenfd = pgp_agent_listen(sock)) < 0) {
+        pgp_seckey_cache_free(cache);
+        rnp_end(&rnp);
+        return EXIT_FAILURE;
+    }
+
+    (void) memset(&sa, 0x0, sizeof(sa));
+    sa.sa_handler = stop;
+    (void) sigemptyset(&sa.sa_mask);
+    (void) sigaction(SIGINT, &sa, NULL);
+    (void) sigaction(SIGTERM, &sa, NULL);
+    (void) sigaction(SIGHUP, &sa, NULL);
+    (void) signal(SIGPIPE, SIG_IGN);
+
+    (void) fprintf(stderr, "%s: listening on %s\n", __progname, sock);
+    serve(&rnp, cache, listenfd);
+
+    (void) close(listenfd);
+    (void) unlink(sock);
+    pgp_seckey_cache_free(cache);
+    rnp_end(&rnp);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1046 @@
+/*
+ * Copyright (c) 2017, [Ribose Inc](https://www.ribose.com).
+ * All rights reserved.
+ *
+ * This code is originally derived from software contributed to
+ * The NetBSD Foundation by Alistair Crooks (agc@netbsd.org), and
+ * carried further by Ribose Inc (https://www.ribose.com).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* End-to-end benchmarks for the rnp library.
+ *
+ * rnp-bench generates a throwaway home directory with synthetic keys and
+ * payloads, runs each operation a number of times and reports throughput,
+ * latency percentiles and peak RSS as JSON, so that results can be compared
+ * between releases.
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <json.h>
+#include <rnp.h>
+
+#include "packet.h"
+#include "packet-parse.h"
+#include "create.h"
+#include "memory.h"
+#include "readerwriter.h"
+#include "signature.h"
+#include "../common/constants.h"
+
+extern char *__progname;
+
+static const char *usage = "[options]\n"
+                           "where options are:\n"
+                           "\t[--sizes=<size>[,<size>...]] AND/OR\n"
+                           "\t[--keys=<count>[,<count>...]] AND/OR\n"
+                           "\t[--ops=<op>[,<op>...]] AND/OR\n"
+                           "\t[--iterations=<count>] AND/OR\n"
+                           "\t[--lookups=<count>] AND/OR\n"
+                           "\t[--genkeys=<count>] AND/OR\n"
+                           "\t[--numbits=<bits>] AND/OR\n"
+                           "\t[--tmpdir=<dir>] AND/OR\n"
+                           "\t[--output=<file>] AND/OR\n"
+                           "\t[--keep]\n"
+                           "sizes accept K, M and G suffixes; ops are any of\n"
+                           "\tencrypt, decrypt, sign, verify, armor, dearmor, load, lookup\n";
+
+enum optdefs {
+    /* commands */
+    HELP_CMD = 260,
+    VERSION_CMD,
+
+    /* options */
+    SIZES,
+    KEYS,
+    OPS,
+    ITERATIONS,
+    LOOKUPS,
+    GENKEYS,
+    NUMBITS,
+    TMPDIR,
+    OUTPUT,
+    KEEP
+};
+
+#define EXIT_ERROR 2
+
+static struct option options[] = {
+  {"help", no_argument, NULL, HELP_CMD},
+  {"version", no_argument, NULL, VERSION_CMD},
+  {"sizes", required_argument, NULL, SIZES},
+  {"size", required_argument, NULL, SIZES},
+  {"keys", required_argument, NULL, KEYS},
+  {"ops", required_argument, NULL, OPS},
+  {"iterations", required_argument, NULL, ITERATIONS},
+  {"lookups", required_argument, NULL, LOOKUPS},
+  {"genkeys", required_argument, NULL, GENKEYS},
+  {"numbits", required_argument, NULL, NUMBITS},
+  {"tmpdir", required_argument, NULL, TMPDIR},
+  {"output", required_argument, NULL, OUTPUT},
+  {"keep", no_argument, NULL, KEEP},
+  {NULL, 0, NULL, 0},
+};
+
+/* operations which may be selected with --ops */
+#define BENCH_ENCRYPT 0x01
+#define BENCH_DECRYPT 0x02
+#define BENCH_SIGN 0x04
+#define BENCH_VERIFY 0x08
+#define BENCH_ARMOR 0x10
+#define BENCH_DEARMOR 0x20
+#define BENCH_LOAD 0x40
+#define BENCH_LOOKUP 0x80
+#define BENCH_ALL 0xff
+
+static const struct {
+    const char *name;
+    unsigned    mask;
+} bench_ops[] = {
+  {"encrypt", BENCH_ENCRYPT},
+  {"decrypt", BENCH_DECRYPT},
+  {"sign", BENCH_SIGN},
+  {"verify", BENCH_VERIFY},
+  {"armor", BENCH_ARMOR},
+  {"dearmor", BENCH_DEARMOR},
+  {"load", BENCH_LOAD},
+  {"lookup", BENCH_LOOKUP},
+  {"all", BENCH_ALL},
+  {NULL, 0},
+};
+
+#define MAX_BENCH_LIST 32
+#define BENCH_UID_FMT "bench-%u@rnp"
+#define BENCH_CHUNK (1024 * 1024)
+
+/* gather up program variables into one struct */
+typedef struct bench_t {
+    char         tmpdir[MAXPATHLEN]; /* scratch directory */
+    char         gendir[MAXPATHLEN]; /* home of the generated keys */
+    char *       output;             /* results file, stdout if NULL */
+    FILE *       res;                /* where the JSON goes */
+    uint64_t     sizes[MAX_BENCH_LIST];
+    unsigned     sizec;
+    uint64_t     keys[MAX_BENCH_LIST];
+    unsigned     keyc;
+    unsigned     ops;        /* BENCH_* mask */
+    unsigned     iterations; /* timed runs per data point */
+    unsigned     lookups;    /* lookups per keyring size */
+    unsigned     genkeys;    /* distinct keys to generate */
+    int          numbits;    /* RSA modulus size */
+    int          keep;       /* leave tmpdir behind */
+    off_t *      offsets;    /* end of each generated key in pubring.gpg */
+    json_object *results;
+} bench_t;
+
+/* nanoseconds from a monotonic clock */
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/* format a path into buf, failing rather than using a truncated one */
+static int
+bench_path(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list vp;
+    int     cc;
+
+    va_start(vp, fmt);
+    cc = vsnprintf(buf, size, fmt, vp);
+    va_end(vp);
+    if (cc < 0 || (size_t) cc >= size) {
+        (void) fprintf(stderr, "%s: path too long\n", __progname);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * peak resident set size of the whole process so far, in kilobytes. It is
+ * not reset between operations, so it only grows from one result to the next.
+ */
+static long
+peak_rss_kb(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) != 0) {
+        return -1;
+    }
+    return ru.ru_maxrss;
+}
+
+/* parse "64K", "16M", "2G" and plain byte counts */
+static int
+parse_size(const char *s, uint64_t *size)
+{
+    unsigned long long n;
+    char *             end;
+
+    errno = 0;
+    n = strtoull(s, &end, 10);
+    if (errno || end == s) {
+        return 0;
+    }
+    switch (*end) {
+    case 'k':
+    case 'K':
+        n <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        n <<= 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        n <<= 30;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end != '\0' || n == 0) {
+        return 0;
+    }
+    *size = n;
+    return 1;
+}
+
+/* parse a comma separated list of sizes */
+static int
+parse_list(const char *arg, uint64_t *list, unsigned *count)
+{
+    char  buf[1024];
+    char *cp;
+    char *next;
+
+    (void) snprintf(buf, sizeof(buf), "%s", arg);
+    for (*count = 0, cp = buf; cp != NULL; cp = next) {
+        if ((next = strchr(cp, ',')) != NULL) {
+            *next++ = '\0';
+        }
+        if (*count == MAX_BENCH_LIST || !parse_size(cp, &list[*count])) {
+            (void) fprintf(stderr, "%s: bad list entry '%s'\n", __progname, cp);
+            return 0;
+        }
+        *count += 1;
+    }
+    return 1;
+}
+
+static int
+parse_ops(const char *arg, unsigned *ops)
+{
+    char  buf[1024];
+    char *cp;
+    char *next;
+    int   i;
+
+    (void) snprintf(buf, sizeof(buf), "%s", arg);
+    for (*ops = 0, cp = buf; cp != NULL; cp = next) {
+        if ((next = strchr(cp, ',')) != NULL) {
+            *next++ = '\0';
+        }
+        for (i = 0; bench_ops[i].name && strcmp(bench_ops[i].name, cp) != 0; i++)
+            ;
+        if (bench_ops[i].name == NULL) {
+            (void) fprintf(stderr, "%s: unknown op '%s'\n", __progname, cp);
+            return 0;
+        }
+        *ops |= bench_ops[i].mask;
+    }
+    return 1;
+}
+
+/* cheap incompressible filler, we are not measuring the RNG here */
+static void
+fill_buffer(uint8_t *buf, size_t len, uint64_t *state)
+{
+    uint64_t x = *state;
+    size_t   i;
+
+    for (i = 0; i < len; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[i] = (uint8_t) x;
+    }
+    *state = x;
+}
+
+static int
+write_payload(const char *path, uint64_t size)
+{
+    uint64_t state = 0x9e3779b97f4a7c15ULL ^ size;
+    uint8_t *buf;
+    size_t   n;
+    FILE *   fp;
+    int      ok = 1;
+
+    if ((buf = malloc(BENCH_CHUNK)) == NULL) {
+        (void) fprintf(stderr, "write_payload: bad alloc\n");
+        return 0;
+    }
+    if ((fp = fopen(path, "w")) == NULL) {
+        (void) fprintf(stderr, "write_payload: can't create '%s'\n", path);
+        free(buf);
+        return 0;
+    }
+    while (ok && size > 0) {
+        n = (size_t) MIN(size, BENCH_CHUNK);
+        fill_buffer(buf, n, &state);
+        ok = (fwrite(buf, 1, n, fp) == n);
+        size -= n;
+    }
+    ok = (fclose(fp) == 0) && ok;
+    free(buf);
+    return ok;
+}
+
+static int
+remove_cb(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *) a;
+    const uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of sorted samples, in milliseconds */
+static double
+percentile_ms(const uint64_t *sorted, unsigned n, unsigned pct)
+{
+    unsigned rank;
+
+    if (n == 0) {
+        return 0.0;
+    }
+    rank = (unsigned) (((uint64_t) pct * n + 99) / 100);
+    return (double) sorted[(rank > 0) ? rank - 1 : 0] / 1e6;
+}
+
+/* append one result object to bench->results */
+static void
+report(bench_t *   bench,
+       const char *op,
+       const char *param,
+       uint64_t    value,
+       uint64_t    bytes,
+       uint64_t *  samples,
+       unsigned    n)
+{
+    json_object *obj;
+    uint64_t     total;
+    double       secs;
+    unsigned     i;
+
+    for (total = 0, i = 0; i < n; i++) {
+        total += samples[i];
+    }
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    secs = (double) total / 1e9;
+    obj = json_object_new_object();
+    json_object_object_add(obj, "op", json_object_new_string(op));
+    json_object_object_add(obj, param, json_object_new_int64((int64_t) value));
+    json_object_object_add(obj, "iterations", json_object_new_int64(n));
+    json_object_object_add(obj, "total_sec", json_object_new_double(secs));
+    json_object_object_add(
+      obj, "ops_per_sec", json_object_new_double((secs > 0) ? n / secs : 0.0));
+    if (bytes) {
+        json_object_object_add(
+          obj,
+          "mb_per_sec",
+          json_object_new_double((secs > 0) ? (double) bytes * n / secs / 1e6 : 0.0));
+    }
+    json_object_object_add(
+      obj, "p50_ms", json_object_new_double(percentile_ms(samples, n, 50)));
+    json_object_object_add(
+      obj, "p99_ms", json_object_new_double(percentile_ms(samples, n, 99)));
+    json_object_object_add(
+      obj, "process_peak_rss_kb", json_object_new_int64(peak_rss_kb()));
+    json_object_array_add(bench->results, obj);
+    (void) fprintf(
+      stderr, "%s: %s %s=%llu done\n", __progname, op, param, (unsigned long long) value);
+}
+
+/* set up a context rooted at homedir which never prompts */
+static int
+bench_rnp_init(rnp_t *rnp, const char *homedir, int needseckey)
+{
+    char passfd[16];
+    int  fd;
+
+    (void) memset(rnp, 0x0, sizeof(*rnp));
+    /* an empty passphrase, read from /dev/null */
+    if ((fd = open("/dev/null", O_RDONLY)) < 0) {
+        return 0;
+    }
+    (void) snprintf(passfd, sizeof(passfd), "%d", fd);
+    rnp_setvar(rnp, "pass-fd", passfd);
+    rnp_setvar(rnp, "res", "/dev/null");
+    rnp_setvar(rnp, "homedir", homedir);
+    rnp_setvar(rnp, "hash", "SHA256");
+    rnp_setvar(rnp, "numtries", "1");
+    if (needseckey) {
+        rnp_setvar(rnp, "need seckey", "1");
+    }
+    if (!rnp_init(rnp)) {
+        (void) close(fd);
+        return 0;
+    }
+    return 1;
+}
+
+static void
+bench_rnp_end(rnp_t *rnp)
+{
+    pgp_io_t *io = rnp->io;
+
+    if (rnp->passfp) {
+        (void) fclose(rnp->passfp);
+    }
+    if (io && io->res != stdout && io->res != stderr) {
+        (void) fclose(io->res);
+    }
+    rnp_end(rnp);
+}
+
+/* generate the distinct keys all other key material is built from */
+static int
+generate_keys(bench_t *bench)
+{
+    struct stat st;
+    rnp_t       rnp;
+    char        uid[64];
+    char        ring[MAXPATHLEN];
+    unsigned    i;
+
+    if (!bench_path(bench->gendir, sizeof(bench->gendir), "%s/gen", bench->tmpdir) ||
+        !bench_path(
+          ring, sizeof(ring), "%s/%s/pubring.gpg", bench->gendir, SUBDIRECTORY_GNUPG)) {
+        return 0;
+    }
+    if (mkdir(bench->gendir, 0700) != 0) {
+        (void) fprintf(stderr, "%s: can't mkdir '%s'\n", __progname, bench->gendir);
+        return 0;
+    }
+    if ((bench->offsets = calloc(bench->genkeys, sizeof(*bench->offsets))) == NULL) {
+        (void) fprintf(stderr, "generate_keys: bad alloc\n");
+        return 0;
+    }
+    for (i = 0; i < bench->genkeys; i++) {
+        if (!bench_rnp_init(&rnp, bench->gendir, 1)) {
+            return 0;
+        }
+        (void) snprintf(uid, sizeof(uid), BENCH_UID_FMT, i);
+        if (!rnp_generate_key(&rnp, uid, bench->numbits) || stat(ring, &st) != 0) {
+            (void) fprintf(stderr, "%s: can't generate key %u\n", __progname, i);
+            bench_rnp_end(&rnp);
+            return 0;
+        }
+        bench->offsets[i] = st.st_size;
+        bench_rnp_end(&rnp);
+    }
+    return 1;
+}
+
+/* the length of the packet at the start of data, header included, or 0 */
+static size_t
+packet_len(const uint8_t *data, size_t len)
+{
+    size_t hdr;
+    size_t body;
+
+    if (len < 2 || (data[0] & PGP_PTAG_ALWAYS_SET) == 0) {
+        return 0;
+    }
+    if (data[0] & PGP_PTAG_NEW_FORMAT) {
+        if (data[1] < 192) {
+            hdr = 2;
+            body = data[1];
+        } else if (data[1] < 224 && len >= 3) {
+            hdr = 3;
+            body = ((size_t)(data[1] - 192) << 8) + data[2] + 192;
+        } else if (data[1] == 255 && len >= 6) {
+            hdr = 6;
+            body = ((size_t) data[2] << 24) | ((size_t) data[3] << 16) |
+                   ((size_t) data[4] << 8) | data[5];
+        } else {
+            return 0;
+        }
+    } else {
+        switch (data[0] & PGP_PTAG_OF_LENGTH_TYPE_MASK) {
+        case PGP_PTAG_OLD_LEN_1:
+            hdr = 2;
+            body = data[1];
+            break;
+        case PGP_PTAG_OLD_LEN_2:
+            hdr = 3;
+            body = (len >= 3) ? ((size_t) data[1] << 8) | data[2] : len;
+            break;
+        case PGP_PTAG_OLD_LEN_4:
+            hdr = 5;
+            body = (len >= 5) ? ((size_t) data[1] << 24) | ((size_t) data[2] << 16) |
+                                  ((size_t) data[3] << 8) | data[4] :
+                                len;
+            break;
+        default:
+            return 0;
+        }
+    }
+    return (hdr + body <= len) ? hdr + body : 0;
+}
+
+/*
+ * write a copy of the key in data, giving it user id number n so that every
+ * key in the ring can be looked up on its own. The self-signature no longer
+ * matches, which loading and looking up keys do not check.
+ */
+static int
+write_key_copy(FILE *fp, const uint8_t *data, size_t len, uint64_t n)
+{
+    pgp_subpacket_t packet;
+    uint8_t         hdr[2];
+    char            uid[64];
+    size_t          off;
+    size_t          plen;
+    int             uidlen;
+
+    for (off = 0; off < len; off += plen) {
+        if ((plen = packet_len(&data[off], len - off)) == 0) {
+            return 0;
+        }
+        packet.raw = (uint8_t *) &data[off];
+        packet.length = plen;
+        if (pgp_subpacket_tag(&packet) != PGP_PTAG_CT_USER_ID) {
+            if (fwrite(&data[off], 1, plen, fp) != plen) {
+                return 0;
+            }
+            continue;
+        }
+        uidlen = snprintf(uid, sizeof(uid), BENCH_UID_FMT, (unsigned) n);
+        hdr[0] = PGP_PTAG_ALWAYS_SET | PGP_PTAG_NEW_FORMAT | PGP_PTAG_CT_USER_ID;
+        hdr[1] = (uint8_t) uidlen;
+        if (fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+            fwrite(uid, 1, (size_t) uidlen, fp) != (size_t) uidlen) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * write a pubring of `count` keys by cycling through the generated ones,
+ * each copy with a user id of its own
+ */
+static int
+build_keyring(bench_t *bench, const char *homedir, uint64_t count)
+{
+    pgp_memory_t *mem;
+    uint8_t *     data;
+    char          path[MAXPATHLEN];
+    off_t         from;
+    off_t         to;
+    uint64_t      i;
+    FILE *        fp;
+    int           ok = 1;
+
+    if (!bench_path(
+          path, sizeof(path), "%s/%s/pubring.gpg", bench->gendir, SUBDIRECTORY_GNUPG)) {
+        return 0;
+    }
+    if ((mem = pgp_memory_new()) == NULL || !pgp_mem_readfile(mem, path)) {
+        (void) fprintf(stderr, "%s: can't read '%s'\n", __progname, path);
+        return 0;
+    }
+    data = pgp_mem_data(mem);
+    if (!bench_path(path, sizeof(path), "%s/%s", homedir, SUBDIRECTORY_GNUPG)) {
+        pgp_memory_free(mem);
+        return 0;
+    }
+    if ((mkdir(homedir, 0700) != 0 && errno != EEXIST) ||
+        (mkdir(path, 0700) != 0 && errno != EEXIST)) {
+        (void) fprintf(stderr, "%s: can't mkdir '%s'\n", __progname, path);
+        pgp_memory_free(mem);
+        return 0;
+    }
+    if (!bench_path(path, sizeof(path), "%s/%s/pubring.gpg", homedir, SUBDIRECTORY_GNUPG)) {
+        pgp_memory_free(mem);
+        return 0;
+    }
+    if ((fp = fopen(path, "w")) == NULL) {
+        (void) fprintf(stderr, "%s: can't create '%s'\n", __progname, path);
+        pgp_memory_free(mem);
+        return 0;
+    }
+    for (i = 0; ok && i < count; i++) {
+        from = (i % bench->genkeys == 0) ? 0 : bench->offsets[i % bench->genkeys - 1];
+        to = bench->offsets[i % bench->genkeys];
+        ok = write_key_copy(fp, &data[from], (size_t)(to - from), i);
+    }
+    ok = (fclose(fp) == 0) && ok;
+    pgp_memory_free(mem);
+    return ok;
+}
+
+/* wrap size bytes into an armored literal data packet */
+static pgp_memory_t *
+armor_buffer(const uint8_t *data, size_t size)
+{
+    pgp_output_t *output;
+    pgp_memory_t *mem;
+
+    pgp_setup_memory_write(&output, &mem, size + size / 3 + 4096);
+    pgp_writer_push_armor_msg(output);
+    if (!pgp_write_litdata(output, data, (const int) size, PGP_LDT_BINARY)) {
+        pgp_teardown_memory_write(output, mem);
+        return NULL;
+    }
+    pgp_writer_close(output);
+    pgp_output_delete(output);
+    return mem;
+}
+
+static pgp_cb_ret_t
+dearmor_cb(const pgp_packet_t *pkt, pgp_cbdata_t *cbinfo)
+{
+    size_t *len = pgp_callback_arg(cbinfo);
+
+    if (pkt->tag == PGP_PTAG_CT_LITDATA_BODY) {
+        *len += pkt->u.litdata_body.length;
+    }
+    return PGP_RELEASE_MEMORY;
+}
+
+static size_t
+dearmor_buffer(pgp_io_t *io, pgp_memory_t *armored)
+{
+    pgp_stream_t *stream;
+    size_t        len = 0;
+
+    pgp_setup_memory_read(io, &stream, armored, &len, dearmor_cb, 0);
+    pgp_reader_push_dearmour(stream);
+    (void) pgp_parse(stream, 0);
+    pgp_reader_pop_dearmour(stream);
+    pgp_stream_delete(stream);
+    return len;
+}
+
+/* armor and dearmor run in memory, through the same writer and reader stacks */
+static int
+bench_armor(bench_t *bench, rnp_t *rnp, uint64_t size, uint64_t *samples)
+{
+    pgp_memory_t *mem = NULL;
+    uint64_t      state = size;
+    uint8_t *     data;
+    uint64_t      t;
+    unsigned      i;
+    int           ok = 1;
+
+    if (size > INT_MAX) {
+        (void) fprintf(stderr,
+                       "%s: skipping armor for %llu bytes\n",
+                       __progname,
+                       (unsigned long long) size);
+        return 1;
+    }
+    if ((data = malloc((size_t) size)) == NULL) {
+        (void) fprintf(stderr, "bench_armor: bad alloc\n");
+        return 0;
+    }
+    fill_buffer(data, (size_t) size, &state);
+    for (i = 0; ok && i < bench->iterations; i++) {
+        if (mem) {
+            pgp_memory_free(mem);
+        }
+        t = now_ns();
+        mem = armor_buffer(data, (size_t) size);
+        samples[i] = now_ns() - t;
+        ok = (mem != NULL);
+    }
+    if (ok && (bench->ops & BENCH_ARMOR)) {
+        report(bench, "armor", "size", size, size, samples, bench->iterations);
+    }
+    for (i = 0; ok && (bench->ops & BENCH_DEARMOR) && i < bench->iterations; i++) {
+        t = now_ns();
+        ok = (dearmor_buffer(rnp->io, mem) == size);
+        samples[i] = now_ns() - t;
+    }
+    if (ok && (bench->ops & BENCH_DEARMOR)) {
+        report(bench, "dearmor", "size", size, size, samples, bench->iterations);
+    }
+    if (mem) {
+        pgp_memory_free(mem);
+    }
+    free(data);
+    return ok;
+}
+
+/* encrypt, decrypt, sign and verify a file of `size` bytes */
+static int
+bench_crypto(bench_t *bench, rnp_t *rnp, uint64_t size, uint64_t *samples)
+{
+    char     userid[64];
+    char     in[MAXPATHLEN];
+    char     enc[MAXPATHLEN];
+    char     dec[MAXPATHLEN];
+    char     sig[MAXPATHLEN];
+    uint64_t t;
+    unsigned i;
+    int      ok = 1;
+
+    (void) snprintf(userid, sizeof(userid), BENCH_UID_FMT, 0);
+    if (!bench_path(in, sizeof(in), "%s/payload", bench->tmpdir) ||
+        !bench_path(enc, sizeof(enc), "%s/payload.gpg", bench->tmpdir) ||
+        !bench_path(dec, sizeof(dec), "%s/payload.out", bench->tmpdir) ||
+        !bench_path(sig, sizeof(sig), "%s/payload.sig", bench->tmpdir) ||
+        !write_payload(in, size)) {
+        return 0;
+    }
+    /* decrypt needs something to decrypt even if encrypt isn't reported */
+    if (bench->ops & (BENCH_ENCRYPT | BENCH_DECRYPT)) {
+        for (i = 0; ok && i < bench->iterations; i++) {
+            t = now_ns();
+            ok = rnp_encrypt_file(rnp, userid, in, enc, 0);
+            samples[i] = now_ns() - t;
+        }
+        if (ok && (bench->ops & BENCH_ENCRYPT)) {
+            report(bench, "encrypt", "size", size, size, samples, bench->iterations);
+        }
+    }
+    for (i = 0; ok && (bench->ops & BENCH_DECRYPT) && i < bench->iterations; i++) {
+        t = now_ns();
+        ok = rnp_decrypt_file(rnp, enc, dec, 0);
+        samples[i] = now_ns() - t;
+    }
+    if (ok && (bench->ops & BENCH_DECRYPT)) {
+        report(bench, "decrypt", "size", size, size, samples, bench->iterations);
+    }
+    if (ok && (bench->ops & (BENCH_SIGN | BENCH_VERIFY))) {
+        for (i = 0; ok && i < bench->iterations; i++) {
+            t = now_ns();
+            ok = rnp_sign_file(rnp, userid, in, sig, 0, 0, 0);
+            samples[i] = now_ns() - t;
+        }
+        if (ok && (bench->ops & BENCH_SIGN)) {
+            report(bench, "sign", "size", size, size, samples, bench->iterations);
+        }
+    }
+    for (i = 0; ok && (bench->ops & BENCH_VERIFY) && i < bench->iterations; i++) {
+        t = now_ns();
+        ok = rnp_verify_file(rnp, sig, NULL, 0);
+        samples[i] = now_ns() - t;
+    }
+    if (ok && (bench->ops & BENCH_VERIFY)) {
+        report(bench, "verify", "size", size, size, samples, bench->iterations);
+    }
+    (void) unlink(in);
+    (void) unlink(enc);
+    (void) unlink(dec);
+    (void) unlink(sig);
+    if (!ok) {
+        (void) fprintf(stderr,
+                       "%s: operation failed at size %llu\n",
+                       __progname,
+                       (unsigned long long) size);
+    }
+    return ok;
+}
+
+/* load a keyring of `count` keys, then look up random keys in it by user id */
+static int
+bench_keyring(bench_t *bench, uint64_t count)
+{
+    uint64_t *samples;
+    uint64_t  state = count;
+    uint64_t  t;
+    rnp_t     rnp;
+    char      homedir[MAXPATHLEN];
+    char      uid[64];
+    unsigned  n;
+    unsigned  i;
+    int       ok = 1;
+
+    n = MAX(bench->iterations, bench->lookups);
+    if ((samples = calloc(n, sizeof(*samples))) == NULL) {
+        (void) fprintf(stderr, "bench_keyring: bad alloc\n");
+        return 0;
+    }
+    if (!bench_path(homedir,
+                    sizeof(homedir),
+                    "%s/ring-%llu",
+                    bench->tmpdir,
+                    (unsigned long long) count) ||
+        !build_keyring(bench, homedir, count)) {
+        free(samples);
+        return 0;
+    }
+    for (i = 0; ok && i < bench->iterations; i++) {
+        if (!bench_rnp_init(&rnp, homedir, 0)) {
+            ok = 0;
+            break;
+        }
+        t = now_ns();
+        ok = rnp_load_keys(&rnp);
+        samples[i] = now_ns() - t;
+        /* keep the last one around for lookups */
+        if (!ok || i + 1 < bench->iterations || !(bench->ops & BENCH_LOOKUP)) {
+            bench_rnp_end(&rnp);
+        }
+    }
+    if (ok && (bench->ops & BENCH_LOAD)) {
+        report(bench, "load", "keys", count, 0, samples, bench->iterations);
+    }
+    if (ok && (bench->ops & BENCH_LOOKUP)) {
+        for (i = 0; ok && i < bench->lookups; i++) {
+            fill_buffer((uint8_t *) &t, sizeof(t), &state);
+            /* every key in the ring has a user id of its own */
+            (void) snprintf(uid, sizeof(uid), BENCH_UID_FMT, (unsigned) (t % count));
+            t = now_ns();
+            ok = rnp_find_key(&rnp, uid);
+            samples[i] = now_ns() - t;
+        }
+        bench_rnp_end(&rnp);
+        if (ok) {
+            report(bench, "lookup", "keys", count, 0, samples, bench->lookups);
+        }
+    }
+    if (!ok) {
+        (void) fprintf(stderr,
+                       "%s: keyring of %llu keys failed\n",
+                       __progname,
+                       (unsigned long long) count);
+    }
+    free(samples);
+    return ok;
+}
+
+static int
+bench_run(bench_t *bench)
+{
+    uint64_t *samples;
+    rnp_t     rnp;
+    unsigned  i;
+    int       ok = 1;
+
+    if (!generate_keys(bench)) {
+        return 0;
+    }
+    if ((samples = calloc(bench->iterations, sizeof(*samples))) == NULL) {
+        (void) fprintf(stderr, "bench_run: bad alloc\n");
+        return 0;
+    }
+    if (bench->ops & (BENCH_ENCRYPT | BENCH_DECRYPT | BENCH_SIGN | BENCH_VERIFY | BENCH_ARMOR |
+                      BENCH_DEARMOR)) {
+        if (!bench_rnp_init(&rnp, bench->gendir, 1) || !rnp_load_keys(&rnp)) {
+            (void) fprintf(stderr, "%s: can't load generated keys\n", __progname);
+            free(samples);
+            return 0;
+        }
+        for (i = 0; ok && i < bench->sizec; i++) {
+            if (bench->ops & (BENCH_ENCRYPT | BENCH_DECRYPT | BENCH_SIGN | BENCH_VERIFY)) {
+                ok = bench_crypto(bench, &rnp, bench->sizes[i], samples);
+            }
+            if (ok && (bench->ops & (BENCH_ARMOR | BENCH_DEARMOR))) {
+                ok = bench_armor(bench, &rnp, bench->sizes[i], samples);
+            }
+        }
+        bench_rnp_end(&rnp);
+    }
+    for (i = 0; ok && (bench->ops & (BENCH_LOAD | BENCH_LOOKUP)) && i < bench->keyc; i++) {
+        ok = bench_keyring(bench, bench->keys[i]);
+    }
+    free(samples);
+    return ok;
+}
+
+static void
+print_usage(const char *usagemsg)
+{
+    (void) fprintf(stderr, "%s\n", rnp_get_info("version"));
+    (void) fprintf(stderr, "Usage: %s %s", __progname, usagemsg);
+}
+
+int
+main(int argc, char **argv)
+{
+    json_object *root;
+    bench_t      bench;
+    char *       tmpdir = NULL;
+    unsigned     i;
+    int          optindex;
+    int          ret;
+    int          fd;
+    int          ch;
+
+    (void) memset(&bench, 0x0, sizeof(bench));
+    bench.ops = BENCH_ALL;
+    bench.iterations = 10;
+    bench.lookups = 1000;
+    bench.genkeys = 4;
+    bench.numbits = 2048;
+    (void) parse_list("1K,64K,1M,16M", bench.sizes, &bench.sizec);
+    (void) parse_list("10,1000", bench.keys, &bench.keyc);
+
+    while ((ch = getopt_long(argc, argv, "Vho:", options, &optindex)) != -1) {
+        if (ch >= HELP_CMD) {
+            ch = options[optindex].val;
+        }
+        switch (ch) {
+        case 'V':
+        case VERSION_CMD:
+            (void) printf("%s\n", rnp_get_info("version"));
+            exit(EXIT_SUCCESS);
+        case 'h':
+        case HELP_CMD:
+            print_usage(usage);
+            exit(EXIT_SUCCESS);
+        case SIZES:
+            if (!parse_list(optarg, bench.sizes, &bench.sizec)) {
+                exit(EXIT_ERROR);
+            }
+            break;
+        case KEYS:
+            if (!parse_list(optarg, bench.keys, &bench.keyc)) {
+                exit(EXIT_ERROR);
+            }
+            break;
+        case OPS:
+            if (!parse_ops(optarg, &bench.ops)) {
+                exit(EXIT_ERROR);
+            }
+            break;
+        case ITERATIONS:
+            bench.iterations = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case LOOKUPS:
+            bench.lookups = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case GENKEYS:
+            bench.genkeys = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case NUMBITS:
+            bench.numbits = atoi(optarg);
+            break;
+        case TMPDIR:
+            tmpdir = optarg;
+            break;
+        case 'o':
+        case OUTPUT:
+            bench.output = optarg;
+            break;
+        case KEEP:
+            bench.keep = 1;
+            break;
+        default:
+            print_usage(usage);
+            exit(EXIT_ERROR);
+        }
+    }
+    if (bench.iterations == 0 || bench.lookups == 0 || bench.genkeys == 0 ||
+        bench.numbits < 1024) {
+        (void) fprintf(stderr,
+                       "%s: iterations, lookups and genkeys must be positive, "
+                       "numbits at least 1024\n",
+                       __progname);
+        exit(EXIT_ERROR);
+    }
+    for (i = 0; i < bench.keyc; i++) {
+        if (bench.keys[i] == 0 || bench.keys[i] > UINT_MAX) {
+            (void) fprintf(stderr, "%s: bad keyring size\n", __progname);
+            exit(EXIT_ERROR);
+        }
+    }
+
+    /* the library chats on stdout, keep the results stream clean */
+    if (bench.output) {
+        bench.res = fopen(bench.output, "w");
+    } else if ((fd = dup(STDOUT_FILENO)) >= 0) {
+        bench.res = fdopen(fd, "w");
+    }
+    if (bench.res == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        (void) fprintf(stderr, "%s: can't open results stream\n", __progname);
+        exit(EXIT_ERROR);
+    }
+
+    if (tmpdir == NULL && (tmpdir = getenv("TMPDIR")) == NULL) {
+        tmpdir = "/tmp";
+    }
+    if (!bench_path(bench.tmpdir, sizeof(bench.tmpdir), "%s/rnp-bench.XXXXXX", tmpdir) ||
+        mkdtemp(bench.tmpdir) == NULL) {
+        (void) fprintf(stderr, "%s: can't create scratch dir in '%s'\n", __progname, tmpdir);
+        exit(EXIT_ERROR);
+    }
+
+    bench.results = json_object_new_array();
+    ret = bench_run(&bench);
+
+    root = json_object_new_object();
+    json_object_object_add(root, "version", json_object_new_string(rnp_get_info("version")));
+    json_object_object_add(root, "numbits", json_object_new_int(bench.numbits));
+    json_object_object_add(root, "genkeys", json_object_new_int64(bench.genkeys));
+    json_object_object_add(root, "results", bench.results);
+    json_object_object_add(
+      root, "process_peak_rss_kb", json_object_new_int64(peak_rss_kb()));
+    json_object_object_add(root, "success", json_object_new_boolean(ret));
+    (void) fprintf(
+      bench.res, "%s\n", json_object_to_json_string_ext(root, JSON_C_TO_STRING_PRETTY));
+    (void) fclose(bench.res);
+    json_object_put(root);
+
+    if (bench.keep) {
+        (void) fprintf(stderr, "%s: scratch files kept in %s\n", __progname, bench.tmpdir);
+    } else {
+        (void) nftw(bench.tmpdir, remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+    }
+    free(bench.offsets);
+    exit((ret) ? EXIT_SUCCESS : EXIT_ERROR);
+}
@@ -35,8 +35,10 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <regex.h>
 #include <rnp.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -55,19 +57,25 @@ static const char *usage = "--help OR\n"
                            "\t--decrypt [--output=file] [options] files... OR\n\n"
                            "\t--sign [--detach] [--hash=alg] [--output=file]\n"
                            "\t\t[options] files... OR\n"
+                           "\t--sign --encrypt [--output=file] [options] files... OR\n"
                            "\t--verify [options] files... OR\n"
                            "\t--cat [--output=file] [options] files... OR\n"
                            "\t--clearsign [--output=file] [options] files... OR\n"
                            "\t--list-packets [options] OR\n"
+                           "\t--speed [--speed-seconds=<secs>] [algorithm...] OR\n"
                            "\t--version\n"
                            "where options are:\n"
+                           "\t[--agent[=<socket>]] AND/OR\n"
                            "\t[--armor] AND/OR\n"
                            "\t[--cipher=<ciphername>] AND/OR\n"
                            "\t[--coredumps] AND/OR\n"
                            "\t[--homedir=<homedir>] AND/OR\n"
+                           "\t[--jobs=<n>] AND/OR\n"
                            "\t[--keyring=<keyring>] AND/OR\n"
                            "\t[--keyring-format=<format>] AND/OR\n"
                            "\t[--numtries=<attempts>] AND/OR\n"
+                           "\t[--stats] AND/OR\n"
+                           "\t[--trace=<file>] AND/OR\n"
                            "\t[--userid=<userid>] AND/OR\n"
                            "\t[--maxmemalloc=<number of bytes>] AND/OR\n"
                            "\t[--verbose]\n";
@@ -78,10 +86,12 @@ enum optdefs {
     DECRYPT,
     SIGN,
     CLEARSIGN,
+    SIGN_ENCRYPT,
     VERIFY,
     VERIFY_CAT,
     LIST_PACKETS,
     SHOW_KEYS,
+    SPEED,
     VERSION_CMD,
     HELP_CMD,
 
@@ -105,6 +115,11 @@ enum optdefs {
     BIRTHTIME,
     CIPHER,
     NUMTRIES,
+    SPEED_SECONDS,
+    STATS,
+    TRACE,
+    AGENT,
+    JOBS,
 
     /* debug */
     OPS_DEBUG
@@ -112,6 +127,13 @@ enum optdefs {
 
 #define EXIT_ERROR 2
 
+/* the most files worked on at once */
+#define MAX_JOBS 64
+
+/* how long secret keys are kept once unlocked, when working on several
+ * files at once, unless the "seckey_ttl" variable says otherwise */
+#define JOBS_SECKEY_TTL "86400"
+
 static struct option options[] = {
   /* file manipulation commands */
   {"encrypt", no_argument, NULL, ENCRYPT},
@@ -132,6 +154,7 @@ static struct option options[] = {
   {"debug", required_argument, NULL, OPS_DEBUG},
   {"show-keys", no_argument, NULL, SHOW_KEYS},
   {"showkeys", no_argument, NULL, SHOW_KEYS},
+  {"speed", no_argument, NULL, SPEED},
   /* options */
   {"ssh", no_argument, NULL, SSHKEYS},
   {"ssh-keys", no_argument, NULL, SSHKEYS},
@@ -167,19 +190,38 @@ static struct option options[] = {
   {"num-tries", required_argument, NULL, NUMTRIES},
   {"numtries", required_argument, NULL, NUMTRIES},
   {"attempts", required_argument, NULL, NUMTRIES},
+  {"speed-seconds", required_argument, NULL, SPEED_SECONDS},
+  {"stats", no_argument, NULL, STATS},
+  {"trace", required_argument, NULL, TRACE},
+  {"agent", optional_argument, NULL, AGENT},
+  {"jobs", required_argument, NULL, JOBS},
   {NULL, 0, NULL, 0},
 };
 
 /* gather up program variables into one struct */
 typedef struct prog_t {
-    char  keyring[MAXPATHLEN + 1]; /* name of keyring */
-    char *output;                  /* output file name */
-    int   overwrite;               /* overwrite files? */
-    int   armour;                  /* ASCII armor */
-    int   detached;                /* use separate file */
-    int   cmd;                     /* rnp command */
+    char     keyring[MAXPATHLEN + 1]; /* name of keyring */
+    char *   output;                  /* output file name */
+    int      overwrite;               /* overwrite files? */
+    int      armour;                  /* ASCII armor */
+    int      detached;                /* use separate file */
+    int      cmd;                     /* rnp command */
+    int      stats;                   /* print stage statistics */
+    char **  userids;                 /* every --userid given, to encrypt or sign for */
+    unsigned userc;                   /* how many of them */
+    unsigned jobs;                    /* files to work on at once */
 } prog_t;
 
+/* files shared out between threads, which all use the same rnp_t */
+typedef struct jobs_t {
+    rnp_t *     rnp;
+    prog_t *    p;
+    char **     files;
+    unsigned    filec;
+    int *       results; /* what rnp_cmd() gave for each file */
+    atomic_uint next;    /* the next file to start on */
+} jobs_t;
+
 static void
 print_praise(void)
 {
@@ -256,28 +298,54 @@ show_output(char *out, int size, const char *header)
     return cc == size;
 }
 
+/* the command given by val, combining --sign and --encrypt into one */
+static int
+set_cmd(int cmd, int val)
+{
+    if ((cmd == SIGN && val == ENCRYPT) || (cmd == ENCRYPT && val == SIGN)) {
+        return SIGN_ENCRYPT;
+    }
+    return val;
+}
+
 /* do a command once for a specified file 'f' */
 static int
 rnp_cmd(rnp_t *rnp, prog_t *p, char *f)
 {
-    const int cleartext = 1;
-    unsigned  maxsize;
-    char *    out;
-    char *    in;
-    int       ret;
-    int       cc;
+    const int   cleartext = 1;
+    const char *userid;
+    unsigned    maxsize;
+    char *      out;
+    char *      in;
+    int         ret;
+    int         cc;
 
     switch (p->cmd) {
     case ENCRYPT:
         if (f == NULL) {
             cc = stdin_to_mem(rnp, &in, &out, &maxsize);
-            ret = rnp_encrypt_memory(
-              rnp, rnp_getvar(rnp, "userid"), in, cc, out, maxsize, p->armour);
+            if (p->userc > 1) {
+                ret = rnp_encrypt_memory_multi(rnp,
+                                               (const char **) p->userids,
+                                               p->userc,
+                                               in,
+                                               cc,
+                                               out,
+                                               maxsize,
+                                               p->armour);
+            } else {
+                ret = rnp_encrypt_memory(
+                  rnp, rnp_getvar(rnp, "userid"), in, cc, out, maxsize, p->armour);
+            }
             ret = show_output(out, ret, "Bad memory encryption");
             free(in);
             free(out);
             return ret;
         }
+        if (p->userc > 1) {
+            return rnp_encrypt_file_multi(
+              rnp, (const char **) p->userids, p->userc, f, p->output, p->armour);
+        }
         return rnp_encrypt_file(rnp, rnp_getvar(rnp, "userid"), f, p->output, p->armour);
     case DECRYPT:
         if (f == NULL) {
@@ -289,8 +357,34 @@ rnp_cmd(rnp_t *rnp, prog_t *p, char *f)
             return ret;
         }
         return rnp_decrypt_file(rnp, f, p->output, p->armour);
-    case CLEARSIGN:
     case SIGN:
+        if (p->userc > 1) {
+            /* one pass over the data for all of the keys */
+            if (f == NULL) {
+                cc = stdin_to_mem(rnp, &in, &out, &maxsize);
+                ret = rnp_sign_memory_multi(rnp,
+                                            (const char **) p->userids,
+                                            p->userc,
+                                            in,
+                                            cc,
+                                            out,
+                                            maxsize,
+                                            p->armour);
+                ret = show_output(out, ret, "Bad memory signature");
+                free(in);
+                free(out);
+                return ret;
+            }
+            return rnp_sign_file_multi(rnp,
+                                       (const char **) p->userids,
+                                       p->userc,
+                                       f,
+                                       p->output,
+                                       p->armour,
+                                       p->detached);
+        }
+        /* FALLTHROUGH */
+    case CLEARSIGN:
         if (f == NULL) {
             cc = stdin_to_mem(rnp, &in, &out, &maxsize);
             ret = rnp_sign_memory(rnp,
@@ -313,6 +407,32 @@ rnp_cmd(rnp_t *rnp, prog_t *p, char *f)
                              p->armour,
                              (p->cmd == CLEARSIGN) ? cleartext : !cleartext,
                              p->detached);
+    case SIGN_ENCRYPT:
+        /* sign with the last userid given, encrypt for all of them */
+        userid = rnp_getvar(rnp, "userid");
+        if (f == NULL) {
+            cc = stdin_to_mem(rnp, &in, &out, &maxsize);
+            ret = rnp_sign_encrypt_memory(rnp,
+                                          userid,
+                                          (p->userc) ? (const char **) p->userids : &userid,
+                                          (p->userc) ? p->userc : 1,
+                                          in,
+                                          cc,
+                                          out,
+                                          maxsize,
+                                          p->armour);
+            ret = show_output(out, ret, "Bad memory signature and encryption");
+            free(in);
+            free(out);
+            return ret;
+        }
+        return rnp_sign_encrypt_file(rnp,
+                                     userid,
+                                     (p->userc) ? (const char **) p->userids : &userid,
+                                     (p->userc) ? p->userc : 1,
+                                     f,
+                                     p->output,
+                                     p->armour);
     case VERIFY:
     case VERIFY_CAT:
         if (f == NULL) {
@@ -344,10 +464,92 @@ rnp_cmd(rnp_t *rnp, prog_t *p, char *f)
     }
 }
 
+/* commands which can work on several files at once */
+static int
+jobs_cmd(int cmd)
+{
+    switch (cmd) {
+    case ENCRYPT:
+    case DECRYPT:
+    case SIGN:
+    case CLEARSIGN:
+    case SIGN_ENCRYPT:
+    case VERIFY:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void *
+jobs_worker(void *arg)
+{
+    jobs_t * jobs = arg;
+    unsigned i;
+
+    while ((i = atomic_fetch_add(&jobs->next, 1)) < jobs->filec) {
+        jobs->results[i] = rnp_cmd(jobs->rnp, jobs->p, jobs->files[i]);
+    }
+    return NULL;
+}
+
+/*
+ * do the command for each of a number of files, on up to p->jobs threads.
+ * The first file is done before the threads start, so that any secret key
+ * gets unlocked once, and is kept for the rest; nothing in the rnp_t is
+ * made lazily once they have started. The outcome for each file
+ * is reported in the order they were given; 1 if all of them succeeded.
+ */
+static int
+rnp_cmd_jobs(rnp_t *rnp, prog_t *p, char **files, unsigned filec)
+{
+    pthread_t threads[MAX_JOBS];
+    int       started[MAX_JOBS];
+    jobs_t    jobs;
+    unsigned  n;
+    unsigned  i;
+    int       ret;
+
+    if ((jobs.results = calloc(filec, sizeof(*jobs.results))) == NULL) {
+        fputs("Bad alloc\n", stderr);
+        return 0;
+    }
+    if (rnp_getvar(rnp, "seckey_ttl") == NULL) {
+        rnp_setvar(rnp, "seckey_ttl", JOBS_SECKEY_TTL);
+    }
+    jobs.rnp = rnp;
+    jobs.p = p;
+    jobs.files = files;
+    jobs.filec = filec;
+    atomic_init(&jobs.next, 1);
+    jobs.results[0] = rnp_cmd(rnp, p, files[0]);
+    (void) rnp_share(rnp);
+    n = (p->jobs < filec - 1) ? p->jobs : filec - 1;
+    for (i = 0; i < n; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, jobs_worker, &jobs) == 0);
+    }
+    for (i = 0; i < n; i++) {
+        if (started[i]) {
+            (void) pthread_join(threads[i], NULL);
+        }
+    }
+    /* anything left, if no thread could be started */
+    (void) jobs_worker(&jobs);
+    ret = 1;
+    for (i = 0; i < filec; i++) {
+        (void) fprintf(stdout, "%s: %s\n", files[i], (jobs.results[i]) ? "ok" : "failed");
+        ret = ret && jobs.results[i];
+    }
+    free(jobs.results);
+    return ret;
+}
+
 /* set an option */
 static int
 setoption(rnp_t *rnp, prog_t *p, int val, char *arg)
 {
+    char **userids;
+
     switch (val) {
     case COREDUMPS:
         rnp_setvar(rnp, "coredumps", "allowed");
@@ -355,14 +557,14 @@ setoption(rnp_t *rnp, prog_t *p, int val, char *arg)
     case ENCRYPT:
         /* for encryption, we need a userid */
         rnp_setvar(rnp, "need userid", "1");
-        p->cmd = val;
+        p->cmd = set_cmd(p->cmd, val);
         break;
     case SIGN:
     case CLEARSIGN:
         /* for signing, we need a userid and a seckey */
         rnp_setvar(rnp, "need seckey", "1");
         rnp_setvar(rnp, "need userid", "1");
-        p->cmd = val;
+        p->cmd = set_cmd(p->cmd, val);
         break;
     case DECRYPT:
         /* for decryption, we need a seckey */
@@ -373,6 +575,7 @@ setoption(rnp_t *rnp, prog_t *p, int val, char *arg)
     case VERIFY_CAT:
     case LIST_PACKETS:
     case SHOW_KEYS:
+    case SPEED:
         p->cmd = val;
         break;
     case HELP_CMD:
@@ -405,6 +608,14 @@ setoption(rnp_t *rnp, prog_t *p, int val, char *arg)
             exit(EXIT_ERROR);
         }
         rnp_setvar(rnp, "userid", arg);
+        /* encryption is for all of them */
+        if ((userids = realloc(p->userids, (p->userc + 1) * sizeof(*userids))) == NULL ||
+            (userids[p->userc] = strdup(arg)) == NULL) {
+            fputs("No memory for userid\n", stderr);
+            exit(EXIT_ERROR);
+        }
+        p->userids = userids;
+        p->userc += 1;
         break;
     case ARMOUR:
         p->armour = 1;
@@ -436,6 +647,17 @@ setoption(rnp_t *rnp, prog_t *p, int val, char *arg)
         }
         rnp_setvar(rnp, "pass-fd", arg);
         break;
+    case AGENT:
+        /* no socket means the one in the key directory */
+        rnp_setvar(rnp, "agent", (arg) ? arg : "");
+        break;
+    case JOBS:
+        if (arg == NULL || atoi(arg) < 1) {
+            (void) fprintf(stderr, "No number of jobs provided\n");
+            exit(EXIT_ERROR);
+        }
+        p->jobs = (atoi(arg) > MAX_JOBS) ? MAX_JOBS : (unsigned) atoi(arg);
+        break;
     case OUTPUT:
         if (arg == NULL) {
             (void) fprintf(stderr, "No output filename argument provided\n");
@@ -472,6 +694,18 @@ setoption(rnp_t *rnp, prog_t *p, int val, char *arg)
     case NUMTRIES:
         rnp_setvar(rnp, "numtries", arg);
         break;
+    case SPEED_SECONDS:
+        rnp_setvar(rnp, "speed seconds", arg);
+        break;
+    case STATS:
+        rnp_set_stats(1);
+        p->stats = 1;
+        break;
+    case TRACE:
+        if (!rnp_set_trace(arg)) {
+            exit(EXIT_ERROR);
+        }
+        break;
     case OPS_DEBUG:
         rnp_set_debug(arg);
         break;
@@ -552,7 +786,7 @@ main(int argc, char **argv)
     optindex = 0;
 
     /* TODO: These options should be set after initialising the context. */
-    while ((ch = getopt_long(argc, argv, "S:Vdeo:sv", options, &optindex)) != -1) {
+    while ((ch = getopt_long(argc, argv, "S:Vdej:o:sv", options, &optindex)) != -1) {
         if (ch >= ENCRYPT) {
             /* getopt_long returns 0 for long options */
             if (!setoption(&rnp, &p, options[optindex].val, optarg)) {
@@ -575,7 +809,10 @@ main(int argc, char **argv)
             case 'e':
                 /* for encryption, we need a userid */
                 rnp_setvar(&rnp, "need userid", "1");
-                p.cmd = ENCRYPT;
+                p.cmd = set_cmd(p.cmd, ENCRYPT);
+                break;
+            case 'j':
+                (void) setoption(&rnp, &p, JOBS, optarg);
                 break;
             case 'o':
                 if (!parse_option(&rnp, &p, optarg)) {
@@ -586,7 +823,7 @@ main(int argc, char **argv)
                 /* for signing, we need a userid and a seckey */
                 rnp_setvar(&rnp, "need seckey", "1");
                 rnp_setvar(&rnp, "need userid", "1");
-                p.cmd = SIGN;
+                p.cmd = set_cmd(p.cmd, SIGN);
                 break;
             case 'v':
                 p.cmd = VERIFY;
@@ -598,6 +835,14 @@ main(int argc, char **argv)
         }
     }
 
+    /* the speed test needs no keys, and takes algorithm names, not files */
+    if (p.cmd == SPEED) {
+        ret = rnp_speed(&rnp, argc - optind, &argv[optind]) ? EXIT_SUCCESS : EXIT_FAILURE;
+        rnp_set_trace(NULL);
+        rnp_end(&rnp);
+        return ret;
+    }
+
     if (!rnp_load_keys(&rnp)) {
         switch (errno) {
         case EINVAL:
@@ -606,6 +851,7 @@ main(int argc, char **argv)
         default:
             fputs("fatal: failed to load keys\n", stderr);
         }
+        rnp_set_trace(NULL);
         return EXIT_ERROR;
     }
 
@@ -614,6 +860,11 @@ main(int argc, char **argv)
     if (optind == argc) {
         if (!rnp_cmd(&rnp, &p, NULL))
             ret = EXIT_FAILURE;
+    } else if (p.jobs > 1 && argc - optind > 1 && p.output == NULL && jobs_cmd(p.cmd)) {
+        /* each file has an output of its own */
+        if (!rnp_cmd_jobs(&rnp, &p, &argv[optind], (unsigned) (argc - optind))) {
+            ret = EXIT_FAILURE;
+        }
     } else {
         for (i = optind; i < argc; i++) {
             if (!rnp_cmd(&rnp, &p, argv[i])) {
@@ -621,6 +872,10 @@ main(int argc, char **argv)
             }
         }
     }
+    if (p.stats) {
+        (void) fprintf(stderr, "%s\n", rnp_get_info("stats"));
+    }
+    rnp_set_trace(NULL);
     rnp_end(&rnp);
 
     return ret;
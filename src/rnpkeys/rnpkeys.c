@@ -63,6 +63,7 @@ static const char *usage = "--help OR\n"
                            "\t--list-keys [options] OR\n"
                            "\t--list-sigs [options] OR\n"
                            "\t--trusted-keys [options] OR\n"
+                           "\t--compact [options] OR\n"
                            "\t--get-key keyid [options] OR\n"
                            "\t--version\n"
                            "where options are:\n"
@@ -87,6 +88,7 @@ enum optdefs {
     HELP_CMD,
     GET_KEY,
     TRUSTED_KEYS,
+    COMPACT_KEYS,
 
     /* options */
     SSHKEYS,
@@ -127,6 +129,7 @@ static struct option options[] = {
   {"get-key", no_argument, NULL, GET_KEY},
   {"trusted-keys", optional_argument, NULL, TRUSTED_KEYS},
   {"trusted", optional_argument, NULL, TRUSTED_KEYS},
+  {"compact", no_argument, NULL, COMPACT_KEYS},
   /* debugging commands */
   {"help", no_argument, NULL, HELP_CMD},
   {"version", no_argument, NULL, VERSION_CMD},
@@ -248,6 +251,8 @@ rnp_cmd(rnp_t *rnp, prog_t *p, char *f)
         return 0;
     case TRUSTED_KEYS:
         return rnp_match_pubkeys(rnp, f, stdout);
+    case COMPACT_KEYS:
+        return rnp_compact_keys(rnp);
     case HELP_CMD:
     default:
         print_usage(usage);
@@ -274,6 +279,7 @@ setoption(rnp_t *rnp, prog_t *p, int val, char *arg)
     case IMPORT_KEY:
     case GET_KEY:
     case TRUSTED_KEYS:
+    case COMPACT_KEYS:
     case HELP_CMD:
         p->cmd = val;
         break;
@@ -479,6 +485,10 @@ main(int argc, char **argv)
     if (optind == argc) {
         if (!rnp_cmd(&rnp, &p, NULL))
             ret = EXIT_FAILURE;
+    } else if (p.cmd == IMPORT_KEY) {
+        /* all of them are merged, and the keyring written, at once */
+        if (!rnp_import_keys(&rnp, &argv[optind], (unsigned) (argc - optind)))
+            ret = EXIT_FAILURE;
     } else {
         for (i = optind; i < argc; i++) {
             if (!rnp_cmd(&rnp, &p, argv[i]))